@@ -0,0 +1,94 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <string.h>
+#include <time.h>
+
+#include "bench_io.h"
+
+static ps_malloc_ops_t stdlib_malloc;
+static ps_dma_man_t stdlib_dma;
+static bench_io_counts_t counts;
+
+static int count_malloc(void *cookie, size_t size, void **ptr)
+{
+    counts.mallocs++;
+    return stdlib_malloc.malloc(stdlib_malloc.cookie, size, ptr);
+}
+
+static int count_calloc(void *cookie, size_t nmemb, size_t size, void **ptr)
+{
+    counts.mallocs++;
+    return stdlib_malloc.calloc(stdlib_malloc.cookie, nmemb, size, ptr);
+}
+
+static int count_free(void *cookie, size_t size, void *ptr)
+{
+    counts.frees++;
+    return stdlib_malloc.free(stdlib_malloc.cookie, size, ptr);
+}
+
+static void *count_dma_alloc(void *cookie, size_t size, int align, int cached, ps_mem_flags_t flags)
+{
+    counts.dma_allocs++;
+    return stdlib_dma.dma_alloc_fn(stdlib_dma.cookie, size, align, cached, flags);
+}
+
+static void count_dma_free(void *cookie, void *addr, size_t size)
+{
+    counts.dma_frees++;
+    stdlib_dma.dma_free_fn(stdlib_dma.cookie, addr, size);
+}
+
+static uintptr_t count_dma_pin(void *cookie, void *addr, size_t size)
+{
+    counts.dma_pins++;
+    return stdlib_dma.dma_pin_fn(stdlib_dma.cookie, addr, size);
+}
+
+static void count_dma_unpin(void *cookie, void *addr, size_t size)
+{
+    stdlib_dma.dma_unpin_fn(stdlib_dma.cookie, addr, size);
+}
+
+static void count_cache_op(void *cookie, void *addr, size_t size, dma_cache_op_t op)
+{
+    counts.cache_ops++;
+    stdlib_dma.dma_cache_op_fn(stdlib_dma.cookie, addr, size, op);
+}
+
+int bench_io_init(ps_io_ops_t *io_ops)
+{
+    if (ps_new_stdlib_malloc_ops(&stdlib_malloc) || ps_new_stdlib_dma_man(&stdlib_dma)) {
+        return -1;
+    }
+
+    memset(io_ops, 0, sizeof(*io_ops));
+    io_ops->malloc_ops = (ps_malloc_ops_t) {
+        .malloc = count_malloc,
+        .calloc = count_calloc,
+        .free = count_free,
+    };
+    io_ops->dma_manager = (ps_dma_man_t) {
+        .dma_alloc_fn = count_dma_alloc,
+        .dma_free_fn = count_dma_free,
+        .dma_pin_fn = count_dma_pin,
+        .dma_unpin_fn = count_dma_unpin,
+        .dma_cache_op_fn = count_cache_op,
+    };
+    return 0;
+}
+
+void bench_io_counts(bench_io_counts_t *out)
+{
+    *out = counts;
+}
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
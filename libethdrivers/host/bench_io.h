@@ -0,0 +1,36 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#pragma once
+
+#include <stdint.h>
+#include <platsupport/io.h>
+
+/* Calls made through the io ops of bench_io_init */
+typedef struct bench_io_counts {
+    uint64_t mallocs;
+    uint64_t frees;
+    uint64_t dma_allocs;
+    uint64_t dma_frees;
+    uint64_t dma_pins;
+    uint64_t cache_ops;
+} bench_io_counts_t;
+
+/* The stdlib malloc and DMA managers of libplatsupport, wrapped to count
+ * their calls. DMA memory is mapped 1:1, as the loopback device needs. */
+int bench_io_init(ps_io_ops_t *io_ops);
+
+void bench_io_counts(bench_io_counts_t *counts);
+
+/* Monotonic time in nanoseconds */
+uint64_t bench_now_ns(void);
+
+/* CPU timestamp counter */
+static inline uint64_t bench_cycles(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t) hi << 32) | lo;
+}
@@ -0,0 +1,8 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#pragma once
+
+/* Stands in for the kernel configuration of a seL4 build, the host build has none */
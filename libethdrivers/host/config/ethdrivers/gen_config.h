@@ -0,0 +1,13 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#pragma once
+
+/* Stands in for the generated libethdrivers configuration, at its defaults */
+#define CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT 128
+#define CONFIG_LIB_ETHDRIVER_TX_DESC_COUNT 128
+#define CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS 512
+#define CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE 2048
+#define CONFIG_LIB_ETHDRIVER_RX_COPYBREAK 256
@@ -0,0 +1,12 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#pragma once
+
+/* Stands in for the generated liblwip configuration, lwIP is only built
+ * when the host build is given LWIP_PATH */
+#ifdef HOST_BENCH_LWIP
+#define CONFIG_LIB_LWIP 1
+#endif
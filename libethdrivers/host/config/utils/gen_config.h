@@ -0,0 +1,9 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#pragma once
+
+/* Stands in for the generated libutils configuration, at its default */
+#define CONFIG_LIB_UTILS_DEFAULT_ZF_LOG_LEVEL 5
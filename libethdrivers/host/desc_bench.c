@@ -0,0 +1,198 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Cost of the completion walk over an RX descriptor ring, the loop the
+ * zynq7000, zynqmp, tx2 and odroidc2 drivers run, with the ownership word
+ * read either by a plain load followed by a full barrier or by
+ * dma_ring_load_acquire, each with and without a prefetch of the next
+ * descriptor. The drivers do not prefetch, as it was no faster here: the
+ * walk is sequential and the hardware prefetcher already follows it.
+ *
+ * Before every walk the "device" writes back the ring and the header of
+ * each buffer and the lines are flushed from the cache, as a coherent DMA
+ * write leaves them, so every descriptor is a cache miss.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/util.h>
+#include <ethdrivers/helpers.h>
+
+#include "bench_io.h"
+
+#define RING_SIZE   256
+#define BUF_SIZE    2048
+#define DESC_OWN    BIT(31)
+#define DESC_LEN    MASK(16)
+
+/* The layout of the dwmac and GEM descriptors, which is one or two words
+ * of status and the buffer address */
+typedef struct bench_desc {
+    uint32_t status;
+    uint32_t cntl;
+    uint32_t addr;
+    uint32_t next;
+} bench_desc_t;
+
+typedef enum walk_variant {
+    WALK_BARRIER,
+    WALK_ACQUIRE,
+    WALK_BARRIER_PREFETCH,
+    WALK_ACQUIRE_PREFETCH,
+    WALK_VARIANTS
+} walk_variant_t;
+
+static const char *variant_names[WALK_VARIANTS] = {
+    [WALK_BARRIER] = "barrier",
+    [WALK_ACQUIRE] = "acquire",
+    [WALK_BARRIER_PREFETCH] = "barrier+prefetch",
+    [WALK_ACQUIRE_PREFETCH] = "acquire+prefetch",
+};
+
+static volatile bench_desc_t ring[RING_SIZE] ALIGN(DMA_RING_ALIGN);
+static uint8_t bufs[RING_SIZE][BUF_SIZE] ALIGN(DMA_RING_ALIGN);
+
+static inline void prefetch_next(unsigned int idx)
+{
+    unsigned int next = idx + 1 == RING_SIZE ? 0 : idx + 1;
+    __builtin_prefetch((const void *) &ring[next]);
+}
+
+static void flush_line(const volatile void *addr)
+{
+    asm volatile("clflush %0" :: "m"(*(const volatile char *) addr));
+}
+
+/* Completes every descriptor and leaves the ring and the buffer headers
+ * out of the cache */
+static void device_write_back(unsigned int seq)
+{
+    for (unsigned int i = 0; i < RING_SIZE; i++) {
+        unsigned int len = 60 + (seq + i) % 1455;
+        memset(bufs[i], seq + i, 64);
+        ring[i].addr = i;
+        ring[i].status = len;
+        __atomic_store_n(&ring[i].status, len | DESC_OWN, __ATOMIC_RELEASE);
+    }
+    for (unsigned int i = 0; i < RING_SIZE; i++) {
+        flush_line(&ring[i]);
+        flush_line(bufs[i]);
+    }
+    asm volatile("mfence" ::: "memory");
+}
+
+/* One walk of the ring, returns the number of descriptors handled and adds
+ * what was read to sum */
+static inline ALWAYS_INLINE unsigned int walk(walk_variant_t variant, uint64_t *sum)
+{
+    bool acquire = variant == WALK_ACQUIRE || variant == WALK_ACQUIRE_PREFETCH;
+    bool prefetch = variant == WALK_BARRIER_PREFETCH || variant == WALK_ACQUIRE_PREFETCH;
+    unsigned int idx;
+
+    for (idx = 0; idx < RING_SIZE; idx++) {
+        uint32_t status;
+        if (acquire) {
+            status = dma_ring_load_acquire(&ring[idx].status);
+        } else {
+            status = ring[idx].status;
+        }
+        if (!(status & DESC_OWN)) {
+            break;
+        }
+        if (!acquire) {
+            __sync_synchronize();
+        }
+        if (prefetch) {
+            prefetch_next(idx);
+        }
+        /* what rx_complete reads of the frame */
+        const uint8_t *buf = bufs[ring[idx].addr];
+        *sum += (status & DESC_LEN) + buf[0] + buf[12] + buf[63];
+        ring[idx].status = 0;
+    }
+    return idx;
+}
+
+static int run_variant(walk_variant_t variant, unsigned int walks, double *ns_per_desc)
+{
+    uint64_t sum = 0, cycles = 0, elapsed = 0, descs = 0;
+
+    for (unsigned int i = 0; i < walks; i++) {
+        device_write_back(i);
+        uint64_t start_ns = bench_now_ns();
+        uint64_t start_cycles = bench_cycles();
+        unsigned int done;
+        switch (variant) {
+        case WALK_BARRIER:
+            done = walk(WALK_BARRIER, &sum);
+            break;
+        case WALK_ACQUIRE:
+            done = walk(WALK_ACQUIRE, &sum);
+            break;
+        case WALK_BARRIER_PREFETCH:
+            done = walk(WALK_BARRIER_PREFETCH, &sum);
+            break;
+        default:
+            done = walk(WALK_ACQUIRE_PREFETCH, &sum);
+            break;
+        }
+        cycles += bench_cycles() - start_cycles;
+        elapsed += bench_now_ns() - start_ns;
+        if (done != RING_SIZE) {
+            fprintf(stderr, "bench: walk stopped at descriptor %u\n", done);
+            return -1;
+        }
+        descs += done;
+    }
+
+    *ns_per_desc = (double) elapsed / descs;
+    printf("%-18s %9.2f %9.1f %18llx\n", variant_names[variant], *ns_per_desc,
+           (double) cycles / descs, (unsigned long long) sum);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --walks N        walks of the ring per variant\n"
+            "  --quick          fewer walks, for CI\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int walks = 20000;
+    double ns[WALK_VARIANTS];
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--quick")) {
+            walks = 1000;
+        } else if (!strcmp(argv[i], "--walks") && i + 1 < argc) {
+            walks = strtoul(argv[++i], NULL, 0);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (walks == 0) {
+        fprintf(stderr, "bench: --walks out of range\n");
+        return 1;
+    }
+
+    printf("%u walks of %u descriptors per variant\n", walks, RING_SIZE);
+    printf("%-18s %9s %9s %18s\n", "variant", "ns/desc", "cyc/desc", "sum");
+    for (int v = 0; v < WALK_VARIANTS; v++) {
+        if (run_variant(v, walks, &ns[v])) {
+            return 1;
+        }
+    }
+    printf("acquire vs barrier %.2fx, prefetch with acquire %.2fx\n",
+           ns[WALK_BARRIER] / ns[WALK_ACQUIRE], ns[WALK_ACQUIRE] / ns[WALK_ACQUIRE_PREFETCH]);
+    return 0;
+}
@@ -0,0 +1,293 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Packet rate of the raw driver interface against the loopback device. UDP
+ * frames are sent with raw_tx in bursts and received with raw_poll into
+ * buffers of a dma_pool_t, the way the lwIP and picoTCP glue drive a NIC.
+ * The cost is that of the driver interface and the buffer handling, there
+ * is no hardware, so the results compare changes to that path.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/util.h>
+#include <ethdrivers/raw.h>
+#include <ethdrivers/helpers.h>
+#include <ethdrivers/loopback.h>
+
+#include "bench_io.h"
+
+#define BENCH_MAX_FRAME 1514
+#define BENCH_MAX_BURST 32
+
+typedef struct bench_state {
+    dma_pool_t pool;
+    uint64_t pool_allocs;
+    uint64_t rx_frames;
+    uint64_t rx_bytes;
+    /* frame the next received one is compared against, NULL to only
+     * check its length */
+    const uint8_t *expect;
+    unsigned int expect_len;
+    int errors;
+} bench_state_t;
+
+static uintptr_t bench_allocate_rx_buf(void *cb_cookie, size_t buf_size, void **cookie)
+{
+    bench_state_t *state = cb_cookie;
+    dma_addr_t *buf = dma_pool_alloc(&state->pool, buf_size);
+    if (!buf) {
+        return 0;
+    }
+    state->pool_allocs++;
+    *cookie = buf;
+    return buf->phys;
+}
+
+static void bench_rx_complete(void *cb_cookie, unsigned int num_bufs, void **cookies, unsigned int *lens)
+{
+    bench_state_t *state = cb_cookie;
+    for (unsigned int i = 0; i < num_bufs; i++) {
+        dma_addr_t *buf = cookies[i];
+        if (lens[i] != state->expect_len ||
+            (state->expect && memcmp(buf->virt, state->expect, lens[i]))) {
+            state->errors++;
+        }
+        state->rx_frames++;
+        state->rx_bytes += lens[i];
+        dma_pool_free(&state->pool, buf);
+    }
+}
+
+static void bench_tx_complete(void *cb_cookie, void *cookie)
+{
+}
+
+static uint16_t ip_checksum(const uint8_t *data, unsigned int len)
+{
+    uint32_t sum = 0;
+    for (unsigned int i = 0; i + 1 < len; i += 2) {
+        sum += (data[i] << 8) | data[i + 1];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+/* An Ethernet/IPv4/UDP frame of len bytes from and to mac */
+static void build_frame(uint8_t *frame, unsigned int len, const uint8_t *mac)
+{
+    static const uint8_t ip_src[4] = { 10, 0, 0, 1 };
+    static const uint8_t ip_dst[4] = { 10, 0, 0, 2 };
+    unsigned int ip_len = len - 14;
+    unsigned int udp_len = ip_len - 20;
+
+    memcpy(frame, mac, 6);
+    memcpy(frame + 6, mac, 6);
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+
+    uint8_t *ip = frame + 14;
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    ip[2] = ip_len >> 8;
+    ip[3] = ip_len;
+    ip[8] = 64;
+    ip[9] = 17;
+    memcpy(ip + 12, ip_src, 4);
+    memcpy(ip + 16, ip_dst, 4);
+    uint16_t csum = ip_checksum(ip, 20);
+    ip[10] = csum >> 8;
+    ip[11] = csum;
+
+    uint8_t *udp = ip + 20;
+    udp[0] = 7000 >> 8;
+    udp[1] = 7000 & 0xff;
+    udp[2] = 7000 >> 8;
+    udp[3] = 7000 & 0xff;
+    udp[4] = udp_len >> 8;
+    udp[5] = udp_len;
+    udp[6] = 0;
+    udp[7] = 0;
+    for (unsigned int i = 8; i < udp_len; i++) {
+        udp[i] = i;
+    }
+}
+
+static uintptr_t offset_dma_pin(void *cookie, void *addr, size_t size)
+{
+    return (uintptr_t) addr + 0x1000;
+}
+
+/* The device copies through physical addresses, so it must refuse a DMA
+ * manager that does not map them 1:1 */
+static int check_identity(ps_io_ops_t io_ops)
+{
+    struct eth_driver driver = { 0 };
+
+    io_ops.dma_manager.dma_pin_fn = offset_dma_pin;
+    if (ethif_loopback_init(&driver, io_ops, NULL) == 0) {
+        fprintf(stderr, "bench: loopback accepted a DMA manager that is not 1:1\n");
+        return -1;
+    }
+    printf("loopback refused a DMA manager that is not 1:1\n");
+    return 0;
+}
+
+static int check_data(struct eth_driver *driver, bench_state_t *state, dma_addr_t *tx)
+{
+    static const unsigned int sizes[] = { 60, 64, 1000, BENCH_MAX_FRAME };
+    uint8_t mac[6];
+
+    driver->i_fn.get_mac(driver, mac);
+    for (int i = 0; i < ARRAY_SIZE(sizes); i++) {
+        unsigned int len = sizes[i];
+        build_frame(tx->virt, len, mac);
+        state->expect = tx->virt;
+        state->expect_len = len;
+        uint64_t before = state->rx_frames;
+        if (driver->i_fn.raw_tx(driver, 1, &tx->phys, &len, NULL) != ETHIF_TX_COMPLETE) {
+            fprintf(stderr, "bench: raw_tx of %u bytes failed\n", len);
+            return -1;
+        }
+        driver->i_fn.raw_poll(driver);
+        if (state->errors || state->rx_frames != before + 1) {
+            fprintf(stderr, "bench: frame of %u bytes did not come back intact\n", len);
+            return -1;
+        }
+    }
+    state->expect = NULL;
+    return 0;
+}
+
+static int run_workload(struct eth_driver *driver, bench_state_t *state, dma_addr_t *tx,
+                        unsigned int len, unsigned int burst, uint64_t frames)
+{
+    bench_io_counts_t io_before, io_after;
+    uint8_t mac[6];
+
+    driver->i_fn.get_mac(driver, mac);
+    build_frame(tx->virt, len, mac);
+    state->expect_len = len;
+
+    uint64_t rx_before = state->rx_frames;
+    uint64_t pool_before = state->pool_allocs;
+    bench_io_counts(&io_before);
+    uint64_t start_ns = bench_now_ns();
+    uint64_t start_cycles = bench_cycles();
+
+    for (uint64_t sent = 0; sent < frames;) {
+        for (unsigned int i = 0; i < burst && sent < frames; i++, sent++) {
+            if (driver->i_fn.raw_tx(driver, 1, &tx->phys, &len, NULL) != ETHIF_TX_COMPLETE) {
+                fprintf(stderr, "bench: raw_tx failed\n");
+                return -1;
+            }
+        }
+        driver->i_fn.raw_poll(driver);
+    }
+
+    uint64_t cycles = bench_cycles() - start_cycles;
+    uint64_t elapsed = bench_now_ns() - start_ns;
+    bench_io_counts(&io_after);
+
+    uint64_t received = state->rx_frames - rx_before;
+    if (state->errors || received != frames) {
+        fprintf(stderr, "bench: sent %llu frames, received %llu, %d bad\n",
+                (unsigned long long) frames, (unsigned long long) received, state->errors);
+        return -1;
+    }
+
+    double secs = elapsed / 1e9;
+    printf("%5u %5u %10.0f %9.1f %10.1f %9.3f %9.3f %9.3f\n", len, burst,
+           frames / secs, frames * len * 8 / secs / 1e6, (double) cycles / frames,
+           (double)(io_after.mallocs - io_before.mallocs) / frames,
+           (double)(io_after.dma_allocs - io_before.dma_allocs) / frames,
+           (double)(state->pool_allocs - pool_before) / frames);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --frames N       frames per workload (default 2000000)\n"
+            "  --quick          fewer frames, for CI\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    static const unsigned int sizes[] = { 64, 512, BENCH_MAX_FRAME };
+    static const unsigned int bursts[] = { 1, BENCH_MAX_BURST };
+    static bench_state_t state;
+    uint64_t frames = 2000000;
+    struct eth_driver driver = { 0 };
+    ps_io_ops_t io_ops;
+    ethif_stats_t stats;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--quick")) {
+            frames = 20000;
+        } else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            frames = strtoull(argv[++i], NULL, 0);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (0 == frames) {
+        fprintf(stderr, "bench: --frames out of range\n");
+        return 1;
+    }
+
+    if (bench_io_init(&io_ops) || check_identity(io_ops)) {
+        return 1;
+    }
+
+    driver.cb_cookie = &state;
+    driver.i_cb = (struct raw_iface_callbacks) {
+        .tx_complete = bench_tx_complete,
+        .rx_complete = bench_rx_complete,
+        .allocate_rx_buf = bench_allocate_rx_buf,
+    };
+    ethif_loopback_config_t config = { .queue_size = BENCH_MAX_BURST };
+    if (ethif_loopback_init(&driver, io_ops, &config)) {
+        return 1;
+    }
+
+    dma_pool_config_t pool_config;
+    dma_pool_default_config(&pool_config);
+    if (dma_pool_init(&state.pool, &io_ops.dma_manager, &pool_config, driver.dma_alignment)) {
+        return 1;
+    }
+    dma_addr_t tx = dma_alloc_pin(&io_ops.dma_manager, BENCH_MAX_FRAME, 1, driver.dma_alignment);
+    if (!tx.phys || check_data(&driver, &state, &tx)) {
+        return 1;
+    }
+
+    printf("%llu frames per workload\n", (unsigned long long) frames);
+    printf("%5s %5s %10s %9s %10s %9s %9s %9s\n",
+           "bytes", "burst", "pps", "Mbit/s", "cycles/pkt", "malloc/pkt", "dma/pkt", "pool/pkt");
+    for (int s = 0; s < ARRAY_SIZE(sizes); s++) {
+        for (int b = 0; b < ARRAY_SIZE(bursts); b++) {
+            if (run_workload(&driver, &state, &tx, sizes[s], bursts[b], frames)) {
+                return 1;
+            }
+        }
+    }
+
+    driver.i_fn.get_stats(&driver, &stats);
+    printf("driver: rx %llu tx %llu tx_failed %llu rx_alloc_failed %llu rx_hwm %u polls %llu\n",
+           (unsigned long long) stats.rx_packets, (unsigned long long) stats.tx_packets,
+           (unsigned long long) stats.tx_failed, (unsigned long long) stats.rx_alloc_failed,
+           stats.rx_ring_hwm, (unsigned long long) stats.polls);
+
+    dma_unpin_free(&io_ops.dma_manager, tx.virt, BENCH_MAX_FRAME);
+    dma_pool_put(&state.pool);
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Packet rate of the lwIP glue against the loopback device. A UDP socket
+ * sends datagrams to its own address, which a static ARP entry resolves to
+ * the device, and receives them back through ethif_lwip_poll. This covers
+ * the whole path of a datagram through lwIP and the glue, including the
+ * copies into and out of the preallocated DMA buffers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/util.h>
+#include <ethdrivers/lwip.h>
+#include <ethdrivers/loopback.h>
+#include <lwip/init.h>
+#include <lwip/netif.h>
+#include <lwip/udp.h>
+#include <lwip/etharp.h>
+#include <netif/ethernet.h>
+
+#include "bench_io.h"
+
+#define BENCH_PORT 7000
+/* datagrams sent before the device is polled, the RX pbufs come from
+ * PBUF_POOL so this stays well below PBUF_POOL_SIZE */
+#define BENCH_MAX_BURST 8
+
+typedef struct bench_state {
+    uint64_t rx_frames;
+    unsigned int expect_len;
+    int errors;
+} bench_state_t;
+
+/* lwIP runs without timers here, but the core still reads the clock */
+u32_t sys_now(void)
+{
+    return bench_now_ns() / 1000000;
+}
+
+static void bench_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    bench_state_t *state = arg;
+    if (p->tot_len != state->expect_len) {
+        state->errors++;
+    }
+    state->rx_frames++;
+    pbuf_free(p);
+}
+
+static int run_workload(lwip_iface_t *iface, struct udp_pcb *pcb, const ip4_addr_t *addr, bench_state_t *state,
+                        unsigned int payload, unsigned int burst, uint64_t frames)
+{
+    bench_io_counts_t io_before, io_after;
+    dma_cache_stats_t cache_before, cache_after;
+
+    state->expect_len = payload;
+    uint64_t rx_before = state->rx_frames;
+    bench_io_counts(&io_before);
+    ethif_lwip_cache_stats(iface, &cache_before);
+    uint64_t start_ns = bench_now_ns();
+    uint64_t start_cycles = bench_cycles();
+
+    for (uint64_t sent = 0; sent < frames;) {
+        for (unsigned int i = 0; i < burst && sent < frames; i++, sent++) {
+            struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, payload, PBUF_RAM);
+            if (!p) {
+                fprintf(stderr, "bench: pbuf_alloc failed\n");
+                return -1;
+            }
+            memset(p->payload, (uint8_t) sent, payload);
+            err_t err = udp_sendto(pcb, p, addr, BENCH_PORT);
+            pbuf_free(p);
+            if (err != ERR_OK) {
+                fprintf(stderr, "bench: udp_sendto failed with %d\n", err);
+                return -1;
+            }
+        }
+        ethif_lwip_poll(iface);
+    }
+
+    uint64_t cycles = bench_cycles() - start_cycles;
+    uint64_t elapsed = bench_now_ns() - start_ns;
+    bench_io_counts(&io_after);
+    ethif_lwip_cache_stats(iface, &cache_after);
+
+    uint64_t received = state->rx_frames - rx_before;
+    if (state->errors || received != frames) {
+        fprintf(stderr, "bench: sent %llu datagrams, received %llu, %d bad\n",
+                (unsigned long long) frames, (unsigned long long) received, state->errors);
+        return -1;
+    }
+
+    uint64_t cache_ops = (cache_after.clean - cache_before.clean) +
+                         (cache_after.invalidate - cache_before.invalidate) +
+                         (cache_after.clean_invalidate - cache_before.clean_invalidate);
+    double secs = elapsed / 1e9;
+    printf("%5u %5u %10.0f %10.1f %9.3f %9.3f %9.3f\n", payload, burst,
+           frames / secs, (double) cycles / frames,
+           (double)(io_after.mallocs - io_before.mallocs) / frames,
+           (double)(io_after.dma_allocs - io_before.dma_allocs) / frames,
+           (double) cache_ops / frames);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --frames N       datagrams per workload (default 1000000)\n"
+            "  --quick          fewer datagrams, for CI\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    /* 64, 512 and 1514 byte frames */
+    static const unsigned int payloads[] = { 18, 470, 1472 };
+    static const unsigned int bursts[] = { 1, BENCH_MAX_BURST };
+    static bench_state_t state;
+    static lwip_iface_t iface_storage;
+    static struct netif netif;
+    uint64_t frames = 1000000;
+    ps_io_ops_t io_ops;
+    ip4_addr_t addr, netmask, gw;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--quick")) {
+            frames = 20000;
+        } else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            frames = strtoull(argv[++i], NULL, 0);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (0 == frames) {
+        fprintf(stderr, "bench: --frames out of range\n");
+        return 1;
+    }
+
+    if (bench_io_init(&io_ops)) {
+        return 1;
+    }
+    lwip_init();
+
+    lwip_iface_t *iface = ethif_new_lwip_driver_no_malloc(io_ops, NULL, ethif_loopback_init, NULL, &iface_storage);
+    if (!iface) {
+        return 1;
+    }
+    IP4_ADDR(&addr, 10, 0, 0, 1);
+    IP4_ADDR(&netmask, 255, 255, 255, 0);
+    IP4_ADDR(&gw, 10, 0, 0, 254);
+    if (!netif_add(&netif, &addr, &netmask, &gw, iface, ethif_get_ethif_init(iface), ethernet_input)) {
+        fprintf(stderr, "bench: netif_add failed\n");
+        return 1;
+    }
+    netif_set_default(&netif);
+    netif_set_up(&netif);
+
+    /* Datagrams to our own address go out of the device and come back */
+    struct eth_addr mac;
+    memcpy(mac.addr, netif.hwaddr, ETH_HWADDR_LEN);
+    if (etharp_add_static_entry(&addr, &mac) != ERR_OK) {
+        fprintf(stderr, "bench: etharp_add_static_entry failed\n");
+        return 1;
+    }
+
+    struct udp_pcb *pcb = udp_new();
+    if (!pcb || udp_bind(pcb, IP_ADDR_ANY, BENCH_PORT) != ERR_OK) {
+        fprintf(stderr, "bench: failed to bind UDP port %d\n", BENCH_PORT);
+        return 1;
+    }
+    udp_recv(pcb, bench_recv, &state);
+
+    printf("%llu datagrams per workload\n", (unsigned long long) frames);
+    printf("%5s %5s %10s %10s %9s %9s %9s\n",
+           "bytes", "burst", "pps", "cycles/pkt", "malloc/pkt", "dma/pkt", "cache/pkt");
+    for (int s = 0; s < ARRAY_SIZE(payloads); s++) {
+        for (int b = 0; b < ARRAY_SIZE(bursts); b++) {
+            if (run_workload(iface, pcb, &addr, &state, payloads[s], bursts[b], frames)) {
+                return 1;
+            }
+        }
+    }
+
+    ethif_stats_t stats;
+    iface->driver.i_fn.get_stats(&iface->driver, &stats);
+    printf("driver: rx %llu tx %llu tx_failed %llu rx_alloc_failed %llu rx_hwm %u polls %llu\n",
+           (unsigned long long) stats.rx_packets, (unsigned long long) stats.tx_packets,
+           (unsigned long long) stats.tx_failed, (unsigned long long) stats.rx_alloc_failed,
+           stats.rx_ring_hwm, (unsigned long long) stats.polls);
+    return 0;
+}
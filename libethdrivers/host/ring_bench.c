@@ -0,0 +1,147 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Cost of the index wrapping of eth_ring_t. Buffers are posted until the
+ * ring is full and reaped in bursts, the way a driver refills and completes
+ * its RX ring, reading a descriptor word at every index.
+ *
+ * A power of two ring wraps with a mask, other sizes with a compare, and the
+ * modulo the drivers used before is timed for reference. This is built
+ * twice: ring_bench at the default configuration, where eth_ring_wrap picks
+ * between mask and compare at run time, and ring_bench_pow2 with
+ * CONFIG_LIB_ETHDRIVER_POW2_RINGS, where only the mask is left.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/util.h>
+#include <ethdrivers/ring.h>
+
+#include "bench_io.h"
+
+#define BENCH_BURST 32
+
+static const unsigned int sizes[] = { 256, 255, 1024, 1000 };
+
+static uint32_t descs[1024];
+
+/* eth_ring_post and eth_ring_reap with a modulo in place of eth_ring_wrap */
+static inline void mod_post(eth_ring_t *ring, void *cookie)
+{
+    ring->cookies[ring->tail] = cookie;
+    ring->tail = (ring->tail + 1) % ring->size;
+    ring->remain--;
+}
+
+static inline void *mod_reap(eth_ring_t *ring)
+{
+    void *cookie = ring->cookies[ring->head];
+    ring->head = (ring->head + 1) % ring->size;
+    ring->remain++;
+    return cookie;
+}
+
+static uint64_t walk(eth_ring_t *ring, uint64_t ops, bool modulo)
+{
+    uint64_t sum = 0;
+
+    for (uint64_t done = 0; done < ops;) {
+        while (ring->remain > 0) {
+            void *cookie = (void *)(uintptr_t)(done + 1);
+            if (modulo) {
+                mod_post(ring, cookie);
+            } else {
+                eth_ring_post(ring, cookie, 1);
+            }
+        }
+        for (unsigned int i = 0; i < BENCH_BURST; i++, done++) {
+            sum += descs[ring->head];
+            if (modulo) {
+                sum += (uintptr_t) mod_reap(ring);
+            } else {
+                sum += (uintptr_t) eth_ring_reap(ring);
+            }
+        }
+    }
+    return sum;
+}
+
+static int run_size(unsigned int size, uint64_t ops)
+{
+    eth_ring_t ring;
+    uint64_t sums[2];
+    double ns[2];
+
+#ifdef CONFIG_LIB_ETHDRIVER_POW2_RINGS
+    if (!IS_POWER_OF_2(size)) {
+        printf("%5u %-8s skipped, not a power of two\n", size, "");
+        return 0;
+    }
+#endif
+    if (eth_ring_init(&ring, size, 0, false)) {
+        fprintf(stderr, "bench: could not create a ring of %u\n", size);
+        return -1;
+    }
+    for (int modulo = 0; modulo < 2; modulo++) {
+        eth_ring_reset(&ring, 0);
+        uint64_t start_ns = bench_now_ns();
+        sums[modulo] = walk(&ring, ops, modulo);
+        ns[modulo] = (double)(bench_now_ns() - start_ns) / ops;
+    }
+    eth_ring_destroy(&ring);
+
+    if (sums[0] != sums[1]) {
+        fprintf(stderr, "bench: ring of %u wrapped differently with a modulo\n", size);
+        return -1;
+    }
+    printf("%5u %-8s %9.2f %9.2f\n", size, ring.mask ? "mask" : "compare", ns[0], ns[1]);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --ops N          buffers posted and reaped per ring\n"
+            "  --quick          fewer buffers, for CI\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t ops = 100000000;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--quick")) {
+            ops = 1000000;
+        } else if (!strcmp(argv[i], "--ops") && i + 1 < argc) {
+            ops = strtoull(argv[++i], NULL, 0);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (ops == 0 || ops % BENCH_BURST) {
+        fprintf(stderr, "bench: --ops must be a multiple of %d\n", BENCH_BURST);
+        return 1;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(descs); i++) {
+        descs[i] = i;
+    }
+#ifdef CONFIG_LIB_ETHDRIVER_POW2_RINGS
+    printf("power of two rings only\n");
+#endif
+    printf("%llu buffers per ring\n", (unsigned long long) ops);
+    printf("%5s %-8s %9s %9s\n", "size", "wrap", "ns/buf", "modulo");
+    for (int i = 0; i < ARRAY_SIZE(sizes); i++) {
+        if (run_size(sizes[i], ops)) {
+            return 1;
+        }
+    }
+    return 0;
+}
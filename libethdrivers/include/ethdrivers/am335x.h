@@ -7,17 +7,46 @@
 #ifndef __ETHIF_AM335X_DRIVER_H
 #define __ETHIF_AM335X_DRIVER_H
 
+#include <stdint.h>
 #include <platsupport/io.h>
 #include <ethdrivers/raw.h>
 
+/* CPDMA RX channels reception can be spread over. Transmission always uses
+ * a single CPDMA TX channel, channel 0 */
+#define AM335X_MAX_RX_CHANNELS 8
+#define AM335X_NUM_SLAVE_PORTS 2
+
+typedef struct ethif_am335x_config {
+    /* Mapped control module, PRCM and CPSW registers */
+    uintptr_t eth_mmio_ctr_reg;
+    uintptr_t eth_mmio_prcm_reg;
+    uintptr_t eth_mmio_cpsw_reg;
+    /* Number of CPDMA RX channels, each gets an equal share of the RX
+     * descriptors in CPPI RAM. 0 is the same as 1 */
+    unsigned int num_rx_channels;
+    /* RX channel that the frames of each slave port are steered to */
+    unsigned int port_rx_channel[AM335X_NUM_SLAVE_PORTS];
+    /* Expected peak packet rates, from which the limits for interrupt
+     * pacing are worked out. 0 leaves the interrupt unpaced */
+    unsigned int rx_pkts_per_ms;
+    unsigned int tx_pkts_per_ms;
+} ethif_am335x_config_t;
+
 /**
  * This function initialises the hardware and conforms to the ethif_driver_init
  * type in raw.h
  * @param[out] eth_driver   Ethernet driver structure to fill out
  * @param[in] io_ops        A structure containing os specific data and
  *                          functions.
- * @param[in] config        Unused, should be NULL
+ * @param[in] config        Mapped registers, laid out as the first three
+ *                          fields of ethif_am335x_config_t. A single RX
+ *                          channel is used and interrupts are not paced.
  */
 int ethif_am335x_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *config);
 
+/**
+ * Same as ethif_am335x_init, but config is an ethif_am335x_config_t
+ */
+int ethif_am335x_init_config(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *config);
+
 #endif
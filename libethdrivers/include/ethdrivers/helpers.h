@@ -7,16 +7,219 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <platsupport/io.h>
+#include <utils/zf_log_if.h>
 
 typedef struct dma_addr {
     void *virt;
     uintptr_t phys;
 }dma_addr_t;
 
+/* The lwIP and picoTCP glue are not locked. Their IRQ and poll wrappers
+ * use these to catch a second thread driving an interface, such as MSI-X
+ * vectors of one device serviced from different threads. */
+static inline void ethif_single_thread_enter(int *busy)
+{
+    int was_busy = __atomic_exchange_n(busy, 1, __ATOMIC_ACQUIRE);
+    ZF_LOGF_IF(was_busy, "Interface driven by two threads at once");
+}
+
+static inline void ethif_single_thread_leave(int *busy)
+{
+    __atomic_store_n(busy, 0, __ATOMIC_RELEASE);
+}
+
 /* Small wrapper that does ps_dma_alloc and then ps_dma_pin */
 dma_addr_t dma_alloc_pin(ps_dma_man_t *dma_man, size_t size, int cached, int alignment);
 
 /* Small wrapper than does ps_dma_unpin and then ps_dma_free */
 void dma_unpin_free(ps_dma_man_t *dma_man, void *virt, size_t size);
 
+/* Descriptor rings are aligned and padded to at least this, so that no other
+ * data shares a cache line with a ring */
+#define DMA_RING_ALIGN 64
+
+/**
+ * Allocate and pin an uncached descriptor ring
+ *
+ * @param dma_man       DMA manager to allocate from
+ * @param desc_size     Size of one descriptor
+ * @param count         Number of descriptors
+ * @param alignment     Alignment the device needs, DMA_RING_ALIGN if less
+ * @return              The ring, phys is 0 on error
+ */
+dma_addr_t dma_ring_alloc(ps_dma_man_t *dma_man, size_t desc_size, unsigned int count, int alignment);
+
+/* Free a ring from dma_ring_alloc */
+void dma_ring_free(ps_dma_man_t *dma_man, volatile void *ring, size_t desc_size, unsigned int count);
+
+/* Read a descriptor word written back by the device. Later reads, of the rest
+ * of the descriptor or of the buffer it describes, cannot be ordered before
+ * it, which is all a completion check needs and is cheaper than following
+ * the read with a full barrier. */
+static inline uint32_t dma_ring_load_acquire(volatile uint32_t *word)
+{
+    return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+}
+
+
+/* Counters for the cache maintenance performed on DMA buffers */
+typedef struct dma_cache_stats {
+    uint64_t clean;
+    uint64_t invalidate;
+    uint64_t clean_invalidate;
+    /* operations avoided because the buffer was known to be clean */
+    uint64_t skipped;
+    /* packets sent and received, to relate the counts above to */
+    uint64_t packets;
+} dma_cache_stats_t;
+
+/* Whether the CPU may hold dirty cache lines for a buffer */
+typedef enum dma_buf_state {
+    DMA_BUF_CLEAN,
+    DMA_BUF_DIRTY,
+} dma_buf_state_t;
+
+#define DMA_CACHE_BATCH_SIZE 32
+
+typedef struct dma_cache_range {
+    dma_cache_op_t op;
+    uintptr_t start;
+    uintptr_t end;
+} dma_cache_range_t;
+
+/* Batches cache maintenance on DMA buffers. Operations of the same kind on
+ * adjacent or overlapping memory are merged into one and nothing is done
+ * until dma_cache_flush, which must happen before the memory is handed to
+ * the device or read by the CPU. */
+typedef struct dma_cache {
+    ps_dma_man_t *dma_man;
+    dma_cache_stats_t stats;
+    unsigned int num_pending;
+    dma_cache_range_t pending[DMA_CACHE_BATCH_SIZE];
+} dma_cache_t;
+
+void dma_cache_init(dma_cache_t *cache, ps_dma_man_t *dma_man);
+
+/* Queue an operation, flushing the batch first if it is full */
+void dma_cache_queue(dma_cache_t *cache, dma_cache_op_t op, void *vaddr, size_t size);
+
+/* Perform all queued operations */
+void dma_cache_flush(dma_cache_t *cache);
+
+/* Record an operation that was not needed */
+static inline void dma_cache_skip(dma_cache_t *cache)
+{
+    cache->stats.skipped++;
+}
+
+/* Most buffer sizes a dma_pool_t can be configured with */
+#define DMA_POOL_MAX_CLASSES 4
+/* Pool buffers are rounded up to at least this, so that no two buffers share
+ * a cache line and maintenance on one cannot disturb another */
+#define DMA_POOL_MIN_ALIGN 64
+
+typedef struct dma_pool_class_config {
+    size_t buf_size;
+    unsigned int num_bufs;
+} dma_pool_class_config_t;
+
+/* Size classes of a pool, in ascending order of buf_size */
+typedef struct dma_pool_config {
+    unsigned int num_classes;
+    dma_pool_class_config_t classes[DMA_POOL_MAX_CLASSES];
+} dma_pool_config_t;
+
+typedef struct dma_pool_class {
+    size_t buf_size;
+    unsigned int num_bufs;
+    unsigned int num_free;
+    /* stack of free buffers */
+    dma_addr_t **free;
+    /* all buffers of the class, the dma_buf_state_t of each and the
+     * number of references held to each */
+    dma_addr_t *bufs;
+    uint8_t *state;
+    uint16_t *refs;
+} dma_pool_class_t;
+
+/* Preallocated DMA buffers of a few fixed sizes, carved out of a single
+ * pinned allocation. Buffers are handed out as dma_addr_t pointers that
+ * stay valid for the life of the pool.
+ *
+ * A pool can be shared by several interfaces, so that a buffer received on
+ * one can be handed to raw_tx of another without copying the frame. Buffers
+ * are reference counted for this, each holder drops its reference with
+ * dma_pool_free. The pool does no locking, interfaces sharing it must be
+ * driven from the same thread. */
+typedef struct dma_pool {
+    ps_dma_man_t *dma_man;
+    dma_addr_t mem;
+    size_t mem_size;
+    int alignment;
+    /* references to the pool itself, see dma_pool_get */
+    unsigned int users;
+    unsigned int num_classes;
+    dma_pool_class_t classes[DMA_POOL_MAX_CLASSES];
+} dma_pool_t;
+
+/* One class of CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS buffers of
+ * CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE bytes */
+void dma_pool_default_config(dma_pool_config_t *config);
+
+/**
+ * Allocate and pin the memory of a pool. All buffers start out clean. The
+ * caller holds the only reference to the pool.
+ *
+ * @param pool      Pool to initialise
+ * @param dma_man   DMA manager to allocate from, must outlive the pool
+ * @param config    Size classes, copied
+ * @param alignment Alignment of every buffer
+ * @return          0 on success, -1 on error
+ */
+int dma_pool_init(dma_pool_t *pool, ps_dma_man_t *dma_man, const dma_pool_config_t *config, int alignment);
+
+/* Free the memory of a pool, all buffers must have been returned */
+void dma_pool_destroy(dma_pool_t *pool);
+
+/* Take a reference to an initialised pool for another user, such as an
+ * interface that allocates from it */
+void dma_pool_get(dma_pool_t *pool);
+
+/* Drop a reference to a pool, the last one destroys it */
+void dma_pool_put(dma_pool_t *pool);
+
+/* Whether the buffers of a pool satisfy a DMA alignment requirement */
+static inline bool dma_pool_aligned(dma_pool_t *pool, int alignment)
+{
+    return alignment <= 1 || (alignment <= pool->alignment && pool->alignment % alignment == 0);
+}
+
+static inline bool dma_pool_ready(dma_pool_t *pool)
+{
+    return pool->num_classes != 0;
+}
+
+/* Size of the largest buffer in the pool */
+static inline size_t dma_pool_max_size(dma_pool_t *pool)
+{
+    return pool->num_classes ? pool->classes[pool->num_classes - 1].buf_size : 0;
+}
+
+/* Take a buffer of at least size bytes from the smallest class that has one
+ * free. NULL if there is none. The caller holds the only reference. */
+dma_addr_t *dma_pool_alloc(dma_pool_t *pool, size_t size);
+
+/* Whether buf is one of the buffers of the pool */
+bool dma_pool_contains(dma_pool_t *pool, dma_addr_t *buf);
+
+/* Take another reference to a buffer, for instance before handing a
+ * received buffer to raw_tx of a second interface */
+void dma_pool_ref(dma_pool_t *pool, dma_addr_t *buf);
+
+/* Drop a reference to a buffer, the last one returns it to the pool */
+void dma_pool_free(dma_pool_t *pool, dma_addr_t *buf);
+
+/* The dma_buf_state_t of a buffer, which the pool only initialises */
+uint8_t *dma_pool_buf_state(dma_pool_t *pool, dma_addr_t *buf);
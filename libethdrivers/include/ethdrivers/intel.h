@@ -12,6 +12,23 @@
 typedef struct ethif_intel_config {
     void *bar0;
     uint8_t prom_mode;
+    /* Number of receive queues to spread packets over with RSS. 0 keeps the
+     * single queue with legacy descriptors. Only supported on the 82580 */
+    unsigned int num_rx_queues;
+    /* Use header split descriptors so that packet headers, and small packets
+     * in full, land in driver owned buffers that are handed over with the
+     * rx_complete_split callback. Requires num_rx_queues */
+    uint8_t rx_hdr_split;
+    /* Keep frames queued for transmit when the link goes down, so they go
+     * out once it is back and raw_tx keeps accepting frames while there is
+     * room. By default they are handed back unsent with tx_complete and
+     * raw_tx fails until the link is up */
+    uint8_t tx_keep_on_link_down;
+    /* With more than one IRQ these are MSI-X vectors, one per receive queue
+     * followed by one for transmit and link events. The vectors can only be
+     * handled on different threads if the rx callbacks are thread safe,
+     * the lwIP and picoTCP glue are not. With none the link state is
+     * read on every raw_poll */
     size_t num_irqs;
     ps_irq_t irq_info[];
 } ethif_intel_config_t;
@@ -36,3 +53,15 @@ int ethif_e82580_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *c
  */
 int ethif_e82574_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *config);
 
+
+/**
+ * Process completed receives and refill buffers of a single receive queue.
+ * Different queues can be polled concurrently, but not concurrently with
+ * raw_poll. The rx_complete and allocate_rx_buf callbacks are invoked from
+ * the calling thread, so they must be thread safe to do so. The lwIP and
+ * picoTCP glue are not, interfaces using them must service every queue
+ * from one thread.
+ * @param[in] eth_driver    Ethernet driver structure
+ * @param[in] queue         Receive queue index, less than num_rx_queues
+ */
+void ethif_intel_rx_queue_poll(struct eth_driver *eth_driver, unsigned int queue);
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <platsupport/io.h>
+#include <ethdrivers/raw.h>
+
+/* A software NIC that receives every frame it sends. It needs no device, so
+ * the lwIP and picoTCP glue can be run and profiled without hardware.
+ *
+ * Frames are copied by the CPU, so the physical addresses handed to raw_tx
+ * and returned by allocate_rx_buf must also be valid virtual addresses. Use a
+ * DMA manager that maps memory 1:1, such as ps_new_stdlib_dma_man; init
+ * fails with any other. libethdrivers/host benchmarks the device on a Linux
+ * host. */
+
+typedef struct ethif_loopback_config {
+    /* MAC address as 0x0000aabbccddeeff, 0 for a locally administered default */
+    uint64_t mac;
+    /* frames that can be in flight between raw_tx and raw_poll, 0 for the
+     * RX descriptor count */
+    unsigned int queue_size;
+} ethif_loopback_config_t;
+
+/**
+ * This function initialises the loopback device and conforms to the
+ * ethif_driver_init type in raw.h. Sent frames are delivered to rx_complete
+ * by the next raw_poll or raw_handleIRQ call, never from within raw_tx.
+ * @param[out] eth_driver   Ethernet driver structure to fill out
+ * @param[in] io_ops        A structure containing os specific data and
+ *                          functions.
+ * @param[in] config        Pointer to a ethif_loopback_config struct, or NULL
+ */
+int ethif_loopback_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *config);
@@ -18,6 +18,42 @@
 #include <lwip/netif.h>
 #include <stdint.h>
 
+/* Number of receive pbufs kept for reuse after their frame was copied out */
+#define LWIP_RX_RECYCLE_SIZE 32
+/* Number of received frames kept until the end of a poll or IRQ pass, so
+ * that their cache maintenance is done in one batch */
+#define LWIP_RX_PENDING_SIZE DMA_CACHE_BATCH_SIZE
+/* Frames in more buffers than this are handed to lwIP straight away */
+#define LWIP_RX_PENDING_BUFS 4
+
+struct lwip_iface;
+
+/* A received frame waiting for ethif_lwip_rx_flush */
+typedef struct lwip_rx_pending {
+    /* pbuf holding the first hdr_len bytes of a split frame, or NULL */
+    struct pbuf *hdr;
+    unsigned int hdr_len;
+    unsigned int num_bufs;
+    void *cookies[LWIP_RX_PENDING_BUFS];
+    unsigned int lens[LWIP_RX_PENDING_BUFS];
+    uint16_t csum_verified;
+} lwip_rx_pending_t;
+
+/**
+ * Called for every frame received into a preallocated buffer before it is
+ * copied into a pbuf. The hook may pass the buffer on to other interfaces
+ * sharing the pool with ethif_lwip_forward. The frame was invalidated from
+ * the cache, a hook that writes to it must call ethif_lwip_buf_dirty
+ * before forwarding it.
+ *
+ * @param cookie    rx_hook_cookie of the interface
+ * @param iface     Interface the frame was received on
+ * @param buf       Buffer holding the frame, the hook gets no reference
+ * @param len       Length of the frame
+ * @return          true if the frame is consumed and must not go to lwIP
+ */
+typedef bool (*lwip_rx_hook_fn)(void *cookie, struct lwip_iface *iface, dma_addr_t *buf, unsigned int len);
+
 /* Structure describing an LWIP interface to an ethernet driver.
  * This structure is defined publicly for performance reasons
  * but should not be used directly */
@@ -27,8 +63,37 @@ typedef struct lwip_iface {
     ps_dma_man_t dma_man;
     struct netif *netif;
 
-    int num_free_bufs;
-    dma_addr_t **bufs;
+    /* preallocated buffers, either a shared pool or own_pool, which is set
+     * up from pool_config on first use */
+    bool prealloc;
+    dma_pool_config_t pool_config;
+    dma_pool_t *pool;
+    dma_pool_t own_pool;
+    dma_cache_t cache;
+
+    lwip_rx_hook_fn rx_hook;
+    void *rx_hook_cookie;
+
+    /* the driver reported the link down */
+    bool link_down;
+
+    /* ETHIF_TX_CSUM_* requests to make for every outgoing frame */
+    uint32_t tx_csum_flags;
+    /* NETIF_CHECKSUM_CHECK_* flags the driver verified for the frame
+     * being input, lwIP skips those checks for it */
+    uint16_t rx_csum_verified;
+
+    /* set while ethif_lwip_handle_irq or ethif_lwip_poll is running */
+    int busy;
+
+    /* frames received in this pass, see ethif_lwip_rx_flush */
+    bool rx_delivering;
+    int num_rx_pending;
+    lwip_rx_pending_t rx_pending[LWIP_RX_PENDING_SIZE];
+
+    /* pbufs from the copy-break path that can be reposted as they are */
+    int num_rx_recycle;
+    struct pbuf *rx_recycle[LWIP_RX_RECYCLE_SIZE];
 } lwip_iface_t;
 
 /**
@@ -67,16 +132,89 @@ lwip_iface_t *ethif_new_lwip_driver(ps_io_ops_t io_ops, ps_dma_man_t *pbuf_dma,
  */
 lwip_iface_t *ethif_new_lwip_driver_no_malloc(ps_io_ops_t io_ops, ps_dma_man_t *pbuf_dma, ethif_driver_init driver, void *driver_config, lwip_iface_t *iface);
 
+/**
+ * Same as ethif_new_lwip_driver_no_malloc with preallocated buffers, but
+ * with buffer sizes and counts for this interface rather than the
+ * CONFIG_LIB_ETHDRIVER_* defaults. Frames are sent from the smallest
+ * buffer they fit into, so a class of small buffers serves ACKs and the
+ * like without tying up full sized ones.
+ *
+ * @param[in] pool_config   Size classes of the buffer pool, copied
+ * @param[in] iface         Interface to initialise, or NULL to malloc one
+ */
+lwip_iface_t *ethif_new_lwip_driver_pool(ps_io_ops_t io_ops, const dma_pool_config_t *pool_config,
+                                         ethif_driver_init driver, void *driver_config, lwip_iface_t *iface);
+
+/**
+ * Same as ethif_new_lwip_driver_pool, but the interface allocates from a
+ * pool that other interfaces may share. Buffers received on one of them can
+ * then be sent out of another with ethif_lwip_forward without a copy.
+ *
+ * @param[in] pool      Initialised pool, the interface takes a reference to
+ *                      it. Its buffers must be aligned for the driver.
+ * @param[in] iface     Interface to initialise, or NULL to malloc one
+ */
+lwip_iface_t *ethif_new_lwip_driver_shared(ps_io_ops_t io_ops, dma_pool_t *pool, ethif_driver_init driver,
+                                           void *driver_config, lwip_iface_t *iface);
+
+/**
+ * Send a frame held in a buffer of the pool of this interface, typically
+ * one received on another interface sharing the pool, without copying it.
+ * A reference to the buffer is taken until the driver is done with it, the
+ * caller keeps its own.
+ *
+ * @param[in] iface     Interface to send from
+ * @param[in] buf       Buffer of the pool of iface
+ * @param[in] len       Length of the frame
+ * @return              0 on success, -1 on error
+ */
+int ethif_lwip_forward(lwip_iface_t *iface, dma_addr_t *buf, unsigned int len);
+
+/* For rx hooks that write to a received buffer, so that it gets cleaned
+ * from the cache before it is forwarded or reused */
+static inline void ethif_lwip_buf_dirty(lwip_iface_t *iface, dma_addr_t *buf) {
+    *dma_pool_buf_state(iface->pool, buf) = DMA_BUF_DIRTY;
+}
+
+/**
+ * Hand the frames received since the last call to lwIP, after one batch of
+ * cache maintenance for all of them. ethif_lwip_handle_irq and
+ * ethif_lwip_poll do this at the end of their pass. Callers that run the
+ * driver in other ways, such as ethif_intel_rx_queue_poll, call it after.
+ */
+void ethif_lwip_rx_flush(lwip_iface_t *iface);
+
+/* Install a hook that sees frames before lwIP does, NULL removes it */
+static inline void ethif_lwip_set_rx_hook(lwip_iface_t *iface, lwip_rx_hook_fn hook, void *cookie) {
+    iface->rx_hook = hook;
+    iface->rx_hook_cookie = cookie;
+}
+
 /* Wrapper function for an LWIP driver for asking the underlying
- * eth driver to handle an IRQ */
+ * eth driver to handle an IRQ. Neither the interface nor lwIP is locked,
+ * so all IRQs of a device, including every MSI-X vector, must be handled
+ * from the one thread that runs lwIP. Aborts if two threads get in. */
 static inline void ethif_lwip_handle_irq(lwip_iface_t *iface, int irq) {
+    ethif_single_thread_enter(&iface->busy);
     iface->driver.i_fn.raw_handleIRQ(&iface->driver, irq);
+    ethif_lwip_rx_flush(iface);
+    ethif_single_thread_leave(&iface->busy);
 }
 
 /* Wrapper function for an LWIP driver for asking the underlying
- * eth driver to manual check its state in the absence of interrupts */
+ * eth driver to manual check its state in the absence of interrupts.
+ * Same threading rules as ethif_lwip_handle_irq. */
 static inline void ethif_lwip_poll(lwip_iface_t *iface) {
+    ethif_single_thread_enter(&iface->busy);
     iface->driver.i_fn.raw_poll(&iface->driver);
+    ethif_lwip_rx_flush(iface);
+    ethif_single_thread_leave(&iface->busy);
+}
+
+/* Cache maintenance counters for this interface. Dividing by the packets
+ * counter gives the cost per packet */
+static inline void ethif_lwip_cache_stats(lwip_iface_t *iface, dma_cache_stats_t *stats) {
+    *stats = iface->cache.stats;
 }
 
 /* Retrieve the netif_init_fn for this iface for passing to netif_add */
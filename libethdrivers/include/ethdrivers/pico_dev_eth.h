@@ -27,18 +27,21 @@ typedef struct pico_device_eth {
     // Underlying ethernet driver struct
     struct eth_driver driver;
 
-    // Buffer management
+    // Buffer management, either a shared pool or own_pool, which is set up
+    // from pool_config on first use
     ps_dma_man_t dma_man;
-    int num_free_bufs;
-    dma_addr_t **bufs;
-    dma_addr_t * dma_bufs;
+    dma_pool_config_t pool_config;
+    dma_pool_t *pool;
+    dma_pool_t own_pool;
 
-    int next_free_buf;
-    int *buf_pool;
-    int *rx_queue;
+    // Received buffers waiting for pico_eth_poll, one slot per pool buffer
+    dma_addr_t **rx_queue;
     int *rx_lens;
     int rx_count;
 
+    // Set while ethif_pico_handle_irq is running
+    int busy;
+
 } pico_device_eth;
 
 /*
@@ -48,10 +51,29 @@ struct pico_device *pico_eth_create(char *name, ethif_driver_init driver_init, v
 
 struct pico_device *pico_eth_create_no_malloc(char *name, ethif_driver_init driver_init, void *driver_config, ps_io_ops_t io_ops, pico_device_eth *pico_dev);
 
+/*
+ * Same as pico_eth_create_no_malloc, but with buffer sizes and counts for this
+ * device rather than the CONFIG_LIB_ETHDRIVER_* defaults. pool_config is
+ * copied, pico_dev may be NULL to malloc one.
+ */
+struct pico_device *pico_eth_create_pool(char *name, ethif_driver_init driver_init, void *driver_config, ps_io_ops_t io_ops,
+                                         const dma_pool_config_t *pool_config, pico_device_eth *pico_dev);
+
+/*
+ * Same as pico_eth_create_pool, but allocating from an initialised pool that
+ * other devices may share. The device takes a reference to the pool.
+ */
+struct pico_device *pico_eth_create_shared(char *name, ethif_driver_init driver_init, void *driver_config, ps_io_ops_t io_ops,
+                                           dma_pool_t *pool, pico_device_eth *pico_dev);
+
 /* Wrapper function for a picotcp driver for asking the underlying
- * eth driver to handle an IRQ */
+ * eth driver to handle an IRQ. The device is not locked, so all IRQs of it,
+ * including every MSI-X vector, must be handled from one thread. Aborts if
+ * two threads get in. */
 static inline void ethif_pico_handle_irq(pico_device_eth *iface, int irq) {
+    ethif_single_thread_enter(&iface->busy);
     iface->driver.i_fn.raw_handleIRQ(&iface->driver, irq);
+    ethif_single_thread_leave(&iface->busy);
 }
 
 #endif // CONFIG_LIB_PICOTCP
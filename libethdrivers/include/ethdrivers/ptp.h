@@ -0,0 +1,125 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <errno.h>
+#include <utils/time.h>
+#include <platsupport/ltimer.h>
+
+/* The IEEE 1588 clock of a MAC. Hardware packet timestamps (ETHIF_RX_TIMESTAMP,
+ * ethif_raw_tx_complete_ts) are values of this clock, in nanoseconds. */
+typedef struct ethif_ptp_clock {
+    /*
+     * Read the current time of the clock
+     *
+     * @param data      for the clock to use
+     * @param[out] ns   the time in nanoseconds
+     * @return          0 on success, errno on error.
+     */
+    int (*get_time)(void *data, uint64_t *ns);
+
+    /*
+     * Step the clock to a new time
+     *
+     * @param data      for the clock to use
+     * @param ns        new time in nanoseconds
+     * @return          0 on success, errno on error.
+     */
+    int (*set_time)(void *data, uint64_t ns);
+
+    /*
+     * Step the clock by a signed offset
+     *
+     * @param data      for the clock to use
+     * @param delta     nanoseconds to add to the clock
+     * @return          0 on success, errno on error.
+     */
+    int (*adj_time)(void *data, int64_t delta);
+
+    /*
+     * Change the rate of the clock relative to its nominal rate
+     *
+     * @param data      for the clock to use
+     * @param ppb       parts per billion to speed up (positive) or slow
+     *                  down (negative) the clock by
+     * @return          0 on success, errno on error.
+     */
+    int (*adj_freq)(void *data, int32_t ppb);
+
+    /* nanoseconds between two distinct readings of the clock */
+    uint64_t resolution;
+
+    /* data for the implementation to use */
+    void *data;
+} ethif_ptp_clock_t;
+
+static inline int ethif_ptp_get_time(ethif_ptp_clock_t *clock, uint64_t *ns)
+{
+    if (!clock || !clock->get_time) {
+        return ENOSYS;
+    }
+    return clock->get_time(clock->data, ns);
+}
+
+static inline int ethif_ptp_set_time(ethif_ptp_clock_t *clock, uint64_t ns)
+{
+    if (!clock || !clock->set_time) {
+        return ENOSYS;
+    }
+    return clock->set_time(clock->data, ns);
+}
+
+static inline int ethif_ptp_adj_time(ethif_ptp_clock_t *clock, int64_t delta)
+{
+    if (!clock || !clock->adj_time) {
+        return ENOSYS;
+    }
+    return clock->adj_time(clock->data, delta);
+}
+
+static inline int ethif_ptp_adj_freq(ethif_ptp_clock_t *clock, int32_t ppb)
+{
+    if (!clock || !clock->adj_freq) {
+        return ENOSYS;
+    }
+    return clock->adj_freq(clock->data, ppb);
+}
+
+/**
+ * Wrap a PTP clock as an ltimer that provides get_time and get_resolution
+ * only. It has no IRQs or timeouts, so it serves as a time source next to a
+ * platform ltimer rather than replacing it. Stepping the clock with set_time
+ * or adj_time breaks the monotonic guarantee of ltimer_get_time, so only
+ * steer it with adj_freq while it is in use as an ltimer.
+ *
+ * @param clock     Clock to wrap, must outlive the ltimer
+ * @param ltimer    Filled in with the wrapper
+ * @return          0 on success, EINVAL if the clock cannot tell the time
+ */
+int ethif_ptp_clock_ltimer(ethif_ptp_clock_t *clock, ltimer_t *ltimer);
+
+/* Helpers for drivers whose timer has a 32 bit nanoseconds field that wraps
+ * every second, with the seconds kept elsewhere. Returns the full time of a
+ * hardware timestamp 'ts_ns' that was taken less than half a second before
+ * or after 'now', so one reading of the clock serves a whole completion
+ * pass. */
+static inline uint64_t ethif_ptp_extend_ns(uint64_t now, uint32_t ts_ns)
+{
+    uint64_t sec = now / NS_IN_S;
+    uint32_t now_ns = now % NS_IN_S;
+    if (ts_ns > now_ns && ts_ns - now_ns > NS_IN_S / 2) {
+        /* stamped before the last wrap, there is none before second 0 */
+        if (sec > 0) {
+            sec--;
+        }
+    } else if (ts_ns < now_ns && now_ns - ts_ns > NS_IN_S / 2) {
+        /* stamped after the next wrap */
+        sec++;
+    }
+    return sec * NS_IN_S + ts_ns;
+}
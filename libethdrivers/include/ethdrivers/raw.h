@@ -8,15 +8,67 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <platsupport/io.h>
 
 struct eth_driver;
+struct ethif_ptp_clock;
 
 #define ETHIF_TX_ENQUEUED 0
 #define ETHIF_TX_FAILED -1
 #define ETHIF_TX_COMPLETE 1
 
+/* Offload capabilities a driver advertises in eth_driver.offload_caps. The
+ * ETHIF_TX_CSUM_* bits are also used per packet in ethif_tx_meta_t.flags to
+ * ask the hardware to insert that checksum. Unless the driver advertises
+ * ETHIF_CAP_TX_CSUM_PSEUDO the checksum fields must be zero in the frame,
+ * otherwise the TCP/UDP checksum field must hold the (uncomplemented) sum of
+ * the IPv4 pseudo header. */
+#define ETHIF_TX_CSUM_IPV4 BIT(0)
+#define ETHIF_TX_CSUM_TCP BIT(1)
+#define ETHIF_TX_CSUM_UDP BIT(2)
+#define ETHIF_CAP_TX_CSUM_PSEUDO BIT(3)
+/* Frames with a bad IPv4/TCP/UDP checksum are either dropped by the hardware
+ * or reported with ETHIF_RX_CSUM_BAD. Fragmented datagrams are never verified. */
+#define ETHIF_CAP_RX_CSUM BIT(4)
+/* Per packet request for, and capability of, a hardware transmit timestamp
+ * that is reported through ethif_raw_tx_complete_ts */
+#define ETHIF_TX_TIMESTAMP BIT(5)
+/* Received packets carry hardware timestamps (ETHIF_RX_TIMESTAMP) */
+#define ETHIF_CAP_RX_TIMESTAMP BIT(6)
+
+/* Per packet flags reported in ethif_rx_meta_t.flags */
+#define ETHIF_RX_CSUM_IP_OK BIT(0)
+#define ETHIF_RX_CSUM_L4_OK BIT(1)
+#define ETHIF_RX_CSUM_BAD BIT(2)
+/* ethif_rx_meta_t.rss_hash is valid */
+#define ETHIF_RX_RSS_HASH BIT(3)
+/* ethif_rx_meta_t.timestamp is valid */
+#define ETHIF_RX_TIMESTAMP BIT(4)
+
+/* Per packet metadata given to ethif_raw_tx_meta */
+typedef struct ethif_tx_meta {
+    /* ETHIF_TX_CSUM_* requests, only ones advertised by the driver may be set */
+    uint32_t flags;
+    /* Offset of the IPv4 header from the start of the frame */
+    uint16_t l3_offset;
+    /* Offset of the TCP/UDP header from the start of the frame */
+    uint16_t l4_offset;
+} ethif_tx_meta_t;
+
+/* Per packet metadata given to ethif_raw_rx_complete_meta */
+typedef struct ethif_rx_meta {
+    /* ETHIF_RX_* flags */
+    uint32_t flags;
+    /* Receive side scaling hash computed by the hardware */
+    uint32_t rss_hash;
+    /* Hardware receive queue the packet arrived on */
+    uint16_t queue;
+    /* Time of reception on the driver's PTP clock, in nanoseconds */
+    uint64_t timestamp;
+} ethif_rx_meta_t;
+
 /**
  * Transmit a packet.
  *
@@ -36,6 +88,15 @@ struct eth_driver;
 typedef int (*ethif_raw_tx)(struct eth_driver *driver, unsigned int num, uintptr_t *phys, unsigned int *len,
                             void *cookie);
 
+/**
+ * Transmit a packet with offload requests. Same as ethif_raw_tx otherwise.
+ * Drivers that do not support any per packet offloads leave this NULL.
+ *
+ * @param meta      Offloads to perform for this packet, may be NULL
+ */
+typedef int (*ethif_raw_tx_meta)(struct eth_driver *driver, unsigned int num, uintptr_t *phys, unsigned int *len,
+                                 void *cookie, const ethif_tx_meta_t *meta);
+
 /**
  * Handle an IRQ event
  *
@@ -94,6 +155,32 @@ typedef uintptr_t (*ethif_raw_allocate_rx_buf)(void *cb_cookie, size_t buf_size,
  */
 typedef void (*ethif_raw_rx_complete)(void *cb_cookie, unsigned int num_bufs, void **cookies, unsigned int *lens);
 
+/**
+ * Same as ethif_raw_rx_complete but also passes the per packet metadata
+ * the hardware reported. Optional, drivers fall back to ethif_raw_rx_complete
+ * if this is not set (see ethif_rx_complete).
+ *
+ * @param meta          Metadata for this packet, valid during the callback
+ */
+typedef void (*ethif_raw_rx_complete_meta)(void *cb_cookie, unsigned int num_bufs, void **cookies, unsigned int *lens,
+                                           const ethif_rx_meta_t *meta);
+
+/**
+ * Function called by the driver for a packet that starts in driver owned
+ * memory, such as a hardware header split buffer. The first hdr_len bytes of
+ * the frame are at hdr and the rest follows in the buffers, as for
+ * ethif_raw_rx_complete. If the whole frame fit in hdr then num_bufs is 0
+ * and the driver reposts its receive buffer without allocating a new one.
+ * Optional, drivers only split packets if this is set.
+ *
+ * @param hdr           Start of the frame, valid during the callback
+ * @param hdr_len       Number of bytes at hdr
+ * @param meta          Metadata for this packet, valid during the callback
+ */
+typedef void (*ethif_raw_rx_complete_split)(void *cb_cookie, const void *hdr, unsigned int hdr_len,
+                                            unsigned int num_bufs, void **cookies, unsigned int *lens,
+                                            const ethif_rx_meta_t *meta);
+
 /**
  * Function called by the driver upon successful TX
  *
@@ -102,6 +189,27 @@ typedef void (*ethif_raw_rx_complete)(void *cb_cookie, unsigned int num_bufs, vo
  */
 typedef void (*ethif_raw_tx_complete)(void *cb_cookie, void *cookie);
 
+/**
+ * Same as ethif_raw_tx_complete, for packets sent with ETHIF_TX_TIMESTAMP
+ * that the hardware timestamped. Optional, without it the timestamp is
+ * dropped and ethif_raw_tx_complete is called.
+ *
+ * @param timestamp     Time of transmission on the driver's PTP clock, in
+ *                      nanoseconds
+ */
+typedef void (*ethif_raw_tx_complete_ts)(void *cb_cookie, void *cookie, uint64_t timestamp);
+
+/**
+ * Function called by the driver when the link goes up or down. Drivers that
+ * call it take link changes from their interrupts rather than polling for
+ * them, and call it once from their init function with the initial state.
+ * Optional, interfaces of drivers that never call it are assumed up.
+ *
+ * @param cb_cookie     Cookie given in eth_driver struct
+ * @param up            Whether the link is now up
+ */
+typedef void (*ethif_raw_link_change)(void *cb_cookie, bool up);
+
 /**
  * Defining of generic function for initializing an ethernet
  * driver. Takes an allocated and partially filled out
@@ -125,6 +233,42 @@ typedef int (*ethif_driver_init)(struct eth_driver *driver, ps_io_ops_t io_ops,
  */
 typedef void (*ethif_get_mac)(struct eth_driver *driver, uint8_t *mac);
 
+/* Counters a driver keeps about itself */
+typedef struct ethif_stats {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    /* allocate_rx_buf did not return a buffer */
+    uint64_t rx_alloc_failed;
+    /* raw_tx returned ETHIF_TX_FAILED */
+    uint64_t tx_failed;
+    /* frames handed back with tx_complete without being sent */
+    uint64_t tx_dropped;
+    /* most descriptors that were in use at once */
+    uint32_t rx_ring_hwm;
+    uint32_t tx_ring_hwm;
+    uint64_t irqs;
+    uint64_t polls;
+} ethif_stats_t;
+
+/**
+ * Read the counters of a driver. May be called from any thread at any time,
+ * each counter is read atomically but not all of them at the same instant.
+ *
+ * @param driver    Pointer to ethernet driver
+ * @param stats     Filled in with the current counters
+ */
+typedef void (*ethif_get_stats)(struct eth_driver *driver, ethif_stats_t *stats);
+
+/**
+ * Get the IEEE 1588 clock that timestamps packets. NULL if the driver has
+ * none.
+ *
+ * @param driver    Pointer to ethernet driver
+ */
+typedef struct ethif_ptp_clock *(*ethif_get_ptp_clock)(struct eth_driver *driver);
+
 /* Structure defining the set of functions an ethernet driver
  * must implement and expose */
 struct raw_iface_funcs {
@@ -134,6 +278,9 @@ struct raw_iface_funcs {
     ethif_print_state_t print_state;
     ethif_low_level_init_t low_level_init;
     ethif_get_mac get_mac;
+    ethif_raw_tx_meta raw_tx_meta;
+    ethif_get_stats get_stats;
+    ethif_get_ptp_clock get_ptp_clock;
 };
 
 /* Structure defining the set of functions an ethernet driver
@@ -143,6 +290,10 @@ struct raw_iface_callbacks {
     ethif_raw_tx_complete tx_complete;
     ethif_raw_rx_complete rx_complete;
     ethif_raw_allocate_rx_buf allocate_rx_buf;
+    ethif_raw_rx_complete_meta rx_complete_meta;
+    ethif_raw_rx_complete_split rx_complete_split;
+    ethif_raw_tx_complete_ts tx_complete_ts;
+    ethif_raw_link_change link_change;
 };
 
 /* Structure to hold the interface for an ethernet driver */
@@ -153,8 +304,95 @@ struct eth_driver {
     void *cb_cookie;
     ps_io_ops_t io_ops;
     int dma_alignment;
+    /* ETHIF_TX_CSUM_* and ETHIF_CAP_* bits supported by the driver */
+    uint32_t offload_caps;
 };
 
+/* Helper for drivers to hand a received packet and its metadata back */
+static inline void ethif_rx_complete(struct eth_driver *driver, unsigned int num_bufs, void **cookies,
+                                     unsigned int *lens, const ethif_rx_meta_t *meta)
+{
+    if (driver->i_cb.rx_complete_meta) {
+        driver->i_cb.rx_complete_meta(driver->cb_cookie, num_bufs, cookies, lens, meta);
+    } else {
+        driver->i_cb.rx_complete(driver->cb_cookie, num_bufs, cookies, lens);
+    }
+}
+
+/* Helper for drivers to hand back a sent packet, with its timestamp if the
+ * hardware took one */
+static inline void ethif_tx_complete(struct eth_driver *driver, void *cookie, bool has_timestamp,
+                                     uint64_t timestamp)
+{
+    if (has_timestamp && driver->i_cb.tx_complete_ts) {
+        driver->i_cb.tx_complete_ts(driver->cb_cookie, cookie, timestamp);
+    } else {
+        driver->i_cb.tx_complete(driver->cb_cookie, cookie);
+    }
+}
+
+/* Helper for drivers to report a change of the link state */
+static inline void ethif_link_change(struct eth_driver *driver, bool up)
+{
+    if (driver->i_cb.link_change) {
+        driver->i_cb.link_change(driver->cb_cookie, up);
+    }
+}
+
+/* Helpers for drivers to maintain an ethif_stats_t. Updates are relaxed
+ * atomics so readers on other cores see whole values without the data
+ * path paying for ordering */
+static inline void ethif_stats_add(uint64_t *counter, uint64_t val)
+{
+    __atomic_fetch_add(counter, val, __ATOMIC_RELAXED);
+}
+
+static inline void ethif_stats_hwm(uint32_t *hwm, uint32_t val)
+{
+    if (val > __atomic_load_n(hwm, __ATOMIC_RELAXED)) {
+        __atomic_store_n(hwm, val, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void ethif_stats_read(ethif_stats_t *src, ethif_stats_t *dst)
+{
+    *dst = (ethif_stats_t) {
+        .rx_packets = __atomic_load_n(&src->rx_packets, __ATOMIC_RELAXED),
+        .rx_bytes = __atomic_load_n(&src->rx_bytes, __ATOMIC_RELAXED),
+        .tx_packets = __atomic_load_n(&src->tx_packets, __ATOMIC_RELAXED),
+        .tx_bytes = __atomic_load_n(&src->tx_bytes, __ATOMIC_RELAXED),
+        .rx_alloc_failed = __atomic_load_n(&src->rx_alloc_failed, __ATOMIC_RELAXED),
+        .tx_failed = __atomic_load_n(&src->tx_failed, __ATOMIC_RELAXED),
+        .tx_dropped = __atomic_load_n(&src->tx_dropped, __ATOMIC_RELAXED),
+        .rx_ring_hwm = __atomic_load_n(&src->rx_ring_hwm, __ATOMIC_RELAXED),
+        .tx_ring_hwm = __atomic_load_n(&src->tx_ring_hwm, __ATOMIC_RELAXED),
+        .irqs = __atomic_load_n(&src->irqs, __ATOMIC_RELAXED),
+        .polls = __atomic_load_n(&src->polls, __ATOMIC_RELAXED)
+    };
+}
+
+/* Account for a received packet made of num_bufs buffers */
+static inline void ethif_stats_rx(ethif_stats_t *stats, unsigned int num_bufs, unsigned int *lens)
+{
+    uint64_t bytes = 0;
+    for (unsigned int i = 0; i < num_bufs; i++) {
+        bytes += lens[i];
+    }
+    ethif_stats_add(&stats->rx_packets, 1);
+    ethif_stats_add(&stats->rx_bytes, bytes);
+}
+
+/* Account for a packet handed to the hardware for transmission */
+static inline void ethif_stats_tx(ethif_stats_t *stats, unsigned int num, unsigned int *len)
+{
+    uint64_t bytes = 0;
+    for (unsigned int i = 0; i < num; i++) {
+        bytes += len[i];
+    }
+    ethif_stats_add(&stats->tx_packets, 1);
+    ethif_stats_add(&stats->tx_bytes, bytes);
+}
+
 struct dma_buf_cookie {
     void *vbuf;
     void *pbuf;
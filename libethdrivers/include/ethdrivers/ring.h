@@ -0,0 +1,170 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <ethdrivers/gen_config.h>
+#include <ethdrivers/raw.h>
+
+/* Index and cookie bookkeeping for a ring of descriptors shared with a
+ * device. It does not depend on the descriptor format, which stays with the
+ * driver. Buffers are posted at tail and reaped at head, the descriptors in
+ * between belong to the device. Indices of a ring whose size is a power of
+ * two wrap with a mask, others with a compare, never with a division. With
+ * CONFIG_LIB_ETHDRIVER_POW2_RINGS every ring is a power of two and the
+ * compare is compiled out. */
+typedef struct eth_ring {
+    unsigned int size;
+    /* size - 1 if size is a power of two, otherwise 0 */
+    unsigned int mask;
+    unsigned int head;
+    unsigned int tail;
+    /* descriptors that can still be posted */
+    unsigned int remain;
+    /* descriptors never posted, for devices that would take a full ring
+     * for an empty one */
+    unsigned int reserve;
+    /* cookie of every posted buffer or frame, at its first descriptor */
+    void **cookies;
+    /* number of descriptors of every posted frame, at its first descriptor.
+     * NULL for rings where every buffer takes one descriptor */
+    unsigned int *lengths;
+} eth_ring_t;
+
+/**
+ * Allocate the bookkeeping of a ring and reset it to start at index 0
+ *
+ * @param ring      Ring to initialise
+ * @param size      Number of descriptors
+ * @param reserve   Number of descriptors to never post
+ * @param frames    Whether a posted frame can take several descriptors
+ * @return          0 on success, -1 on error
+ */
+int eth_ring_init(eth_ring_t *ring, unsigned int size, unsigned int reserve, bool frames);
+
+/* Free the bookkeeping of a ring, safe on a zeroed or destroyed ring */
+void eth_ring_destroy(eth_ring_t *ring);
+
+/* Mark every descriptor free, with the next one posted at index start */
+static inline void eth_ring_reset(eth_ring_t *ring, unsigned int start)
+{
+    ring->head = ring->tail = start;
+    ring->remain = ring->size - ring->reserve;
+}
+
+/* Wrap an index, which must be less than twice the size */
+static inline unsigned int eth_ring_wrap(const eth_ring_t *ring, unsigned int idx)
+{
+#ifdef CONFIG_LIB_ETHDRIVER_POW2_RINGS
+    return idx & ring->mask;
+#else
+    if (ring->mask) {
+        return idx & ring->mask;
+    }
+    return idx >= ring->size ? idx - ring->size : idx;
+#endif
+}
+
+/* Slot of a free running counter, such as the 16 bit indices of a virtqueue,
+ * for which a modulo is only consistent across overflow if the size is a
+ * power of two */
+static inline unsigned int eth_ring_slot(const eth_ring_t *ring, unsigned int counter)
+{
+#ifdef CONFIG_LIB_ETHDRIVER_POW2_RINGS
+    return counter & ring->mask;
+#else
+    return ring->mask ? counter & ring->mask : counter % ring->size;
+#endif
+}
+
+static inline unsigned int eth_ring_next(const eth_ring_t *ring, unsigned int idx)
+{
+    return eth_ring_wrap(ring, idx + 1);
+}
+
+/* Number of descriptors owned by the device */
+static inline unsigned int eth_ring_used(const eth_ring_t *ring)
+{
+    return ring->size - ring->reserve - ring->remain;
+}
+
+/* Number of descriptors of the frame starting at idx */
+static inline unsigned int eth_ring_frame_len(const eth_ring_t *ring, unsigned int idx)
+{
+    return ring->lengths ? ring->lengths[idx] : 1;
+}
+
+/* Account for a buffer or frame of n descriptors written at tail. Returns
+ * the index of its first descriptor. */
+static inline unsigned int eth_ring_post(eth_ring_t *ring, void *cookie, unsigned int n)
+{
+    unsigned int first = ring->tail;
+    ring->cookies[first] = cookie;
+    if (ring->lengths) {
+        ring->lengths[first] = n;
+    }
+    ring->tail = eth_ring_wrap(ring, first + n);
+    ring->remain -= n;
+    return first;
+}
+
+/* Hand back the n descriptors at head in one go, for callers that collected
+ * the cookies themselves */
+static inline void eth_ring_release(eth_ring_t *ring, unsigned int n)
+{
+    ring->head = eth_ring_wrap(ring, ring->head + n);
+    ring->remain += n;
+}
+
+/* Hand back the buffer or frame at head and return its cookie */
+static inline void *eth_ring_reap(eth_ring_t *ring)
+{
+    void *cookie = ring->cookies[ring->head];
+    eth_ring_release(ring, eth_ring_frame_len(ring, ring->head));
+    return cookie;
+}
+
+/* Write the receive descriptor at idx for a buffer at phys, handing it to
+ * the device */
+typedef void (*eth_ring_rx_write_fn)(struct eth_driver *driver, unsigned int idx, uintptr_t phys);
+
+/**
+ * Post receive buffers from the allocate_rx_buf callback of the driver until
+ * the ring is full or no buffer is left. The caller tells the device about
+ * the whole batch afterwards, rather than once per buffer.
+ *
+ * @param ring      Receive ring, one descriptor per buffer
+ * @param driver    Driver to allocate buffers for
+ * @param buf_size  Size of the buffers
+ * @param stats     Statistics to account allocation failures and the ring
+ *                  high water mark to
+ * @param write     Function writing a descriptor
+ * @return          Number of buffers posted
+ */
+static inline unsigned int eth_ring_refill(eth_ring_t *ring, struct eth_driver *driver, size_t buf_size,
+                                           ethif_stats_t *stats, eth_ring_rx_write_fn write)
+{
+    unsigned int posted = 0;
+
+    if (!driver->i_cb.allocate_rx_buf) {
+        return 0;
+    }
+    while (ring->remain > 0) {
+        void *cookie = NULL;
+        uintptr_t phys = driver->i_cb.allocate_rx_buf(driver->cb_cookie, buf_size, &cookie);
+        if (!phys) {
+            ethif_stats_add(&stats->rx_alloc_failed, 1);
+            break;
+        }
+        write(driver, ring->tail, phys);
+        eth_ring_post(ring, cookie, 1);
+        posted++;
+    }
+    ethif_stats_hwm(&stats->rx_ring_hwm, eth_ring_used(ring));
+    return posted;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/* Optional per-packet latency tracing for the ethernet drivers.
+ *
+ * With CONFIG_LIB_ETHDRIVER_LATENCY_TRACE set, drivers time how long
+ * packets spend between points of the data path and accumulate the samples
+ * into log2 histograms that can be read or dumped at any time. Without it
+ * every call here compiles away to nothing.
+ *
+ * Only the pc99 Intel (e1000/igb), imx6 ENET and virtio-pci drivers record
+ * samples, the other drivers leave the histograms empty. */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <autoconf.h>
+#include <ethdrivers/gen_config.h>
+
+typedef enum {
+    /* the packet arriving until it is handed to rx_complete. Arrival is the
+     * hardware receive timestamp where the driver has one in the units of
+     * the clock (imx6 ENET), otherwise the start of the interrupt or poll
+     * that found the packet. Either way the rx_complete callbacks of earlier
+     * packets of the same pass are included */
+    ETHIF_TRACE_RX_DELIVER,
+    /* time spent inside the rx_complete callback */
+    ETHIF_TRACE_RX_CALLBACK,
+    /* raw_tx until the driver calls tx_complete for the packet */
+    ETHIF_TRACE_TX_COMPLETE,
+    ETHIF_TRACE_NUM_POINTS
+} ethif_trace_point_t;
+
+/* Bucket i counts samples of [2^(i-1), 2^i) ticks, bucket 0 counts 0 */
+#define ETHIF_TRACE_BUCKETS 65
+
+typedef struct ethif_trace_hist {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[ETHIF_TRACE_BUCKETS];
+} ethif_trace_hist_t;
+
+/**
+ * Source of timestamps. Returns a monotonic tick count.
+ *
+ * @param data  Cookie passed to ethif_trace_set_clock
+ */
+typedef uint64_t (*ethif_trace_clock_fn)(void *data);
+
+#ifdef CONFIG_LIB_ETHDRIVER_LATENCY_TRACE
+
+extern ethif_trace_clock_fn ethif_trace_clock;
+extern void *ethif_trace_clock_data;
+
+void ethif_trace_record_ticks(ethif_trace_point_t point, uint64_t ticks);
+
+/* Convert nanoseconds to ticks of the clock, false if its rate is not known */
+bool ethif_trace_ticks_from_ns(uint64_t ns, uint64_t *ticks);
+
+static inline uint64_t ethif_trace_now(void)
+{
+    return ethif_trace_clock ? ethif_trace_clock(ethif_trace_clock_data) : 0;
+}
+
+/* Record the time since 'start', as returned by ethif_trace_now */
+static inline void ethif_trace_record(ethif_trace_point_t point, uint64_t start)
+{
+    if (ethif_trace_clock) {
+        ethif_trace_record_ticks(point, ethif_trace_now() - start);
+    }
+}
+
+/* Timestamp ring slot 'idx'. 'stamps' comes from ethif_trace_alloc_stamps */
+static inline void ethif_trace_stamp(uint64_t *stamps, unsigned int idx)
+{
+    if (stamps) {
+        stamps[idx] = ethif_trace_now();
+    }
+}
+
+/* Record the time since ring slot 'idx' was stamped */
+static inline void ethif_trace_complete(uint64_t *stamps, unsigned int idx, ethif_trace_point_t point)
+{
+    if (stamps) {
+        ethif_trace_record(point, stamps[idx]);
+    }
+}
+
+#else
+
+static inline uint64_t ethif_trace_now(void)
+{
+    return 0;
+}
+
+static inline bool ethif_trace_ticks_from_ns(uint64_t ns, uint64_t *ticks)
+{
+    return false;
+}
+
+static inline void ethif_trace_record(ethif_trace_point_t point, uint64_t start)
+{
+}
+
+static inline void ethif_trace_stamp(uint64_t *stamps, unsigned int idx)
+{
+}
+
+static inline void ethif_trace_complete(uint64_t *stamps, unsigned int idx, ethif_trace_point_t point)
+{
+}
+
+#endif /* CONFIG_LIB_ETHDRIVER_LATENCY_TRACE */
+
+/**
+ * Replace the clock used for timestamps. The default is the TSC on x86 and
+ * the generic timer on ARM when the kernel exports it to user level,
+ * otherwise there is no clock and nothing is recorded until one is set.
+ * An ltimer can be plugged in through a wrapper around ltimer_get_time.
+ *
+ * @param clock     Clock to use, NULL disables recording
+ * @param data      Passed to every call of clock
+ * @param freq_hz   Tick rate of clock, used to print nanoseconds in
+ *                  ethif_trace_dump. 0 if unknown.
+ */
+void ethif_trace_set_clock(ethif_trace_clock_fn clock, void *data, uint64_t freq_hz);
+
+/**
+ * Allocate the timestamp array for a ring of 'size' slots. Returns NULL when
+ * tracing is compiled out, and the stamp functions ignore a NULL array.
+ */
+uint64_t *ethif_trace_alloc_stamps(size_t size);
+void ethif_trace_free_stamps(uint64_t *stamps);
+
+/* Copy out the histogram of a trace point. Buckets are read one at a time,
+ * so samples recorded concurrently may be partially included. */
+void ethif_trace_read(ethif_trace_point_t point, ethif_trace_hist_t *hist);
+
+/* Clear all histograms */
+void ethif_trace_reset(void);
+
+/* Print all non-empty histograms */
+void ethif_trace_dump(void);
@@ -130,6 +130,14 @@ extern "C" {
 #define CPSW_INT_PACING_C2_RX_PULSE            (0x10 << CPSW_WR_INT_CONTROL_INT_PACE_EN_SHIFT)
 #define CPSW_INT_PACING_C2_TX_PULSE            (0x20 << CPSW_WR_INT_CONTROL_INT_PACE_EN_SHIFT)
 
+    /*
+    ** Limits of 'intPerMilli' for CPSWWrIntPacingEnable, and the prescale
+    ** giving a 4us pacing tick from the 125MHz CPSW main clock
+    */
+#define CPSW_IMAX_MIN                          (2u)
+#define CPSW_IMAX_MAX                          (63u)
+#define CPSW_PACING_PRESCALE_125MHZ            (500u)
+
     /*
     ** Macros which can be passed as 'portState' to CPSWALEPortStateSet
     */
@@ -291,6 +299,10 @@ extern "C" {
     extern unsigned int CPSWWrCoreIntStatusGet(unsigned int baseAddr, unsigned int core,
                                                unsigned int channel, unsigned int intFlag);
     extern unsigned int CPSWWrRGMIIStatusGet(unsigned int baseAddr, unsigned int statFlag);
+    extern void CPSWWrPrescaleSet(unsigned int baseAddr, unsigned int prescale);
+    extern void CPSWWrIntPacingEnable(unsigned int baseAddr, unsigned int core,
+                                      unsigned int intPerMilli, unsigned int pacFlag);
+    extern void CPSWWrIntPacingDisable(unsigned int baseAddr, unsigned int pacFlag);
     extern void CPSWALEInit(unsigned int baseAddr);
     extern void CPSWALEPortStateSet(unsigned int baseAddr, unsigned int portNum,
                                     unsigned int portState);
@@ -346,6 +358,8 @@ extern "C" {
     extern void CPSWContextSave(CPSWCONTEXT *contextPtr);
     extern void CPSWContextRestore(CPSWCONTEXT *contextPtr);
     extern void CPSWHostPortDualMacModeSet(unsigned int baseAddr);
+    extern void CPSWHostPortRxChMapSet(unsigned int baseAddr, unsigned int portNum,
+                                       unsigned int channel);
     extern void CPSWALEVLANAwareSet(unsigned int baseAddr);
     extern void CPSWPortVLANConfig(unsigned int baseAddr, unsigned int vlanId,
                                    unsigned int cfiBit, unsigned int vlanPri);
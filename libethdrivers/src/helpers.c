@@ -5,6 +5,8 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 
+#include <stdlib.h>
+#include <ethdrivers/gen_config.h>
 #include <ethdrivers/helpers.h>
 
 dma_addr_t dma_alloc_pin(ps_dma_man_t *dma_man, size_t size, int cached, int alignment)
@@ -40,3 +42,238 @@ void dma_unpin_free(ps_dma_man_t *dma_man, void *virt, size_t size)
     ps_dma_unpin(dma_man, virt, size);
     ps_dma_free(dma_man, virt, size);
 }
+
+static size_t dma_ring_size(size_t desc_size, unsigned int count)
+{
+    return ALIGN_UP(desc_size * count, DMA_RING_ALIGN);
+}
+
+dma_addr_t dma_ring_alloc(ps_dma_man_t *dma_man, size_t desc_size, unsigned int count, int alignment)
+{
+    return dma_alloc_pin(dma_man, dma_ring_size(desc_size, count), 0, MAX(alignment, DMA_RING_ALIGN));
+}
+
+void dma_ring_free(ps_dma_man_t *dma_man, volatile void *ring, size_t desc_size, unsigned int count)
+{
+    dma_unpin_free(dma_man, (void *)ring, dma_ring_size(desc_size, count));
+}
+
+void dma_cache_init(dma_cache_t *cache, ps_dma_man_t *dma_man)
+{
+    *cache = (dma_cache_t) {
+        .dma_man = dma_man
+    };
+}
+
+void dma_cache_queue(dma_cache_t *cache, dma_cache_op_t op, void *vaddr, size_t size)
+{
+    uintptr_t start = (uintptr_t)vaddr;
+    uintptr_t end = start + size;
+    if (size == 0) {
+        return;
+    }
+    if (cache->num_pending > 0) {
+        dma_cache_range_t *last = &cache->pending[cache->num_pending - 1];
+        if (last->op == op && start <= last->end && end >= last->start) {
+            last->start = MIN(last->start, start);
+            last->end = MAX(last->end, end);
+            return;
+        }
+    }
+    if (cache->num_pending == DMA_CACHE_BATCH_SIZE) {
+        dma_cache_flush(cache);
+    }
+    cache->pending[cache->num_pending++] = (dma_cache_range_t) {
+        .op = op, .start = start, .end = end
+    };
+}
+
+void dma_cache_flush(dma_cache_t *cache)
+{
+    for (unsigned int i = 0; i < cache->num_pending; i++) {
+        void *vaddr = (void *)cache->pending[i].start;
+        size_t size = cache->pending[i].end - cache->pending[i].start;
+        switch (cache->pending[i].op) {
+        case DMA_CACHE_OP_CLEAN:
+            ps_dma_cache_clean(cache->dma_man, vaddr, size);
+            cache->stats.clean++;
+            break;
+        case DMA_CACHE_OP_INVALIDATE:
+            ps_dma_cache_invalidate(cache->dma_man, vaddr, size);
+            cache->stats.invalidate++;
+            break;
+        case DMA_CACHE_OP_CLEAN_INVALIDATE:
+            ps_dma_cache_clean_invalidate(cache->dma_man, vaddr, size);
+            cache->stats.clean_invalidate++;
+            break;
+        }
+    }
+    cache->num_pending = 0;
+}
+
+void dma_pool_default_config(dma_pool_config_t *config)
+{
+    *config = (dma_pool_config_t) {
+        .num_classes = 1,
+        .classes[0] = {
+            .buf_size = CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE,
+            .num_bufs = CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS
+        }
+    };
+}
+
+int dma_pool_init(dma_pool_t *pool, ps_dma_man_t *dma_man, const dma_pool_config_t *config, int alignment)
+{
+    *pool = (dma_pool_t) {
+        .dma_man = dma_man
+    };
+
+    if (config->num_classes == 0 || config->num_classes > DMA_POOL_MAX_CLASSES) {
+        ZF_LOGE("Invalid number of pool size classes %u", config->num_classes);
+        return -1;
+    }
+
+    int align = MAX(alignment, DMA_POOL_MIN_ALIGN);
+    pool->alignment = align;
+    size_t total = 0;
+    for (unsigned int i = 0; i < config->num_classes; i++) {
+        dma_pool_class_t *cls = &pool->classes[i];
+        cls->buf_size = ALIGN_UP(config->classes[i].buf_size, (size_t)align);
+        cls->num_bufs = config->classes[i].num_bufs;
+        if (cls->buf_size == 0 || (i > 0 && cls->buf_size <= pool->classes[i - 1].buf_size)) {
+            ZF_LOGE("Pool size classes must be in strictly ascending order");
+            goto error;
+        }
+        cls->free = calloc(cls->num_bufs, sizeof(*cls->free));
+        cls->bufs = calloc(cls->num_bufs, sizeof(*cls->bufs));
+        cls->state = calloc(cls->num_bufs, sizeof(*cls->state));
+        cls->refs = calloc(cls->num_bufs, sizeof(*cls->refs));
+        /* counted from here on so dma_pool_destroy frees the arrays */
+        pool->num_classes++;
+        if (cls->num_bufs && (!cls->free || !cls->bufs || !cls->state || !cls->refs)) {
+            ZF_LOGE("Failed to allocate pool bookkeeping");
+            goto error;
+        }
+        total += cls->buf_size * cls->num_bufs;
+    }
+
+    pool->mem = dma_alloc_pin(dma_man, total, 1, align);
+    if (!pool->mem.phys) {
+        ZF_LOGE("Failed to allocate %zu bytes for the pool", total);
+        goto error;
+    }
+    pool->mem_size = total;
+    ps_dma_cache_clean_invalidate(dma_man, pool->mem.virt, total);
+
+    size_t offset = 0;
+    for (unsigned int i = 0; i < pool->num_classes; i++) {
+        dma_pool_class_t *cls = &pool->classes[i];
+        for (unsigned int j = 0; j < cls->num_bufs; j++) {
+            cls->bufs[j] = (dma_addr_t) {
+                .virt = (uint8_t *)pool->mem.virt + offset,
+                .phys = pool->mem.phys + offset
+            };
+            cls->state[j] = DMA_BUF_CLEAN;
+            cls->free[j] = &cls->bufs[j];
+            offset += cls->buf_size;
+        }
+        cls->num_free = cls->num_bufs;
+    }
+    pool->users = 1;
+    return 0;
+
+error:
+    dma_pool_destroy(pool);
+    return -1;
+}
+
+void dma_pool_destroy(dma_pool_t *pool)
+{
+    if (pool->mem.virt) {
+        dma_unpin_free(pool->dma_man, pool->mem.virt, pool->mem_size);
+    }
+    for (unsigned int i = 0; i < pool->num_classes; i++) {
+        free(pool->classes[i].free);
+        free(pool->classes[i].bufs);
+        free(pool->classes[i].state);
+        free(pool->classes[i].refs);
+    }
+    *pool = (dma_pool_t) {
+        .dma_man = pool->dma_man
+    };
+}
+
+void dma_pool_get(dma_pool_t *pool)
+{
+    assert(dma_pool_ready(pool));
+    pool->users++;
+}
+
+void dma_pool_put(dma_pool_t *pool)
+{
+    assert(pool->users > 0);
+    if (--pool->users == 0) {
+        dma_pool_destroy(pool);
+    }
+}
+
+static dma_pool_class_t *dma_pool_class_of(dma_pool_t *pool, dma_addr_t *buf)
+{
+    for (unsigned int i = 0; i < pool->num_classes; i++) {
+        dma_pool_class_t *cls = &pool->classes[i];
+        if (buf >= cls->bufs && buf < cls->bufs + cls->num_bufs) {
+            return cls;
+        }
+    }
+    return NULL;
+}
+
+bool dma_pool_contains(dma_pool_t *pool, dma_addr_t *buf)
+{
+    return dma_pool_class_of(pool, buf) != NULL;
+}
+
+dma_addr_t *dma_pool_alloc(dma_pool_t *pool, size_t size)
+{
+    for (unsigned int i = 0; i < pool->num_classes; i++) {
+        dma_pool_class_t *cls = &pool->classes[i];
+        if (cls->buf_size >= size && cls->num_free > 0) {
+            dma_addr_t *buf = cls->free[--cls->num_free];
+            cls->refs[buf - cls->bufs] = 1;
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+void dma_pool_ref(dma_pool_t *pool, dma_addr_t *buf)
+{
+    dma_pool_class_t *cls = dma_pool_class_of(pool, buf);
+    assert(cls);
+    uint16_t *refs = &cls->refs[buf - cls->bufs];
+    assert(*refs > 0 && *refs < UINT16_MAX);
+    (*refs)++;
+}
+
+void dma_pool_free(dma_pool_t *pool, dma_addr_t *buf)
+{
+    dma_pool_class_t *cls = dma_pool_class_of(pool, buf);
+    if (!cls) {
+        ZF_LOGE("Buffer %p does not belong to the pool", buf);
+        return;
+    }
+    uint16_t *refs = &cls->refs[buf - cls->bufs];
+    assert(*refs > 0);
+    if (--*refs > 0) {
+        return;
+    }
+    assert(cls->num_free < cls->num_bufs);
+    cls->free[cls->num_free++] = buf;
+}
+
+uint8_t *dma_pool_buf_state(dma_pool_t *pool, dma_addr_t *buf)
+{
+    dma_pool_class_t *cls = dma_pool_class_of(pool, buf);
+    assert(cls);
+    return &cls->state[buf - cls->bufs];
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <string.h>
+#include <utils/util.h>
+#include <ethdrivers/loopback.h>
+#include <ethdrivers/raw.h>
+#include <ethdrivers/gen_config.h>
+
+#define LOOPBACK_MTU    1500
+/* Ethernet header plus MTU */
+#define LOOPBACK_MAX_FRAME (LOOPBACK_MTU + 14)
+/* 02:00:00:00:00:01, locally administered */
+#define LOOPBACK_DEFAULT_MAC 0x020000000001ull
+
+typedef struct loopback_frame {
+    void *cookie;
+    unsigned int len;
+} loopback_frame_t;
+
+typedef struct loopback_dev {
+    uint64_t mac;
+    /* frames copied into RX buffers and waiting for raw_poll */
+    loopback_frame_t *queue;
+    unsigned int queue_size;
+    unsigned int head;
+    unsigned int count;
+    ethif_stats_t stats;
+} loopback_dev_t;
+
+static void deliver_rx(struct eth_driver *driver)
+{
+    loopback_dev_t *dev = driver->eth_data;
+    ethif_rx_meta_t meta = { 0 };
+
+    /* Only deliver what was queued on entry, a callback that transmits
+     * gets its frames delivered on the next call */
+    unsigned int num = dev->count;
+    while (num-- > 0) {
+        loopback_frame_t frame = dev->queue[dev->head];
+        dev->head = (dev->head + 1) % dev->queue_size;
+        dev->count--;
+        ethif_stats_rx(&dev->stats, 1, &frame.len);
+        ethif_rx_complete(driver, 1, &frame.cookie, &frame.len, &meta);
+    }
+}
+
+static void handle_irq(struct eth_driver *driver, int irq)
+{
+    loopback_dev_t *dev = driver->eth_data;
+    ethif_stats_add(&dev->stats.irqs, 1);
+    deliver_rx(driver);
+}
+
+static void raw_poll(struct eth_driver *driver)
+{
+    loopback_dev_t *dev = driver->eth_data;
+    ethif_stats_add(&dev->stats.polls, 1);
+    deliver_rx(driver);
+}
+
+static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
+                  unsigned int *len, void *cookie)
+{
+    loopback_dev_t *dev = driver->eth_data;
+
+    unsigned int total = 0;
+    for (unsigned int i = 0; i < num; i++) {
+        total += len[i];
+    }
+    if (total > LOOPBACK_MAX_FRAME || dev->count == dev->queue_size) {
+        ethif_stats_add(&dev->stats.tx_failed, 1);
+        return ETHIF_TX_FAILED;
+    }
+    ethif_stats_tx(&dev->stats, num, len);
+
+    /* The frame has been "sent" once it is copied out, a missing RX buffer
+     * drops it on the receive side like a real NIC would */
+    void *rx_cookie = NULL;
+    uintptr_t rx_phys = driver->i_cb.allocate_rx_buf ?
+                        driver->i_cb.allocate_rx_buf(driver->cb_cookie, total, &rx_cookie) : 0;
+    if (!rx_phys) {
+        ethif_stats_add(&dev->stats.rx_alloc_failed, 1);
+        return ETHIF_TX_COMPLETE;
+    }
+
+    uint8_t *dst = (void *)rx_phys;
+    for (unsigned int i = 0; i < num; i++) {
+        memcpy(dst, (void *)phys[i], len[i]);
+        dst += len[i];
+    }
+
+    unsigned int tail = (dev->head + dev->count) % dev->queue_size;
+    dev->queue[tail] = (loopback_frame_t) {
+        .cookie = rx_cookie,
+        .len = total
+    };
+    dev->count++;
+    ethif_stats_hwm(&dev->stats.rx_ring_hwm, dev->count);
+
+    return ETHIF_TX_COMPLETE;
+}
+
+static void get_mac(struct eth_driver *driver, uint8_t *mac)
+{
+    loopback_dev_t *dev = driver->eth_data;
+    uint64_t mac_u64 = dev->mac;
+    for (unsigned int i = 0; i < 6; i++) {
+        mac[5 - i] = (uint8_t)mac_u64;
+        mac_u64 >>= 8;
+    }
+}
+
+static void low_level_init(struct eth_driver *driver, uint8_t *mac, int *mtu)
+{
+    if (mac) {
+        get_mac(driver, mac);
+    }
+    if (mtu) {
+        *mtu = LOOPBACK_MTU;
+    }
+}
+
+static void print_state(struct eth_driver *driver)
+{
+    loopback_dev_t *dev = driver->eth_data;
+    ZF_LOGI("loopback: %u of %u frames queued", dev->count, dev->queue_size);
+}
+
+static void get_stats(struct eth_driver *driver, ethif_stats_t *stats)
+{
+    loopback_dev_t *dev = driver->eth_data;
+    ethif_stats_read(&dev->stats, stats);
+}
+
+static struct raw_iface_funcs iface_fns = {
+    .raw_handleIRQ = handle_irq,
+    .print_state = print_state,
+    .low_level_init = low_level_init,
+    .raw_tx = raw_tx,
+    .raw_poll = raw_poll,
+    .get_mac = get_mac,
+    .get_stats = get_stats
+};
+
+/* raw_tx copies frames through their physical addresses, which only works
+ * if the DMA manager hands out memory at the same virtual address */
+static bool dma_maps_identity(ps_dma_man_t *dma_man)
+{
+    void *probe = ps_dma_alloc(dma_man, LOOPBACK_MAX_FRAME, sizeof(uintptr_t), 1, PS_MEM_NORMAL);
+    if (!probe) {
+        return false;
+    }
+    uintptr_t phys = ps_dma_pin(dma_man, probe, LOOPBACK_MAX_FRAME);
+    ps_dma_unpin(dma_man, probe, LOOPBACK_MAX_FRAME);
+    ps_dma_free(dma_man, probe, LOOPBACK_MAX_FRAME);
+    return phys == (uintptr_t)probe;
+}
+
+int ethif_loopback_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *config)
+{
+    ethif_loopback_config_t *lb_config = config;
+    loopback_dev_t *dev = NULL;
+
+    if (!dma_maps_identity(&io_ops.dma_manager)) {
+        ZF_LOGE("Loopback device needs a DMA manager that maps memory 1:1");
+        return -1;
+    }
+
+    int error = ps_calloc(&io_ops.malloc_ops, 1, sizeof(*dev), (void **)&dev);
+    if (error) {
+        ZF_LOGE("Failed to allocate loopback device");
+        return -1;
+    }
+
+    dev->mac = (lb_config && lb_config->mac) ? lb_config->mac : LOOPBACK_DEFAULT_MAC;
+    dev->queue_size = (lb_config && lb_config->queue_size) ? lb_config->queue_size :
+                      CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT;
+    error = ps_calloc(&io_ops.malloc_ops, dev->queue_size, sizeof(*dev->queue), (void **)&dev->queue);
+    if (error) {
+        ZF_LOGE("Failed to allocate loopback queue");
+        ps_free(&io_ops.malloc_ops, sizeof(*dev), dev);
+        return -1;
+    }
+
+    eth_driver->eth_data = dev;
+    eth_driver->i_fn = iface_fns;
+    eth_driver->io_ops = io_ops;
+    eth_driver->dma_alignment = sizeof(uintptr_t);
+    eth_driver->offload_caps = 0;
+
+    return 0;
+}
@@ -15,70 +15,186 @@
 #include <string.h>
 #include <lwip/netif.h>
 #include <netif/etharp.h>
+#include <lwip/ip.h>
 #include <lwip/stats.h>
 #include <lwip/snmp.h>
 #include "debug.h"
 
-static void initialize_free_bufs(lwip_iface_t *iface)
+/* Sum of the IPv4 pseudo header, as the hardware expects to find it in the
+ * TCP/UDP checksum field when it advertises ETHIF_CAP_TX_CSUM_PSEUDO */
+static uint16_t pseudo_hdr_sum(struct ip_hdr *iphdr, uint8_t proto, uint16_t l4_len)
 {
-    dma_addr_t *dma_bufs = NULL;
-    dma_bufs = malloc(sizeof(dma_addr_t) * CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS);
-    if (!dma_bufs) {
-        goto error;
+    uint16_t addrs[4];
+    uint32_t sum = htons(proto) + htons(l4_len);
+    /* source and destination address are adjacent in the header */
+    memcpy(addrs, &iphdr->src, sizeof(addrs));
+    for (int i = 0; i < 4; i++) {
+        sum += addrs[i];
     }
-    memset(dma_bufs, 0, sizeof(dma_addr_t) * CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS);
-    iface->bufs = malloc(sizeof(dma_addr_t *) * CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS);
-    if (!iface->bufs) {
-        goto error;
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
     }
-    for (int i = 0; i < CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS; i++) {
-        dma_bufs[i] = dma_alloc_pin(&iface->dma_man, CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE, 1,
-                                    iface->driver.dma_alignment);
-        if (!dma_bufs[i].phys) {
-            goto error;
+    return sum;
+}
+
+/* Work out which checksums of an outgoing frame the hardware needs to insert.
+ * Returns NULL if there is nothing to ask for */
+static const ethif_tx_meta_t *tx_csum_meta(lwip_iface_t *iface, uint8_t *frame, unsigned int len,
+                                           ethif_tx_meta_t *meta)
+{
+    if (!iface->tx_csum_flags) {
+        return NULL;
+    }
+    struct eth_hdr *ethhdr = (struct eth_hdr *)frame;
+    if (len < SIZEOF_ETH_HDR + IP_HLEN || htons(ethhdr->type) != ETHTYPE_IP) {
+        return NULL;
+    }
+    struct ip_hdr *iphdr = (struct ip_hdr *)(frame + SIZEOF_ETH_HDR);
+    unsigned int ip_hlen = IPH_HL(iphdr) * 4;
+    meta->flags = iface->tx_csum_flags & ETHIF_TX_CSUM_IPV4;
+    meta->l3_offset = SIZEOF_ETH_HDR;
+    meta->l4_offset = SIZEOF_ETH_HDR + ip_hlen;
+    /* The hardware cannot checksum a datagram that is split over several
+     * frames. TCP never gets fragmented and UDP over IPv4 can go without. */
+    if (IPH_OFFSET(iphdr) & PP_HTONS(IP_OFFMASK | IP_MF)) {
+        return meta->flags ? meta : NULL;
+    }
+    unsigned int csum_offset;
+    switch (IPH_PROTO(iphdr)) {
+    case IP_PROTO_TCP:
+        meta->flags |= iface->tx_csum_flags & ETHIF_TX_CSUM_TCP;
+        csum_offset = 16;
+        break;
+    case IP_PROTO_UDP:
+        meta->flags |= iface->tx_csum_flags & ETHIF_TX_CSUM_UDP;
+        csum_offset = 6;
+        break;
+    default:
+        return meta->flags ? meta : NULL;
+    }
+    if ((meta->flags & (ETHIF_TX_CSUM_TCP | ETHIF_TX_CSUM_UDP)) &&
+        (iface->driver.offload_caps & ETHIF_CAP_TX_CSUM_PSEUDO)) {
+        if (len < meta->l4_offset + csum_offset + 2) {
+            /* headers not contiguous, cannot seed the checksum */
+            meta->flags &= ~(ETHIF_TX_CSUM_TCP | ETHIF_TX_CSUM_UDP);
+        } else {
+            uint16_t sum = pseudo_hdr_sum(iphdr, IPH_PROTO(iphdr), ntohs(IPH_LEN(iphdr)) - ip_hlen);
+            memcpy(frame + meta->l4_offset + csum_offset, &sum, sizeof(sum));
         }
-        ps_dma_cache_clean_invalidate(&iface->dma_man, dma_bufs[i].virt, CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE);
-        iface->bufs[i] = &dma_bufs[i];
     }
-    iface->num_free_bufs = CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS;
-    return;
-error:
-    if (iface->bufs) {
-        free(iface->bufs);
+    return meta->flags ? meta : NULL;
+}
+
+static int raw_tx_csum(lwip_iface_t *iface, unsigned int num, uintptr_t *phys, unsigned int *len, void *cookie,
+                       const ethif_tx_meta_t *meta)
+{
+    if (meta && iface->driver.i_fn.raw_tx_meta) {
+        return iface->driver.i_fn.raw_tx_meta(&iface->driver, num, phys, len, cookie, meta);
     }
-    if (dma_bufs) {
-        for (int i = 0; i < CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS; i++) {
-            if (dma_bufs[i].virt) {
-                dma_unpin_free(&iface->dma_man, dma_bufs[i].virt, CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE);
-            }
+    return iface->driver.i_fn.raw_tx(&iface->driver, num, phys, len, cookie);
+}
+
+/* NETIF_CHECKSUM_CHECK_* flags for the checksums the hardware verified */
+static u16_t rx_csum_verified(const ethif_rx_meta_t *meta)
+{
+    u16_t verified = 0;
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+    if (meta->flags & ETHIF_RX_CSUM_IP_OK) {
+        verified |= NETIF_CHECKSUM_CHECK_IP;
+    }
+    if (meta->flags & ETHIF_RX_CSUM_L4_OK) {
+        verified |= NETIF_CHECKSUM_CHECK_TCP | NETIF_CHECKSUM_CHECK_UDP;
+    }
+#endif
+    return verified;
+}
+
+/* Hand a received frame to lwIP, takes ownership of p */
+static void ethif_input(lwip_iface_t *iface, struct pbuf *p)
+{
+    struct eth_hdr *ethhdr;
+    ethhdr = p->payload;
+#if NO_SYS && LWIP_CHECKSUM_CTRL_PER_NETIF
+    /* Without a tcpip thread lwIP is done with the frame when input returns,
+     * so the checks can be skipped for this frame alone. Frames the hardware
+     * did not verify, such as fragments, are still checked by lwIP. */
+    u16_t chksum_flags = iface->netif->chksum_flags;
+    NETIF_SET_CHECKSUM_CTRL(iface->netif, chksum_flags & ~iface->rx_csum_verified);
+#endif
+
+    switch (htons(ethhdr->type)) {
+    /* IP or ARP packet? */
+    case ETHTYPE_IP:
+    case ETHTYPE_ARP:
+#if PPPOE_SUPPORT
+    /* PPPoE packet? */
+    case ETHTYPE_PPPOEDISC:
+    case ETHTYPE_PPPOE:
+#endif /* PPPOE_SUPPORT */
+        /* full packet send to tcpip_thread to process */
+        if (iface->netif->input(p, iface->netif) != ERR_OK) {
+            LWIP_DEBUGF(NETIF_DEBUG, ("ethernetif_input: IP input error\n"));
+            pbuf_free(p);
         }
-        free(dma_bufs);
+        break;
+
+    default:
+        pbuf_free(p);
+        break;
+    }
+#if NO_SYS && LWIP_CHECKSUM_CTRL_PER_NETIF
+    NETIF_SET_CHECKSUM_CTRL(iface->netif, chksum_flags);
+#endif
+}
+
+/* Allocate a pool pbuf for a frame of len bytes that gets copied in */
+static struct pbuf *alloc_copy_pbuf(unsigned int len)
+{
+#if ETH_PAD_SIZE
+    len += ETH_PAD_SIZE; /* allow room for Ethernet padding */
+#endif
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+#if ETH_PAD_SIZE
+    if (p) {
+        pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
     }
-    iface->bufs = NULL;
+#endif
+    return p;
+}
+
+static int initialize_free_bufs(lwip_iface_t *iface)
+{
+    return dma_pool_init(&iface->own_pool, &iface->dma_man, &iface->pool_config, iface->driver.dma_alignment);
 }
 
 static uintptr_t lwip_allocate_rx_buf(void *iface, size_t buf_size, void **cookie)
 {
     lwip_iface_t *lwip_iface = (lwip_iface_t *)iface;
-    if (buf_size > CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE) {
-        LOG_ERROR("Requested RX buffer of size %zu which can never be fullfilled by preallocated buffers of size %d", buf_size,
-                  CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE);
-        return 0;
-    }
-    if (lwip_iface->num_free_bufs == 0) {
-        if (!lwip_iface->bufs) {
-            initialize_free_bufs(lwip_iface);
-            if (!lwip_iface->bufs) {
-                LOG_ERROR("Failed lazy initialization of preallocated free buffers");
-                return 0;
-            }
-        } else {
+    if (!dma_pool_ready(lwip_iface->pool)) {
+        if (initialize_free_bufs(lwip_iface)) {
+            LOG_ERROR("Failed lazy initialization of preallocated free buffers");
             return 0;
         }
     }
-    lwip_iface->num_free_bufs--;
-    dma_addr_t *buf = lwip_iface->bufs[lwip_iface->num_free_bufs];
-    ps_dma_cache_invalidate(&lwip_iface->dma_man, buf->virt, buf_size);
+    if (buf_size > dma_pool_max_size(lwip_iface->pool)) {
+        LOG_ERROR("Requested RX buffer of size %zu which can never be fullfilled by preallocated buffers of size %zu",
+                  buf_size, dma_pool_max_size(lwip_iface->pool));
+        return 0;
+    }
+    dma_addr_t *buf = dma_pool_alloc(lwip_iface->pool, buf_size);
+    if (!buf) {
+        return 0;
+    }
+    /* Only dirty lines could be written back over what the device receives,
+     * clean ones get invalidated for the received range in lwip_rx_complete */
+    uint8_t *state = dma_pool_buf_state(lwip_iface->pool, buf);
+    if (*state == DMA_BUF_DIRTY) {
+        dma_cache_queue(&lwip_iface->cache, DMA_CACHE_OP_INVALIDATE, buf->virt, buf_size);
+        dma_cache_flush(&lwip_iface->cache);
+        *state = DMA_BUF_CLEAN;
+    } else {
+        dma_cache_skip(&lwip_iface->cache);
+    }
     *cookie = (void *)buf;
     return buf->phys;
 }
@@ -86,58 +202,45 @@ static uintptr_t lwip_allocate_rx_buf(void *iface, size_t buf_size, void **cooki
 static void lwip_tx_complete(void *iface, void *cookie)
 {
     lwip_iface_t *lwip_iface = (lwip_iface_t *)iface;
-    lwip_iface->bufs[lwip_iface->num_free_bufs] = cookie;
-    lwip_iface->num_free_bufs++;
+    dma_pool_free(lwip_iface->pool, cookie);
 }
 
-static void lwip_rx_complete(void *iface, unsigned int num_bufs, void **cookies, unsigned int *lens)
+static void rx_defer(lwip_iface_t *iface, struct pbuf *hdr, unsigned int hdr_len, unsigned int num_bufs,
+                     void **cookies, unsigned int *lens, u16_t csum_verified);
+
+/* Copy a received frame out of its preallocated buffers into a pbuf and
+ * hand it to lwIP. hdr, if set, already holds the first hdr_len bytes of a
+ * split frame. The buffers have been invalidated and go back to the pool. */
+static void deliver_copy(lwip_iface_t *iface, struct pbuf *hdr, unsigned int hdr_len, unsigned int num_bufs,
+                         void **cookies, unsigned int *lens)
 {
-    struct pbuf *p;
-    int len;
-    lwip_iface_t *lwip_iface = (lwip_iface_t *)iface;
+    struct pbuf *p = hdr;
     int i;
-    len = 0;
-    for (i = 0; i < num_bufs; i++) {
-        ps_dma_cache_invalidate(&lwip_iface->dma_man, ((dma_addr_t *)cookies[i])->virt, lens[i]);
-        len += lens[i];
-    }
-#if ETH_PAD_SIZE
-    len += ETH_PAD_SIZE; /* allow room for Ethernet padding */
-#endif
-    /* Get a buffer from the pool */
-    p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
-    if (p == NULL) {
+    if (!p) {
+        if (num_bufs == 1 && iface->rx_hook &&
+            iface->rx_hook(iface->rx_hook_cookie, iface, cookies[0], lens[0])) {
+            lwip_tx_complete(iface, cookies[0]);
+            return;
+        }
+        unsigned int len = 0;
         for (i = 0; i < num_bufs; i++) {
-            lwip_tx_complete(iface, cookies[i]);
+            len += lens[i];
+        }
+        p = alloc_copy_pbuf(len);
+        if (!p) {
+            for (i = 0; i < num_bufs; i++) {
+                lwip_tx_complete(iface, cookies[i]);
+            }
+            return;
         }
-        return;
     }
 
-#if ETH_PAD_SIZE
-    pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
-    len -= ETH_PAD_SIZE;
-#endif
-
     /* fill the pbuf chain */
-    struct pbuf *q = p;
-    unsigned int copied = 0;
-    unsigned int buf = 0;
-    unsigned int buf_done = 0;
-    unsigned int pbuf_done = 0;
-    while (copied < len) {
-        unsigned int next = MIN(q->len - pbuf_done, lens[buf] - buf_done);
-        memcpy(q->payload + pbuf_done, ((dma_addr_t *)cookies[buf])->virt + buf_done, next);
-        buf_done += next;
-        pbuf_done += next;
-        copied += next;
-        if (buf_done == lens[buf]) {
-            buf++;
-            buf_done = 0;
-        }
-        if (pbuf_done == q->len) {
-            q = q->next;
-            pbuf_done = 0;
-        }
+    unsigned int offset = hdr_len;
+    for (i = 0; i < num_bufs; i++) {
+        pbuf_take_at(p, ((dma_addr_t *)cookies[i])->virt, lens[i], offset);
+        offset += lens[i];
+        lwip_tx_complete(iface, cookies[i]);
     }
 
 //    PKT_DEBUG(printf("Receiving packet\n"));
@@ -147,40 +250,57 @@ static void lwip_rx_complete(void *iface, unsigned int num_bufs, void **cookies,
     pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
 #endif
     LINK_STATS_INC(link.recv);
+    ethif_input(iface, p);
+}
 
-    for (i = 0; i < num_bufs; i++) {
-        lwip_tx_complete(iface, cookies[i]);
-    }
-
-    struct eth_hdr *ethhdr;
-    ethhdr = p->payload;
+static void lwip_rx_complete(void *iface, unsigned int num_bufs, void **cookies, unsigned int *lens)
+{
+    rx_defer(iface, NULL, 0, num_bufs, cookies, lens, 0);
+}
 
-    switch (htons(ethhdr->type)) {
-    /* IP or ARP packet? */
-    case ETHTYPE_IP:
-    case ETHTYPE_ARP:
-#if PPPOE_SUPPORT
-    /* PPPoE packet? */
-    case ETHTYPE_PPPOEDISC:
-    case ETHTYPE_PPPOE:
-#endif /* PPPOE_SUPPORT */
-        /* full packet send to tcpip_thread to process */
-        if (lwip_iface->netif->input(p, lwip_iface->netif) != ERR_OK) {
-            LWIP_DEBUGF(NETIF_DEBUG, ("ethernetif_input: IP input error\n"));
-            pbuf_free(p);
-            p = NULL;
+static void lwip_rx_complete_meta(void *iface, unsigned int num_bufs, void **cookies, unsigned int *lens,
+                                  const ethif_rx_meta_t *meta)
+{
+    if (meta->flags & ETHIF_RX_CSUM_BAD) {
+        LINK_STATS_INC(link.chkerr);
+        for (int i = 0; i < num_bufs; i++) {
+            lwip_tx_complete(iface, cookies[i]);
         }
-        break;
+        return;
+    }
+    rx_defer(iface, NULL, 0, num_bufs, cookies, lens, rx_csum_verified(meta));
+}
 
-    default:
-        pbuf_free(p);
-        break;
+static void lwip_rx_complete_split(void *iface, const void *hdr, unsigned int hdr_len, unsigned int num_bufs,
+                                   void **cookies, unsigned int *lens, const ethif_rx_meta_t *meta)
+{
+    unsigned int len = hdr_len;
+    int i;
+    for (i = 0; i < num_bufs; i++) {
+        len += lens[i];
     }
+    struct pbuf *p = NULL;
+    if (!(meta->flags & ETHIF_RX_CSUM_BAD)) {
+        p = alloc_copy_pbuf(len);
+    } else {
+        LINK_STATS_INC(link.chkerr);
+    }
+    if (!p) {
+        for (i = 0; i < num_bufs; i++) {
+            lwip_tx_complete(iface, cookies[i]);
+        }
+        return;
+    }
+    /* the header is only valid during the callback, the rest is copied
+     * once the buffers are invalidated */
+    pbuf_take(p, hdr, hdr_len);
+    rx_defer(iface, p, hdr_len, num_bufs, cookies, lens, rx_csum_verified(meta));
 }
 
 static err_t ethif_link_output(struct netif *netif, struct pbuf *p)
 {
     lwip_iface_t *iface = (lwip_iface_t *)netif->state;
+    ethif_tx_meta_t meta_buf;
     dma_addr_t buf;
     struct pbuf *q;
     int status;
@@ -189,22 +309,25 @@ static err_t ethif_link_output(struct netif *netif, struct pbuf *p)
     pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
 #endif
 
-    if (p->tot_len > CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE) {
-        return ERR_MEM;
-    }
-    if (iface->num_free_bufs == 0) {
+    dma_addr_t *orig_buf = dma_pool_alloc(iface->pool, p->tot_len);
+    if (!orig_buf) {
         return ERR_MEM;
     }
-    iface->num_free_bufs--;
-    dma_addr_t *orig_buf = iface->bufs[iface->num_free_bufs];
     buf = *orig_buf;
 
+    uint8_t *state = dma_pool_buf_state(iface->pool, orig_buf);
     char *pkt_pos = (char *)buf.virt;
+    *state = DMA_BUF_DIRTY;
     for (q = p; q != NULL; q = q->next) {
         memcpy(pkt_pos, q->payload, q->len);
         pkt_pos += q->len;
     }
-    ps_dma_cache_clean(&iface->dma_man, buf.virt, p->tot_len);
+    const ethif_tx_meta_t *meta = tx_csum_meta(iface, buf.virt, p->tot_len, &meta_buf);
+    /* only the frame was written, so cleaning it leaves the whole buffer clean */
+    dma_cache_queue(&iface->cache, DMA_CACHE_OP_CLEAN, buf.virt, p->tot_len);
+    dma_cache_flush(&iface->cache);
+    *state = DMA_BUF_CLEAN;
+    iface->cache.stats.packets++;
 //    PKT_DEBUG(cprintf(COL_TX, "Sending packet"));
 //    PKT_DEBUG(print_packet(COL_TX, (void*)buf.virt, p->tot_len));
 
@@ -213,7 +336,7 @@ static err_t ethif_link_output(struct netif *netif, struct pbuf *p)
 #endif
 
     unsigned int length = p->tot_len;
-    status = iface->driver.i_fn.raw_tx(&iface->driver, 1, &buf.phys, &length, orig_buf);
+    status = raw_tx_csum(iface, 1, &buf.phys, &length, orig_buf, meta);
     switch (status) {
     case ETHIF_TX_FAILED:
         lwip_tx_complete(iface, orig_buf);
@@ -229,9 +352,56 @@ static err_t ethif_link_output(struct netif *netif, struct pbuf *p)
     return ERR_OK;
 }
 
+int ethif_lwip_forward(lwip_iface_t *iface, dma_addr_t *buf, unsigned int len)
+{
+    if (!iface->prealloc || !dma_pool_contains(iface->pool, buf)) {
+        LOG_ERROR("Buffer %p is not from the pool of this interface", buf);
+        return -1;
+    }
+    uint8_t *state = dma_pool_buf_state(iface->pool, buf);
+    if (*state == DMA_BUF_DIRTY) {
+        dma_cache_queue(&iface->cache, DMA_CACHE_OP_CLEAN, buf->virt, len);
+        dma_cache_flush(&iface->cache);
+        *state = DMA_BUF_CLEAN;
+    } else {
+        dma_cache_skip(&iface->cache);
+    }
+    iface->cache.stats.packets++;
+
+    dma_pool_ref(iface->pool, buf);
+    uintptr_t phys = buf->phys;
+    unsigned int length = len;
+    int status = iface->driver.i_fn.raw_tx(&iface->driver, 1, &phys, &length, buf);
+    switch (status) {
+    case ETHIF_TX_FAILED:
+        lwip_tx_complete(iface, buf);
+        return -1;
+    case ETHIF_TX_COMPLETE:
+        lwip_tx_complete(iface, buf);
+    case ETHIF_TX_ENQUEUED:
+        break;
+    }
+
+    LINK_STATS_INC(link.xmit);
+    return 0;
+}
+
 static uintptr_t lwip_pbuf_allocate_rx_buf(void *iface, size_t buf_size, void **cookie)
 {
     lwip_iface_t *lwip_iface = (lwip_iface_t *)iface;
+    if (lwip_iface->num_rx_recycle > 0 && lwip_iface->rx_recycle[lwip_iface->num_rx_recycle - 1]->len >= buf_size) {
+        /* The CPU only read from this buffer since it was last invalidated so
+         * no cache maintenance is needed before handing it back */
+        struct pbuf *p = lwip_iface->rx_recycle[--lwip_iface->num_rx_recycle];
+        uintptr_t phys = ps_dma_pin(&lwip_iface->dma_man, p->payload, buf_size);
+        if (!phys) {
+            pbuf_free(p);
+            return 0;
+        }
+        dma_cache_skip(&lwip_iface->cache);
+        *cookie = p;
+        return phys;
+    }
 #if ETH_PAD_SIZE
     buf_size += ETH_PAD_SIZE; /* allow room for Ethernet padding */
 #endif
@@ -258,7 +428,9 @@ static uintptr_t lwip_pbuf_allocate_rx_buf(void *iface, size_t buf_size, void **
         pbuf_free(p);
         return 0;
     }
-    ps_dma_cache_invalidate(&lwip_iface->dma_man, p->payload, buf_size);
+    /* nothing is known about what the CPU last did with this memory */
+    dma_cache_queue(&lwip_iface->cache, DMA_CACHE_OP_INVALIDATE, p->payload, buf_size);
+    dma_cache_flush(&lwip_iface->cache);
     *cookie = p;
     return phys;
 }
@@ -282,60 +454,158 @@ static void lwip_pbuf_tx_complete(void *iface, void *cookie)
     pbuf_free(cookie);
 }
 
-static void lwip_pbuf_rx_complete(void *iface, unsigned int num_bufs, void **cookies, unsigned int *lens)
+/* Hand a frame received into pbufs to lwIP. hdr, if set, already holds the
+ * driver owned start of a split frame. The buffers have been invalidated. */
+static void deliver_pbuf(lwip_iface_t *iface, struct pbuf *hdr, unsigned int num_bufs, void **cookies,
+                         unsigned int *lens)
 {
     struct pbuf *p = NULL;
     int i;
-    lwip_iface_t *lwip_iface = (lwip_iface_t *)iface;
 
-    assert(num_bufs > 0);
+#if CONFIG_LIB_ETHDRIVER_RX_COPYBREAK > 0
+    if (!hdr && num_bufs == 1 && lens[0] <= CONFIG_LIB_ETHDRIVER_RX_COPYBREAK &&
+        iface->num_rx_recycle < LWIP_RX_RECYCLE_SIZE) {
+        /* copy small frames out so the large DMA buffer can be reused straight away */
+        struct pbuf *q = (struct pbuf *)cookies[0];
+        p = alloc_copy_pbuf(lens[0]);
+        if (p) {
+            pbuf_take(p, q->payload, lens[0]);
+            iface->rx_recycle[iface->num_rx_recycle++] = q;
+            num_bufs = 0;
+        }
+    }
+#endif
     /* staple all the bufs together, do it in reverse order for efficiency
      * of traversing pbuf chains */
+    struct pbuf *bufs = NULL;
     for (i = num_bufs - 1; i >= 0; i--) {
         struct pbuf *q = (struct pbuf *)cookies[i];
-        ps_dma_cache_invalidate(&lwip_iface->dma_man, q->payload, lens[i]);
         pbuf_realloc(q, lens[i]);
-        if (p) {
-            pbuf_cat(q, p);
+        if (bufs) {
+            pbuf_cat(q, bufs);
+        }
+        bufs = q;
+    }
+    if (hdr) {
+        /* the payload stays in the DMA buffers, chained after the header */
+        p = hdr;
+        if (bufs) {
+            pbuf_cat(p, bufs);
         }
-        p = q;
+    } else if (bufs) {
+        p = bufs;
     }
 
 #if ETH_PAD_SIZE
     pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
 #endif
-
     LINK_STATS_INC(link.recv);
+    ethif_input(iface, p);
+}
 
-    struct eth_hdr *ethhdr;
-    ethhdr = p->payload;
+static void lwip_pbuf_rx_complete(void *iface, unsigned int num_bufs, void **cookies, unsigned int *lens)
+{
+    assert(num_bufs > 0);
+    rx_defer(iface, NULL, 0, num_bufs, cookies, lens, 0);
+}
 
-    switch (htons(ethhdr->type)) {
-    /* IP or ARP packet? */
-    case ETHTYPE_IP:
-    case ETHTYPE_ARP:
-#if PPPOE_SUPPORT
-    /* PPPoE packet? */
-    case ETHTYPE_PPPOEDISC:
-    case ETHTYPE_PPPOE:
-#endif /* PPPOE_SUPPORT */
-        /* full packet send to tcpip_thread to process */
-        if (lwip_iface->netif->input(p, lwip_iface->netif) != ERR_OK) {
-            LWIP_DEBUGF(NETIF_DEBUG, ("ethernetif_input: IP input error\n"));
-            LOG_INFO("failed to input\n");
-            pbuf_free(p);
+static void lwip_pbuf_rx_complete_meta(void *iface, unsigned int num_bufs, void **cookies, unsigned int *lens,
+                                       const ethif_rx_meta_t *meta)
+{
+    if (meta->flags & ETHIF_RX_CSUM_BAD) {
+        LINK_STATS_INC(link.chkerr);
+        for (int i = 0; i < num_bufs; i++) {
+            pbuf_free(cookies[i]);
         }
-        break;
+        return;
+    }
+    rx_defer(iface, NULL, 0, num_bufs, cookies, lens, rx_csum_verified(meta));
+}
 
-    default:
-        pbuf_free(p);
-        break;
+static void lwip_pbuf_rx_complete_split(void *iface, const void *hdr, unsigned int hdr_len, unsigned int num_bufs,
+                                        void **cookies, unsigned int *lens, const ethif_rx_meta_t *meta)
+{
+    struct pbuf *p = NULL;
+    int i;
+    if (!(meta->flags & ETHIF_RX_CSUM_BAD)) {
+        p = alloc_copy_pbuf(hdr_len);
+    } else {
+        LINK_STATS_INC(link.chkerr);
+    }
+    if (!p) {
+        for (i = 0; i < num_bufs; i++) {
+            pbuf_free(cookies[i]);
+        }
+        return;
+    }
+    pbuf_take(p, hdr, hdr_len);
+    rx_defer(iface, p, hdr_len, num_bufs, cookies, lens, rx_csum_verified(meta));
+}
+
+static void rx_deliver(lwip_iface_t *iface, struct pbuf *hdr, unsigned int hdr_len, unsigned int num_bufs,
+                       void **cookies, unsigned int *lens, u16_t csum_verified)
+{
+    iface->rx_csum_verified = csum_verified;
+    if (iface->prealloc) {
+        deliver_copy(iface, hdr, hdr_len, num_bufs, cookies, lens);
+    } else {
+        deliver_pbuf(iface, hdr, num_bufs, cookies, lens);
+    }
+    iface->rx_csum_verified = 0;
+}
+
+/* Queue the invalidation of a received frame and keep the frame for
+ * ethif_lwip_rx_flush, so that the frames of a poll or IRQ pass share one
+ * batch of cache maintenance */
+static void rx_defer(lwip_iface_t *iface, struct pbuf *hdr, unsigned int hdr_len, unsigned int num_bufs,
+                     void **cookies, unsigned int *lens, u16_t csum_verified)
+{
+    for (unsigned int i = 0; i < num_bufs; i++) {
+        void *virt = iface->prealloc ? ((dma_addr_t *)cookies[i])->virt : ((struct pbuf *)cookies[i])->payload;
+        dma_cache_queue(&iface->cache, DMA_CACHE_OP_INVALIDATE, virt, lens[i]);
     }
+    iface->cache.stats.packets++;
+
+    if (iface->rx_delivering || num_bufs > LWIP_RX_PENDING_BUFS) {
+        /* received while lwIP is being handed frames, or in too many
+         * buffers to keep, so it goes in now after what came before it */
+        if (iface->rx_delivering) {
+            dma_cache_flush(&iface->cache);
+        } else {
+            ethif_lwip_rx_flush(iface);
+        }
+        rx_deliver(iface, hdr, hdr_len, num_bufs, cookies, lens, csum_verified);
+        return;
+    }
+    if (iface->num_rx_pending == LWIP_RX_PENDING_SIZE) {
+        ethif_lwip_rx_flush(iface);
+    }
+    lwip_rx_pending_t *frame = &iface->rx_pending[iface->num_rx_pending++];
+    frame->hdr = hdr;
+    frame->hdr_len = hdr_len;
+    frame->num_bufs = num_bufs;
+    frame->csum_verified = csum_verified;
+    memcpy(frame->cookies, cookies, num_bufs * sizeof(*cookies));
+    memcpy(frame->lens, lens, num_bufs * sizeof(*lens));
+}
+
+void ethif_lwip_rx_flush(lwip_iface_t *iface)
+{
+    dma_cache_flush(&iface->cache);
+    iface->rx_delivering = true;
+    for (int i = 0; i < iface->num_rx_pending; i++) {
+        lwip_rx_pending_t *frame = &iface->rx_pending[i];
+        rx_deliver(iface, frame->hdr, frame->hdr_len, frame->num_bufs, frame->cookies, frame->lens,
+                   frame->csum_verified);
+    }
+    iface->num_rx_pending = 0;
+    iface->rx_delivering = false;
 }
 
 static err_t ethif_pbuf_link_output(struct netif *netif, struct pbuf *p)
 {
     lwip_iface_t *iface = (lwip_iface_t *)netif->state;
+    ethif_tx_meta_t meta_buf;
     struct pbuf *q;
     int status;
 
@@ -345,6 +615,8 @@ static err_t ethif_pbuf_link_output(struct netif *netif, struct pbuf *p)
 #if ETH_PAD_SIZE
     pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
 #endif
+    /* lwIP keeps all the headers in the first pbuf */
+    const ethif_tx_meta_t *meta = tx_csum_meta(iface, p->payload, p->len, &meta_buf);
     int max_frames = 0;
 
     /* work out how many pieces this buffer could potentially take up */
@@ -366,18 +638,21 @@ static err_t ethif_pbuf_link_output(struct netif *netif, struct pbuf *p)
             }
             lengths[num_frames] = next - loc;
             phys[num_frames] = ps_dma_pin(&iface->dma_man, (void *)loc, lengths[num_frames]);
-            ps_dma_cache_clean(&iface->dma_man, (void *)loc, lengths[num_frames]);
+            /* pages of one pbuf are merged back into a single clean */
+            dma_cache_queue(&iface->cache, DMA_CACHE_OP_CLEAN, (void *)loc, lengths[num_frames]);
             assert(phys[num_frames]);
             num_frames++;
             loc = next;
         }
     }
+    dma_cache_flush(&iface->cache);
+    iface->cache.stats.packets++;
 
 #if ETH_PAD_SIZE
     pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
 #endif
 
-    status = iface->driver.i_fn.raw_tx(&iface->driver, num_frames, phys, lengths, p);
+    status = raw_tx_csum(iface, num_frames, phys, lengths, p, meta);
     switch (status) {
     case ETHIF_TX_FAILED:
         lwip_pbuf_tx_complete(iface, p);
@@ -393,18 +668,81 @@ static err_t ethif_pbuf_link_output(struct netif *netif, struct pbuf *p)
     return ERR_OK;
 }
 
+static void lwip_link_change(void *iface, bool up)
+{
+    lwip_iface_t *lwip_iface = (lwip_iface_t *)iface;
+    lwip_iface->link_down = !up;
+    /* before ethif_init the state is picked up from link_down */
+    if (lwip_iface->netif) {
+        if (up) {
+            netif_set_link_up(lwip_iface->netif);
+        } else {
+            netif_set_link_down(lwip_iface->netif);
+        }
+    }
+}
+
 static struct raw_iface_callbacks lwip_prealloc_callbacks = {
     .tx_complete = lwip_tx_complete,
     .rx_complete = lwip_rx_complete,
-    .allocate_rx_buf = lwip_allocate_rx_buf
+    .allocate_rx_buf = lwip_allocate_rx_buf,
+    .rx_complete_meta = lwip_rx_complete_meta,
+    .rx_complete_split = lwip_rx_complete_split,
+    .link_change = lwip_link_change
 };
 
 static struct raw_iface_callbacks lwip_pbuf_callbacks = {
     .tx_complete = lwip_pbuf_tx_complete,
     .rx_complete = lwip_pbuf_rx_complete,
-    .allocate_rx_buf = lwip_pbuf_allocate_rx_buf
+    .allocate_rx_buf = lwip_pbuf_allocate_rx_buf,
+    .rx_complete_meta = lwip_pbuf_rx_complete_meta,
+    .rx_complete_split = lwip_pbuf_rx_complete_split,
+    .link_change = lwip_link_change
 };
 
+/* Hand the checksums the driver can deal with over to the hardware. Checksums
+ * lwIP was built not to generate (CHECKSUM_GEN_*) are always requested, the
+ * remaining ones only if lwIP allows turning them off per netif. Receive
+ * checks stay on for the netif, ethif_input skips them per frame when the
+ * driver reports them verified. */
+static void configure_csum_offload(lwip_iface_t *iface, struct netif *netif)
+{
+    uint32_t caps = iface->driver.offload_caps;
+    uint32_t tx_flags = 0;
+#if !CHECKSUM_GEN_IP
+    tx_flags |= ETHIF_TX_CSUM_IPV4;
+#endif
+#if !CHECKSUM_GEN_TCP
+    tx_flags |= ETHIF_TX_CSUM_TCP;
+#endif
+#if !CHECKSUM_GEN_UDP
+    tx_flags |= ETHIF_TX_CSUM_UDP;
+#endif
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+    u16_t chksum_flags = NETIF_CHECKSUM_ENABLE_ALL;
+    if (caps & ETHIF_TX_CSUM_IPV4) {
+        chksum_flags &= ~NETIF_CHECKSUM_GEN_IP;
+    }
+    if (caps & ETHIF_TX_CSUM_TCP) {
+        chksum_flags &= ~NETIF_CHECKSUM_GEN_TCP;
+    }
+    if (caps & ETHIF_TX_CSUM_UDP) {
+        chksum_flags &= ~NETIF_CHECKSUM_GEN_UDP;
+    }
+    NETIF_SET_CHECKSUM_CTRL(netif, chksum_flags);
+    tx_flags |= caps & (ETHIF_TX_CSUM_IPV4 | ETHIF_TX_CSUM_TCP | ETHIF_TX_CSUM_UDP);
+#endif
+    if (tx_flags & ~caps) {
+        LOG_ERROR("Driver cannot insert checksums (0x%x) that lwIP does not generate", tx_flags & ~caps);
+    }
+#if !CHECKSUM_CHECK_IP || !CHECKSUM_CHECK_TCP || !CHECKSUM_CHECK_UDP
+    if (!(caps & ETHIF_CAP_RX_CSUM)) {
+        LOG_INFO("Driver does not verify checksums that lwIP does not check");
+    }
+#endif
+    iface->tx_csum_flags = tx_flags & caps;
+}
+
 static err_t ethif_init(struct netif *netif)
 {
     if (netif -> state == NULL) {
@@ -418,24 +756,30 @@ static err_t ethif_init(struct netif *netif)
 
     netif->hwaddr_len = ETHARP_HWADDR_LEN;
     netif->output = etharp_output;
-    if (iface->bufs == NULL) {
-        netif->linkoutput = ethif_pbuf_link_output;
-    } else {
+    if (iface->prealloc) {
         netif->linkoutput = ethif_link_output;
+    } else {
+        netif->linkoutput = ethif_pbuf_link_output;
     }
 
     NETIF_INIT_SNMP(netif, snmp_ifType_ethernet_csmacd,
                     LINK_SPEED_OF_YOUR_NETIF_IN_BPS);
 
     netif -> flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP |
-                     NETIF_FLAG_LINK_UP | NETIF_FLAG_IGMP;
+                     NETIF_FLAG_IGMP;
+    if (!iface->link_down) {
+        netif->flags |= NETIF_FLAG_LINK_UP;
+    }
+
+    configure_csum_offload(iface, netif);
 
     iface->netif = netif;
     return ERR_OK;
 }
 
-lwip_iface_t *ethif_new_lwip_driver_no_malloc(ps_io_ops_t io_ops, ps_dma_man_t *pbuf_dma, ethif_driver_init driver,
-                                              void *driver_config, lwip_iface_t *iface)
+static lwip_iface_t *new_lwip_driver(ps_io_ops_t io_ops, ps_dma_man_t *pbuf_dma, const dma_pool_config_t *pool_config,
+                                     dma_pool_t *shared_pool, ethif_driver_init driver, void *driver_config,
+                                     lwip_iface_t *iface)
 {
     memset(iface, 0, sizeof(*iface));
     iface->driver.cb_cookie = iface;
@@ -445,16 +789,28 @@ lwip_iface_t *ethif_new_lwip_driver_no_malloc(ps_io_ops_t io_ops, ps_dma_man_t *
     } else {
         iface->driver.i_cb = lwip_prealloc_callbacks;
         iface->dma_man = io_ops.dma_manager;
+        iface->prealloc = true;
+        if (shared_pool) {
+            dma_pool_get(shared_pool);
+            iface->pool = shared_pool;
+        } else {
+            iface->pool_config = *pool_config;
+            iface->pool = &iface->own_pool;
+        }
     }
+    dma_cache_init(&iface->cache, &iface->dma_man);
     int err;
     err = driver(&iface->driver, io_ops, driver_config);
     if (err) {
         goto error;
     }
+    if (shared_pool && !dma_pool_aligned(shared_pool, iface->driver.dma_alignment)) {
+        LOG_ERROR("Shared pool buffers are not aligned to %d as the driver needs", iface->driver.dma_alignment);
+        goto error;
+    }
     /* if the driver did not already cause it to happen, allocate the preallocated buffers */
-    if (!pbuf_dma && !iface->bufs) {
-        initialize_free_bufs(iface);
-        if (iface->bufs == NULL) {
+    if (iface->prealloc && !dma_pool_ready(iface->pool)) {
+        if (initialize_free_bufs(iface)) {
             LOG_ERROR("Fault preallocating bufs");
             goto error;
         }
@@ -462,9 +818,62 @@ lwip_iface_t *ethif_new_lwip_driver_no_malloc(ps_io_ops_t io_ops, ps_dma_man_t *
     iface->ethif_init = ethif_init;
     return iface;
 error:
+    if (iface->pool && dma_pool_ready(iface->pool)) {
+        dma_pool_put(iface->pool);
+    }
     return NULL;
 }
 
+lwip_iface_t *ethif_new_lwip_driver_no_malloc(ps_io_ops_t io_ops, ps_dma_man_t *pbuf_dma, ethif_driver_init driver,
+                                              void *driver_config, lwip_iface_t *iface)
+{
+    dma_pool_config_t pool_config;
+    dma_pool_default_config(&pool_config);
+    return new_lwip_driver(io_ops, pbuf_dma, &pool_config, NULL, driver, driver_config, iface);
+}
+
+lwip_iface_t *ethif_new_lwip_driver_pool(ps_io_ops_t io_ops, const dma_pool_config_t *pool_config,
+                                         ethif_driver_init driver, void *driver_config, lwip_iface_t *iface)
+{
+    lwip_iface_t *ret;
+    lwip_iface_t *alloc = NULL;
+    if (!iface) {
+        iface = alloc = malloc(sizeof(*iface));
+        if (!iface) {
+            LOG_ERROR("Failed to malloc");
+            return NULL;
+        }
+    }
+    ret = new_lwip_driver(io_ops, NULL, pool_config, NULL, driver, driver_config, iface);
+    if (!ret) {
+        free(alloc);
+    }
+    return ret;
+}
+
+lwip_iface_t *ethif_new_lwip_driver_shared(ps_io_ops_t io_ops, dma_pool_t *pool, ethif_driver_init driver,
+                                           void *driver_config, lwip_iface_t *iface)
+{
+    lwip_iface_t *ret;
+    lwip_iface_t *alloc = NULL;
+    if (!dma_pool_ready(pool)) {
+        LOG_ERROR("Shared pool is not initialised");
+        return NULL;
+    }
+    if (!iface) {
+        iface = alloc = malloc(sizeof(*iface));
+        if (!iface) {
+            LOG_ERROR("Failed to malloc");
+            return NULL;
+        }
+    }
+    ret = new_lwip_driver(io_ops, NULL, NULL, pool, driver, driver_config, iface);
+    if (!ret) {
+        free(alloc);
+    }
+    return ret;
+}
+
 lwip_iface_t *ethif_new_lwip_driver(ps_io_ops_t io_ops, ps_dma_man_t *pbuf_dma, ethif_driver_init driver,
                                     void *driver_config)
 {
@@ -17,111 +17,45 @@
 #include "debug.h"
 #include <utils/zf_log.h>
 
-static int alloc_buf_pool(pico_device_eth *pico_iface)
-{
-    /* Take the next free buffer */
-    if (pico_iface->next_free_buf == -1) {
-        ZF_LOGE("Out of preallocated eth buffers.");
-        return -1;
-    }
-
-    int retval = pico_iface->next_free_buf;
-    pico_iface->next_free_buf = pico_iface->buf_pool[retval];
-    return retval;
-
-}
-
-static void free_buf_pool(pico_device_eth *pico_iface, int buf_no)
-{
-    /* Return back into the buffer pool */
-    if (buf_no < 0 || buf_no > CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS) {
-        ZF_LOGE("Attempted to return a buffer outside of the pool %d.", buf_no);
-        return;
-    }
-    pico_iface->buf_pool[buf_no] = pico_iface->next_free_buf;
-    pico_iface->next_free_buf = buf_no;
-}
-
 static void destroy_free_bufs(pico_device_eth *pico_iface)
 {
-    if (pico_iface->bufs) {
-        free(pico_iface->bufs);
-    }
-    if (pico_iface->dma_bufs) {
-        for (int i = 0; i < CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS; i++) {
-            if (pico_iface->dma_bufs[i].virt) {
-                dma_unpin_free(&pico_iface->dma_man, pico_iface->dma_bufs[i].virt,
-                               CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE);
-            }
-        }
-        free(pico_iface->dma_bufs);
-        pico_iface->dma_bufs = NULL;
-    }
-
-    if (pico_iface->buf_pool) {
-        free(pico_iface->buf_pool);
+    /* a shared pool stays with the device, only its own one goes */
+    if (pico_iface->pool == &pico_iface->own_pool && dma_pool_ready(pico_iface->pool)) {
+        dma_pool_put(pico_iface->pool);
     }
-    pico_iface->next_free_buf = -1;
 
     if (pico_iface->rx_lens) {
         free(pico_iface->rx_lens);
+        pico_iface->rx_lens = NULL;
     }
 
-    pico_iface->bufs = NULL;
+    if (pico_iface->rx_queue) {
+        free(pico_iface->rx_queue);
+        pico_iface->rx_queue = NULL;
+    }
 }
 
 static void initialize_free_bufs(pico_device_eth *pico_iface)
 {
-    dma_addr_t *dma_bufs = NULL;
-    dma_bufs = calloc(CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS, sizeof(dma_addr_t));
-    pico_iface->dma_bufs = dma_bufs;
-    if (!dma_bufs) {
-        destroy_free_bufs(pico_iface);
-        return;
-    }
-
-    pico_iface->bufs = malloc(sizeof(dma_addr_t *) * CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS);
-    if (!pico_iface->bufs) {
-        destroy_free_bufs(pico_iface);
-        return;
-    }
-
-    /* Pin buffers */
-    for (int i = 0; i < CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS; i++) {
-        dma_bufs[i] = dma_alloc_pin(&pico_iface->dma_man,
-                                    CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE, 1,  pico_iface->driver.dma_alignment);
-        if (!dma_bufs[i].phys) {
-            destroy_free_bufs(pico_iface);
-            return;
-        }
-        ps_dma_cache_clean_invalidate(&pico_iface->dma_man, dma_bufs[i].virt,
-                                      CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE);
-        pico_iface->bufs[i] = &dma_bufs[i];
-    }
-
-    pico_iface->num_free_bufs = CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS;
-
-    /* Setup the buffer pool management */
-    pico_iface->buf_pool = malloc(sizeof(int) * CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS);
-    if (!pico_iface->buf_pool) {
-        destroy_free_bufs(pico_iface);
+    if (!dma_pool_ready(pico_iface->pool) &&
+        dma_pool_init(pico_iface->pool, &pico_iface->dma_man, &pico_iface->pool_config,
+                      pico_iface->driver.dma_alignment)) {
         return;
     }
 
-    for (int i = 0; i < CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS; i++) {
-        pico_iface->buf_pool[i] = i - 1;
+    /* Rx queue, large enough for every buffer of the pool */
+    unsigned int num_bufs = 0;
+    for (int i = 0; i < pico_iface->pool->num_classes; i++) {
+        num_bufs += pico_iface->pool->classes[i].num_bufs;
     }
-    pico_iface->next_free_buf = CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS - 1;
-
-    /* Rx queue */
     pico_iface->rx_count = 0;
-    pico_iface->rx_lens = calloc(CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS, sizeof(int));
+    pico_iface->rx_lens = calloc(num_bufs, sizeof(int));
     if (!pico_iface->rx_lens) {
         destroy_free_bufs(pico_iface);
         return;
     }
 
-    pico_iface->rx_queue = calloc(CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS, sizeof(int));
+    pico_iface->rx_queue = calloc(num_bufs, sizeof(dma_addr_t *));
     if (!pico_iface->rx_queue) {
         destroy_free_bufs(pico_iface);
         return;
@@ -135,35 +69,35 @@ static uintptr_t pico_allocate_rx_buf(void *iface, size_t buf_size, void **cooki
 {
     pico_device_eth *pico_iface = (pico_device_eth *)iface;
 
-    if (buf_size > CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE) {
-        ZF_LOGE("Requested RX buffer of size %zu which can never be fullfilled by preallocated buffers of size %d",
-                buf_size, CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE);
-        return 0;
-    }
-
-    if (!pico_iface->bufs) {
+    if (!pico_iface->rx_queue) {
         initialize_free_bufs(pico_iface);
-        if (!pico_iface->bufs) {
+        if (!pico_iface->rx_queue) {
             ZF_LOGE("Failed lazy initialization of preallocated free buffers");
             return 0;
         }
     }
 
-    int buf_no = alloc_buf_pool(pico_iface);
-    if (buf_no < 0) {
+    if (buf_size > dma_pool_max_size(pico_iface->pool)) {
+        ZF_LOGE("Requested RX buffer of size %zu which can never be fullfilled by preallocated buffers of size %zu",
+                buf_size, dma_pool_max_size(pico_iface->pool));
+        return 0;
+    }
+
+    dma_addr_t *buf = dma_pool_alloc(pico_iface->pool, buf_size);
+    if (!buf) {
         /* No buffers available */
         return 0;
     }
 
-    dma_addr_t *buf = pico_iface->bufs[buf_no];
     ps_dma_cache_invalidate(&pico_iface->dma_man, buf->virt, buf_size);
-    *(long *) cookie = buf_no;
+    *cookie = buf;
     return buf->phys;
 }
 
 static void pico_tx_complete(void *iface, void *cookie)
 {
-    free_buf_pool(iface, (long) cookie);
+    pico_device_eth *pico_iface = (pico_device_eth *)iface;
+    dma_pool_free(pico_iface->pool, cookie);
 }
 
 static void pico_rx_complete(void *iface, unsigned int num_bufs, void **cookies, unsigned int *lens)
@@ -175,13 +109,12 @@ static void pico_rx_complete(void *iface, unsigned int num_bufs, void **cookies,
         ZF_LOGE("RX buffer of size is smaller than MTU. Frame splitting unhandled.\n");
         /* Frame splitting is not handled. Warn and return bufs to pool. */
         for (int i = 0; i < num_bufs; i++) {
-            free_buf_pool(pico_iface, (long) cookies[i]);
+            dma_pool_free(pico_iface->pool, cookies[i]);
         }
     } else {
-        int buf_no = (long) cookies[0];
         /* Store the information about the rx bufs */
-        pico_iface->rx_queue[pico_iface->rx_count] = buf_no;
-        pico_iface->rx_lens[buf_no] = lens[0];
+        pico_iface->rx_queue[pico_iface->rx_count] = cookies[0];
+        pico_iface->rx_lens[pico_iface->rx_count] = lens[0];
         pico_iface->rx_count += 1;
 
 #ifdef CONFIG_LIB_PICOTCP_ASYNC_DRIVER
@@ -202,30 +135,25 @@ static int pico_eth_send(struct pico_device *dev, void *input_buf, int len)
     int status;
     struct pico_device_eth *eth_device = (struct pico_device_eth *)dev;
 
-    if (len > CONFIG_LIB_ETHDRIVER_PREALLOCATED_BUF_SIZE) {
-        return 0;
-    }
-
-    long buf_no = alloc_buf_pool(eth_device);
-    if (buf_no < 0) {
+    dma_addr_t *orig_buf = dma_pool_alloc(eth_device->pool, len);
+    if (!orig_buf) {
+        ZF_LOGE("Out of preallocated eth buffers.");
         return 0;
     }
-
-    dma_addr_t *orig_buf = eth_device->bufs[buf_no];
     buf = *orig_buf;
     memcpy(buf.virt, input_buf, len);
     ps_dma_cache_clean(&eth_device->dma_man, buf.virt, len);
 
     unsigned int length = len;
-    status = eth_device->driver.i_fn.raw_tx(&eth_device->driver, 1, &buf.phys, &length, (void *) buf_no);
+    status = eth_device->driver.i_fn.raw_tx(&eth_device->driver, 1, &buf.phys, &length, orig_buf);
 
     switch (status) {
     case ETHIF_TX_FAILED:
-        pico_tx_complete(dev, (void *) buf_no);
+        pico_tx_complete(dev, orig_buf);
         ZF_LOGE("Failed tx\n");
         return 0; // Error for PICO
     case ETHIF_TX_COMPLETE:
-        pico_tx_complete(dev, (void *) buf_no);
+        pico_tx_complete(dev, orig_buf);
     case ETHIF_TX_ENQUEUED:
         break;
     }
@@ -249,14 +177,13 @@ static int pico_eth_poll(struct pico_device *dev, int loop_score)
 
         /* Retrieve the data from the rx buffer */
         eth_device->rx_count -= 1;
-        int buf_no = eth_device->rx_queue[eth_device->rx_count];
-        dma_addr_t *buf = eth_device->bufs[buf_no];
+        dma_addr_t *buf = eth_device->rx_queue[eth_device->rx_count];
 
-        int len = eth_device->rx_lens[buf_no];
+        int len = eth_device->rx_lens[eth_device->rx_count];
         ps_dma_cache_invalidate(&eth_device->dma_man, buf->virt, len);
         pico_stack_recv(dev, buf->virt, len);
 
-        free_buf_pool(eth_device, buf_no);
+        dma_pool_free(eth_device->pool, buf);
         loop_score--;
     }
 
@@ -269,8 +196,9 @@ static struct raw_iface_callbacks pico_prealloc_callbacks = {
     .allocate_rx_buf = pico_allocate_rx_buf
 };
 
-struct pico_device *pico_eth_create_no_malloc(char *name,
-                                              ethif_driver_init driver_init, void *driver_config, ps_io_ops_t io_ops, struct pico_device_eth *eth_dev)
+static struct pico_device *pico_eth_create_internal(char *name, ethif_driver_init driver_init, void *driver_config,
+                                                    ps_io_ops_t io_ops, const dma_pool_config_t *pool_config,
+                                                    dma_pool_t *shared_pool, struct pico_device_eth *eth_dev)
 {
 
     if (eth_dev == NULL) {
@@ -283,17 +211,33 @@ struct pico_device *pico_eth_create_no_malloc(char *name,
     /* Set the dma manager up */
     eth_dev->driver.i_cb = pico_prealloc_callbacks;
     eth_dev->dma_man = io_ops.dma_manager;
+    if (shared_pool) {
+        dma_pool_get(shared_pool);
+        eth_dev->pool = shared_pool;
+    } else {
+        eth_dev->pool_config = *pool_config;
+        eth_dev->pool = &eth_dev->own_pool;
+    }
 
     eth_dev->driver.cb_cookie = eth_dev;
     /* Initialize hardware */
     int err;
     err = driver_init(&(eth_dev->driver), io_ops, driver_config);
     if (err) {
+        if (shared_pool) {
+            dma_pool_put(shared_pool);
+        }
+        return NULL;
+    }
+
+    if (shared_pool && !dma_pool_aligned(shared_pool, eth_dev->driver.dma_alignment)) {
+        ZF_LOGE("Shared pool buffers are not aligned to %d as the driver needs", eth_dev->driver.dma_alignment);
+        dma_pool_put(shared_pool);
         return NULL;
     }
 
     /* Initialise buffers in case driver did not do so */
-    if (!eth_dev->bufs) {
+    if (!eth_dev->rx_queue) {
         initialize_free_bufs(eth_dev);
     }
 
@@ -320,13 +264,66 @@ struct pico_device *pico_eth_create_no_malloc(char *name,
     /* Register in picoTCP (equivalent to netif init in lwip)*/
     if (pico_device_init(&(eth_dev->pico_dev), name, mac) != 0) {
         ZF_LOGE("Failed to initialize pico device");
-        free(eth_dev);
+        if (shared_pool) {
+            dma_pool_put(shared_pool);
+        }
         return NULL;
     }
 
     return (struct pico_device *)eth_dev;
 }
 
+struct pico_device *pico_eth_create_no_malloc(char *name,
+                                              ethif_driver_init driver_init, void *driver_config, ps_io_ops_t io_ops, struct pico_device_eth *eth_dev)
+{
+    dma_pool_config_t pool_config;
+    dma_pool_default_config(&pool_config);
+    return pico_eth_create_internal(name, driver_init, driver_config, io_ops, &pool_config, NULL, eth_dev);
+}
+
+struct pico_device *pico_eth_create_pool(char *name, ethif_driver_init driver_init, void *driver_config, ps_io_ops_t io_ops,
+                                         const dma_pool_config_t *pool_config, struct pico_device_eth *eth_dev)
+{
+    struct pico_device_eth *allocated = NULL;
+    if (!eth_dev) {
+        allocated = eth_dev = malloc(sizeof(struct pico_device_eth));
+        if (!eth_dev) {
+            ZF_LOGE("Failed to malloc pico eth device interface");
+            return NULL;
+        }
+    }
+
+    struct pico_device *pico_dev = pico_eth_create_internal(name, driver_init, driver_config, io_ops, pool_config, NULL, eth_dev);
+    if (!pico_dev) {
+        free(allocated);
+    }
+    return pico_dev;
+}
+
+struct pico_device *pico_eth_create_shared(char *name, ethif_driver_init driver_init, void *driver_config, ps_io_ops_t io_ops,
+                                           dma_pool_t *pool, struct pico_device_eth *eth_dev)
+{
+    if (!dma_pool_ready(pool)) {
+        ZF_LOGE("Shared pool is not initialised");
+        return NULL;
+    }
+
+    struct pico_device_eth *allocated = NULL;
+    if (!eth_dev) {
+        allocated = eth_dev = malloc(sizeof(struct pico_device_eth));
+        if (!eth_dev) {
+            ZF_LOGE("Failed to malloc pico eth device interface");
+            return NULL;
+        }
+    }
+
+    struct pico_device *pico_dev = pico_eth_create_internal(name, driver_init, driver_config, io_ops, NULL, pool, eth_dev);
+    if (!pico_dev) {
+        free(allocated);
+    }
+    return pico_dev;
+}
+
 struct pico_device *pico_eth_create(char *name,
                                     ethif_driver_init driver_init, void *driver_config, ps_io_ops_t io_ops)
 {
@@ -338,7 +335,11 @@ struct pico_device *pico_eth_create(char *name,
         return NULL;
     }
 
-    return pico_eth_create_no_malloc(name, driver_init, driver_config, io_ops, eth_dev);
+    struct pico_device *pico_dev = pico_eth_create_no_malloc(name, driver_init, driver_config, io_ops, eth_dev);
+    if (!pico_dev) {
+        free(eth_dev);
+    }
+    return pico_dev;
 }
 
 #endif // CONFIG_LIB_PICOTCP
@@ -8,11 +8,10 @@
 #include <ethdrivers/helpers.h>
 #include <string.h>
 #include <utils/util.h>
-#include <lwip/netif.h>
+#include "cpsw/cpsw_config.h"
 #include "cpsw/cpswif.h"
 #include <ethdrivers/plat/cpsw.h>
 #include <ethdrivers/plat/interrupt.h>
-#include "lwiplib.h"
 
 #define DEFAULT_MAC "\x00\x19\xb8\x00\xf0\xa3"
 
@@ -32,57 +31,66 @@ low_level_init(struct eth_driver *driver, uint8_t *mac, int *mtu)
     *mtu = MAX_PKT_SIZE;
 }
 
-static void fill_rx_bufs(struct eth_driver *driver)
+static void fill_rx_chan(struct eth_driver *driver, struct cpsw_rx_chan *chan)
 {
     struct beaglebone_eth_data *dev = (struct beaglebone_eth_data*)driver->eth_data;
 
-    THREAD_MEMORY_RELEASE();
-
-    while (dev->rx_remain > 0) {
+    while (chan->remain > 0) {
         /* request a buffer */
         void *cookie;
-        int next_rdt = (dev->rdt + 1) % dev->rx_size;
+        int next_rdt = (chan->rdt + 1) % chan->size;
         uintptr_t phys = driver->i_cb.allocate_rx_buf ? driver->i_cb.allocate_rx_buf(driver->cb_cookie, MAX_PKT_SIZE, &cookie) : 0;
         if (!phys) {
+            ethif_stats_add(&dev->stats.rx_alloc_failed, 1);
             break;
         }
-        dev->rx_cookies[dev->rdt] = cookie;
+        chan->cookies[chan->rdt] = cookie;
 
-        dev->rx_ring[dev->rdt].bufptr = phys;
-        dev->rx_ring[dev->rdt].bufoff_len = PBUF_LEN_MAX;
+        chan->ring[chan->rdt].bufptr = phys;
+        chan->ring[chan->rdt].bufoff_len = PBUF_LEN_MAX;
         /* Mark the descriptor as owned by CPDMA to tell the CPSW hardware it can put
          * RX data into it
          */
         THREAD_MEMORY_RELEASE();
 
-        dev->rx_ring[dev->rdt].flags_pktlen = CPDMA_BUF_DESC_OWNER;
+        chan->ring[chan->rdt].flags_pktlen = CPDMA_BUF_DESC_OWNER;
         /* Set the next field in the hardware descriptor. The device will traverse the ring
          * using the next field to dump other RX data
          */
         THREAD_MEMORY_RELEASE();
-        dev->rx_ring[dev->rdt].next = ((struct descriptor *) dev->rx_ring_phys) + next_rdt;
+        chan->ring[chan->rdt].next = ((struct descriptor *) chan->ring_phys) + next_rdt;
 
-        dev->rdt = next_rdt;
-        dev->rx_remain--;
+        chan->rdt = next_rdt;
+        chan->remain--;
     }
 
-    THREAD_MEMORY_ACQUIRE();
+    ethif_stats_hwm(&dev->stats.rx_ring_hwm, chan->size - 2 - chan->remain);
 }
 
-static void free_desc_ring(struct beaglebone_eth_data *dev, ps_dma_man_t *dma_man)
+static void fill_rx_bufs(struct eth_driver *driver)
 {
-    if (dev->rx_ring) {
-        dma_unpin_free(dma_man, (void*)dev->rx_ring, sizeof(struct descriptor) * dev->rx_size);
-        dev->rx_ring = NULL;
-    }
-    if (dev->tx_ring) {
-        dma_unpin_free(dma_man, (void*)dev->tx_ring, sizeof(struct descriptor) * dev->tx_size);
-        dev->tx_ring = NULL;
+    struct beaglebone_eth_data *dev = (struct beaglebone_eth_data*)driver->eth_data;
+
+    THREAD_MEMORY_RELEASE();
+
+    for (unsigned int i = 0; i < dev->num_rx_chans; i++) {
+        fill_rx_chan(driver, &dev->rx_chan[i]);
     }
-    if (dev->rx_cookies) {
-        free(dev->rx_cookies);
-        dev->rx_cookies = NULL;
+
+    THREAD_MEMORY_ACQUIRE();
+}
+
+static void free_desc_ring(struct beaglebone_eth_data *dev)
+{
+    /* The rings themselves live in CPPI RAM, only the bookkeeping is ours */
+    for (unsigned int i = 0; i < dev->num_rx_chans; i++) {
+        if (dev->rx_chan[i].cookies) {
+            free(dev->rx_chan[i].cookies);
+            dev->rx_chan[i].cookies = NULL;
+        }
+        dev->rx_chan[i].ring = NULL;
     }
+    dev->tx_ring = NULL;
     if (dev->tx_cookies) {
         free(dev->tx_cookies);
         dev->tx_cookies = NULL;
@@ -95,42 +103,54 @@ static void free_desc_ring(struct beaglebone_eth_data *dev, ps_dma_man_t *dma_ma
 
 static int initialize_desc_ring(struct beaglebone_eth_data *dev, ps_dma_man_t *dma_man)
 {
-    /* CPSW device has its own fixed memory area to save RX and TX ring descriptors */
+    /* CPSW device has its own fixed memory area to save RX and TX ring descriptors.
+     * The first half holds the TX ring, the second half is split evenly between
+     * the RX channels */
     dma_addr_t tx_ring = {.virt = VPTR_CPSW_CPPI(dev->iomm_address.eth_mmio_cpsw_reg), .phys = CPSW0_CPPI_RAM_REGS};
-    dma_addr_t rx_ring = {.virt = VPTR_CPSW_CPPI(dev->iomm_address.eth_mmio_cpsw_reg) + (SIZE_CPPI_RAM >> 1), .phys = CPSW0_CPPI_RAM_REGS + (SIZE_CPPI_RAM >> 1)};
-    dev->rx_ring = rx_ring.virt;
-    dev->rx_ring_phys = rx_ring.phys;
+    volatile struct descriptor *rx_base = (volatile struct descriptor *)((uint8_t *) tx_ring.virt + (SIZE_CPPI_RAM >> 1));
+    uintptr_t rx_base_phys = CPSW0_CPPI_RAM_REGS + (SIZE_CPPI_RAM >> 1);
 
-    ps_dma_cache_clean_invalidate(dma_man, rx_ring.virt, sizeof(struct descriptor) * dev->rx_size);
     ps_dma_cache_clean_invalidate(dma_man, tx_ring.virt, sizeof(struct descriptor) * dev->tx_size);
 
-    dev->rx_cookies = malloc(sizeof(void*) * dev->rx_size);
     dev->tx_cookies = malloc(sizeof(void*) * dev->tx_size);
     dev->tx_lengths = malloc(sizeof(unsigned int) * dev->tx_size);
-    if (!dev->rx_cookies || !dev->tx_cookies || !dev->tx_lengths) {
-        if (dev->rx_cookies) {
-            free(dev->rx_cookies);
-        }
-        if (dev->tx_cookies) {
-            free(dev->tx_cookies);
-        }
-        if (dev->tx_lengths) {
-            free(dev->tx_lengths);
-        }
+    if (!dev->tx_cookies || !dev->tx_lengths) {
         ZF_LOGE("Failed to malloc");
-        free_desc_ring(dev, dma_man);
+        free_desc_ring(dev);
         return -1;
     }
+
+    for (unsigned int c = 0; c < dev->num_rx_chans; c++) {
+        struct cpsw_rx_chan *chan = &dev->rx_chan[c];
+        chan->ring = rx_base + c * chan->size;
+        chan->ring_phys = (uintptr_t)(((struct descriptor *) rx_base_phys) + c * chan->size);
+        ps_dma_cache_clean_invalidate(dma_man, (void *) chan->ring, sizeof(struct descriptor) * chan->size);
+
+        chan->cookies = malloc(sizeof(void*) * chan->size);
+        if (!chan->cookies) {
+            ZF_LOGE("Failed to malloc");
+            free_desc_ring(dev);
+            return -1;
+        }
+        /* Remaining needs to be 2 less than size as we cannot actually enqueue size many descriptors,
+         * since then the head and tail pointers would be equal, indicating empty. */
+        chan->remain = chan->size - 2;
+        chan->rdt = chan->rdh = 0;
+        for (unsigned int i = 0; i < chan->size; i++) {
+            chan->ring[i] = (struct descriptor) {
+                .next = NULL,
+                .bufptr = 0,
+                .bufoff_len = 0,
+                .flags_pktlen = CPDMA_BUF_DESC_OWNER
+            };
+        }
+    }
+
     dev->tx_ring = tx_ring.virt;
     dev->tx_ring_phys = tx_ring.phys;
-    /* Remaining needs to be 2 less than size as we cannot actually enqueue size many descriptors,
-     * since then the head and tail pointers would be equal, indicating empty. */
-    dev->rx_remain = dev->rx_size - 2;
     dev->tx_remain = dev->tx_size - 2;
+    dev->tdt = dev->tdh = 0;
 
-    dev->rdt = dev->rdh = dev->tdt = dev->tdh = 0;
-
-    /* zero both rings */
     for (unsigned int i = 0; i < dev->tx_size; i++) {
         dev->tx_ring[i] = (struct descriptor) {
             .next = NULL,
@@ -139,52 +159,54 @@ static int initialize_desc_ring(struct beaglebone_eth_data *dev, ps_dma_man_t *d
             .flags_pktlen = 0
         };
     }
-    for (unsigned int i = 0; i < dev->rx_size; i++) {
-        dev->rx_ring[i] = (struct descriptor) {
-            .next = NULL,
-            .bufptr = 0,
-            .bufoff_len = 0,
-            .flags_pktlen = CPDMA_BUF_DESC_OWNER
-        };
-    }
     THREAD_MEMORY_FENCE();
 
     return 0;
 }
 
-static void complete_rx(struct eth_driver *eth_driver)
+static void complete_rx_chan(struct eth_driver *eth_driver, unsigned int c)
 {
     struct beaglebone_eth_data *dev = (struct beaglebone_eth_data*)eth_driver->eth_data;
-    unsigned int rdt = dev->rdt;
-
-    while ((dev->rdh != rdt) && ((dev->rx_ring[dev->rdh].flags_pktlen & CPDMA_BUF_DESC_OWNER) != CPDMA_BUF_DESC_OWNER)) {
-        int orig_rdh = dev->rdh;
+    struct cpsw_rx_chan *chan = &dev->rx_chan[c];
+    unsigned int rdt = chan->rdt;
 
+    while ((chan->rdh != rdt) && ((chan->ring[chan->rdh].flags_pktlen & CPDMA_BUF_DESC_OWNER) != CPDMA_BUF_DESC_OWNER)) {
+        int orig_rdh = chan->rdh;
 
         /* Ensure no memory references get ordered before we checked the descriptor was written back */
         THREAD_MEMORY_ACQUIRE();
 
-        void *cookie = dev->rx_cookies[dev->rdh];
-        unsigned int len = (dev->rx_ring[dev->rdh].flags_pktlen) & CPDMA_BD_PKTLEN_MASK;
+        void *cookie = chan->cookies[chan->rdh];
+        unsigned int len = (chan->ring[chan->rdh].flags_pktlen) & CPDMA_BD_PKTLEN_MASK;
         /* update rdh */
-        dev->rdh = (dev->rdh + 1) % dev->rx_size;
-        dev->rx_remain++;
+        chan->rdh = (chan->rdh + 1) % chan->size;
+        chan->remain++;
 
         /* Give the buffers back */
+        ethif_stats_rx(&dev->stats, 1, &len);
         eth_driver->i_cb.rx_complete(eth_driver->cb_cookie, 1, &cookie, &len);
 
         /* Acknowledge that this packet is processed */
-        CPSWCPDMARxCPWrite(VPTR_CPSW_CPDMA(dev->iomm_address.eth_mmio_cpsw_reg), 0, (uintptr_t)  (((volatile struct descriptor *) dev->rx_ring_phys) + (orig_rdh)));
-        dev->rx_ring[orig_rdh].flags_pktlen = CPDMA_BUF_DESC_OWNER;
-        CPSWCPDMARxHdrDescPtrWrite(VPTR_CPSW_CPDMA(dev->iomm_address.eth_mmio_cpsw_reg), ((struct descriptor *) dev->rx_ring_phys) + dev->rdh, 0);
+        CPSWCPDMARxCPWrite(VPTR_CPSW_CPDMA(dev->iomm_address.eth_mmio_cpsw_reg), c, (uintptr_t)  (((volatile struct descriptor *) chan->ring_phys) + (orig_rdh)));
+        chan->ring[orig_rdh].flags_pktlen = CPDMA_BUF_DESC_OWNER;
+        CPSWCPDMARxHdrDescPtrWrite(VPTR_CPSW_CPDMA(dev->iomm_address.eth_mmio_cpsw_reg), ((struct descriptor *) chan->ring_phys) + chan->rdh, c);
 
     }
 }
 
+static void complete_rx(struct eth_driver *eth_driver)
+{
+    struct beaglebone_eth_data *dev = (struct beaglebone_eth_data*)eth_driver->eth_data;
+
+    for (unsigned int i = 0; i < dev->num_rx_chans; i++) {
+        complete_rx_chan(eth_driver, i);
+    }
+}
+
 static void complete_tx(struct eth_driver *driver)
 {
     struct beaglebone_eth_data *dev = (struct beaglebone_eth_data*)driver->eth_data;
-    volatile u32_t cnt = 0xFFFF;
+    volatile uint32_t cnt = 0xFFFF;
 
     int orig_tdh = dev->tdh;
 
@@ -226,6 +248,7 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
 
     /* Ensure we have room */
     if (num > dev->tx_remain) {
+        ethif_stats_add(&dev->stats.tx_failed, 1);
         return ETHIF_TX_FAILED;
     }
 
@@ -255,6 +278,8 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
     dev->tx_lengths[dev->tdt] = num;
     dev->tdt = (dev->tdt + num) % dev->tx_size;
     dev->tx_remain -= num;
+    ethif_stats_tx(&dev->stats, num, len);
+    ethif_stats_hwm(&dev->stats.tx_ring_hwm, dev->tx_size - 2 - dev->tx_remain);
 
     THREAD_MEMORY_RELEASE();
 
@@ -283,11 +308,16 @@ static void handle_irq(struct eth_driver *driver, int irq)
 
     struct beaglebone_eth_data *eth_data = (struct beaglebone_eth_data*)driver->eth_data;
 
+    ethif_stats_add(&eth_data->stats.irqs, 1);
+    /* All RX channels share the one RX pulse interrupt of core 0. The end of
+     * interrupt write lets the (paced) pulse fire again */
     if (irq == SYS_INT_3PGSWRXINT0) {
         complete_rx(driver);
         fill_rx_bufs(driver);
+        CPSWCPDMAEndOfIntVectorWrite(VPTR_CPSW_CPDMA(eth_data->iomm_address.eth_mmio_cpsw_reg), CPSW_EOI_RX_PULSE);
     } else if (irq == SYS_INT_3PGSWTXINT0) {
         complete_tx(driver);
+        CPSWCPDMAEndOfIntVectorWrite(VPTR_CPSW_CPDMA(eth_data->iomm_address.eth_mmio_cpsw_reg), CPSW_EOI_TX_PULSE);
     } else {
         ZF_LOGE("Unrecognised interrupt number %d\n", irq);
     }
@@ -301,20 +331,42 @@ static void print_state(void)
 
 static void raw_poll(struct eth_driver *driver)
 {
+    struct beaglebone_eth_data *eth_data = (struct beaglebone_eth_data*)driver->eth_data;
+
+    ethif_stats_add(&eth_data->stats.polls, 1);
     complete_tx(driver);
     complete_rx(driver);
     fill_rx_bufs(driver);
 }
 
+static void get_stats(struct eth_driver *driver, ethif_stats_t *stats)
+{
+    struct beaglebone_eth_data *eth_data = (struct beaglebone_eth_data*)driver->eth_data;
+
+    ethif_stats_read(&eth_data->stats, stats);
+}
+
 static struct raw_iface_funcs iface_fns = {
     .raw_handleIRQ = handle_irq,
     .print_state = print_state,
     .low_level_init = low_level_init,
     .raw_tx = raw_tx,
-    .raw_poll = raw_poll
+    .raw_poll = raw_poll,
+    .get_stats = get_stats
 };
 
-int ethif_am335x_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *config)
+/* Interrupts per ms so that a ring is serviced before it is half full at the
+ * given packet rate, within what the pacing logic can be set to */
+static unsigned int pacing_imax(unsigned int pkts_per_ms, unsigned int ring_size)
+{
+    if (!pkts_per_ms) {
+        return 0;
+    }
+    unsigned int imax = DIV_ROUND_UP(pkts_per_ms, MAX(ring_size / 2, 1));
+    return MIN(MAX(imax, CPSW_IMAX_MIN), CPSW_IMAX_MAX);
+}
+
+int ethif_am335x_init_config(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *config)
 {
     uint8_t mac[LEN_MAC_ADDRESS];
     /* Number if tx and rx buffers is limited by the CPSW/CPPI buffer size */
@@ -326,9 +378,21 @@ int ethif_am335x_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *c
     struct beaglebone_eth_data *eth_data = NULL;
 
     int err;
-    struct EthVirtAddr *eth_addresses = (struct EthVirtAddr *) config;
+    ethif_am335x_config_t *eth_config = (ethif_am335x_config_t *) config;
+
+    unsigned int num_rx_chans = eth_config->num_rx_channels ? eth_config->num_rx_channels : 1;
+    if (num_rx_chans > AM335X_MAX_RX_CHANNELS) {
+        ZF_LOGE("%u RX channels requested, CPDMA only has %d", num_rx_chans, AM335X_MAX_RX_CHANNELS);
+        return -1;
+    }
+    for (int i = 0; i < AM335X_NUM_SLAVE_PORTS; i++) {
+        if (eth_config->port_rx_channel[i] >= num_rx_chans) {
+            ZF_LOGE("Port %d steered to RX channel %u out of %u", i + 1, eth_config->port_rx_channel[i], num_rx_chans);
+            return -1;
+        }
+    }
 
-    eth_data = (struct beaglebone_eth_data*)malloc(sizeof(struct beaglebone_eth_data));
+    eth_data = (struct beaglebone_eth_data*)calloc(1, sizeof(struct beaglebone_eth_data));
     if (eth_data == NULL) {
         ZF_LOGE("Failed to allocate eth data struct");
         return -1;
@@ -346,21 +410,33 @@ int ethif_am335x_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *c
         return -1;
     }
 
-    compile_time_assert("CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT  <= max_rx_cppi", CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT <= (SIZE_CPPI_RAM >> 1) / sizeof(struct descriptor));
     compile_time_assert("CONFIG_LIB_ETHDRIVER_TX_DESC_COUNT  <= max_tx_cppi", CONFIG_LIB_ETHDRIVER_TX_DESC_COUNT <= (SIZE_CPPI_RAM >> 1) / sizeof(struct descriptor));
 
-    /* Trim the number of buffers requested to the maximum count the hardware can support */
-    eth_data->rx_size = CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT;
-    eth_data->tx_size = CONFIG_LIB_ETHDRIVER_TX_DESC_COUNT;
+    /* Trim the number of buffers requested to the maximum count the hardware can support,
+     * the RX half of CPPI RAM is shared by all the RX channels */
+    unsigned int rx_size = MIN(CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT, max_rx_cppi / num_rx_chans);
+    if (rx_size < CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT) {
+        ZF_LOGW("Only %u RX descriptors per channel fit in CPPI RAM", rx_size);
+    }
+    eth_data->num_rx_chans = num_rx_chans;
+    for (unsigned int i = 0; i < num_rx_chans; i++) {
+        eth_data->rx_chan[i].size = rx_size;
+    }
+    eth_data->tx_size = MIN(CONFIG_LIB_ETHDRIVER_TX_DESC_COUNT, max_tx_cppi);
+    for (int i = 0; i < AM335X_NUM_SLAVE_PORTS; i++) {
+        eth_data->port_rx_chan[i] = eth_config->port_rx_channel[i];
+    }
+    eth_data->rx_imax = pacing_imax(eth_config->rx_pkts_per_ms, rx_size);
+    eth_data->tx_imax = pacing_imax(eth_config->tx_pkts_per_ms, eth_data->tx_size);
 
     eth_driver->eth_data = eth_data;
     eth_driver->dma_alignment = DMA_ALIGN;
     eth_driver->i_fn = iface_fns;
 
     /* Tell the driver the mapped virtual addresses of the CPSW device */
-    eth_data->iomm_address.eth_mmio_ctr_reg = eth_addresses->eth_mmio_ctr_reg;
-    eth_data->iomm_address.eth_mmio_prcm_reg = eth_addresses->eth_mmio_prcm_reg;
-    eth_data->iomm_address.eth_mmio_cpsw_reg = eth_addresses->eth_mmio_cpsw_reg;
+    eth_data->iomm_address.eth_mmio_ctr_reg = eth_config->eth_mmio_ctr_reg;
+    eth_data->iomm_address.eth_mmio_prcm_reg = eth_config->eth_mmio_prcm_reg;
+    eth_data->iomm_address.eth_mmio_cpsw_reg = eth_config->eth_mmio_cpsw_reg;
 
     err = initialize_desc_ring(eth_data, &io_ops.dma_manager);
     if (err) {
@@ -368,14 +444,14 @@ int ethif_am335x_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *c
         return -1;
     }
 
-    CPSWPinMuxSetup((uintptr_t) eth_addresses->eth_mmio_ctr_reg);
+    CPSWPinMuxSetup((uintptr_t) eth_config->eth_mmio_ctr_reg);
 
-    CPSWClkEnable((uintptr_t) eth_addresses->eth_mmio_prcm_reg);
+    CPSWClkEnable((uintptr_t) eth_config->eth_mmio_prcm_reg);
 
-    EVMPortMIIModeSelect((uintptr_t) eth_addresses->eth_mmio_ctr_reg);
+    EVMPortMIIModeSelect((uintptr_t) eth_config->eth_mmio_ctr_reg);
 
     /* Only need one port (port0) */
-    EVMMACAddrGet((uintptr_t) eth_addresses->eth_mmio_ctr_reg, 0, mac);
+    EVMMACAddrGet((uintptr_t) eth_config->eth_mmio_ctr_reg, 0, mac);
 
     /* set MAC hardware address */
     for (int temp = 0; temp < LEN_MAC_ADDRESS; temp++) {
@@ -397,3 +473,16 @@ int ethif_am335x_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *c
     /* done */
     return 0;
 }
+
+int ethif_am335x_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *config)
+{
+    struct EthVirtAddr *eth_addresses = (struct EthVirtAddr *) config;
+    ethif_am335x_config_t eth_config = {
+        .eth_mmio_ctr_reg = eth_addresses->eth_mmio_ctr_reg,
+        .eth_mmio_prcm_reg = eth_addresses->eth_mmio_prcm_reg,
+        .eth_mmio_cpsw_reg = eth_addresses->eth_mmio_cpsw_reg,
+        .num_rx_channels = 1,
+    };
+
+    return ethif_am335x_init_config(eth_driver, io_ops, &eth_config);
+}
@@ -380,6 +380,64 @@ unsigned int CPSWWrRGMIIStatusGet(unsigned int baseAddr, unsigned int statFlag)
     return (HWREG(baseAddr + CPSW_WR_RGMII_CTL) & statFlag);
 }
 
+/**
+ * \brief   Sets the interrupt pacing prescaler
+ *
+ * \param   baseAddr    Base address of the CPSW Wrapper Module
+ * \param   prescale    Number of CPSW main clock cycles in 4us
+ *
+ * \return  None
+ **/
+void CPSWWrPrescaleSet(unsigned int baseAddr, unsigned int prescale)
+{
+    HWREG(baseAddr + CPSW_WR_INT_CONTROL) &= ~CPSW_WR_INT_CONTROL_INT_PRESCALE;
+    HWREG(baseAddr + CPSW_WR_INT_CONTROL) |=
+        (prescale << CPSW_WR_INT_CONTROL_INT_PRESCALE_SHIFT)
+        & CPSW_WR_INT_CONTROL_INT_PRESCALE;
+}
+
+/**
+ * \brief   Enables interrupt pacing for a core, limiting the pulse
+ *          interrupts to at most intPerMilli per millisecond
+ *
+ * \param   baseAddr    Base address of the CPSW Wrapper Module
+ * \param   core        Core number
+ * \param   intPerMilli Interrupts per millisecond, 2 to 63
+ * \param   pacFlag     Interrupt to pace
+ *    'pacFlag' can take one of the below values. \n
+ *          CPSW_INT_PACING_Cn_RX_PULSE - RX pulse interrupt of core n \n
+ *          CPSW_INT_PACING_Cn_TX_PULSE - TX pulse interrupt of core n
+ *
+ * \return  None
+ **/
+void CPSWWrIntPacingEnable(unsigned int baseAddr, unsigned int core,
+                           unsigned int intPerMilli, unsigned int pacFlag)
+{
+    if (pacFlag & (CPSW_INT_PACING_C0_RX_PULSE | CPSW_INT_PACING_C1_RX_PULSE
+                   | CPSW_INT_PACING_C2_RX_PULSE)) {
+        HWREG(baseAddr + CPSW_WR_C_RX_IMAX(core)) =
+            intPerMilli & CPSW_WR_C0_RX_IMAX_C0_RX_IMAX;
+    } else {
+        HWREG(baseAddr + CPSW_WR_C_TX_IMAX(core)) =
+            intPerMilli & CPSW_WR_C0_TX_IMAX_C0_TX_IMAX;
+    }
+    HWREG(baseAddr + CPSW_WR_INT_CONTROL) |= pacFlag;
+}
+
+/**
+ * \brief   Disables interrupt pacing
+ *
+ * \param   baseAddr    Base address of the CPSW Wrapper Module
+ * \param   pacFlag     Interrupts to stop pacing, as for
+ *                      CPSWWrIntPacingEnable
+ *
+ * \return  None
+ **/
+void CPSWWrIntPacingDisable(unsigned int baseAddr, unsigned int pacFlag)
+{
+    HWREG(baseAddr + CPSW_WR_INT_CONTROL) &= ~pacFlag;
+}
+
 /**
  * \brief   Initializes the ALE. The ALE logic is reset and the ALE table
  *          entries are cleared.
@@ -651,6 +709,32 @@ void CPSWHostPortDualMacModeSet(unsigned int baseAddr)
         CPSW_PORT_P0_TX_IN_CTL_TX_IN_DUAL_MAC;
 }
 
+/**
+ * \brief   Selects the CPDMA RX channel for frames that a slave port
+ *          forwards to the host port
+ *
+ * \param   baseAddr      Base address of the CPSW Host Port Module registers
+ * \param   portNum       Slave port number, 1 or 2
+ * \param   channel       CPDMA RX channel, 0 to 7
+ *
+ * \return  None
+ *
+ **/
+void CPSWHostPortRxChMapSet(unsigned int baseAddr, unsigned int portNum,
+                            unsigned int channel)
+{
+    /* Four priorities per port, with a 3 bit channel in each nibble */
+    unsigned int shift = (portNum - 1) * 16;
+    unsigned int map = 0;
+    unsigned int pri;
+
+    for (pri = 0; pri < 4; pri++) {
+        map |= (channel & 0x7) << (shift + pri * 4);
+    }
+    HWREG(baseAddr + CPSW_PORT_CPDMA_RX_CH_MAP0) &= ~(0xFFFFu << shift);
+    HWREG(baseAddr + CPSW_PORT_CPDMA_RX_CH_MAP0) |= map;
+}
+
 /**
  * \brief   Configures Port VLAN
  *
@@ -1,9 +1,9 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
 
 /**
-*  \file lwiplib.h
+*  \file cpsw_config.h
 *
-*  \brief lwip abstraction layer related declarations
+*  \brief run time configuration of the CPSW ports and switch
 */
 /*
  * Copyright (c) 2001-2004 Swedish Institute of Computer Science.
@@ -40,31 +40,14 @@
 /* Copyright (C) 2010 Texas Instruments Incorporated - http://www.ti.com/
  * ALL RIGHTS RESERVED
  */
-#ifndef __LWIPLIB_H__
-#define __LWIPLIB_H__
+#ifndef __CPSW_CONFIG_H__
+#define __CPSW_CONFIG_H__
 
-#include <lwip/opt.h>
-
-/* Ensure that AUTOIP COOP option is configured correctly.*/
-#undef LWIP_DHCP_AUTOIP_COOP
-#define LWIP_DHCP_AUTOIP_COOP   ((LWIP_DHCP) && (LWIP_AUTOIP))
-
-#include <lwip/api.h>
-#include <lwip/netifapi.h>
-#include <lwip/tcp.h>
-#include <lwip/udp.h>
-#include <lwip/tcpip.h>
-#include <lwip/sockets.h>
-#include <lwip/mem.h>
-#include <lwip/stats.h>
+#include <stdint.h>
 
 /******************************************************************************
 **                            Macro Definitions
 ******************************************************************************/
-#define IPADDR_USE_STATIC                  (0)
-#define IPADDR_USE_DHCP                    (1)
-#define IPADDR_USE_AUTOIP                  (2)
-
 #ifndef LEN_MAC_ADDRESS
 #define LEN_MAC_ADDRESS                    (6)
 #endif
@@ -208,55 +191,55 @@ enum {
 
 #ifdef CPSW_SWITCH_CONFIG
 typedef struct cpsw_switch_param {
-    u32_t  port_num;
-    u32_t  port_mask;
-    u32_t  vid;        /* VLAN identifier */
-    u32_t  prio_port;  /* port priority 0 -7 */
-    u32_t  cfi_port;   /* port CFI  0 /1 */
-    u32_t  unreg_multi;    /* unreg multicast Egress Ports */
-    u32_t  reg_multi;  /* register multicast Egress ports */
-    u32_t  untag_port; /* Untag ports */
-    u8_t  addr[LEN_MAC_ADDRESS]; /* Ethernet Address */
-    u32_t  super;
-    u32_t  fwd_state;
-    u32_t  ucast_flags;
-    u32_t  ucast_type;
-    u32_t  blocked;
-    u32_t  secure;
-    u32_t  ageable;
-    u32_t  ale_tbl_index;    /* if 1 print ale table */
-    u32_t  vlan_aware;
-    u32_t  drop_packet;
-    u32_t  direction;  /* Tx -1 / Rx - 0 */
-    u32_t  addr_type;  /* Address type BroadMulti/Uni cast */
-    u32_t  limit;      /* multicast/broadcast limit */
-    u32_t  vlan_ingress_check;
-    u32_t  port_state;
-    u32_t  drop_untagged;
-    u32_t  enable;     /* 1-enable/0-Disable */
-    u32_t  unknown_vlan;
-    u32_t  mac_auth;
+    uint32_t  port_num;
+    uint32_t  port_mask;
+    uint32_t  vid;        /* VLAN identifier */
+    uint32_t  prio_port;  /* port priority 0 -7 */
+    uint32_t  cfi_port;   /* port CFI  0 /1 */
+    uint32_t  unreg_multi;    /* unreg multicast Egress Ports */
+    uint32_t  reg_multi;  /* register multicast Egress ports */
+    uint32_t  untag_port; /* Untag ports */
+    uint8_t  addr[LEN_MAC_ADDRESS]; /* Ethernet Address */
+    uint32_t  super;
+    uint32_t  fwd_state;
+    uint32_t  ucast_flags;
+    uint32_t  ucast_type;
+    uint32_t  blocked;
+    uint32_t  secure;
+    uint32_t  ageable;
+    uint32_t  ale_tbl_index;    /* if 1 print ale table */
+    uint32_t  vlan_aware;
+    uint32_t  drop_packet;
+    uint32_t  direction;  /* Tx -1 / Rx - 0 */
+    uint32_t  addr_type;  /* Address type BroadMulti/Uni cast */
+    uint32_t  limit;      /* multicast/broadcast limit */
+    uint32_t  vlan_ingress_check;
+    uint32_t  port_state;
+    uint32_t  drop_untagged;
+    uint32_t  enable;     /* 1-enable/0-Disable */
+    uint32_t  unknown_vlan;
+    uint32_t  mac_auth;
 } CPSW_SW_PARAM_IF;
 #endif
 
 typedef struct cpsw_phy_param {
-    u32_t  slv_port_num;
-    u32_t  autoneg;
-    u32_t  config;
-    u32_t  speed;
-    u32_t  duplex;
+    uint32_t  slv_port_num;
+    uint32_t  autoneg;
+    uint32_t  config;
+    uint32_t  speed;
+    uint32_t  duplex;
 } CPSW_PHY_PARAM_IF;
 
 typedef struct cpsw_config {
-    u32_t cmd;   /* API to be invoked by the kernel driver */
-    u32_t cpsw_inst;
+    uint32_t cmd;   /* API to be invoked by the kernel driver */
+    uint32_t cpsw_inst;
     struct cpsw_phy_param *phy_param;
 #ifdef CPSW_SWITCH_CONFIG
     struct cpsw_switch_param *switch_param;
-    u32_t  buf[MAX_ALE_ENTRIES][ALE_ENTRY_NUM_WORDS]; /* Buffer for Ale Dump */
-    u32_t  ale_entry[ALE_ENTRY_NUM_WORDS];
+    uint32_t  buf[MAX_ALE_ENTRIES][ALE_ENTRY_NUM_WORDS]; /* Buffer for Ale Dump */
+    uint32_t  ale_entry[ALE_ENTRY_NUM_WORDS];
 #endif
-    s32_t ret;   /* Return  Success/Failure */
+    int32_t ret;   /* Return  Success/Failure */
 } CPSW_CONF_IF;
 
-#endif /* __LWIPLIB_H__ */
+#endif /* __CPSW_CONFIG_H__ */
@@ -44,17 +44,7 @@
  * This file is dervied from the "ethernetif.c" skeleton Ethernet network
  * interface driver for lwIP.
  */
-#include "../lwiplib.h"
-#include <lwip/opt.h>
-#include <lwip/def.h>
-#include <lwip/mem.h>
-#include <lwip/pbuf.h>
-#include <lwip/sys.h>
-#include <lwip/stats.h>
-#include <lwip/snmp.h>
-#include <netif/etharp.h>
-#include <netif/ppp_oe.h>
-#include <lwip/err.h>
+#include "cpsw_config.h"
 #include "cpswif.h"
 #include <ethdrivers/helpers.h>
 #include <platsupport/io.h>
@@ -194,26 +184,26 @@ cpswif_inst_config(struct eth_driver *driver)
  * @param  cpswinst  The CPSW instance structure pointer
  *
  * @return index of the ALE entry which is free
- *         ERR_VAL if entry not found
+ *         -1 if entry not found
  */
-static err_t
+static int
 cpswif_ale_entry_match_free(struct cpswinst *cpswinst)
 {
-    u32_t ale_entry[ALE_ENTRY_NUM_WORDS];
-    s32_t idx;
+    uint32_t ale_entry[ALE_ENTRY_NUM_WORDS];
+    int32_t idx;
 
     /* Check which ALE entry is free starting from 0th entry */
     for (idx = 0; idx < MAX_ALE_ENTRIES; idx++) {
         CPSWALETableEntryGet(cpswinst->ale_base, idx, ale_entry);
 
         /* Break if the table entry is free */
-        if (((*(((u8_t *)ale_entry) + ENTRY_TYPE_IDX))
+        if (((*(((uint8_t *)ale_entry) + ENTRY_TYPE_IDX))
                 & ENTRY_TYPE) == ENTRY_FREE) {
             return idx;
         }
     }
 
-    return ERR_VAL;
+    return -1;
 }
 
 /**
@@ -225,24 +215,24 @@ cpswif_ale_entry_match_free(struct cpswinst *cpswinst)
  * @return None
  */
 static void
-cpswif_ale_unicastentry_set(struct cpswinst *cpswinst, u32_t port_num,
-                            u8_t *eth_addr)
+cpswif_ale_unicastentry_set(struct cpswinst *cpswinst, uint32_t port_num,
+                            uint8_t *eth_addr)
 {
-    volatile u32_t cnt;
-    volatile s32_t idx;
-    u32_t ale_entry[ALE_ENTRY_NUM_WORDS] = {0, 0, 0};
+    volatile uint32_t cnt;
+    volatile int32_t idx;
+    uint32_t ale_entry[ALE_ENTRY_NUM_WORDS] = {0, 0, 0};
 
-    for (cnt = 0; cnt < ETHARP_HWADDR_LEN; cnt++) {
-        *(((u8_t *)ale_entry) + cnt) = eth_addr[ETHARP_HWADDR_LEN - cnt - 1];
+    for (cnt = 0; cnt < LEN_MAC_ADDRESS; cnt++) {
+        *(((uint8_t *)ale_entry) + cnt) = eth_addr[LEN_MAC_ADDRESS - cnt - 1];
     }
 
-    *(((u8_t *)ale_entry) + ALE_UCAST_ENTRY_TYPE) = ALE_ENTRY_UCAST;
-    *(((u8_t *)ale_entry) + ALE_UCAST_ENTRY_DLR_PORT_BLK_SEC) =
+    *(((uint8_t *)ale_entry) + ALE_UCAST_ENTRY_TYPE) = ALE_ENTRY_UCAST;
+    *(((uint8_t *)ale_entry) + ALE_UCAST_ENTRY_DLR_PORT_BLK_SEC) =
         (port_num << ALE_UCAST_ENTRY_PORT_SHIFT);
 
     idx = cpswif_ale_entry_match_free(cpswinst);
 
-    if (idx < MAX_ALE_ENTRIES ) {
+    if (idx >= 0) {
         CPSWALETableEntrySet(cpswinst->ale_base, idx, ale_entry);
     }
 }
@@ -253,25 +243,24 @@ cpswif_ale_unicastentry_set(struct cpswinst *cpswinst, u32_t port_num,
  * @param portmask   The port mask for the port number
  * @param eth_addr   Ethernet Address
  *
- * @return index of the ALE entry added
- *         ERR_VAL if table entry is not free
+ * @return None
  */
 static void
-cpswif_ale_multicastentry_set(struct cpswinst *cpswinst, u32_t portmask,
-                              u8_t *eth_addr)
+cpswif_ale_multicastentry_set(struct cpswinst *cpswinst, uint32_t portmask,
+                              uint8_t *eth_addr)
 {
-    volatile u32_t cnt;
-    volatile s32_t idx;
-    u32_t ale_entry[ALE_ENTRY_NUM_WORDS] = {0, 0, 0};
+    volatile uint32_t cnt;
+    volatile int32_t idx;
+    uint32_t ale_entry[ALE_ENTRY_NUM_WORDS] = {0, 0, 0};
 
     idx = cpswif_ale_entry_match_free(cpswinst);
-    if (idx < MAX_ALE_ENTRIES ) {
-        for (cnt = 0; cnt < ETHARP_HWADDR_LEN; cnt++) {
-            *(((u8_t *)ale_entry) + cnt) = eth_addr[ETHARP_HWADDR_LEN - cnt - 1];
+    if (idx >= 0) {
+        for (cnt = 0; cnt < LEN_MAC_ADDRESS; cnt++) {
+            *(((uint8_t *)ale_entry) + cnt) = eth_addr[LEN_MAC_ADDRESS - cnt - 1];
         }
 
-        *(((u8_t *)ale_entry) + ALE_MCAST_ENTRY_TYPE_FWD_STATE) = ALE_ENTRY_MCAST;
-        *(((u8_t *)ale_entry) + ALE_MCAST_ENTRY_PORTMASK_SUP) |=
+        *(((uint8_t *)ale_entry) + ALE_MCAST_ENTRY_TYPE_FWD_STATE) = ALE_ENTRY_MCAST;
+        *(((uint8_t *)ale_entry) + ALE_MCAST_ENTRY_PORTMASK_SUP) |=
             (portmask << ALE_MCAST_ENTRY_PORTMASK_SHIFT);
 
         CPSWALETableEntrySet(cpswinst->ale_base, idx, ale_entry);
@@ -289,15 +278,15 @@ cpswif_ale_multicastentry_set(struct cpswinst *cpswinst, u32_t portmask,
  *                     SELECT_100_FULL - 100Base Full Duplex
  *                     SELECT_1000_HALF - 1000Base Half Duplex
  *                     SELECT_1000_FULL - 1000Base Full Duplex
- * @return ERR_OK      If link set up is successful
+ * @return 0           If link set up is successful
  *                     others if not successful
  */
-static err_t
-cpswif_phy_autoneg(struct cpswinst *cpswinst, u32_t port_num, u32_t adv)
+static int
+cpswif_phy_autoneg(struct cpswinst *cpswinst, uint32_t port_num, uint32_t adv)
 {
-    err_t linkstat = ERR_CONN;
-    u16_t adv_val = 0, partnr_ablty = 0, gbps_partnr_ablty = 0, gig_adv_val = 0;
-    u32_t aut_neg_cnt = 200, auto_stat, transfer_mode = 0;
+    int linkstat = -1;
+    uint16_t adv_val = 0, partnr_ablty = 0, gbps_partnr_ablty = 0, gig_adv_val = 0;
+    uint32_t aut_neg_cnt = 200, auto_stat, transfer_mode = 0;
 
     /* Check if ethernet PHY is present or not */
     if (0 == (MDIOPhyAliveStatusGet(cpswinst->mdio_base)
@@ -373,11 +362,11 @@ cpswif_phy_autoneg(struct cpswinst *cpswinst, u32_t port_num, u32_t adv)
         }
 
         if (0 != aut_neg_cnt) {
-            linkstat = ERR_OK;
+            linkstat = 0;
             LWIP_PRINTF("\n\rAuto-Negotiation Successful.");
         } else {
             LWIP_PRINTF("\n\rAuto-Negotiation Not Successful.");
-            return ERR_CONN;
+            return -1;
         }
 
         /* Get what the partner supports */
@@ -406,14 +395,14 @@ cpswif_phy_autoneg(struct cpswinst *cpswinst, u32_t port_num, u32_t adv)
         }
     } else {
         LWIP_PRINTF("\n\rAuto-Negotiation Not Successful.");
-        linkstat = ERR_CONN;
+        linkstat = -1;
     }
 
     /**
      * Set the Sliver with the negotiation results if autonegotiation
      * is successful
      */
-    if (linkstat == ERR_OK) {
+    if (linkstat == 0) {
         CPSWSlTransferModeSet(cpswinst->port[port_num - 1].sliver_base,
                               transfer_mode);
     }
@@ -446,16 +435,16 @@ cpswif_phy_autoneg(struct cpswinst *cpswinst, u32_t port_num, u32_t adv)
  * @param  duplex      Configuration for duplex
  *                     SELECT_HALF_DUPLEX - Half Duplex
  *                     SELECT_FULL_DUPLEX - Full Duplex
- * @return ERR_OK      If link set up is successful
+ * @return 0           If link set up is successful
  *                     others if not successful
  */
-static err_t
-cpswif_phy_forced(struct cpswinst *cpswinst, u32_t port_num, u32_t speed,
-                  u32_t duplex)
+static int
+cpswif_phy_forced(struct cpswinst *cpswinst, uint32_t port_num, uint32_t speed,
+                  uint32_t duplex)
 {
-    err_t linkstat = ERR_CONN;
-    u16_t speed_val = 0, duplex_val = 0;
-    u32_t frc_stat_cnt = 200, frc_stat = FALSE, transfer_mode = 0;
+    int linkstat = -1;
+    uint16_t speed_val = 0, duplex_val = 0;
+    uint32_t frc_stat_cnt = 200, frc_stat = FALSE, transfer_mode = 0;
 
     /* Check if ethernet PHY is present or not */
     if (0 == (MDIOPhyAliveStatusGet(cpswinst->mdio_base)
@@ -527,7 +516,7 @@ cpswif_phy_forced(struct cpswinst *cpswinst, u32_t port_num, u32_t speed,
         }
 
         if (0 != frc_stat_cnt) {
-            linkstat = ERR_OK;
+            linkstat = 0;
             LWIP_PRINTF("\n\rPhy Configuration Successful.");
             LWIP_PRINTF("\n\rPHY link verified for Port %d of Instance %d.",
                         port_num, 0);
@@ -535,7 +524,7 @@ cpswif_phy_forced(struct cpswinst *cpswinst, u32_t port_num, u32_t speed,
             LWIP_PRINTF("\n\rPhy Configuration Successful.");
             LWIP_PRINTF("\n\rPHY link connectivity failed for Port %d of Inst %d.",
                         port_num, 0);
-            return ERR_CONN;
+            return -1;
         }
 
         if (SELECT_SPEED_1000 == speed) {
@@ -560,7 +549,7 @@ cpswif_phy_forced(struct cpswinst *cpswinst, u32_t port_num, u32_t speed,
         LWIP_PRINTF("\n\rPhy Configuration Not Successful.");
         LWIP_PRINTF("\n\rPHY link connectivity failed for Port %d of Inst %d.",
                     port_num, 0);
-        linkstat = ERR_CONN;
+        linkstat = -1;
     }
 
     /**
@@ -579,16 +568,16 @@ cpswif_phy_forced(struct cpswinst *cpswinst, u32_t port_num, u32_t speed,
 * setup and set the CPSW with the result of autonegotiation.
 * @param  driver   ethernet driver data structure
 * @param  cpswportif  The cpsw port interface structure pointer
-* @return ERR_OK      If link set up is successful
+* @return 0           If link set up is successful
 *                     others if not successful
 */
-static err_t
-cpswif_autoneg_config(struct eth_driver *driver, u32_t inst_num, u32_t port_num)
+static int
+cpswif_autoneg_config(struct eth_driver *driver, uint32_t inst_num, uint32_t port_num)
 {
     struct cpswinst *cpswinst = ((struct beaglebone_eth_data*)driver->eth_data)->cpswinst;
-    err_t linkstat = ERR_CONN;
-    u16_t adv_val, partnr_ablty, gbps_partnr_ablty, gig_adv_val;
-    u32_t aut_neg_cnt = 200, auto_stat, transfer_mode = 0;
+    int linkstat = -1;
+    uint16_t adv_val, partnr_ablty, gbps_partnr_ablty, gig_adv_val;
+    uint32_t aut_neg_cnt = 200, auto_stat, transfer_mode = 0;
 
     /* We advertise for 10/100 Mbps both half and full duplex */
     adv_val = (PHY_100BTX | PHY_100BTX_FD | PHY_10BT | PHY_10BT_FD);
@@ -627,11 +616,11 @@ cpswif_autoneg_config(struct eth_driver *driver, u32_t inst_num, u32_t port_num)
         }
 
         if (0 != aut_neg_cnt) {
-            linkstat = ERR_OK;
+            linkstat = 0;
             LWIP_PRINTF("\n\rAuto-Negotiation Successful.");
         } else {
             LWIP_PRINTF("\n\rAuto-Negotiation Not Successful.");
-            return ERR_CONN;
+            return -1;
         }
 
         /* Get what the partner supports */
@@ -660,14 +649,14 @@ cpswif_autoneg_config(struct eth_driver *driver, u32_t inst_num, u32_t port_num)
         }
     } else {
         LWIP_PRINTF("\n\rAuto-Negotiation Not Successful.");
-        linkstat = ERR_CONN;
+        linkstat = -1;
     }
 
     /**
      * Set the Sliver with the negotiation results if autonegotiation
      * is successful
      */
-    if (linkstat == ERR_OK) {
+    if (linkstat == 0) {
         CPSWSlTransferModeSet(cpswinst->port[port_num - 1].sliver_base,
                               transfer_mode);
     }
@@ -681,14 +670,14 @@ cpswif_autoneg_config(struct eth_driver *driver, u32_t inst_num, u32_t port_num)
  * @param cpswif  The CPSW interface structure pointer
  * @param slv_port_num  The slave port number
  *
- * @return ERR_OK    if link configurations are successful
+ * @return 0         if link configurations are successful
  *                   an error status if failed
  */
-static err_t
-cpswif_phylink_config(struct eth_driver *driver, struct cpswportif * cpswif, u32_t slv_port_num)
+static int
+cpswif_phylink_config(struct eth_driver *driver, struct cpswportif * cpswif, uint32_t slv_port_num)
 {
     struct cpswinst *cpswinst = ((struct beaglebone_eth_data*)driver->eth_data)->cpswinst;
-    err_t err;
+    int err;
 
     /* Check if ethernet PHY is present or not */
     if (0 == (MDIOPhyAliveStatusGet(cpswinst->mdio_base)
@@ -696,7 +685,7 @@ cpswif_phylink_config(struct eth_driver *driver, struct cpswportif * cpswif, u32
         LWIP_PRINTF("\n\rNo PHY found at address %d for  Port %d of Instance %d.",
                     cpswinst->port[slv_port_num - 1].phy_addr, slv_port_num,
                     cpswif->inst_num);
-        return ERR_CONN;
+        return -1;
     }
 
     LWIP_PRINTF("\n\rPHY found at address %d for  Port %d of Instance %d.",
@@ -707,14 +696,14 @@ cpswif_phylink_config(struct eth_driver *driver, struct cpswportif * cpswif, u32
      * PHY is alive. So autonegotiate and get the speed and duplex
      * parameters, set it in the sliver
      */
-    err = (err_t)(cpswif_autoneg_config(driver, cpswif->inst_num, slv_port_num));
+    err = cpswif_autoneg_config(driver, cpswif->inst_num, slv_port_num);
 
     /* Check if PHY link is there or not */
     if (FALSE == ((PhyLinkStatusGet(cpswinst->mdio_base,
                                     cpswinst->port[slv_port_num - 1].phy_addr, 1000)))) {
         LWIP_PRINTF("\n\rPHY link connectivity failed for Port %d of Instance %d.",
                     slv_port_num, cpswif->inst_num);
-        return ERR_CONN;
+        return -1;
     }
 
     LWIP_PRINTF("\n\rPHY link verified for Port %d of Instance %d.",
@@ -729,10 +718,10 @@ cpswif_phylink_config(struct eth_driver *driver, struct cpswportif * cpswif, u32
  * Initializes the CPSW port
  * @param driver   ethernet driver data structure
  *
- * @return ERR_OK    if port initialization is successful
+ * @return 0         if port initialization is successful
  *                   an error status if failed
  */
-static err_t
+static int
 cpswif_port_init(struct eth_driver *driver)
 {
     struct beaglebone_eth_data *eth_data = (struct beaglebone_eth_data*)driver->eth_data;
@@ -758,7 +747,37 @@ cpswif_cpdma_init(struct eth_driver *driver)
 {
     struct beaglebone_eth_data *eth_data = (struct beaglebone_eth_data*)driver->eth_data;
     struct cpswinst *cpswinst = eth_data->cpswinst;
-    CPSWCPDMARxHdrDescPtrWrite(cpswinst->cpdma_base, ((struct descriptor *) eth_data->rx_ring_phys), 0);
+    for (unsigned int i = 0; i < eth_data->num_rx_chans; i++) {
+        CPSWCPDMARxHdrDescPtrWrite(cpswinst->cpdma_base, ((struct descriptor *) eth_data->rx_chan[i].ring_phys), i);
+    }
+}
+
+/**
+ * Steers the frames of each slave port to its RX channel and sets up
+ * interrupt pacing if a limit was configured.
+ *
+ * @param  driver   ethernet driver data structure
+ * @return None
+ */
+static void
+cpswif_wr_init(struct eth_driver *driver)
+{
+    struct beaglebone_eth_data *eth_data = (struct beaglebone_eth_data*)driver->eth_data;
+    struct cpswinst *cpswinst = eth_data->cpswinst;
+
+    /* The ALE forwards frames for us to the host port, which then picks
+     * the CPDMA channel from the priority map of the ingress port */
+    for (int i = 0; i < AM335X_NUM_SLAVE_PORTS; i++) {
+        CPSWHostPortRxChMapSet(cpswinst->host_port_base, i + 1, eth_data->port_rx_chan[i]);
+    }
+
+    CPSWWrPrescaleSet(cpswinst->wrpr_base, CPSW_PACING_PRESCALE_125MHZ);
+    if (eth_data->rx_imax) {
+        CPSWWrIntPacingEnable(cpswinst->wrpr_base, 0, eth_data->rx_imax, CPSW_INT_PACING_C0_RX_PULSE);
+    }
+    if (eth_data->tx_imax) {
+        CPSWWrIntPacingEnable(cpswinst->wrpr_base, 0, eth_data->tx_imax, CPSW_INT_PACING_C0_TX_PULSE);
+    }
 }
 
 /**
@@ -774,7 +793,7 @@ cpswif_inst_init(struct eth_driver *driver)
 
     struct beaglebone_eth_data *eth_data = (struct beaglebone_eth_data*)driver->eth_data;
     struct cpswportif *cpswif = (struct cpswportif*) eth_data->cpswPortIf;
-    u32_t inst_num = cpswif->inst_num;
+    uint32_t inst_num = cpswif->inst_num;
 
     struct cpswinst *cpswinst = eth_data->cpswinst;
 
@@ -804,18 +823,18 @@ cpswif_inst_init(struct eth_driver *driver)
     __atomic_thread_fence(__ATOMIC_ACQ_REL);
 
     /* For normal CPSW switch mode, set multicast entry. */
-    u8_t bcast_addr[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    uint8_t bcast_addr[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
     cpswif_ale_multicastentry_set(cpswinst,
                                   PORT_0_MASK | PORT_1_MASK | PORT_2_MASK,
                                   bcast_addr);
     cpswif_ale_unicastentry_set(cpswinst, 0,
-                                (u8_t *)(&(cpswif->eth_addr)));
+                                (uint8_t *)(&(cpswif->eth_addr)));
 
     /* Set the ethernet address for both the ports */
     CPSWPortSrcAddrSet(cpswinst->port[0].port_base,
-                       (u8_t *)(&(cpswif->eth_addr)));
+                       (uint8_t *)(&(cpswif->eth_addr)));
     CPSWPortSrcAddrSet(cpswinst->port[1].port_base,
-                       (u8_t *)(&(cpswif->eth_addr)));
+                       (uint8_t *)(&(cpswif->eth_addr)));
 
     /* Enable the statistics. Lets see in case we come across any issues */
     CPSWStatisticsEnable(cpswinst->ss_base);
@@ -823,6 +842,8 @@ cpswif_inst_init(struct eth_driver *driver)
     /* Initialize the buffer descriptors for CPDMA */
     cpswif_cpdma_init(driver);
 
+    cpswif_wr_init(driver);
+
     __atomic_thread_fence(__ATOMIC_ACQ_REL);
 
     /* Acknowledge receive and transmit interrupts for proper interrupt pulsing*/
@@ -833,12 +854,14 @@ cpswif_inst_init(struct eth_driver *driver)
     CPSWCPDMATxEnable(cpswinst->cpdma_base);
     CPSWCPDMARxEnable(cpswinst->cpdma_base);
 
-    /* Enable the interrupts for channel 0 and for control core 0 */
+    /* Enable the interrupts for TX channel 0, every RX channel and for control core 0 */
     CPSWCPDMATxIntEnable(cpswinst->cpdma_base, 0);
     CPSWWrCoreIntEnable(cpswinst->wrpr_base, 0, 0, CPSW_CORE_INT_TX_PULSE);
 
-    CPSWCPDMARxIntEnable(cpswinst->cpdma_base, 0);
-    CPSWWrCoreIntEnable(cpswinst->wrpr_base, 0, 0, CPSW_CORE_INT_RX_PULSE);
+    for (unsigned int i = 0; i < eth_data->num_rx_chans; i++) {
+        CPSWCPDMARxIntEnable(cpswinst->cpdma_base, i);
+        CPSWWrCoreIntEnable(cpswinst->wrpr_base, 0, i, CPSW_CORE_INT_RX_PULSE);
+    }
 
     __atomic_thread_fence(__ATOMIC_ACQ_REL);
 }
@@ -849,18 +872,18 @@ cpswif_inst_init(struct eth_driver *driver)
  * cpswif_port_init() to do low level initializations
  *
  * @param driver   ethernet driver data structure
- * @return ERR_OK   If the interface is initialized
- *                  any other err_t on error
+ * @return 0        If the interface is initialized
+ *                  -1 on error
  */
-err_t
+int
 cpswif_init(struct eth_driver *driver)
 {
-    static u32_t inst_init_flag = 0;
+    static uint32_t inst_init_flag = 0;
 
     struct beaglebone_eth_data *eth_data = (struct beaglebone_eth_data*)driver->eth_data;
 
     /* We only use one instance */
-    u32_t inst_num = 0;
+    uint32_t inst_num = 0;
 
     /**
      * Initialize an instance only once. Port initialization will be
@@ -872,23 +895,11 @@ cpswif_init(struct eth_driver *driver)
         inst_init_flag |= (1 << inst_num);
     }
 
-    if (cpswif_port_init(driver) != ERR_OK) {
-        return ERR_CONN;
+    if (cpswif_port_init(driver) != 0) {
+        return -1;
     }
 
-    return ERR_OK;
-}
-
-/**
- * Gets the netif status
- *
- * @param   netif   The netif whoes status to be checked
- * @return  The netif status
- */
-u32_t
-cpswif_netif_status(struct netif *netif)
-{
-    return ((u32_t)(netif_is_up(netif)));
+    return 0;
 }
 
 /**
@@ -900,8 +911,8 @@ cpswif_netif_status(struct netif *netif)
  *
  * @return  the link status
  */
-u32_t
-cpswif_link_status(struct eth_driver *driver, u32_t inst_num, u32_t slv_port_num)
+uint32_t
+cpswif_link_status(struct eth_driver *driver, uint32_t inst_num, uint32_t slv_port_num)
 {
     struct cpswinst *cpswinst = ((struct beaglebone_eth_data*)driver->eth_data)->cpswinst;
 
@@ -918,8 +929,8 @@ cpswif_link_status(struct eth_driver *driver, u32_t inst_num, u32_t slv_port_num
  *
  * @return  the status
  */
-static u32_t
-check_valid(u32_t value, u32_t min, u32_t max)
+static uint32_t
+check_valid(uint32_t value, uint32_t min, uint32_t max)
 {
     if ((min <= value) && (value <= max)) {
         return TRUE;
@@ -42,9 +42,10 @@
  * Copyright (c) 2010 Texas Instruments Incorporated
  *
  */
-#include <lwip/netif.h>
+#include <stdint.h>
 #include <platsupport/io.h>
 #include <ethdrivers/raw.h>
+#include <ethdrivers/am335x.h>
 
 #ifndef __CPSWIF_H__
 #define __CPSWIF_H__
@@ -152,12 +153,12 @@ struct EthVirtAddr {
  * Slave port information
  */
 struct cpswport {
-    u32_t port_base;
-    u32_t sliver_base;
-    u32_t phy_addr;
+    uint32_t port_base;
+    uint32_t sliver_base;
+    uint32_t phy_addr;
 
     /* The PHY is capable of GitaBit or Not */
-    u32_t phy_gbps;
+    uint32_t phy_gbps;
 } cpswport;
 
 /*****************************************************************************/
@@ -166,12 +167,12 @@ struct cpswport {
  */
 struct cpswportif {
     /* CPSW instance number */
-    u32_t inst_num;
+    uint32_t inst_num;
 
     /* CPSW port number */
-    u32_t port_num;
+    uint32_t port_num;
 
-    u8_t eth_addr[6];
+    uint8_t eth_addr[6];
 } cpswportif;
 
 /**
@@ -179,13 +180,13 @@ struct cpswportif {
  */
 struct cpswinst {
     /* Base addresses */
-    u32_t ss_base;
-    u32_t mdio_base;
-    u32_t wrpr_base;
-    u32_t ale_base;
-    u32_t cpdma_base;
-    u32_t cppi_ram_base;
-    u32_t host_port_base;
+    uint32_t ss_base;
+    uint32_t mdio_base;
+    uint32_t wrpr_base;
+    uint32_t ale_base;
+    uint32_t cpdma_base;
+    uint32_t cppi_ram_base;
+    uint32_t host_port_base;
 
     /* Slave port information */
     struct cpswport port[MAX_SLAVEPORT_PER_INST];
@@ -199,28 +200,40 @@ struct descriptor {
     volatile uint32_t flags_pktlen;
 };
 
+/* Receive ring of one CPDMA RX channel */
+struct cpsw_rx_chan {
+    uintptr_t ring_phys;
+    volatile struct descriptor *ring;
+    unsigned int size;
+    void **cookies;
+    unsigned int remain;
+    /* track where the head and tail of the queue are for
+     * enqueueing buffers / checking for completions */
+    unsigned int rdt, rdh;
+};
+
 struct beaglebone_eth_data {
     struct cpswportif *cpswPortIf;
     struct cpswinst   *cpswinst;
     uintptr_t tx_ring_phys;
-    uintptr_t rx_ring_phys;
     volatile struct descriptor *tx_ring;
-    volatile struct descriptor *rx_ring;
-    unsigned int rx_size;
     unsigned int tx_size;
-    void **rx_cookies;
-    unsigned int rx_remain;
     unsigned int tx_remain;
     void **tx_cookies;
     unsigned int *tx_lengths;
-    /* track where the head and tail of the queues are for
-     * enqueueing buffers / checking for completions */
-    unsigned int rdt, rdh, tdt, tdh;
+    unsigned int tdt, tdh;
+    unsigned int num_rx_chans;
+    struct cpsw_rx_chan rx_chan[AM335X_MAX_RX_CHANNELS];
+    /* RX channel of each slave port */
+    unsigned int port_rx_chan[AM335X_NUM_SLAVE_PORTS];
+    /* interrupts per ms for pacing, 0 if not paced */
+    unsigned int rx_imax;
+    unsigned int tx_imax;
     struct EthVirtAddr iomm_address;
+    ethif_stats_t stats;
 };
 
-extern u32_t cpswif_netif_status(struct netif *netif);
-extern u32_t cpswif_link_status(struct eth_driver *driver, u32_t inst_num, u32_t slv_port_num);
-extern err_t cpswif_init(struct eth_driver *driver);
+extern uint32_t cpswif_link_status(struct eth_driver *driver, uint32_t inst_num, uint32_t slv_port_num);
+extern int cpswif_init(struct eth_driver *driver);
 
 #endif /* _CPSWIF_H__ */
@@ -15,6 +15,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <utils/util.h>
+#include <utils/time.h>
 
 #ifdef CONFIG_PLAT_IMX8MQ_EVK
 #define CCM_PADDR 0x30380000
@@ -24,6 +26,14 @@
 #define ENET_FREQ  125000000UL
 #define MDC_FREQ    20000000UL /* must be less than 2.5MHz */
 
+/* Clock of the 1588 timer */
+#ifdef CONFIG_PLAT_IMX8MQ_EVK
+#define ENET_PTP_FREQ  20000000UL /* ENET_TIMER_CLK_ROOT as set up in enet_init */
+#else
+#define ENET_PTP_FREQ  ENET_FREQ
+#endif
+#define ENET_PTP_INC   (NS_IN_S / ENET_PTP_FREQ)
+
 struct mib_regs {
     /* NOTE: Counter not implemented because it is not applicable (read 0 always).*/
     uint32_t rmon_t_drop;        /* 00 Register Count of frames not counted correctly */
@@ -217,6 +227,12 @@ static inline enet_regs_t *enet_get_regs(struct enet *enet)
 
 /* Receive Accelerator Function Configuration */
 #define RACC_LINEDIS  BIT(6) /* Discard frames with MAC layer errors */
+#define RACC_PRODIS   BIT(2) /* Discard frames with wrong protocol checksum */
+#define RACC_IPDIS    BIT(1) /* Discard frames with wrong IPv4 header checksum */
+
+/* Transmit Accelerator Function Configuration */
+#define TACC_PROCHK   BIT(4) /* Insert protocol checksum if requested in the descriptor */
+#define TACC_IPCHK    BIT(3) /* Insert IPv4 header checksum if requested in the descriptor */
 
 /* Transmit FIFO watermark */
 #define TFWR_STRFWD   BIT( 8) /* Enables store and forward */
@@ -226,6 +242,16 @@ static inline enet_regs_t *enet_get_regs(struct enet *enet)
 #define MIBC_IDLE     BIT(30) /* MIB currently updating a counter */
 #define MIBC_CLEAR    BIT(29) /* Clear all counters */
 
+/* 1588 timer control */
+#define ATCR_CAPTURE  BIT(11) /* Capture the timer value into ATVR */
+#define ATCR_RESTART  BIT( 9) /* Reset the timer to zero */
+#define ATCR_PEREN    BIT( 4) /* Reset the timer on the periodic event */
+#define ATCR_EN       BIT( 0) /* Enable the timer */
+
+/* 1588 timer increment */
+#define ATINC_INC(x)      ((x) & 0x7f)        /* ns per timer clock */
+#define ATINC_INC_CORR(x) (((x) & 0x7f) << 8) /* ns per clock when correcting */
+
 /* RX descriptor active */
 #define RDAR_RDAR     BIT(24) /* RX descriptor active */
 
@@ -529,6 +555,58 @@ void enet_crc_strip_disable(struct enet *enet)
     regs->rcr &= ~RCR_CRCSTRIP;
 }
 
+void enet_csum_offload_enable(struct enet *enet)
+{
+    enet_regs_t *regs = enet_get_regs(enet);
+    /* Checksum insertion needs store and forward, which enet_init sets up */
+    assert(regs->tfwr & TFWR_STRFWD);
+    regs->tacc |= TACC_IPCHK | TACC_PROCHK;
+    regs->racc |= RACC_IPDIS | RACC_PRODIS;
+}
+
+uint32_t enet_ptp_enable(struct enet *enet)
+{
+    enet_regs_t *regs = enet_get_regs(enet);
+    /* Count nanoseconds and wrap every second, raising NETIRQ_TS_TIMER */
+    regs->atinc = ATINC_INC(ENET_PTP_INC);
+    regs->atcor = 0;
+    regs->atper = NS_IN_S;
+    regs->atcr = ATCR_RESTART;
+    regs->atcr = ATCR_EN | ATCR_PEREN;
+    return ENET_PTP_INC;
+}
+
+uint32_t enet_ptp_read(struct enet *enet)
+{
+    enet_regs_t *regs = enet_get_regs(enet);
+    regs->atcr |= ATCR_CAPTURE;
+    /* The captured value takes a few timer clocks to reach ATVR */
+    udelay(1);
+    return regs->atvr;
+}
+
+void enet_ptp_write(struct enet *enet, uint32_t ns)
+{
+    enet_get_regs(enet)->atvr = ns;
+}
+
+void enet_ptp_adj_freq(struct enet *enet, int32_t ppb)
+{
+    enet_regs_t *regs = enet_get_regs(enet);
+    uint32_t inc = ENET_PTP_INC;
+    if (ppb == 0) {
+        regs->atcor = 0;
+        regs->atinc = ATINC_INC(inc);
+        return;
+    }
+    /* Every 'period' timer clocks add one nanosecond more or less than
+     * usual, which is ppb nanoseconds per second */
+    uint32_t abs_ppb = ppb < 0 ? -(uint32_t)ppb : ppb;
+    uint32_t period = MAX(ENET_PTP_FREQ / abs_ppb, 1);
+    regs->atcor = period;
+    regs->atinc = ATINC_INC(inc) | ATINC_INC_CORR(ppb < 0 ? inc - 1 : inc + 1);
+}
+
 struct enet *enet_init(void *mapped_peripheral, uintptr_t tx_phys,
                        uintptr_t rx_phys, size_t rx_bufsize, uint64_t mac,
                        ps_io_ops_t *io_ops)
@@ -544,7 +622,8 @@ struct enet *enet_init(void *mapped_peripheral, uintptr_t tx_phys,
     /* Perform reset */
     regs->ecr = ECR_RESET;
     while (regs->ecr & ECR_RESET);
-    regs->ecr |= ECR_DBSWP;
+    /* Little endian, enhanced (32 byte) buffer descriptors */
+    regs->ecr |= ECR_DBSWP | ECR_EN1588;
 
     /* Clear and mask interrupts */
     regs->eimr = 0x00000000;
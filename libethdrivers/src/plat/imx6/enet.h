@@ -76,3 +76,14 @@ void enet_prom_enable(struct enet  *enet);
 void enet_prom_disable(struct enet *enet);
 void enet_crc_strip_enable(struct enet *enet);
 void enet_crc_strip_disable(struct enet *enet);
+/* Insert checksums as requested by the TX descriptors, drop RX frames with bad checksums */
+void enet_csum_offload_enable(struct enet *enet);
+
+/* Start the 1588 timer. It counts nanoseconds and wraps to zero every
+ * second, signalled by NETIRQ_TS_TIMER. Returns nanoseconds per timer clock */
+uint32_t enet_ptp_enable(struct enet *enet);
+/* Nanoseconds within the current second */
+uint32_t enet_ptp_read(struct enet *enet);
+void enet_ptp_write(struct enet *enet, uint32_t ns);
+/* Run the timer ppb parts per billion faster (or slower if negative) */
+void enet_ptp_adj_freq(struct enet *enet, int32_t ppb);
@@ -12,6 +12,9 @@
 #include <ethdrivers/imx6.h>
 #include <ethdrivers/raw.h>
 #include <ethdrivers/helpers.h>
+#include <ethdrivers/ring.h>
+#include <ethdrivers/trace.h>
+#include <ethdrivers/ptp.h>
 #include <ethdrivers/plat/eth_plat.h>
 #include <string.h>
 #include <utils/util.h>
@@ -23,7 +26,7 @@
 #include "uboot/micrel.h"
 #include "unimplemented.h"
 
-#define IRQ_MASK    (NETIRQ_RXF | NETIRQ_TXF | NETIRQ_EBERR)
+#define IRQ_MASK    (NETIRQ_RXF | NETIRQ_TXF | NETIRQ_EBERR | NETIRQ_TS_TIMER)
 #define BUF_SIZE    MAX_PKT_SIZE
 #define DMA_ALIGN   32
 
@@ -39,16 +42,19 @@ struct descriptor {
 #error Could not determine endianess
 #endif
     uint32_t phys;
+    /* enhanced descriptor part, enabled by ECR_EN1588 */
+    uint32_t esc;
+    uint32_t prot;
+    uint32_t bdu;
+    uint32_t ts;
+    uint16_t res[4];
 };
 
 typedef struct {
     unsigned int cnt;
-    unsigned int remain;
-    unsigned int tail;
-    unsigned int head;
     volatile struct descriptor *descr;
     uintptr_t phys;
-    void **cookies; /* Array with tx/tx size elements of type 'void *' */
+    eth_ring_t slots;
 } ring_ctx_t;
 
 
@@ -61,7 +67,12 @@ typedef struct {
     struct phy_device *phy;
     ring_ctx_t tx;
     ring_ctx_t rx;
-    unsigned int *tx_lengths;
+    /* time each packet was queued, NULL unless tracing */
+    uint64_t *tx_stamps;
+    ethif_stats_t stats;
+    /* The 1588 timer only holds nanoseconds, seconds are counted here */
+    ethif_ptp_clock_t ptp;
+    uint64_t ptp_sec;
 } imx6_eth_driver_t;
 
 /* Receive descriptor status */
@@ -82,6 +93,13 @@ typedef struct {
 #define RXD_ERROR    (RXD_BADLEN  | RXD_BADALIGN | RXD_CRCERR |\
                       RXD_OVERRUN | RXD_TRUNC)
 
+/* Receive enhanced descriptor status */
+#define RXD_EXT_INT   BIT(23) /* Generate RXB/RXF interrupts */
+#define RXD_EXT_ICE   BIT( 5) /* IP header checksum error */
+#define RXD_EXT_PCR   BIT( 4) /* Protocol checksum error */
+#define RXD_EXT_IPV6  BIT( 1) /* Frame is IPv6 */
+#define RXD_EXT_FRAG  BIT( 0) /* Frame is an IPv4 fragment */
+
 /* Transmit descriptor status */
 #define TXD_READY     BIT(15) /* buffer in use waiting to be transmitted */
 #define TXD_OWN0      BIT(14) /* Receive software ownership. R/W by user */
@@ -91,6 +109,12 @@ typedef struct {
 #define TXD_ADDCRC    BIT(10) /* Append a CRC to the end of the frame */
 #define TXD_ADDBADCRC BIT( 9) /* Append a bad CRC to the end of the frame */
 
+/* Transmit enhanced descriptor control */
+#define TXD_EXT_INT   BIT(30) /* Generate TXB/TXF interrupts */
+#define TXD_EXT_TS    BIT(29) /* Timestamp the frame */
+#define TXD_EXT_PINS  BIT(28) /* Insert protocol specific checksum */
+#define TXD_EXT_IINS  BIT(27) /* Insert IP header checksum */
+
 static imx6_eth_driver_t *imx6_eth_driver(struct eth_driver *driver)
 {
     assert(driver);
@@ -145,11 +169,14 @@ static void update_ring_slot(
     unsigned int idx,
     uintptr_t phys,
     uint16_t len,
-    uint16_t stat)
+    uint16_t stat,
+    uint32_t esc)
 {
     volatile struct descriptor *d = &(ring->descr[idx]);
     d->phys = phys;
     d->len = len;
+    d->esc = esc;
+    d->bdu = 0;
 
     /* Ensure all writes to the descriptor complete, before we set the flags
      * that makes hardware aware of this slot.
@@ -159,51 +186,40 @@ static void update_ring_slot(
     d->stat = stat;
 }
 
+static void write_rx_desc(struct eth_driver *driver, unsigned int idx, uintptr_t phys)
+{
+    imx6_eth_driver_t *dev = imx6_eth_driver(driver);
+    uint16_t stat = RXD_EMPTY;
+    if (idx == dev->rx.cnt - 1) {
+        stat |= RXD_WRAP;
+    }
+    update_ring_slot(&dev->rx, idx, phys, 0, stat, RXD_EXT_INT);
+}
+
 static void fill_rx_bufs(imx6_eth_driver_t *dev)
 {
     assert(dev);
 
     ring_ctx_t *ring = &(dev->rx);
 
-    void *cb_cookie = dev->eth_drv.cb_cookie;
-    ethif_raw_allocate_rx_buf cb_alloc = dev->eth_drv.i_cb.allocate_rx_buf;
-    if (!cb_alloc) {
+    if (!dev->eth_drv.i_cb.allocate_rx_buf) {
         /* The function may not be set up (yet), in this case we can't do
          * anything. If lwip is used, this can be either lwip_allocate_rx_buf()
          * or lwip_pbuf_allocate_rx_buf() from src/lwip.c
          */
         ZF_LOGW("callback allocate_rx_buf not set, can't allocate %d buffers",
-                ring->remain);
+                ring->slots.remain);
     } else {
         __sync_synchronize();
-        while (ring->remain > 0) {
-            /* request a buffer */
-            void *cookie = NULL;
-            uintptr_t phys = cb_alloc(cb_cookie, BUF_SIZE, &cookie);
-            if (!phys) {
-                /* There are no buffers left. This can happen if the pool is too
-                 * small because CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS
-                 * is less than CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT.
-                 */
-                break;
-            }
-            uint16_t stat = RXD_EMPTY;
-            int idx = ring->tail;
-            int new_tail = idx + 1;
-            if (new_tail == ring->cnt) {
-                new_tail = 0;
-                stat |= RXD_WRAP;
-            }
-            ring->cookies[idx] = cookie;
-            update_ring_slot(ring, idx, phys, 0, stat);
-            ring->tail = new_tail;
-            /* There is a race condition if add/remove is not synchronized. */
-            ring->remain--;
-        }
+        /* Running out of buffers can happen if the pool is too small because
+         * CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS is less than
+         * CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT, it is counted in rx_alloc_failed.
+         */
+        eth_ring_refill(&ring->slots, &dev->eth_drv, BUF_SIZE, &dev->stats, write_rx_desc);
         __sync_synchronize();
     }
 
-    if (ring->tail != ring->head) {
+    if (eth_ring_used(&ring->slots)) {
         struct enet *enet = dev->enet;
         assert(enet);
         if (!enet_rx_enabled(enet)) {
@@ -235,35 +251,14 @@ static void free_desc_ring(imx6_eth_driver_t *dev)
         dev->tx.descr = NULL;
     }
 
-    ps_malloc_ops_t *malloc_ops = &(dev->eth_drv.io_ops.malloc_ops);
-    assert(malloc_ops);
-
-    if (dev->rx.cookies) {
-        ps_free(
-            malloc_ops,
-            sizeof(void *) * dev->rx.cnt,
-            dev->rx.cookies);
-        dev->rx.cookies = NULL;
-    }
+    eth_ring_destroy(&dev->rx.slots);
+    eth_ring_destroy(&dev->tx.slots);
 
-    if (dev->tx.cookies) {
-        ps_free(
-            malloc_ops,
-            sizeof(void *) * dev->tx.cnt,
-            dev->tx.cookies);
-        dev->tx.cookies = NULL;
-    }
-
-    if (dev->tx_lengths) {
-        ps_free(
-            malloc_ops,
-            sizeof(void *) * dev->tx.cnt,
-            dev->tx_lengths);
-        dev->tx_lengths = NULL;
-    }
+    ethif_trace_free_stamps(dev->tx_stamps);
+    dev->tx_stamps = NULL;
 }
 
-static int setup_desc_ring(imx6_eth_driver_t *dev, ring_ctx_t *ring)
+static int setup_desc_ring(imx6_eth_driver_t *dev, ring_ctx_t *ring, bool frames)
 {
     assert(dev);
     assert(ring);
@@ -300,25 +295,11 @@ static int setup_desc_ring(imx6_eth_driver_t *dev, ring_ctx_t *ring)
 
     assert(ring->cnt >= 2);
     ring->descr[ring->cnt - 1].stat = TXD_WRAP;
-    /* Remaining needs to be 2 less than size as we cannot actually enqueue
-     * size many descriptors, since then the head and tail pointers would be
-     * equal, indicating empty.
+    /* Keep 2 descriptors back as we cannot actually enqueue size many
+     * descriptors, since then the head and tail pointers would be equal,
+     * indicating empty.
      */
-    ring->remain = ring->cnt - 2;
-
-    ring->tail = 0;
-    ring->head = 0;
-
-    /* allocate and zero memory for cookies */
-    ps_malloc_ops_t *malloc_ops = &(dev->eth_drv.io_ops.malloc_ops);
-    assert(malloc_ops);
-    int ret = ps_calloc(
-                  malloc_ops,
-                  ring->cnt,
-                  sizeof(void *),
-                  (void **) &ring->cookies);
-    if (ret) {
-        ZF_LOGE("Failed to malloc, code %d", ret);
+    if (eth_ring_init(&ring->slots, ring->cnt, 2, frames)) {
         return -1;
     }
 
@@ -328,25 +309,109 @@ static int setup_desc_ring(imx6_eth_driver_t *dev, ring_ctx_t *ring)
     return 0;
 }
 
-static void complete_rx(imx6_eth_driver_t *dev)
+/* Account for a pending wrap of the 1588 timer, returns true if there was one */
+static bool ptp_check_wrap(imx6_eth_driver_t *dev)
+{
+    if (enet_clr_events(dev->enet, NETIRQ_TS_TIMER)) {
+        dev->ptp_sec++;
+        return true;
+    }
+    return false;
+}
+
+static uint64_t ptp_now(imx6_eth_driver_t *dev)
+{
+    uint32_t ns = enet_ptp_read(dev->enet);
+    uint64_t sec = dev->ptp_sec;
+    /* If the timer wrapped after it was read, the reading belongs to the
+     * previous second. Readings just after a wrap are small, just before
+     * one they are close to a second. */
+    if (ptp_check_wrap(dev)) {
+        sec = (ns < NS_IN_S / 2) ? dev->ptp_sec : sec;
+    }
+    return sec * NS_IN_S + ns;
+}
+
+static int ptp_get_time(void *data, uint64_t *ns)
+{
+    *ns = ptp_now(data);
+    return 0;
+}
+
+static int ptp_set_time(void *data, uint64_t ns)
+{
+    imx6_eth_driver_t *dev = data;
+    enet_ptp_write(dev->enet, ns % NS_IN_S);
+    enet_clr_events(dev->enet, NETIRQ_TS_TIMER);
+    dev->ptp_sec = ns / NS_IN_S;
+    return 0;
+}
+
+static int ptp_adj_time(void *data, int64_t delta)
+{
+    return ptp_set_time(data, ptp_now(data) + delta);
+}
+
+static int ptp_adj_freq(void *data, int32_t ppb)
+{
+    imx6_eth_driver_t *dev = data;
+    enet_ptp_adj_freq(dev->enet, ppb);
+    return 0;
+}
+
+/* Full time of a descriptor timestamp. 'now' caches the current time across
+ * a completion pass, 0 if not read yet, so the clock is read at most once
+ * per pass. */
+static uint64_t ptp_extend(imx6_eth_driver_t *dev, uint32_t ts, uint64_t *now)
+{
+    if (!*now) {
+        *now = ptp_now(dev);
+    }
+    return ethif_ptp_extend_ns(*now, ts);
+}
+
+static struct ethif_ptp_clock *get_ptp_clock(struct eth_driver *driver)
+{
+    assert(driver);
+
+    imx6_eth_driver_t *dev = imx6_eth_driver(driver);
+    assert(dev);
+
+    return &dev->ptp;
+}
+
+static uint32_t rx_csum_flags(uint32_t esc)
+{
+    if (esc & (RXD_EXT_ICE | RXD_EXT_PCR)) {
+        return ETHIF_RX_CSUM_BAD;
+    }
+    if (esc & (RXD_EXT_IPV6 | RXD_EXT_FRAG)) {
+        /* the accelerator only verifies unfragmented IPv4 */
+        return 0;
+    }
+    return ETHIF_RX_CSUM_IP_OK | ETHIF_RX_CSUM_L4_OK;
+}
+
+/* 'entry' is when the interrupt or poll that found the packets began */
+static void complete_rx(imx6_eth_driver_t *dev, uint64_t entry)
 {
     assert(dev);
 
-    void *cb_cookie = dev->eth_drv.cb_cookie;
-    ethif_raw_rx_complete cb_complete = dev->eth_drv.i_cb.rx_complete;
-    assert(cb_complete);
+    assert(dev->eth_drv.i_cb.rx_complete);
 
     ring_ctx_t *ring = &(dev->rx);
-    unsigned int head = ring->head;
+    eth_ring_t *slots = &ring->slots;
+    uint64_t now = 0;
+    uint64_t now_stamp = 0;
 
     /* Release all descriptors that have data. */
-    while (head != ring->tail) {
+    while (eth_ring_used(slots)) {
 
         /* The NIC hardware can modify the descriptor any time, 'volatile'
          * prevents the compiler's optimizer from caching values and enforces
          * every access happen as stated in the code.
          */
-        volatile struct descriptor *d = &(ring->descr[head]);
+        volatile struct descriptor *d = &(ring->descr[slots->head]);
 
         /* If the slot is still marked as empty we are done. */
         if (d->stat & RXD_EMPTY) {
@@ -357,19 +422,32 @@ static void complete_rx(imx6_eth_driver_t *dev)
             break;
         }
 
-        void *cookie = ring->cookies[head];
-        /* Go to next buffer, handle roll-over. */
-        if (++head == ring->cnt) {
-            head = 0;
-        }
-        ring->head = head;
-
         /* There is a race condition here if add/remove is not synchronized. */
-        ring->remain++;
+        void *cookie = eth_ring_reap(slots);
 
         /* Tell the driver it can return the DMA buffer to the pool. */
         unsigned int len = d->len;
-        cb_complete(cb_cookie, 1, &cookie, &len);
+        ethif_rx_meta_t meta = {
+            .flags = rx_csum_flags(d->esc) | ETHIF_RX_TIMESTAMP,
+            .timestamp = ptp_extend(dev, d->ts, &now)
+        };
+        if (!now_stamp) {
+            /* the PTP clock was read for the first packet just now */
+            now_stamp = ethif_trace_now();
+        }
+        /* the packet arrived as long before the PTP clock was read as its
+         * timestamp is old. A timestamp ahead of the clock means it was set
+         * back since, then the start of the pass has to do */
+        uint64_t start = entry;
+        uint64_t age;
+        if ((meta.timestamp <= now) && ethif_trace_ticks_from_ns(now - meta.timestamp, &age)) {
+            start = now_stamp - age;
+        }
+        ethif_stats_rx(&dev->stats, 1, &len);
+        ethif_trace_record(ETHIF_TRACE_RX_DELIVER, start);
+        uint64_t cb_start = ethif_trace_now();
+        ethif_rx_complete(&dev->eth_drv, 1, &cookie, &len, &meta);
+        ethif_trace_record(ETHIF_TRACE_RX_CALLBACK, cb_start);
     }
 }
 
@@ -377,66 +455,49 @@ static void complete_tx(imx6_eth_driver_t *dev)
 {
     assert(dev);
 
-    void *cb_cookie = dev->eth_drv.cb_cookie;
-    ethif_raw_tx_complete cb_complete = dev->eth_drv.i_cb.tx_complete;
-    assert(cb_complete);
+    assert(dev->eth_drv.i_cb.tx_complete);
 
-    unsigned int cnt_org;
-    void *cookie;
     ring_ctx_t *ring = &(dev->tx);
-    unsigned int head = ring->head;
-    unsigned int cnt = 0;
-
-    while (head != ring->tail) {
-
-        if (0 == cnt) {
-            cnt = dev->tx_lengths[head];
-            if ((0 == cnt) || (cnt > dev->tx.cnt)) {
-                /* We are not supposed to read 0 here. */
-                ZF_LOGE("complete_tx with cnt=%u at head %u", cnt, head);
-                return;
-            }
-            cnt_org = cnt;
-            cookie = ring->cookies[head];
+    eth_ring_t *slots = &ring->slots;
+    uint64_t now = 0;
+
+    while (eth_ring_used(slots)) {
+        unsigned int first = slots->head;
+        unsigned int cnt = eth_ring_frame_len(slots, first);
+        if ((0 == cnt) || (cnt > eth_ring_used(slots))) {
+            /* There is some kind of overflow or data corruption. The number
+             * of tx descriptors holding data can't exceed the space in the
+             * ring.
+             */
+            ZF_LOGE("complete_tx with cnt=%u at head %u", cnt, first);
+            assert(0);
+            return;
         }
 
         /* The NIC hardware can modify the descriptor any time, 'volatile'
          * prevents the compiler's optimizer from caching values and enforces
          * every access happens as stated in the code.
          */
-        volatile struct descriptor *d = &(ring->descr[head]);
-
-        /* If this buffer was not sent, we can't release any buffer. */
-        if (d->stat & TXD_READY) {
-            assert(dev->enet);
-            if (!enet_tx_enabled(dev->enet)) {
-                enet_tx_enable(dev->enet);
+        volatile struct descriptor *d = NULL;
+        for (unsigned int i = 0; i < cnt; i++) {
+            d = &(ring->descr[eth_ring_wrap(slots, first + i)]);
+            /* If this buffer was not sent, we can't release any buffer. */
+            if (d->stat & TXD_READY) {
+                assert(dev->enet);
+                if (!enet_tx_enabled(dev->enet)) {
+                    enet_tx_enable(dev->enet);
+                }
+                return;
             }
-            return;
         }
 
-        /* Go to next buffer, handle roll-over. */
-        if (++head == dev->tx.cnt) {
-            head = 0;
-        }
-
-        if (0 == --cnt) {
-            ring->head = head;
-            /* race condition if add/remove is not synchronized. */
-            ring->remain += cnt_org;
-            /* give the buffer back */
-            cb_complete(cb_cookie, cookie);
-        }
-
-    }
-
-    /* The only reason to arrive here is when head equals tails. If cnt is not
-     * zero, then there is some kind of overflow or data corruption. The number
-     * of tx descriptors holding data can't exceed the space in the ring.
-     */
-    if (0 != cnt) {
-        ZF_LOGE("head at %u reached tail, but cnt=%u", head, cnt);
-        assert(0);
+        /* race condition if add/remove is not synchronized. */
+        void *cookie = eth_ring_reap(slots);
+        ethif_trace_complete(dev->tx_stamps, first, ETHIF_TRACE_TX_COMPLETE);
+        /* give the buffer back, the last descriptor has the timestamp */
+        bool has_ts = d->esc & TXD_EXT_TS;
+        ethif_tx_complete(&dev->eth_drv, cookie, has_ts,
+                          has_ts ? ptp_extend(dev, d->ts, &now) : 0);
     }
 }
 
@@ -453,6 +514,7 @@ static void print_state(struct eth_driver *driver)
 
 static void handle_irq(struct eth_driver *driver, int irq)
 {
+    uint64_t start = ethif_trace_now();
     assert(driver);
 
     imx6_eth_driver_t *dev = imx6_eth_driver(driver);
@@ -460,12 +522,16 @@ static void handle_irq(struct eth_driver *driver, int irq)
     struct enet *enet = dev->enet;
     assert(enet);
 
+    ethif_stats_add(&dev->stats.irqs, 1);
     uint32_t e = enet_clr_events(enet, IRQ_MASK);
+    if (e & NETIRQ_TS_TIMER) {
+        dev->ptp_sec++;
+    }
     if (e & NETIRQ_TXF) {
         complete_tx(dev);
     }
     if (e & NETIRQ_RXF) {
-        complete_rx(dev);
+        complete_rx(dev, start);
         fill_rx_bufs(dev);
     }
     if (e & NETIRQ_EBERR) {
@@ -499,20 +565,24 @@ static void eth_irq_handle(void *ctx, ps_irq_acknowledge_fn_t acknowledge_fn,
 
 static void raw_poll(struct eth_driver *driver)
 {
+    uint64_t start = ethif_trace_now();
     assert(driver);
 
     imx6_eth_driver_t *dev = imx6_eth_driver(driver);
     assert(dev);
 
+    ethif_stats_add(&dev->stats.polls, 1);
     // TODO: If the interrupts are still enabled, there could be race here. The
     //       caller must ensure this can't happen.
-    complete_rx(dev);
+    ptp_check_wrap(dev);
+    complete_rx(dev, start);
     complete_tx(dev);
     fill_rx_bufs(dev);
 }
 
-static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
-                  unsigned int *len, void *cookie)
+static int raw_tx_meta(struct eth_driver *driver, unsigned int num,
+                       uintptr_t *phys, unsigned int *len, void *cookie,
+                       const ethif_tx_meta_t *meta)
 {
     if (0 == num) {
         ZF_LOGW("raw_tx() called with num=0");
@@ -527,20 +597,35 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
     ring_ctx_t *ring = &(dev->tx);
 
     /* Ensure we have room */
-    if (ring->remain < num) {
+    if (ring->slots.remain < num) {
         /* not enough room, try to complete some and check again */
         complete_tx(dev);
-        unsigned int rem = ring->remain;
+        unsigned int rem = ring->slots.remain;
         if (rem < num) {
             ZF_LOGE("TX queue lacks space, has %d, need %d", rem, num);
+            ethif_stats_add(&dev->stats.tx_failed, 1);
             return ETHIF_TX_FAILED;
         }
     }
 
     __sync_synchronize();
 
-    unsigned int tail = ring->tail;
-    unsigned int tail_new = tail;
+    unsigned int tail_new = ring->slots.tail;
+
+    ethif_stats_tx(&dev->stats, num, len);
+
+    uint32_t esc = TXD_EXT_INT;
+    if (meta) {
+        if (meta->flags & ETHIF_TX_CSUM_IPV4) {
+            esc |= TXD_EXT_IINS;
+        }
+        if (meta->flags & (ETHIF_TX_CSUM_TCP | ETHIF_TX_CSUM_UDP)) {
+            esc |= TXD_EXT_PINS;
+        }
+        if (meta->flags & ETHIF_TX_TIMESTAMP) {
+            esc |= TXD_EXT_TS;
+        }
+    }
 
     unsigned int i = num;
     while (i-- > 0) {
@@ -550,18 +635,17 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
         }
 
         unsigned int idx = tail_new;
-        if (++tail_new == dev->tx.cnt) {
-            tail_new = 0;
+        tail_new = eth_ring_next(&ring->slots, idx);
+        if (0 == tail_new) {
             stat |= TXD_WRAP;
         }
-        update_ring_slot(ring, idx, *phys++, *len++, stat);
+        update_ring_slot(ring, idx, *phys++, *len++, stat, esc);
     }
 
-    ring->cookies[tail] = cookie;
-    dev->tx_lengths[tail] = num;
-    ring->tail = tail_new;
     /* There is a race condition here if add/remove is not synchronized. */
-    ring->remain -= num;
+    unsigned int first = eth_ring_post(&ring->slots, cookie, num);
+    ethif_trace_stamp(dev->tx_stamps, first);
+    ethif_stats_hwm(&dev->stats.tx_ring_hwm, eth_ring_used(&ring->slots));
 
     __sync_synchronize();
 
@@ -574,6 +658,22 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
     return ETHIF_TX_ENQUEUED;
 }
 
+static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
+                  unsigned int *len, void *cookie)
+{
+    return raw_tx_meta(driver, num, phys, len, cookie, NULL);
+}
+
+static void get_stats(struct eth_driver *driver, ethif_stats_t *stats)
+{
+    assert(driver);
+
+    imx6_eth_driver_t *dev = imx6_eth_driver(driver);
+    assert(dev);
+
+    ethif_stats_read(&dev->stats, stats);
+}
+
 static uint64_t obtain_mac(const nic_config_t *nic_config,
                            ps_io_mapper_t *io_mapper)
 {
@@ -650,29 +750,19 @@ static int init_device(imx6_eth_driver_t *dev, const nic_config_t *nic_config)
             (uint8_t)(mac >> 8),
             (uint8_t)(mac));
 
-    ret = setup_desc_ring(dev, &(dev->rx));
+    ret = setup_desc_ring(dev, &(dev->rx), false);
     if (ret) {
         ZF_LOGE("Failed to allocate rx_ring, code %d", ret);
         goto error;
     }
 
-    ret = setup_desc_ring(dev, &(dev->tx));
+    ret = setup_desc_ring(dev, &(dev->tx), true);
     if (ret) {
         ZF_LOGE("Failed to allocate tx_ring, code %d", ret);
         goto error;
     }
 
-    ps_malloc_ops_t *malloc_ops = &(dev->eth_drv.io_ops.malloc_ops);
-    assert(malloc_ops);
-    ret = ps_calloc(
-              malloc_ops,
-              dev->tx.cnt,
-              sizeof(unsigned int),
-              (void **)&dev->tx_lengths);
-    if (ret) {
-        ZF_LOGE("Failed to malloc, code %d", ret);
-        goto error;
-    }
+    dev->tx_stamps = ethif_trace_alloc_stamps(dev->tx.cnt);
     /* ring got allocated, need to free it on error */
 
     unsigned int enet_id = nic_config ? nic_config->id : 0;
@@ -717,6 +807,19 @@ static int init_device(imx6_eth_driver_t *dev, const nic_config_t *nic_config)
         enet_crc_strip_disable(dev->enet);
     }
 
+    /* Let the accelerator insert and verify IPv4/TCP/UDP checksums */
+    enet_csum_offload_enable(dev->enet);
+
+    /* Start the 1588 timer, descriptors get timestamped from now on */
+    dev->ptp = (ethif_ptp_clock_t) {
+        .get_time = ptp_get_time,
+        .set_time = ptp_set_time,
+        .adj_time = ptp_adj_time,
+        .adj_freq = ptp_adj_freq,
+        .resolution = enet_ptp_enable(dev->enet),
+        .data = dev
+    };
+
     /* Non-Promiscuous mode means that only traffic relevant for us is made
      * visible by the hardware, everything else is discarded automatically. We
      * will only see packets addressed to our MAC and broadcast/multicast
@@ -884,12 +987,18 @@ int ethif_imx_init_module(ps_io_ops_t *io_ops, const char *device_path)
         .low_level_init  = low_level_init,
         .raw_tx          = raw_tx,
         .raw_poll        = raw_poll,
-        .get_mac         = get_mac
+        .get_mac         = get_mac,
+        .raw_tx_meta     = raw_tx_meta,
+        .get_stats       = get_stats,
+        .get_ptp_clock   = get_ptp_clock
     };
 
     driver->eth_drv.eth_data = driver; /* use simply extend the structure */
     driver->eth_drv.io_ops = *io_ops;
     driver->eth_drv.dma_alignment = DMA_ALIGN;
+    driver->eth_drv.offload_caps = ETHIF_TX_CSUM_IPV4 | ETHIF_TX_CSUM_TCP |
+                                   ETHIF_TX_CSUM_UDP | ETHIF_CAP_RX_CSUM |
+                                   ETHIF_TX_TIMESTAMP | ETHIF_CAP_RX_TIMESTAMP;
     driver->tx.cnt = CONFIG_LIB_ETHDRIVER_TX_DESC_COUNT;
     driver->rx.cnt = CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT;
 
@@ -13,6 +13,7 @@
 #include <ethdrivers/odroidc2.h>
 #include <ethdrivers/raw.h>
 #include <ethdrivers/helpers.h>
+#include <ethdrivers/ring.h>
 #include <utils/util.h>
 
 #include "uboot/common.h"
@@ -43,13 +44,9 @@ struct odroidc2_eth_data {
     volatile struct descriptor *rx_ring;
     unsigned int rx_size;
     unsigned int tx_size;
-    void **rx_cookies; /* Array of rx_size elements of type 'void *' */
-    void **tx_cookies; /* Array of tx_size elements of type 'void *' */
-    unsigned int rx_remain;
-    unsigned int tx_remain;
-    unsigned int *tx_lengths;
-    /* Indexes used to keep track of the head and tail of the descriptor queues */
-    unsigned int rdt, rdh, tdt, tdh;
+    eth_ring_t rx;
+    eth_ring_t tx;
+    ethif_stats_t stats;
 };
 
 static bool enabled = false;
@@ -61,32 +58,25 @@ static void low_level_init(struct eth_driver *driver, uint8_t *mac, int *mtu)
     *mtu = MAX_PKT_SIZE;
 }
 
-static void fill_rx_bufs(struct eth_driver *driver)
+static void write_rx_desc(struct eth_driver *driver, unsigned int idx, uintptr_t phys)
 {
     struct odroidc2_eth_data *dev = (struct odroidc2_eth_data *)driver->eth_data;
-    __sync_synchronize();
-    while (dev->rx_remain > 0) {
-        /* request a buffer */
-        void *cookie = NULL;
-        int next_rdt = (dev->rdt + 1) % dev->rx_size;
-
-        // This fn ptr is either lwip_allocate_rx_buf or lwip_pbuf_allocate_rx_buf (in src/lwip.c)
-        uintptr_t phys = driver->i_cb.allocate_rx_buf ? driver->i_cb.allocate_rx_buf(driver->cb_cookie, BUF_SIZE, &cookie) : 0;
-        if (!phys) {
-            // NOTE: This condition could happen if
-            //       CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS < CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT
-            break;
-        }
 
-        dev->rx_cookies[dev->rdt] = cookie;
-        dev->rx_ring[dev->rdt].dmamac_addr = phys;
-        dev->rx_ring[dev->rdt].dmamac_cntl = (MAC_MAX_FRAME_SZ & DESC_RXCTRL_SIZE1MASK) | DESC_RXCTRL_RXCHAIN;
-        dev->rx_ring[dev->rdt].txrx_status = DESC_RXSTS_OWNBYDMA;
+    dev->rx_ring[idx].dmamac_addr = phys;
+    dev->rx_ring[idx].dmamac_cntl = (MAC_MAX_FRAME_SZ & DESC_RXCTRL_SIZE1MASK) | DESC_RXCTRL_RXCHAIN;
+    /* Ensure the descriptor is written before the DMA owns it */
+    THREAD_MEMORY_RELEASE();
+    dev->rx_ring[idx].txrx_status = DESC_RXSTS_OWNBYDMA;
+}
 
-        __sync_synchronize();
-        dev->rdt = next_rdt;
-        dev->rx_remain--;
-    }
+static void fill_rx_bufs(struct eth_driver *driver)
+{
+    struct odroidc2_eth_data *dev = (struct odroidc2_eth_data *)driver->eth_data;
+    __sync_synchronize();
+    // allocate_rx_buf is either lwip_allocate_rx_buf or lwip_pbuf_allocate_rx_buf (in src/lwip.c)
+    // NOTE: Allocation fails if
+    //       CONFIG_LIB_ETHDRIVER_NUM_PREALLOCATED_BUFFERS < CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT
+    eth_ring_refill(&dev->rx, driver, BUF_SIZE, &dev->stats, write_rx_desc);
     __sync_synchronize();
 
     /* NOTE Maybe check if receiving isn't enabled? */
@@ -98,37 +88,27 @@ static void fill_rx_bufs(struct eth_driver *driver)
 static void free_desc_ring(struct odroidc2_eth_data *dev, ps_dma_man_t *dma_man)
 {
     if (dev->rx_ring) {
-        dma_unpin_free(dma_man, (void *)dev->rx_ring, sizeof(struct descriptor) * dev->rx_size);
+        dma_ring_free(dma_man, dev->rx_ring, sizeof(struct descriptor), dev->rx_size);
         dev->rx_ring = NULL;
     }
     if (dev->tx_ring) {
-        dma_unpin_free(dma_man, (void *)dev->tx_ring, sizeof(struct descriptor) * dev->tx_size);
+        dma_ring_free(dma_man, dev->tx_ring, sizeof(struct descriptor), dev->tx_size);
         dev->tx_ring = NULL;
     }
-    if (dev->rx_cookies) {
-        free(dev->rx_cookies);
-        dev->rx_cookies = NULL;
-    }
-    if (dev->tx_cookies) {
-        free(dev->tx_cookies);
-        dev->tx_cookies = NULL;
-    }
-    if (dev->tx_lengths) {
-        free(dev->tx_lengths);
-        dev->tx_lengths = NULL;
-    }
+    eth_ring_destroy(&dev->rx);
+    eth_ring_destroy(&dev->tx);
 }
 
 static int initialize_desc_ring(struct odroidc2_eth_data *dev, ps_dma_man_t *dma_man)
 {
-    dma_addr_t rx_ring = dma_alloc_pin(dma_man, sizeof(struct descriptor) * dev->rx_size, 0, DMA_ALIGN);
+    dma_addr_t rx_ring = dma_ring_alloc(dma_man, sizeof(struct descriptor), dev->rx_size, DMA_ALIGN);
     if (!rx_ring.phys) {
         LOG_ERROR("Failed to allocate rx_ring");
         return -1;
     }
     dev->rx_ring = rx_ring.virt;
     dev->rx_ring_phys = rx_ring.phys;
-    dma_addr_t tx_ring = dma_alloc_pin(dma_man, sizeof(struct descriptor) * dev->tx_size, 0, DMA_ALIGN);
+    dma_addr_t tx_ring = dma_ring_alloc(dma_man, sizeof(struct descriptor), dev->tx_size, DMA_ALIGN);
     if (!tx_ring.phys) {
         LOG_ERROR("Failed to allocate tx_ring");
         free_desc_ring(dev, dma_man);
@@ -136,31 +116,15 @@ static int initialize_desc_ring(struct odroidc2_eth_data *dev, ps_dma_man_t *dma
     }
     ps_dma_cache_clean_invalidate(dma_man, rx_ring.virt, sizeof(struct descriptor) * dev->rx_size);
     ps_dma_cache_clean_invalidate(dma_man, tx_ring.virt, sizeof(struct descriptor) * dev->tx_size);
-    dev->rx_cookies = malloc(sizeof(void *) * dev->rx_size);
-    dev->tx_cookies = malloc(sizeof(void *) * dev->tx_size);
-    dev->tx_lengths = malloc(sizeof(unsigned int) * dev->tx_size);
-    if (!dev->rx_cookies || !dev->tx_cookies || !dev->tx_lengths) {
-        if (dev->rx_cookies) {
-            free(dev->rx_cookies);
-        }
-        if (dev->tx_cookies) {
-            free(dev->tx_cookies);
-        }
-        if (dev->tx_lengths) {
-            free(dev->tx_lengths);
-        }
+    dev->tx_ring = tx_ring.virt;
+    dev->tx_ring_phys = tx_ring.phys;
+    /* Keep 2 descriptors back as we cannot actually enqueue size many descriptors,
+     * since then the head and tail pointers would be equal, indicating empty. */
+    if (eth_ring_init(&dev->rx, dev->rx_size, 2, false) || eth_ring_init(&dev->tx, dev->tx_size, 2, true)) {
         LOG_ERROR("Failed to malloc");
         free_desc_ring(dev, dma_man);
         return -1;
     }
-    dev->tx_ring = tx_ring.virt;
-    dev->tx_ring_phys = tx_ring.phys;
-    /* Remaining needs to be 2 less than size as we cannot actually enqueue size many descriptors,
-     * since then the head and tail pointers would be equal, indicating empty. */
-    dev->rx_remain = dev->rx_size - 2;
-    dev->tx_remain = dev->tx_size - 2;
-
-    dev->rdt = dev->rdh = dev->tdt = dev->tdh = 0;
 
     uintptr_t next_phys = dev->tx_ring_phys;
 
@@ -198,21 +162,18 @@ static int initialize_desc_ring(struct odroidc2_eth_data *dev, ps_dma_man_t *dma
 static void complete_rx(struct eth_driver *eth_driver)
 {
     struct odroidc2_eth_data *dev = (struct odroidc2_eth_data *)eth_driver->eth_data;
-    unsigned int rdt = dev->rdt;
-    while (dev->rdh != rdt) {
-        unsigned int status = dev->rx_ring[dev->rdh].txrx_status;
+    eth_ring_t *ring = &dev->rx;
+    while (eth_ring_used(ring)) {
         /* Ensure no memory references get ordered before we checked the descriptor was written back */
-        __sync_synchronize();
+        unsigned int status = dma_ring_load_acquire(&dev->rx_ring[ring->head].txrx_status);
         if (status & DESC_RXSTS_OWNBYDMA) {
             /* not complete yet */
             break;
         }
-        void *cookie = dev->rx_cookies[dev->rdh];
         unsigned int len = (status & DESC_RXSTS_FRMLENMSK) >> DESC_RXSTS_FRMLENSHFT;
-        /* update rdh */
-        dev->rdh = (dev->rdh + 1) % dev->rx_size;
-        dev->rx_remain++;
+        void *cookie = eth_ring_reap(ring);
         /* Give the buffers back */
+        ethif_stats_rx(&dev->stats, 1, &len);
         eth_driver->i_cb.rx_complete(eth_driver->cb_cookie, 1, &cookie, &len);
     }
     /* NOTE Maybe re-enable the Ethernet device for RX if there are still descriptors? */
@@ -221,20 +182,19 @@ static void complete_rx(struct eth_driver *eth_driver)
 static void complete_tx(struct eth_driver *driver)
 {
     struct odroidc2_eth_data *dev = (struct odroidc2_eth_data *)driver->eth_data;
-    while (dev->tdh != dev->tdt) {
+    eth_ring_t *ring = &dev->tx;
+    while (eth_ring_used(ring)) {
         unsigned int i;
-        for (i = 0; i < dev->tx_lengths[dev->tdh]; i++) {
-            if (dev->tx_ring[dev->tdh + i].txrx_status & DESC_TXSTS_OWNBYDMA) {
+        for (i = 0; i < eth_ring_frame_len(ring, ring->head); i++) {
+            unsigned int ring_pos = eth_ring_wrap(ring, ring->head + i);
+            /* do not let memory loads happen before our checking of the descriptor write back */
+            if (dma_ring_load_acquire(&dev->tx_ring[ring_pos].txrx_status) & DESC_TXSTS_OWNBYDMA) {
                 /* Not yet complete */
                 return;
             }
         }
-        /* do not let memory loads happen before our checking of the descriptor write back */
-        __sync_synchronize();
-        /* increase where we believe tdh to be */
-        void *cookie = dev->tx_cookies[dev->tdh];
-        dev->tx_remain += dev->tx_lengths[dev->tdh];
-        dev->tdh = (dev->tdh + dev->tx_lengths[dev->tdh]) % dev->tx_size;
+        /* increase where we believe the head to be */
+        void *cookie = eth_ring_reap(ring);
         /* give the buffer back */
         driver->i_cb.tx_complete(driver->cb_cookie, cookie);
     }
@@ -250,6 +210,7 @@ static void handle_irq(struct eth_driver *driver, int irq)
 {
     struct odroidc2_eth_data *eth_data = (struct odroidc2_eth_data *)driver->eth_data;
     uint32_t status = 0;
+    ethif_stats_add(&eth_data->stats.irqs, 1);
     designware_interrupt_status(eth_data->eth_dev, &status);
     designware_ack(eth_data->eth_dev, status);
     if (status & DMA_INTR_ENA_TIE) {
@@ -288,6 +249,8 @@ static void eth_irq_handle(void *data, ps_irq_acknowledge_fn_t acknowledge_fn, v
 
 static void raw_poll(struct eth_driver *driver)
 {
+    struct odroidc2_eth_data *dev = (struct odroidc2_eth_data *)driver->eth_data;
+    ethif_stats_add(&dev->stats.polls, 1);
     complete_rx(driver);
     complete_tx(driver);
     fill_rx_bufs(driver);
@@ -297,17 +260,18 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
 {
     struct odroidc2_eth_data *dev = (struct odroidc2_eth_data *)driver->eth_data;
     /* Ensure we have room */
-    if (dev->tx_remain < num) {
+    if (dev->tx.remain < num) {
         /* try and complete some */
         complete_tx(driver);
-        if (dev->tx_remain < num) {
+        if (dev->tx.remain < num) {
+            ethif_stats_add(&dev->stats.tx_failed, 1);
             return ETHIF_TX_FAILED;
         }
     }
     unsigned int i;
     __sync_synchronize();
     for (i = 0; i < num; i++) {
-        unsigned int ring = (dev->tdt + i) % dev->tx_size;
+        unsigned int ring = eth_ring_wrap(&dev->tx, dev->tx.tail + i);
         dev->tx_ring[ring].dmamac_addr = phys[i];
         dev->tx_ring[ring].dmamac_cntl = DESC_TXCTRL_TXCHAIN;
         dev->tx_ring[ring].dmamac_cntl |= (len[i] << DESC_TXCTRL_SIZE1SHFT) & DESC_TXCTRL_SIZE1MASK;
@@ -320,10 +284,9 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
         dev->tx_ring[ring].dmamac_cntl |= DESC_TXCTRL_TXINT;
         dev->tx_ring[ring].txrx_status = DESC_TXSTS_OWNBYDMA;
     }
-    dev->tx_cookies[dev->tdt] = cookie;
-    dev->tx_lengths[dev->tdt] = num;
-    dev->tdt = (dev->tdt + num) % dev->tx_size;
-    dev->tx_remain -= num;
+    eth_ring_post(&dev->tx, cookie, num);
+    ethif_stats_tx(&dev->stats, num, len);
+    ethif_stats_hwm(&dev->stats.tx_ring_hwm, eth_ring_used(&dev->tx));
     __sync_synchronize();
 
     /* NOTE Maybe check if it's in the middle of sending? */
@@ -338,13 +301,20 @@ static void get_mac(struct eth_driver *driver, uint8_t *mac)
     memcpy(mac, eth_data->mac, MAC_LEN);
 }
 
+static void get_stats(struct eth_driver *driver, ethif_stats_t *stats)
+{
+    struct odroidc2_eth_data *eth_data = (struct odroidc2_eth_data *) driver->eth_data;
+    ethif_stats_read(&eth_data->stats, stats);
+}
+
 static struct raw_iface_funcs iface_fns = {
     .raw_handleIRQ = handle_irq,
     .print_state = print_state,
     .low_level_init = low_level_init,
     .raw_tx = raw_tx,
     .raw_poll = raw_poll,
-    .get_mac = get_mac
+    .get_mac = get_mac,
+    .get_stats = get_stats
 };
 
 int ethif_odroidc2_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *config)
@@ -361,7 +331,7 @@ int ethif_odroidc2_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void
     struct arm_eth_plat_config *plat_config = (struct arm_eth_plat_config *)config;
     unsigned long base_addr = (unsigned long)((uintptr_t) plat_config->buffer_addr);
 
-    eth_data = (struct odroidc2_eth_data *)malloc(sizeof(struct odroidc2_eth_data));
+    eth_data = (struct odroidc2_eth_data *)calloc(1, sizeof(struct odroidc2_eth_data));
     if (eth_data == NULL) {
         ZF_LOGE("Failed to allocate eth data struct");
         goto error;
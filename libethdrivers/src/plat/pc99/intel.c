@@ -8,6 +8,8 @@
 #include <ethdrivers/intel.h>
 #include <assert.h>
 #include <ethdrivers/helpers.h>
+#include <ethdrivers/ring.h>
+#include <ethdrivers/trace.h>
 
 typedef enum e1000_family {
     e1000_82580 = 1,
@@ -18,18 +20,34 @@ typedef enum e1000_family {
 #define DMA_ALIGN 128
 /* This driver is hard coded to use 2k buffers, don't just change this */
 #define BUF_SIZE 2048
+/* The 82580 has 8 receive queues */
+#define MAX_RX_QUEUES 8
+/* Size of the driver owned buffers headers are split into. Frames up to
+ * this size are received into them in full */
+#define HDR_BUF_SIZE 256
 
 // TX Descriptor Status Bits
 #define TX_DD BIT(0) /* Descriptor Done */
 /* Descriptor CMD Bits */
 #define TX_CMD_EOP BIT(0) /* End of Packet */
 #define TX_CMD_IFCS BIT(1) /* Insert FCS (CRC) */
+#define TX_CMD_IC BIT(2) /* Insert Checksum */
 #define TX_CMD_RS BIT(3) /* Report status */
 #define TX_CMD_IDE BIT(7) /* Interrupt Delay Enable */
 
 // RX Descriptor Status Bits
 #define RX_DD BIT(0) /* Descriptor Done */
 #define RX_EOP BIT(1) /* End of Packet */
+#define RX_82574_IXSM BIT(2) /* Ignore Checksum Indication */
+#define RX_L4CS BIT(5) /* TCP/UDP Checksum Calculated */
+#define RX_IPCS BIT(6) /* IPv4 Checksum Calculated */
+// RX Descriptor Error Bits
+#define RX_ERR_L4E BIT(5) /* TCP/UDP Checksum Error */
+#define RX_ERR_IPE BIT(6) /* IPv4 Checksum Error */
+
+/* Offset of the checksum field in the TCP and UDP headers */
+#define TCP_CSUM_OFFSET 16
+#define UDP_CSUM_OFFSET 6
 
 #define REG(x,y) (*(volatile uint32_t*)(((uintptr_t)(x)->iobase) + (y)))
 
@@ -83,6 +101,19 @@ typedef enum e1000_family {
 #define REG_82574_FCT(x) REG(x, 0x030)
 #define REG_82574_FCAL(x) REG(x, 0x028)
 #define REG_82574_FCAH(x) REG(x, 0x02c)
+#define REG_RXCSUM(x) REG(x, 0x5000)
+#define REG_82580_SRRCTL(x, y) REG(x, 0xC00C + (y) * 0x40)
+#define REG_82580_PSRTYPE(x, y) REG(x, 0x5480 + (y) * 4)
+#define REG_82580_MRQC(x) REG(x, 0x5818)
+#define REG_82580_RETA(x, y) REG(x, 0x5C00 + (y) * 4)
+#define REG_82580_RSSRK(x, y) REG(x, 0x5C80 + (y) * 4)
+#define REG_82580_GPIE(x) REG(x, 0x1514)
+#define REG_82580_EIMS(x) REG(x, 0x1524)
+#define REG_82580_EIMC(x) REG(x, 0x1528)
+#define REG_82580_EIAC(x) REG(x, 0x152C)
+#define REG_82580_EIAM(x) REG(x, 0x1530)
+#define REG_82580_IVAR(x, y) REG(x, 0x1700 + (y) * 4)
+#define REG_82580_IVAR_MISC(x) REG(x, 0x1740)
 
 #define IMC_82580_RESERVED_BITS ((uint32_t)(BIT(1) | BIT(3) | BIT(5) | BIT(9) | BIT(15) | BIT(16) | BIT(17) | BIT(21) | BIT(23) | BIT(27) | BIT(31)))
 #define IMC_82574_RESERVED_BITS (BIT(3) | BIT(5) | BIT(8) | (0b11111 << 10) | BIT(19) | (0b1111111 << 25))
@@ -109,6 +140,8 @@ typedef enum e1000_family {
 #define TXDCTL_82580_RESERVED_BITS (0)
 #define TXDCTL_82574_RESERVED_BITS (0)
 #define TXDCTL_82580_ENABLE BIT(25)
+/* register reads to wait for a disabled transmit queue to stop */
+#define TXDCTL_DISABLE_POLLS 100000
 #define TXDCTL_82574_BIT_THAT_SHOULD_BE_1 BIT(22)
 #define TXDCTL_82574_GRAN BIT(24)
 #define TXDCTL_82574_PTHRESH_OFFSET 0
@@ -138,6 +171,43 @@ typedef enum e1000_family {
 #define RXDCTL_82580_RESERVED_BITS (0)
 #define RXDCTL_82580_ENABLE BIT(25)
 
+#define RXCSUM_IPOFLD BIT(8)
+#define RXCSUM_TUOFLD BIT(9)
+#define RXCSUM_PCSD BIT(13)
+
+#define SRRCTL_BSIZEPACKET(x) ((x) / 1024)
+#define SRRCTL_BSIZEHEADER(x) (((x) / 64) << 8)
+#define SRRCTL_DESCTYPE_ADV_ONEBUF (1 << 25)
+#define SRRCTL_DESCTYPE_HDR_SPLIT_ALWAYS (5 << 25)
+#define SRRCTL_DROP_EN BIT(31)
+
+#define PSRTYPE_TCPHDR BIT(4)
+#define PSRTYPE_UDPHDR BIT(5)
+#define PSRTYPE_IPV4HDR BIT(8)
+#define PSRTYPE_IPV6HDR BIT(9)
+#define PSRTYPE_L2HDR BIT(12)
+
+#define MRQC_ENABLE_RSS 0x2
+#define MRQC_RSS_FIELD_IPV4_TCP BIT(16)
+#define MRQC_RSS_FIELD_IPV4 BIT(17)
+#define MRQC_RSS_FIELD_IPV6 BIT(20)
+#define MRQC_RSS_FIELD_IPV6_TCP BIT(21)
+#define MRQC_RSS_FIELD_IPV4_UDP BIT(22)
+#define MRQC_RSS_FIELD_IPV6_UDP BIT(23)
+
+#define RETA_ENTRIES 128
+#define RSSRK_LENGTH 10
+
+#define GPIE_NSICR BIT(0)
+#define GPIE_MULTIPLE_MSIX BIT(4)
+#define GPIE_EIAME BIT(30)
+#define GPIE_PBA BIT(31)
+
+#define IVAR_VALID BIT(7)
+#define IVAR_RX_OFFSET(q) (((q) & 1) * 16)
+#define IVAR_TX_OFFSET(q) (((q) & 1) * 16 + 8)
+#define IVAR_MISC_OTHER_OFFSET 8
+
 #define IMS_82580_RXDW BIT(7)
 #define IMS_82580_TXDW BIT(0)
 #define IMS_82580_GPHY BIT(10)
@@ -162,6 +232,12 @@ typedef enum e1000_family {
 
 #define MTA_LENGTH 128
 
+/* Microsoft's reference Toeplitz key, as used by most RSS implementations */
+static const uint32_t rss_key[RSSRK_LENGTH] = {
+    0xda565a6d, 0xc20e5b25, 0x3d256741, 0xb08fa343, 0xcb2bcad0,
+    0xb4307bae, 0xa32dcb77, 0x0cf23080, 0x3bb7426a, 0xfa01acbe
+};
+
 struct __attribute((packed)) legacy_tx_ldesc {
     uint64_t bufferAddress;
     uint32_t length: 16;
@@ -182,31 +258,85 @@ struct __attribute((packed)) legacy_rx_ldesc {
     uint32_t VLAN: 16;
 };
 
+/* Advanced receive descriptor (82580). The driver writes the read format and
+ * the hardware replaces it with the write back format */
+union adv_rx_desc {
+    struct {
+        uint64_t pkt_addr;
+        uint64_t hdr_addr;
+    } read;
+    struct {
+        uint32_t info;
+        uint32_t rss_hash;
+        uint32_t status_error;
+        uint16_t length;
+        uint16_t vlan;
+    } wb;
+};
+
+#define ADV_RX_INFO_RSS_TYPE_MASK MASK(4)
+#define ADV_RX_INFO_HDR_LEN(x) (((x) >> 21) & MASK(10))
+#define ADV_RX_STATUS_MASK MASK(20)
+#define ADV_RX_ERROR_OFFSET 24
+
+union rx_desc {
+    struct legacy_rx_ldesc legacy;
+    union adv_rx_desc adv;
+};
+
+typedef struct e1000_rx_queue {
+    /* shadow of the descriptor tail and where we believe the head to be */
+    eth_ring_t slots;
+    volatile union rx_desc *ring;
+    /* if the ring is empty */
+    bool need_rx_buffers;
+    /* header split only: buffer address of each slot, so buffers the
+     * hardware did not use can be reposted, and the header buffers */
+    uintptr_t *phys;
+    void **recycle_cookies;
+    uintptr_t *recycle_phys;
+    unsigned int num_recycle;
+    void *hdr_bufs;
+    uintptr_t hdr_phys;
+} e1000_rx_queue_t;
+
+/* Argument for an IRQ handler, the vector is the MSI-X vector index */
+typedef struct e1000_irq {
+    struct eth_driver *driver;
+    unsigned int vector;
+} e1000_irq_t;
+
 typedef struct e1000_dev {
     e1000_family_t family;
     void *iobase;
-    /* shadow the value of descriptor tails so we don't have to re-read it to increment */
-    uint32_t rdt;
-    uint32_t tdt;
-    /* track what we think the values of rdh and tdh are in the hardware so we can find
-     * complete transmit and receive descriptors */
-    uint32_t tdh;
-    uint32_t rdh;
+    /* shadow the value of descriptor tails so we don't have to re-read it to
+     * increment, and track what we think the values of tdh is in the hardware
+     * so we can find complete transmit descriptors */
+    eth_ring_t tx;
     /* descriptor rings */
-    volatile struct legacy_rx_ldesc *rx_ring;
+    e1000_rx_queue_t rxq[MAX_RX_QUEUES];
+    unsigned int num_rx_queues;
     unsigned int rx_size;
-    unsigned int rx_remain;
-    void **rx_cookies;
+    /* receive queues use advanced descriptors and RSS */
+    bool adv_rx;
+    /* headers are split into driver owned buffers */
+    bool hdr_split;
+    ps_dma_man_t dma_man;
+    /* one MSI-X vector per receive queue and one for everything else */
+    bool msix;
+    e1000_irq_t irqs[MAX_RX_QUEUES + 1];
+    /* no IRQs were registered, link changes are only seen by polling */
+    bool polled;
     volatile struct legacy_tx_ldesc *tx_ring;
     unsigned int tx_size;
-    unsigned int tx_remain;
-    void **tx_cookies;
-    unsigned int *tx_lengths;
+    /* time each packet was queued, NULL unless tracing */
+    uint64_t *tx_stamps;
     uint32_t tx_cmd_bits;
     /* whether we believe the link is up or not */
     int link_up;
-    /* if the rx ring is empty */
-    bool need_rx_buffers;
+    /* leave the transmit ring alone when the link goes down */
+    bool tx_keep_on_link_down;
+    ethif_stats_t stats;
 } e1000_dev_t;
 
 static void disable_all_interrupts(e1000_dev_t *dev)
@@ -214,6 +344,7 @@ static void disable_all_interrupts(e1000_dev_t *dev)
     switch (dev->family) {
     case e1000_82580:
         REG_82580_IMC(dev) = ~IMC_82580_RESERVED_BITS;
+        REG_82580_EIMC(dev) = ~0;
         break;
     case e1000_82574:
         REG_82574_IMC(dev) = ~IMC_82574_RESERVED_BITS;
@@ -242,11 +373,6 @@ static void set_link_up(e1000_dev_t *dev)
     REG_CTRL(dev) = temp;
 }
 
-static void check_link_status(e1000_dev_t *dev)
-{
-    dev->link_up = !!(REG_STATUS(dev) & STATUS_LU);
-}
-
 static void configure_pba(e1000_dev_t *dev)
 {
     switch (dev->family) {
@@ -457,10 +583,12 @@ static void initialize_RXDCTL(e1000_dev_t *dev)
     uint32_t temp;
     switch (dev->family) {
     case e1000_82580:
-        temp = REG_82580_RXDCTL(dev, 0);
-        temp &= ~RXDCTL_82580_RESERVED_BITS;
-        temp |= RXDCTL_82580_ENABLE;
-        REG_82580_RXDCTL(dev, 0) = temp;
+        for (int q = 0; q < dev->num_rx_queues; q++) {
+            temp = REG_82580_RXDCTL(dev, q);
+            temp &= ~RXDCTL_82580_RESERVED_BITS;
+            temp |= RXDCTL_82580_ENABLE;
+            REG_82580_RXDCTL(dev, q) = temp;
+        }
         break;
     case e1000_82574:
         temp = REG_82574_RXDCTL(dev, 0);
@@ -497,6 +625,43 @@ static void initialize_receive_timers(e1000_dev_t *dev)
     }
 }
 
+static void initialize_SRRCTL(e1000_dev_t *dev)
+{
+    for (int q = 0; q < dev->num_rx_queues; q++) {
+        uint32_t temp = SRRCTL_BSIZEPACKET(BUF_SIZE) | SRRCTL_DESCTYPE_ADV_ONEBUF;
+        if (dev->num_rx_queues > 1) {
+            /* drop instead of stalling every queue when one runs out of buffers */
+            temp |= SRRCTL_DROP_EN;
+        }
+        if (dev->hdr_split) {
+            temp &= ~SRRCTL_DESCTYPE_ADV_ONEBUF;
+            temp |= SRRCTL_DESCTYPE_HDR_SPLIT_ALWAYS | SRRCTL_BSIZEHEADER(HDR_BUF_SIZE);
+            REG_82580_PSRTYPE(dev, q) = PSRTYPE_L2HDR | PSRTYPE_IPV4HDR | PSRTYPE_IPV6HDR | PSRTYPE_TCPHDR |
+                                        PSRTYPE_UDPHDR;
+        }
+        REG_82580_SRRCTL(dev, q) = temp;
+    }
+}
+
+static void initialize_rss(e1000_dev_t *dev)
+{
+    /* spread the redirection table evenly over the queues, 4 entries per register */
+    for (int i = 0; i < RETA_ENTRIES / 4; i++) {
+        uint32_t reta = 0;
+        for (int j = 0; j < 4; j++) {
+            reta |= ((i * 4 + j) % dev->num_rx_queues) << (j * 8);
+        }
+        REG_82580_RETA(dev, i) = reta;
+    }
+    for (int i = 0; i < RSSRK_LENGTH; i++) {
+        REG_82580_RSSRK(dev, i) = rss_key[i];
+    }
+    REG_82580_MRQC(dev) = MRQC_ENABLE_RSS | MRQC_RSS_FIELD_IPV4 | MRQC_RSS_FIELD_IPV4_TCP | MRQC_RSS_FIELD_IPV4_UDP |
+                          MRQC_RSS_FIELD_IPV6 | MRQC_RSS_FIELD_IPV6_TCP | MRQC_RSS_FIELD_IPV6_UDP;
+    /* descriptors report the RSS hash in place of the packet checksum */
+    REG_RXCSUM(dev) |= RXCSUM_PCSD;
+}
+
 static void initialize_receive(e1000_dev_t *dev)
 {
     /* zero the MTA */
@@ -505,15 +670,51 @@ static void initialize_receive(e1000_dev_t *dev)
         REG_MTA(dev, i) = 0;
     }
     initialize_receive_timers(dev);
+    if (dev->adv_rx) {
+        initialize_SRRCTL(dev);
+        initialize_rss(dev);
+    }
     initialize_RXDCTL(dev);
+    /* have the hardware verify IPv4 and TCP/UDP checksums */
+    REG_RXCSUM(dev) |= RXCSUM_IPOFLD | RXCSUM_TUOFLD;
     initialize_RCTL(dev);
 }
 
+static void set_ivar(e1000_dev_t *dev, int index, int offset, unsigned int vector)
+{
+    uint32_t temp = REG_82580_IVAR(dev, index);
+    temp &= ~(MASK(8) << offset);
+    temp |= (vector | IVAR_VALID) << offset;
+    REG_82580_IVAR(dev, index) = temp;
+}
+
+static void configure_msix(e1000_dev_t *dev)
+{
+    unsigned int other = dev->num_rx_queues;
+    uint32_t vectors = MASK(dev->num_rx_queues + 1);
+    REG_82580_GPIE(dev) = GPIE_NSICR | GPIE_MULTIPLE_MSIX | GPIE_EIAME | GPIE_PBA;
+    /* each receive queue gets its own vector, transmit and link events share the last one */
+    for (int q = 0; q < dev->num_rx_queues; q++) {
+        set_ivar(dev, q / 2, IVAR_RX_OFFSET(q), q);
+    }
+    set_ivar(dev, 0, IVAR_TX_OFFSET(0), other);
+    REG_82580_IVAR_MISC(dev) = (other | IVAR_VALID) << IVAR_MISC_OTHER_OFFSET;
+    /* vectors are cleared and masked when they fire and re-armed by handle_irq */
+    REG_82580_EIAC(dev) = vectors;
+    REG_82580_EIAM(dev) = vectors;
+    REG_82580_EIMS(dev) = vectors;
+}
+
 static void enable_interrupts(e1000_dev_t *dev)
 {
     switch (dev->family) {
     case e1000_82580:
-        REG_82580_IMS(dev) = IMS_82580_RXDW | IMS_82580_TXDW | IMS_82580_GPHY;
+        if (dev->msix) {
+            configure_msix(dev);
+            REG_82580_IMS(dev) = IMS_82580_GPHY;
+        } else {
+            REG_82580_IMS(dev) = IMS_82580_RXDW | IMS_82580_TXDW | IMS_82580_GPHY;
+        }
         /* enable link status change interrupts in the phy */
         phy_write(dev, 0, 24, BIT(2));
         break;
@@ -654,61 +855,61 @@ static void set_tdlen(e1000_dev_t *dev, uint32_t val)
     }
 }
 
-static void set_rx_ring(e1000_dev_t *dev, uint64_t phys)
+static void set_rx_ring(e1000_dev_t *dev, int q, uint64_t phys)
 {
     uint32_t phys_low = (uint32_t)phys;
     uint32_t phys_high = (uint32_t)(sizeof(phys) > 4 ? phys >> 32 : 0);
     switch (dev->family) {
     case e1000_82580:
-        REG_82580_RDBAL(dev, 0) = phys_low;
-        REG_82580_RDBAH(dev, 0) = phys_high;
+        REG_82580_RDBAL(dev, q) = phys_low;
+        REG_82580_RDBAH(dev, q) = phys_high;
         break;
     case e1000_82574:
-        REG_82574_RDBAL(dev, 0) = phys_low;
-        REG_82574_RDBAH(dev, 0) = phys_high;
+        REG_82574_RDBAL(dev, q) = phys_low;
+        REG_82574_RDBAH(dev, q) = phys_high;
         break;
     default:
         assert(!"Unknown device");
     }
 }
 
-static void set_rdlen(e1000_dev_t *dev, uint32_t val)
+static void set_rdlen(e1000_dev_t *dev, int q, uint32_t val)
 {
     /* rdlen must be multiple of 128 */
     assert(val % 128 == 0);
     switch (dev->family) {
     case e1000_82580:
-        REG_82580_RDLEN(dev, 0) = val;
+        REG_82580_RDLEN(dev, q) = val;
         break;
     case e1000_82574:
-        REG_82574_RDLEN(dev, 0) = val;
+        REG_82574_RDLEN(dev, q) = val;
         break;
     default:
         assert(!"Unknown device");
     }
 }
 
-static void set_rdt(e1000_dev_t *dev, uint32_t val)
+static void set_rdt(e1000_dev_t *dev, int q, uint32_t val)
 {
     switch (dev->family) {
     case e1000_82580:
-        REG_82580_RDT(dev, 0) = val;
+        REG_82580_RDT(dev, q) = val;
         break;
     case e1000_82574:
-        REG_82574_RDT(dev, 0) = val;
+        REG_82574_RDT(dev, q) = val;
         break;
     default:
         assert(!"Unknown device");
     }
 }
 
-static uint32_t read_rdh(e1000_dev_t *dev)
+static uint32_t read_rdh(e1000_dev_t *dev, int q)
 {
     switch (dev->family) {
     case e1000_82580:
-        return REG_82580_RDH(dev, 0);
+        return REG_82580_RDH(dev, q);
     case e1000_82574:
-        return REG_82574_RDH(dev, 0);
+        return REG_82574_RDH(dev, q);
     default:
         assert(!"Unknown device");
         return 0;
@@ -717,113 +918,195 @@ static uint32_t read_rdh(e1000_dev_t *dev)
 
 static void free_desc_ring(e1000_dev_t *dev, ps_dma_man_t *dma_man)
 {
-    if (dev->rx_ring) {
-        dma_unpin_free(dma_man, (void *)dev->rx_ring, sizeof(struct legacy_rx_ldesc) * dev->rx_size);
-        dev->rx_ring = NULL;
+    for (int q = 0; q < dev->num_rx_queues; q++) {
+        e1000_rx_queue_t *rxq = &dev->rxq[q];
+        if (rxq->ring) {
+            dma_unpin_free(dma_man, (void *)rxq->ring, sizeof(union rx_desc) * dev->rx_size);
+            rxq->ring = NULL;
+        }
+        eth_ring_destroy(&rxq->slots);
+        if (rxq->hdr_bufs) {
+            dma_unpin_free(dma_man, rxq->hdr_bufs, HDR_BUF_SIZE * dev->rx_size);
+            rxq->hdr_bufs = NULL;
+        }
+        free(rxq->phys);
+        free(rxq->recycle_cookies);
+        free(rxq->recycle_phys);
+        rxq->phys = NULL;
+        rxq->recycle_cookies = NULL;
+        rxq->recycle_phys = NULL;
     }
     if (dev->tx_ring) {
         dma_unpin_free(dma_man, (void *)dev->tx_ring, sizeof(struct legacy_tx_ldesc) * dev->tx_size);
         dev->tx_ring = NULL;
     }
-    if (dev->rx_cookies) {
-        free(dev->rx_cookies);
-        dev->rx_cookies = NULL;
+    eth_ring_destroy(&dev->tx);
+    ethif_trace_free_stamps(dev->tx_stamps);
+    dev->tx_stamps = NULL;
+}
+
+static int initialize_rx_queue(e1000_dev_t *dev, ps_dma_man_t *dma_man, int q)
+{
+    e1000_rx_queue_t *rxq = &dev->rxq[q];
+    dma_addr_t rx_ring = dma_alloc_pin(dma_man, sizeof(union rx_desc) * dev->rx_size, 1, DMA_ALIGN);
+    if (!rx_ring.phys) {
+        LOG_ERROR("Failed to allocate rx_ring");
+        return -1;
     }
-    if (dev->tx_cookies) {
-        free(dev->tx_cookies);
-        dev->tx_cookies = NULL;
+    rxq->ring = rx_ring.virt;
+    /* Keep 2 descriptors back as we cannot actually enqueue size many descriptors,
+     * since then the head and tail pointers would be equal, indicating empty. */
+    if (eth_ring_init(&rxq->slots, dev->rx_size, 2, false)) {
+        return -1;
     }
-    if (dev->tx_lengths) {
-        free(dev->tx_lengths);
-        dev->tx_lengths = NULL;
+    if (dev->hdr_split) {
+        dma_addr_t hdr_bufs = dma_alloc_pin(dma_man, HDR_BUF_SIZE * dev->rx_size, 1, DMA_ALIGN);
+        if (!hdr_bufs.phys) {
+            LOG_ERROR("Failed to allocate header buffers");
+            return -1;
+        }
+        rxq->hdr_bufs = hdr_bufs.virt;
+        rxq->hdr_phys = hdr_bufs.phys;
+        rxq->phys = malloc(sizeof(uintptr_t) * dev->rx_size);
+        rxq->recycle_cookies = malloc(sizeof(void *) * dev->rx_size);
+        rxq->recycle_phys = malloc(sizeof(uintptr_t) * dev->rx_size);
+        if (!rxq->phys || !rxq->recycle_cookies || !rxq->recycle_phys) {
+            LOG_ERROR("Failed to malloc");
+            return -1;
+        }
     }
+    /* Tell the hardware where the ring is and how big it is */
+    set_rx_ring(dev, q, rx_ring.phys);
+    set_rdlen(dev, q, dev->rx_size * sizeof(union rx_desc));
+
+    /* Set receive ring initially empty */
+    eth_ring_reset(&rxq->slots, read_rdh(dev, q));
+    set_rdt(dev, q, rxq->slots.tail);
+    return 0;
 }
 
 static int initialize_desc_ring(e1000_dev_t *dev, ps_dma_man_t *dma_man)
 {
-    dma_addr_t rx_ring = dma_alloc_pin(dma_man, sizeof(struct legacy_rx_ldesc) * dev->rx_size, 1, DMA_ALIGN);
-    if (!rx_ring.phys) {
-        LOG_ERROR("Failed to allocate rx_ring");
-        return -1;
+    for (int q = 0; q < dev->num_rx_queues; q++) {
+        if (initialize_rx_queue(dev, dma_man, q)) {
+            free_desc_ring(dev, dma_man);
+            return -1;
+        }
     }
-    dev->rx_ring = rx_ring.virt;
     dma_addr_t tx_ring = dma_alloc_pin(dma_man, sizeof(struct legacy_tx_ldesc) * dev->tx_size, 1, DMA_ALIGN);
     if (!tx_ring.phys) {
         LOG_ERROR("Failed to allocate tx_ring");
         free_desc_ring(dev, dma_man);
         return -1;
     }
-    dev->rx_cookies = malloc(sizeof(void *) * dev->rx_size);
-    dev->tx_cookies = malloc(sizeof(void *) * dev->tx_size);
-    dev->tx_lengths = malloc(sizeof(unsigned int) * dev->tx_size);
-    if (!dev->rx_cookies || !dev->tx_cookies || !dev->tx_lengths) {
-        if (dev->rx_cookies) {
-            free(dev->rx_cookies);
-        }
-        if (dev->tx_cookies) {
-            free(dev->tx_cookies);
-        }
-        if (dev->tx_lengths) {
-            free(dev->tx_lengths);
-        }
-        LOG_ERROR("Failed to malloc");
+    dev->tx_ring = tx_ring.virt;
+    if (eth_ring_init(&dev->tx, dev->tx_size, 2, true)) {
         free_desc_ring(dev, dma_man);
         return -1;
     }
-    dev->tx_ring = tx_ring.virt;
-    /* Remaining needs to be 2 less than size as we cannot actually enqueue size many descriptors,
-     * since then the head and tail pointers would be equal, indicating empty. */
-    dev->rx_remain = dev->rx_size - 2;
-    dev->tx_remain = dev->tx_size - 2;
+    dev->tx_stamps = ethif_trace_alloc_stamps(dev->tx_size);
 
-    /* Tell the hardware where the rings are and now big they are */
+    /* Tell the hardware where the ring is and how big it is */
     set_tx_ring(dev, tx_ring.phys);
     set_tdlen(dev, dev->tx_size * sizeof(struct legacy_tx_ldesc));
-    set_rx_ring(dev, rx_ring.phys);
-    set_rdlen(dev, dev->rx_size * sizeof(struct legacy_rx_ldesc));
 
     /* Set transmit ring initially empty */
-    dev->tdh = dev->tdt = 0;
-    set_tdh(dev, dev->tdh);
-    set_tdt(dev, dev->tdt);
-
-    /* Set receive ring initially empty */
-    dev->rdh = dev->rdt = read_rdh(dev);
-    set_rdt(dev, dev->rdt);
+    set_tdh(dev, dev->tx.head);
+    set_tdt(dev, dev->tx.tail);
 
     return 0;
 }
 
-static void complete_rx(struct eth_driver *driver)
+static uint32_t rx_csum_flags(e1000_dev_t *dev, unsigned int status, unsigned int error)
+{
+    uint32_t flags = 0;
+    if (dev->family == e1000_82574 && (status & RX_82574_IXSM)) {
+        return 0;
+    }
+    if (status & RX_IPCS) {
+        flags |= (error & RX_ERR_IPE) ? ETHIF_RX_CSUM_BAD : ETHIF_RX_CSUM_IP_OK;
+    }
+    if (status & RX_L4CS) {
+        flags |= (error & RX_ERR_L4E) ? ETHIF_RX_CSUM_BAD : ETHIF_RX_CSUM_L4_OK;
+    }
+    return flags;
+}
+
+static unsigned int rx_desc_length(e1000_dev_t *dev, volatile union rx_desc *desc)
+{
+    return dev->adv_rx ? desc->adv.wb.length : desc->legacy.length;
+}
+
+/* 'start' is when the interrupt or poll that found the packets began */
+static void complete_rx(struct eth_driver *driver, e1000_rx_queue_t *rxq, uint64_t start)
 {
     e1000_dev_t *dev = (e1000_dev_t *)driver->eth_data;
-    if (dev->rdh == dev->rdt) {
+    eth_ring_t *slots = &rxq->slots;
+    if (!eth_ring_used(slots)) {
         /* We haven't enqueued anything */
         return;
     }
     unsigned int i, j;
     unsigned int count = 1;
-    unsigned int rdt = dev->rdt;
-    for (i = dev->rdh; i != rdt; i = (i + 1) % dev->rx_size, count++) {
-        unsigned int status = dev->rx_ring[i].status;
+    unsigned int rdt = slots->tail;
+    for (i = slots->head; i != rdt; i = eth_ring_next(slots, i), count++) {
+        volatile union rx_desc *desc = &rxq->ring[i];
+        /* status and errors share a word in the advanced write back format */
+        uint32_t staterr = dev->adv_rx ? desc->adv.wb.status_error : desc->legacy.status;
         /* Ensure no memory references get ordered before we checked the descriptor was written back */
         asm volatile("lfence" ::: "memory");
-        if (!(status & RX_DD)) {
+        if (!(staterr & RX_DD)) {
             /* not complete yet */
             break;
         }
-        if (status & RX_EOP) {
+        if (staterr & RX_EOP) {
             void *cookies[count];
             unsigned int len[count];
+            unsigned int num_bufs = 0;
             for (j = 0; j < count; j++) {
-                cookies[j] = dev->rx_cookies[(dev->rdh + j) % dev->rx_size];
-                len[j] = dev->rx_ring[(dev->rdh + j) % dev->rx_size].length;
+                unsigned int slot = eth_ring_wrap(slots, slots->head + j);
+                unsigned int length = rx_desc_length(dev, &rxq->ring[slot]);
+                if (dev->hdr_split && length == 0) {
+                    /* everything went in the header buffer, repost this one as is */
+                    rxq->recycle_cookies[rxq->num_recycle] = slots->cookies[slot];
+                    rxq->recycle_phys[rxq->num_recycle] = rxq->phys[slot];
+                    rxq->num_recycle++;
+                    continue;
+                }
+                cookies[num_bufs] = slots->cookies[slot];
+                len[num_bufs] = length;
+                num_bufs++;
+            }
+            /* checksum status and RSS hash are only valid in the last descriptor */
+            ethif_rx_meta_t meta = { .queue = rxq - dev->rxq };
+            if (dev->adv_rx) {
+                meta.flags = rx_csum_flags(dev, staterr & ADV_RX_STATUS_MASK, staterr >> ADV_RX_ERROR_OFFSET);
+                if (desc->adv.wb.info & ADV_RX_INFO_RSS_TYPE_MASK) {
+                    meta.flags |= ETHIF_RX_RSS_HASH;
+                    meta.rss_hash = desc->adv.wb.rss_hash;
+                }
+            } else {
+                meta.flags = rx_csum_flags(dev, staterr, desc->legacy.error);
             }
+            /* header buffer belongs to the first descriptor of the packet */
+            unsigned int first = slots->head;
             /* update rdh */
-            dev->rdh = (dev->rdh + count) % dev->rx_size;
-            dev->rx_remain += count;
+            eth_ring_release(slots, count);
             /* Give the buffers back */
-            driver->i_cb.rx_complete(driver->cb_cookie, count, cookies, len);
+            ethif_trace_record(ETHIF_TRACE_RX_DELIVER, start);
+            uint64_t cb_start = ethif_trace_now();
+            if (dev->hdr_split) {
+                void *hdr = rxq->hdr_bufs + first * HDR_BUF_SIZE;
+                unsigned int hdr_len = MIN(ADV_RX_INFO_HDR_LEN(rxq->ring[first].adv.wb.info), HDR_BUF_SIZE);
+                ps_dma_cache_invalidate(&dev->dma_man, hdr, hdr_len);
+                ethif_stats_rx(&dev->stats, num_bufs, len);
+                ethif_stats_add(&dev->stats.rx_bytes, hdr_len);
+                driver->i_cb.rx_complete_split(driver->cb_cookie, hdr, hdr_len, num_bufs, cookies, len, &meta);
+            } else {
+                ethif_stats_rx(&dev->stats, num_bufs, len);
+                ethif_rx_complete(driver, num_bufs, cookies, len, &meta);
+            }
+            ethif_trace_record(ETHIF_TRACE_RX_CALLBACK, cb_start);
             count = 0;
         }
     }
@@ -832,10 +1115,11 @@ static void complete_rx(struct eth_driver *driver)
 static void complete_tx(struct eth_driver *driver)
 {
     e1000_dev_t *dev = (e1000_dev_t *)driver->eth_data;
-    while (dev->tdh != dev->tdt) {
+    while (eth_ring_used(&dev->tx)) {
+        unsigned int tdh = dev->tx.head;
         unsigned int i;
-        for (i = 0; i < dev->tx_lengths[dev->tdh]; i++) {
-            if (!(dev->tx_ring[(i + dev->tdh) % dev->tx_size].STA & TX_DD)) {
+        for (i = 0; i < eth_ring_frame_len(&dev->tx, tdh); i++) {
+            if (!(dev->tx_ring[eth_ring_wrap(&dev->tx, tdh + i)].STA & TX_DD)) {
                 /* not all parts complete */
                 return;
             }
@@ -843,121 +1127,276 @@ static void complete_tx(struct eth_driver *driver)
         /* do not let memory loads happen before our checking of the descriptor write back */
         asm volatile("lfence" ::: "memory");
         /* increase where we believe tdh to be */
-        void *cookie = dev->tx_cookies[dev->tdh];
-        dev->tx_remain += dev->tx_lengths[dev->tdh];
-        dev->tdh = (dev->tdh + dev->tx_lengths[dev->tdh]) % dev->tx_size;
+        void *cookie = eth_ring_reap(&dev->tx);
+        ethif_trace_complete(dev->tx_stamps, tdh, ETHIF_TRACE_TX_COMPLETE);
         /* give the buffer back */
         driver->i_cb.tx_complete(driver->cb_cookie, cookie);
     }
 }
 
-static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys, unsigned int *len, void *cookie)
+/* Hand every frame still in the transmit ring back unsent and restart the
+ * ring empty */
+static void drain_tx(struct eth_driver *driver)
 {
     e1000_dev_t *dev = (e1000_dev_t *)driver->eth_data;
-    if (!dev->link_up) {
+    complete_tx(driver);
+    if (!eth_ring_used(&dev->tx)) {
+        return;
+    }
+    /* stop the transmit unit so it lets go of the descriptors */
+    REG_TCTL(dev) &= ~TCTL_EN;
+    if (dev->family == e1000_82580) {
+        REG_82580_TXDCTL(dev, 0) &= ~TXDCTL_82580_ENABLE;
+        /* the queue keeps fetching descriptors until the enable bit reads back clear */
+        int polls = 0;
+        while (REG_82580_TXDCTL(dev, 0) & TXDCTL_82580_ENABLE) {
+            if (++polls == TXDCTL_DISABLE_POLLS) {
+                /* the frames may still be read, leave them in the ring */
+                LOG_ERROR("Transmit queue did not stop, not draining it");
+                REG_82580_TXDCTL(dev, 0) |= TXDCTL_82580_ENABLE;
+                REG_TCTL(dev) |= TCTL_EN;
+                return;
+            }
+        }
+    }
+    while (eth_ring_used(&dev->tx)) {
+        void *cookie = eth_ring_reap(&dev->tx);
+        ethif_stats_add(&dev->stats.tx_dropped, 1);
+        driver->i_cb.tx_complete(driver->cb_cookie, cookie);
+    }
+    eth_ring_reset(&dev->tx, 0);
+    set_tdh(dev, dev->tx.head);
+    set_tdt(dev, dev->tx.tail);
+    if (dev->family == e1000_82580) {
+        REG_82580_TXDCTL(dev, 0) |= TXDCTL_82580_ENABLE;
+    }
+    REG_TCTL(dev) |= TCTL_EN;
+}
+
+/* Read the link state and act on a change */
+static void update_link_status(struct eth_driver *driver)
+{
+    e1000_dev_t *dev = (e1000_dev_t *)driver->eth_data;
+    int link_up = !!(REG_STATUS(dev) & STATUS_LU);
+    if (link_up == dev->link_up) {
+        return;
+    }
+    dev->link_up = link_up;
+    if (!link_up && !dev->tx_keep_on_link_down) {
+        drain_tx(driver);
+    }
+    ethif_link_change(driver, link_up);
+}
+
+static int raw_tx_meta(struct eth_driver *driver, unsigned int num, uintptr_t *phys, unsigned int *len, void *cookie,
+                       const ethif_tx_meta_t *meta)
+{
+    e1000_dev_t *dev = (e1000_dev_t *)driver->eth_data;
+    if (!dev->link_up && !dev->tx_keep_on_link_down) {
+        ethif_stats_add(&dev->stats.tx_failed, 1);
         return ETHIF_TX_FAILED;
     }
     /* Ensure we have room */
-    if (dev->tx_remain < num) {
+    if (dev->tx.remain < num) {
         /* try and complete some */
         complete_tx(driver);
-        if (dev->tx_remain < num) {
+        if (dev->tx.remain < num) {
+            /* a ring that does not drain may be down to a link loss that
+             * no interrupt told us about */
+            update_link_status(driver);
+            ethif_stats_add(&dev->stats.tx_failed, 1);
             return ETHIF_TX_FAILED;
         }
     }
+    /* Legacy descriptors can insert a single checksum, so only TCP/UDP is offered
+     * and the stack seeds the field with the pseudo header sum */
+    uint32_t csum_cmd = 0;
+    uint8_t css = 0;
+    uint8_t cso = 0;
+    if (meta && (meta->flags & (ETHIF_TX_CSUM_TCP | ETHIF_TX_CSUM_UDP))) {
+        csum_cmd = TX_CMD_IC;
+        css = meta->l4_offset;
+        cso = meta->l4_offset + ((meta->flags & ETHIF_TX_CSUM_TCP) ? TCP_CSUM_OFFSET : UDP_CSUM_OFFSET);
+    }
     unsigned int i;
     for (i = 0; i < num; i++) {
-        dev->tx_ring[(dev->tdt + i) % dev->tx_size] = (struct legacy_tx_ldesc) {
+        bool last = (i + 1 == num);
+        dev->tx_ring[eth_ring_wrap(&dev->tx, dev->tx.tail + i)] = (struct legacy_tx_ldesc) {
             .bufferAddress = phys[i],
             .length = len[i],
-            .CSO = 0,
-            .CMD = dev->tx_cmd_bits | (i + 1 == num ? TX_CMD_EOP : 0),
+            /* checksum fields are only valid in the last descriptor */
+            .CSO = last ? cso : 0,
+            .CMD = dev->tx_cmd_bits | (last ? TX_CMD_EOP | csum_cmd : 0),
             .STA = 0,
             .ExtCMD = 0,
-            .CSS = 0,
+            .CSS = last ? css : 0,
             .VLAN = 0
         };
     }
-    dev->tx_cookies[dev->tdt] = cookie;
-    dev->tx_lengths[dev->tdt] = num;
+    ethif_trace_stamp(dev->tx_stamps, dev->tx.tail);
     /* ensure update to descriptors visible before updating tdt */
     asm volatile("mfence" ::: "memory");
-    dev->tdt = (dev->tdt + num) % dev->tx_size;
-    dev->tx_remain -= num;
-    set_tdt(dev, dev->tdt);
+    eth_ring_post(&dev->tx, cookie, num);
+    set_tdt(dev, dev->tx.tail);
+    ethif_stats_tx(&dev->stats, num, len);
+    ethif_stats_hwm(&dev->stats.tx_ring_hwm, eth_ring_used(&dev->tx));
     return ETHIF_TX_ENQUEUED;
 }
 
-static int fill_rx_bufs(struct eth_driver *driver)
+static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys, unsigned int *len, void *cookie)
+{
+    return raw_tx_meta(driver, num, phys, len, cookie, NULL);
+}
+
+static int fill_rx_bufs(struct eth_driver *driver, e1000_rx_queue_t *rxq)
 {
     e1000_dev_t *dev = (e1000_dev_t *)driver->eth_data;
-    int rdt = dev->rdt;
+    eth_ring_t *slots = &rxq->slots;
+    unsigned int rdt = slots->tail;
     /* We want to install buffers in bursts for performance reasons.
      * constantly enqueueing single buffers is expensive */
-    if (dev->rx_remain < 32) {
+    if (slots->remain < 32) {
         return 0;
     }
-    while (dev->rx_remain > 0) {
-        /* request a buffer */
+    while (slots->remain > 0) {
+        /* reuse a buffer the hardware did not touch, or request a new one */
         void *cookie;
-        uintptr_t phys = driver->i_cb.allocate_rx_buf ? driver->i_cb.allocate_rx_buf(driver->cb_cookie, BUF_SIZE, &cookie) : 0;
+        uintptr_t phys;
+        if (rxq->num_recycle > 0) {
+            rxq->num_recycle--;
+            cookie = rxq->recycle_cookies[rxq->num_recycle];
+            phys = rxq->recycle_phys[rxq->num_recycle];
+        } else {
+            phys = driver->i_cb.allocate_rx_buf ? driver->i_cb.allocate_rx_buf(driver->cb_cookie, BUF_SIZE, &cookie) : 0;
+        }
         if (!phys) {
-            dev->need_rx_buffers = true;
+            if (driver->i_cb.allocate_rx_buf) {
+                ethif_stats_add(&dev->stats.rx_alloc_failed, 1);
+            }
+            rxq->need_rx_buffers = true;
             break;
         }
-        dev->rx_cookies[dev->rdt] = cookie;
         /* zery the descriptor */
-        dev->rx_ring[dev->rdt] = (struct legacy_rx_ldesc) {
-            .bufferAddress = phys,
-            .length = BUF_SIZE,
-            .packetChecksum = 0,
-            .status = 0,
-            .error = 0,
-            .VLAN = 0
-        };
-        dev->rdt = (dev->rdt + 1) % dev->rx_size;
-        dev->rx_remain--;
+        if (dev->adv_rx) {
+            rxq->ring[slots->tail].adv.read.pkt_addr = phys;
+            rxq->ring[slots->tail].adv.read.hdr_addr = dev->hdr_split ? rxq->hdr_phys + slots->tail * HDR_BUF_SIZE : 0;
+            if (dev->hdr_split) {
+                rxq->phys[slots->tail] = phys;
+            }
+        } else {
+            rxq->ring[slots->tail].legacy = (struct legacy_rx_ldesc) {
+                .bufferAddress = phys,
+                .length = BUF_SIZE,
+                .packetChecksum = 0,
+                .status = 0,
+                .error = 0,
+                .VLAN = 0
+            };
+        }
+        eth_ring_post(slots, cookie, 1);
     }
-    if (dev->rdt != rdt) {
+    if (slots->tail != rdt) {
         /* ensure update to descriptor visible before updating rdt */
         asm volatile("sfence" ::: "memory");
-        set_rdt(dev, dev->rdt);
+        set_rdt(dev, rxq - dev->rxq, slots->tail);
+        ethif_stats_hwm(&dev->stats.rx_ring_hwm, eth_ring_used(slots));
     }
-    return dev->rx_remain != 0;
+    return slots->remain != 0;
+}
+
+static void poll_rx_queue(struct eth_driver *driver, e1000_rx_queue_t *rxq, uint64_t start)
+{
+    if (rxq->need_rx_buffers) {
+        rxq->need_rx_buffers = false;
+        fill_rx_bufs(driver, rxq);
+    }
+    complete_rx(driver, rxq, start);
+    fill_rx_bufs(driver, rxq);
+}
+
+void ethif_intel_rx_queue_poll(struct eth_driver *driver, unsigned int queue)
+{
+    e1000_dev_t *dev = (e1000_dev_t *)driver->eth_data;
+    uint64_t start = ethif_trace_now();
+    assert(queue < dev->num_rx_queues);
+    ethif_stats_add(&dev->stats.polls, 1);
+    poll_rx_queue(driver, &dev->rxq[queue], start);
 }
 
 static void raw_poll(struct eth_driver *driver)
 {
+    uint64_t start = ethif_trace_now();
     e1000_dev_t *dev = (e1000_dev_t *)driver->eth_data;
-    if (dev->need_rx_buffers) {
-        dev->need_rx_buffers = false;
-        fill_rx_bufs(driver);
+    ethif_stats_add(&dev->stats.polls, 1);
+    for (int q = 0; q < dev->num_rx_queues; q++) {
+        poll_rx_queue(driver, &dev->rxq[q], start);
     }
-    complete_rx(driver);
     complete_tx(driver);
-    fill_rx_bufs(driver);
-    check_link_status(driver->eth_data);
+    /* with interrupts link changes come from them, only look for the link
+     * coming back here as nothing can be sent until it does */
+    if (dev->polled || !dev->link_up) {
+        update_link_status(driver);
+    }
+}
+
+static void handle_rx_irq(struct eth_driver *driver, uint64_t start)
+{
+    e1000_dev_t *dev = (e1000_dev_t *)driver->eth_data;
+    for (int q = 0; q < dev->num_rx_queues; q++) {
+        complete_rx(driver, &dev->rxq[q], start);
+        fill_rx_bufs(driver, &dev->rxq[q]);
+    }
 }
 
+static void handle_82580_gphy(struct eth_driver *driver)
+{
+    e1000_dev_t *dev = (e1000_dev_t *)driver->eth_data;
+    uint32_t phy = phy_read(dev, 0, 25);
+    if (phy & BIT(3)) {
+        update_link_status(driver);
+    }
+}
+
+static void handle_82580_msix(struct eth_driver *driver, unsigned int vector, uint64_t start)
+{
+    e1000_dev_t *dev = (e1000_dev_t *)driver->eth_data;
+    if (vector < dev->num_rx_queues) {
+        complete_rx(driver, &dev->rxq[vector], start);
+        fill_rx_bufs(driver, &dev->rxq[vector]);
+    } else {
+        /* the last vector carries transmit completion and the other causes */
+        uint32_t icr = REG_82580_ICR(dev);
+        complete_tx(driver);
+        if (icr & ICR_82580_GPHY) {
+            handle_82580_gphy(driver);
+        }
+    }
+    /* the vector was auto masked when it fired */
+    REG_82580_EIMS(dev) = BIT(vector);
+}
+
+/* When using MSI-X irq is the vector index, otherwise it is ignored */
 static void handle_irq(struct eth_driver *driver, int irq)
 {
+    uint64_t start = ethif_trace_now();
     e1000_dev_t *dev = (e1000_dev_t *)driver->eth_data;
     uint32_t icr;
+    ethif_stats_add(&dev->stats.irqs, 1);
     switch (dev->family) {
     case e1000_82580:
+        if (dev->msix) {
+            handle_82580_msix(driver, irq, start);
+            break;
+        }
         icr = REG_82580_ICR(dev);
         if (icr & ICR_82580_RXDW) {
-            complete_rx(driver);
-            fill_rx_bufs(driver);
+            handle_rx_irq(driver, start);
         }
         if (icr & ICR_82580_TXDW) {
             complete_tx(driver);
         }
         if (icr & ICR_82580_GPHY) {
-            uint32_t phy = phy_read(dev, 0, 25);
-            if (phy & BIT(3)) {
-                check_link_status(dev);
-            }
+            handle_82580_gphy(driver);
         }
         break;
     case e1000_82574:
@@ -965,17 +1404,13 @@ static void handle_irq(struct eth_driver *driver, int irq)
         /* ack */
         REG_82574_ICR(dev) = icr;
         if (icr & (ICR_82574_RXQ0 | ICR_82574_RXTO | ICR_82574_ACK | ICR_82574_RXDMT0)) {
-            complete_rx(driver);
-            fill_rx_bufs(driver);
+            handle_rx_irq(driver, start);
         }
         if (icr & ICR_82574_TXDW) {
             complete_tx(driver);
         }
         if (icr & ICR_82574_LSC) {
-            check_link_status(dev);
-            if (!dev->link_up) {
-                /* should probably remove everything from the TX ring here */
-            }
+            update_link_status(driver);
         }
         break;
     default:
@@ -983,21 +1418,29 @@ static void handle_irq(struct eth_driver *driver, int irq)
     }
 }
 
+static void get_stats(struct eth_driver *driver, ethif_stats_t *stats)
+{
+    e1000_dev_t *dev = (e1000_dev_t *)driver->eth_data;
+    ethif_stats_read(&dev->stats, stats);
+}
+
 static struct raw_iface_funcs iface_fns = {
     .raw_handleIRQ = handle_irq,
     .print_state = print_state,
     .low_level_init = low_level_init,
     .raw_tx = raw_tx,
     .raw_poll = raw_poll,
-    .get_mac = get_mac
+    .get_mac = get_mac,
+    .raw_tx_meta = raw_tx_meta,
+    .get_stats = get_stats
 };
 
 static void eth_irq_handle(void *data, ps_irq_acknowledge_fn_t acknowledge_fn, void *ack_data)
 {
 
-    struct eth_driver *eth = data;
+    e1000_irq_t *irq = data;
 
-    handle_irq(eth, 0);
+    handle_irq(irq->driver, irq->vector);
 
     int error = acknowledge_fn(ack_data);
     if (error) {
@@ -1013,9 +1456,38 @@ static int common_init(struct eth_driver *driver, ps_io_ops_t io_ops, void *conf
     dev->iobase = eth_config->bar0;
     dev->tx_size = CONFIG_LIB_ETHDRIVER_TX_DESC_COUNT;
     dev->rx_size = CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT;
+    dev->adv_rx = eth_config->num_rx_queues != 0;
+    dev->num_rx_queues = dev->adv_rx ? eth_config->num_rx_queues : 1;
+    dev->msix = eth_config->num_irqs > 1;
+    dev->polled = eth_config->num_irqs == 0;
+    dev->hdr_split = eth_config->rx_hdr_split;
+    dev->tx_keep_on_link_down = eth_config->tx_keep_on_link_down;
+    dev->dma_man = io_ops.dma_manager;
+
+    if (dev->adv_rx && dev->family != e1000_82580) {
+        LOG_ERROR("Multiple receive queues are only supported on the 82580");
+        free(dev);
+        return -1;
+    }
+    if (dev->num_rx_queues > MAX_RX_QUEUES) {
+        LOG_ERROR("At most %d receive queues are supported", MAX_RX_QUEUES);
+        free(dev);
+        return -1;
+    }
+    if (dev->hdr_split && (!dev->adv_rx || !driver->i_cb.rx_complete_split)) {
+        LOG_ERROR("Header split needs receive queues and an rx_complete_split callback");
+        free(dev);
+        return -1;
+    }
+    if (dev->msix && (!dev->adv_rx || eth_config->num_irqs != dev->num_rx_queues + 1)) {
+        LOG_ERROR("MSI-X needs one vector per receive queue and one for transmit and link events");
+        free(dev);
+        return -1;
+    }
 
     /* technically we support alignemtn of 1, but get better performance with some alignment */
     driver->dma_alignment = 16;
+    driver->offload_caps = ETHIF_TX_CSUM_TCP | ETHIF_TX_CSUM_UDP | ETHIF_CAP_TX_CSUM_PSEUDO | ETHIF_CAP_RX_CSUM;
     driver->eth_data = dev;
     driver->i_fn = iface_fns;
 
@@ -1033,13 +1505,16 @@ static int common_init(struct eth_driver *driver, ps_io_ops_t io_ops, void *conf
     /* If num_irqs are 0 then we assume that this driver is either polled or some external environment
      * will call raw_handleIRQ.
      */
-    if (eth_config->num_irqs == 1) {
-        irq_id_t irq_id = ps_irq_register(&io_ops.irq_ops, eth_config->irq_info[0], eth_irq_handle, driver);
+    for (int i = 0; i < eth_config->num_irqs; i++) {
+        dev->irqs[i] = (e1000_irq_t) {
+            .driver = driver,
+            .vector = i
+        };
+        irq_id_t irq_id = ps_irq_register(&io_ops.irq_ops, eth_config->irq_info[i], eth_irq_handle, &dev->irqs[i]);
         if (irq_id < 0) {
             LOG_ERROR("Failed to register IRQ");
             return -1;
         }
-
     }
 
     /* the transmit and receive initialization functions assume
@@ -1051,18 +1526,21 @@ static int common_init(struct eth_driver *driver, ps_io_ops_t io_ops, void *conf
         enable_prom_mode(dev);
     }
 
-    /* fill up the receive ring as much as possible */
-    fill_rx_bufs(driver);
+    /* fill up the receive rings as much as possible */
+    for (int q = 0; q < dev->num_rx_queues; q++) {
+        fill_rx_bufs(driver, &dev->rxq[q]);
+    }
     /* turn interrupts on */
     enable_interrupts(dev);
-    /* check the current status of the link */
-    check_link_status(dev);
+    /* check the current status of the link and report it */
+    dev->link_up = !!(REG_STATUS(dev) & STATUS_LU);
+    ethif_link_change(driver, dev->link_up);
     return ps_interface_register(&io_ops.interface_registration_ops, PS_ETHERNET_INTERFACE, driver, NULL);
 }
 
 int ethif_e82580_init(struct eth_driver *driver, ps_io_ops_t io_ops, void *config)
 {
-    e1000_dev_t *dev = malloc(sizeof(*dev));
+    e1000_dev_t *dev = calloc(1, sizeof(*dev));
     if (!dev) {
         LOG_ERROR("Failed to malloc");
         return -1;
@@ -1074,7 +1552,7 @@ int ethif_e82580_init(struct eth_driver *driver, ps_io_ops_t io_ops, void *confi
 
 int ethif_e82574_init(struct eth_driver *driver, ps_io_ops_t io_ops, void *config)
 {
-    e1000_dev_t *dev = malloc(sizeof(*dev));
+    e1000_dev_t *dev = calloc(1, sizeof(*dev));
     if (!dev) {
         LOG_ERROR("Failed to malloc");
         return -1;
@@ -20,35 +20,28 @@
 static void free_desc_ring(struct tx2_eth_data *dev, ps_dma_man_t *dma_man)
 {
     if (dev->rx_ring != NULL) {
-        dma_unpin_free(dma_man, (void *)dev->rx_ring, sizeof(struct eqos_desc) * dev->rx_size);
+        dma_ring_free(dma_man, dev->rx_ring, sizeof(struct eqos_desc), dev->rx_size);
         dev->rx_ring = NULL;
     }
 
     if (dev->tx_ring != NULL) {
-        dma_unpin_free(dma_man, (void *)dev->tx_ring, sizeof(struct eqos_desc) * dev->tx_size);
+        dma_ring_free(dma_man, dev->tx_ring, sizeof(struct eqos_desc), dev->tx_size);
         dev->tx_ring = NULL;
     }
 
-    if (dev->rx_cookies != NULL) {
-        free(dev->rx_cookies);
-        dev->rx_cookies = NULL;
-    }
+    eth_ring_destroy(&dev->rx);
+    eth_ring_destroy(&dev->tx);
 
-    if (dev->tx_cookies != NULL) {
-        free(dev->tx_cookies);
-        dev->tx_cookies = NULL;
+    if (dev->rx_phys != NULL) {
+        free(dev->rx_phys);
+        dev->rx_phys = NULL;
     }
 
-    if (dev->tx_lengths != NULL) {
-        free(dev->tx_lengths);
-        dev->tx_lengths = NULL;
-    }
 }
 
 static int initialize_desc_ring(struct tx2_eth_data *dev, ps_dma_man_t *dma_man, struct eth_driver *eth_driver)
 {
-    dma_addr_t rx_ring = dma_alloc_pin(dma_man, ALIGN_UP(sizeof(struct eqos_desc) * dev->rx_size, ARCH_DMA_MINALIGN), 0,
-                                       ARCH_DMA_MINALIGN);
+    dma_addr_t rx_ring = dma_ring_alloc(dma_man, sizeof(struct eqos_desc), dev->rx_size, ARCH_DMA_MINALIGN);
     if (!rx_ring.phys) {
         LOG_ERROR("Failed to allocate rx_ring");
         return -1;
@@ -56,8 +49,7 @@ static int initialize_desc_ring(struct tx2_eth_data *dev, ps_dma_man_t *dma_man,
     dev->rx_ring = rx_ring.virt;
     dev->rx_ring_phys = rx_ring.phys;
 
-    dma_addr_t tx_ring = dma_alloc_pin(dma_man, ALIGN_UP(sizeof(struct eqos_desc) * dev->tx_size, ARCH_DMA_MINALIGN), 0,
-                                       ARCH_DMA_MINALIGN);
+    dma_addr_t tx_ring = dma_ring_alloc(dma_man, sizeof(struct eqos_desc), dev->tx_size, ARCH_DMA_MINALIGN);
     if (!tx_ring.phys) {
         LOG_ERROR("Failed to allocate tx_ring");
         free_desc_ring(dev, dma_man);
@@ -69,36 +61,16 @@ static int initialize_desc_ring(struct tx2_eth_data *dev, ps_dma_man_t *dma_man,
     ps_dma_cache_clean_invalidate(dma_man, rx_ring.virt, sizeof(struct eqos_desc) * dev->rx_size);
     ps_dma_cache_clean_invalidate(dma_man, tx_ring.virt, sizeof(struct eqos_desc) * dev->tx_size);
 
-    dev->rx_cookies = calloc(1, sizeof(void *) * dev->rx_size);
-    dev->tx_cookies = calloc(1, sizeof(void *) * dev->tx_size);
-    dev->tx_lengths = calloc(1, sizeof(unsigned int) * dev->tx_size);
-
-    if (dev->rx_cookies == NULL || dev->tx_cookies == NULL || dev->tx_lengths == NULL) {
-
-        if (dev->rx_cookies != NULL) {
-            free(dev->rx_cookies);
-        }
-
-        if (dev->tx_cookies != NULL) {
-            free(dev->tx_cookies);
-        }
-
-        if (dev->tx_lengths != NULL) {
-            free(dev->tx_lengths);
-        }
-
+    /* The whole ring can be used, the tail pointer register tells the
+     * hardware where the posted descriptors end */
+    dev->rx_phys = calloc(1, sizeof(uintptr_t) * dev->rx_size);
+    if (dev->rx_phys == NULL || eth_ring_init(&dev->rx, dev->rx_size, 0, false)
+        || eth_ring_init(&dev->tx, dev->tx_size, 0, true)) {
         LOG_ERROR("Failed to malloc");
         free_desc_ring(dev, dma_man);
         return -1;
     }
 
-    /* Remaining needs to be 2 less than size as we cannot actually enqueue size many descriptors,
-     * since then the head and tail pointers would be equal, indicating empty. */
-    dev->rx_remain = dev->rx_size;
-    dev->tx_remain = dev->tx_size;
-
-    dev->rdt = dev->rdh = dev->tdt = dev->tdh = 0;
-
     /* zero both rings */
     memset((void *)dev->tx_ring, 0, sizeof(struct eqos_desc) * dev->tx_size);
     memset((void *)dev->rx_ring, 0, sizeof(struct eqos_desc) * dev->rx_size);
@@ -108,37 +80,39 @@ static int initialize_desc_ring(struct tx2_eth_data *dev, ps_dma_man_t *dma_man,
     return 0;
 }
 
-static void fill_rx_bufs(struct eth_driver *driver)
+static void write_rx_desc(struct eth_driver *driver, unsigned int idx, uintptr_t phys)
 {
     struct tx2_eth_data *dev = (struct tx2_eth_data *)driver->eth_data;
 
-    while (dev->rx_remain > 0) {
+    if (dev->rx.cookies[idx] != NULL) {
+        ZF_LOGF("Overwriting a descriptor at %d", idx);
+    }
 
-        void *cookie = NULL;
-        /* request a buffer */
-        uintptr_t phys = driver->i_cb.allocate_rx_buf ? driver->i_cb.allocate_rx_buf(driver->cb_cookie, EQOS_MAX_PACKET_SIZE,
-                                                                                     &cookie) : 0;
+    dev->rx_phys[idx] = phys;
+    dev->rx_ring[idx].des0 = phys;
+    dev->rx_ring[idx].des1 = 0;
+    dev->rx_ring[idx].des2 = 0;
+    /* Ensure the descriptor is written before the DMA owns it */
+    THREAD_MEMORY_RELEASE();
+    dev->rx_ring[idx].des3 = EQOS_DESC3_OWN | EQOS_DESC3_BUF1V;
+}
 
-        if (!phys) {
-            break;
-        }
+static void rx_enqueue(struct eth_driver *driver, void *cookie, uintptr_t phys)
+{
+    struct tx2_eth_data *dev = (struct tx2_eth_data *)driver->eth_data;
 
-        if (dev->rx_cookies[dev->rdt] != NULL) {
-            ZF_LOGF("Overwriting a descriptor at dev->rdt %d", dev->rdt);
-        }
+    write_rx_desc(driver, dev->rx.tail, phys);
+    eth_ring_post(&dev->rx, cookie, 1);
+}
 
-        dev->rx_cookies[dev->rdt] = cookie;
-        dev->rx_ring[dev->rdt].des0 = phys;
-        dev->rx_ring[dev->rdt].des1 = 0;
-        dev->rx_ring[dev->rdt].des2 = 0;
-        dev->rx_ring[dev->rdt].des3 = EQOS_DESC3_OWN | EQOS_DESC3_BUF1V;
+static void fill_rx_bufs(struct eth_driver *driver)
+{
+    struct tx2_eth_data *dev = (struct tx2_eth_data *)driver->eth_data;
 
-        dev->rdt = (dev->rdt + 1) % dev->rx_size;
-        dev->rx_remain--;
-    }
+    eth_ring_refill(&dev->rx, driver, EQOS_MAX_PACKET_SIZE, &dev->stats, write_rx_desc);
     __sync_synchronize();
 
-    if (dev->rx_remain != dev->rx_size) {
+    if (eth_ring_used(&dev->rx)) {
         /* We've refilled some buffers, so set the tail pointer so that the DMA controller knows */
         eqos_set_rx_tail_pointer(dev);
     }
@@ -149,29 +123,60 @@ static void fill_rx_bufs(struct eth_driver *driver)
 static void complete_rx(struct eth_driver *eth_driver)
 {
     struct tx2_eth_data *dev = (struct tx2_eth_data *)eth_driver->eth_data;
-    unsigned int num_in_ring = dev->rx_size - dev->rx_remain;
+    eth_ring_t *ring = &dev->rx;
+    unsigned int num_in_ring = eth_ring_used(ring);
 
-    for (int i = 0; i < num_in_ring; i++) {
-        unsigned int status = dev->rx_ring[dev->rdh].des3;
+    while (num_in_ring > 0) {
+        volatile struct eqos_desc *rx_desc = &dev->rx_ring[ring->head];
 
         /* Ensure no memory references get ordered before we checked the descriptor was written back */
-        __sync_synchronize();
+        unsigned int status = dma_ring_load_acquire(&rx_desc->des3);
         if (status & EQOS_DESC3_OWN) {
             /* not complete yet */
             break;
         }
 
+        ethif_rx_meta_t meta = { 0 };
+        bool has_ctx = false;
+        if (rx_desc->des1 & EQOS_DESC1_TSA) {
+            /* The timestamp is in the following context descriptor, come
+             * back later if the hardware has not written it yet */
+            if (num_in_ring < 2) {
+                break;
+            }
+            volatile struct eqos_desc *ctx_desc = &dev->rx_ring[eth_ring_next(ring, ring->head)];
+            unsigned int ctx_status = dma_ring_load_acquire(&ctx_desc->des3);
+            if (ctx_status & EQOS_DESC3_OWN) {
+                break;
+            }
+            if (ctx_status & EQOS_DESC3_CTXT) {
+                has_ctx = true;
+                meta.flags = ETHIF_RX_TIMESTAMP;
+                meta.timestamp = (uint64_t)ctx_desc->des1 * NS_IN_S + ctx_desc->des0;
+            }
+        }
+
         /* TBD: Need to handle multiple buffers for single frame? */
-        void *cookie = dev->rx_cookies[dev->rdh];
-        dev->rx_cookies[dev->rdh] = 0;
+        void *cookie = ring->cookies[ring->head];
+        ring->cookies[ring->head] = NULL;
         unsigned int len = status & 0x7fff;
 
-        dev->rx_remain++;
-        /* update rdh */
-        dev->rdh = (dev->rdh + 1) % dev->rx_size;
+        num_in_ring--;
+        eth_ring_release(ring, 1);
+
+        if (has_ctx) {
+            /* The context descriptor's buffer holds no data, requeue it */
+            void *ctx_cookie = ring->cookies[ring->head];
+            ring->cookies[ring->head] = NULL;
+            uintptr_t ctx_phys = dev->rx_phys[ring->head];
+            num_in_ring--;
+            eth_ring_release(ring, 1);
+            rx_enqueue(eth_driver, ctx_cookie, ctx_phys);
+        }
 
         /* Give the buffers back */
-        eth_driver->i_cb.rx_complete(eth_driver->cb_cookie, 1, &cookie, &len);
+        ethif_stats_rx(&dev->stats, 1, &len);
+        ethif_rx_complete(eth_driver, 1, &cookie, &len, &meta);
     }
 }
 
@@ -180,33 +185,36 @@ static void complete_tx(struct eth_driver *driver)
     struct tx2_eth_data *dev = (struct tx2_eth_data *)driver->eth_data;
     volatile struct eqos_desc *tx_desc;
 
-    while ((dev->tx_size - dev->tx_remain) > 0) {
+    eth_ring_t *ring = &dev->tx;
+
+    while (eth_ring_used(ring) > 0) {
         uint32_t i;
-        for (i = 0; i < dev->tx_lengths[dev->tdh]; i++) {
-            uint32_t ring_pos = (i + dev->tdh) % dev->tx_size;
+        for (i = 0; i < eth_ring_frame_len(ring, ring->head); i++) {
+            uint32_t ring_pos = eth_ring_wrap(ring, ring->head + i);
             tx_desc = &dev->tx_ring[ring_pos];
-            if ((tx_desc->des3 & EQOS_DESC3_OWN)) {
+            /* do not let memory loads happen before our checking of the descriptor write back */
+            if ((dma_ring_load_acquire(&tx_desc->des3) & EQOS_DESC3_OWN)) {
                 /* not all parts complete */
                 return;
             }
         }
 
-        /* do not let memory loads happen before our checking of the descriptor write back */
-        __sync_synchronize();
+        /* the last descriptor of the frame has the timestamp */
+        bool has_ts = tx_desc->des3 & EQOS_DESC3_TTSS;
+        uint64_t ts = has_ts ? (uint64_t)tx_desc->des1 * NS_IN_S + tx_desc->des0 : 0;
 
         /* increase TX Descriptor head */
-        void *cookie = dev->tx_cookies[dev->tdh];
-        dev->tx_remain += dev->tx_lengths[dev->tdh];
-        dev->tdh = (dev->tdh + dev->tx_lengths[dev->tdh]) % dev->tx_size;
+        void *cookie = eth_ring_reap(ring);
 
         /* give the buffer back */
-        driver->i_cb.tx_complete(driver->cb_cookie, cookie);
+        ethif_tx_complete(driver, cookie, has_ts, ts);
     }
 }
 
 static void handle_irq(struct eth_driver *driver, int irq)
 {
     struct tx2_eth_data *eth_data = (struct tx2_eth_data *)driver->eth_data;
+    ethif_stats_add(&eth_data->stats.irqs, 1);
     uint32_t val = eqos_handle_irq(eth_data, irq);
 
     if (val & TX_IRQ) {
@@ -241,18 +249,19 @@ static void low_level_init(struct eth_driver *driver, uint8_t *mac, int *mtu)
     ZF_LOGF("low_level_init not implemented\n");
 }
 
-static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
-                  unsigned int *len, void *cookie)
+static int raw_tx_meta(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
+                       unsigned int *len, void *cookie, const ethif_tx_meta_t *meta)
 {
     assert(num == 1);
     struct tx2_eth_data *dev = (struct tx2_eth_data *)driver->eth_data;
     int err;
     /* Ensure we have room */
-    if ((dev->tx_size - dev->tx_remain) > 32) {
+    if (eth_ring_used(&dev->tx) > 32) {
         /* try and complete some */
         complete_tx(driver);
-        if (dev->tx_remain < num) {
+        if (dev->tx.remain < num) {
             ZF_LOGE("Raw TX failed");
+            ethif_stats_add(&dev->stats.tx_failed, 1);
             return ETHIF_TX_FAILED;
         }
     }
@@ -260,22 +269,30 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
 
     uint32_t i;
     for (i = 0; i < num; i++) {
-        dev->tx_cookies[dev->tdt] = cookie;
-        dev->tx_lengths[dev->tdt] = num;
-        err = eqos_send(dev, (void *)phys[i], len[i]);
+        err = eqos_send(dev, (void *)phys[i], len[i], meta && (meta->flags & ETHIF_TX_TIMESTAMP));
         if (err == -ETIMEDOUT) {
             ZF_LOGF("send timed out");
         }
-        dev->tdt = (dev->tdt + 1) % dev->tx_size;
+        eth_ring_post(&dev->tx, cookie, 1);
     }
 
-    dev->tx_remain -= num;
+    ethif_stats_tx(&dev->stats, num, len);
+    ethif_stats_hwm(&dev->stats.tx_ring_hwm, eth_ring_used(&dev->tx));
 
     return ETHIF_TX_ENQUEUED;
 }
 
+static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
+                  unsigned int *len, void *cookie)
+{
+    return raw_tx_meta(driver, num, phys, len, cookie, NULL);
+}
+
 static void raw_poll(struct eth_driver *driver)
 {
+    struct tx2_eth_data *dev = (struct tx2_eth_data *)driver->eth_data;
+    ethif_stats_add(&dev->stats.polls, 1);
+
     complete_rx(driver);
     complete_tx(driver);
     fill_rx_bufs(driver);
@@ -286,13 +303,49 @@ static void get_mac(struct eth_driver *driver, uint8_t *mac)
     memcpy(mac, TX2_DEFAULT_MAC, 6);
 }
 
+static void get_stats(struct eth_driver *driver, ethif_stats_t *stats)
+{
+    struct tx2_eth_data *dev = (struct tx2_eth_data *)driver->eth_data;
+    ethif_stats_read(&dev->stats, stats);
+}
+
+static int ptp_get_time(void *data, uint64_t *ns)
+{
+    *ns = eqos_ptp_get_time(data);
+    return 0;
+}
+
+static int ptp_set_time(void *data, uint64_t ns)
+{
+    return -eqos_ptp_set_time(data, ns);
+}
+
+static int ptp_adj_time(void *data, int64_t delta)
+{
+    return -eqos_ptp_adj_time(data, delta);
+}
+
+static int ptp_adj_freq(void *data, int32_t ppb)
+{
+    return -eqos_ptp_adj_freq(data, ppb);
+}
+
+static struct ethif_ptp_clock *get_ptp_clock(struct eth_driver *driver)
+{
+    struct tx2_eth_data *dev = (struct tx2_eth_data *)driver->eth_data;
+    return dev->ptp.get_time ? &dev->ptp : NULL;
+}
+
 static struct raw_iface_funcs iface_fns = {
     .raw_handleIRQ = handle_irq,
     .print_state = print_state,
     .low_level_init = low_level_init,
     .raw_tx = raw_tx,
     .raw_poll = raw_poll,
-    .get_mac = get_mac
+    .get_mac = get_mac,
+    .raw_tx_meta = raw_tx_meta,
+    .get_stats = get_stats,
+    .get_ptp_clock = get_ptp_clock
 };
 
 int ethif_tx2_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *config)
@@ -307,7 +360,7 @@ int ethif_tx2_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *conf
         goto error;
     }
 
-    eth_data = (struct tx2_eth_data *)malloc(sizeof(struct tx2_eth_data));
+    eth_data = (struct tx2_eth_data *)calloc(1, sizeof(struct tx2_eth_data));
     if (eth_data == NULL) {
         LOG_ERROR("Failed to allocate eth data struct");
         goto error;
@@ -341,6 +394,22 @@ int ethif_tx2_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *conf
     if (err) {
         goto error;
     }
+
+    uint64_t resolution;
+    err = eqos_ptp_init(eth_data, &resolution);
+    if (err) {
+        ZF_LOGW("PTP clock not available, no hardware timestamps");
+    } else {
+        eth_data->ptp = (ethif_ptp_clock_t) {
+            .get_time = ptp_get_time,
+            .set_time = ptp_set_time,
+            .adj_time = ptp_adj_time,
+            .adj_freq = ptp_adj_freq,
+            .resolution = resolution,
+            .data = eth_data
+        };
+        eth_driver->offload_caps = ETHIF_TX_TIMESTAMP | ETHIF_CAP_RX_TIMESTAMP;
+    }
     return 0;
 error:
     if (eth_data != NULL) {
@@ -23,7 +23,7 @@ void eqos_stop(struct tx2_eth_data *dev);
 
 int eqos_start(struct tx2_eth_data *dev);
 
-int eqos_send(struct tx2_eth_data *dev, void *packet, int length);
+int eqos_send(struct tx2_eth_data *dev, void *packet, int length, bool timestamp);
 
 int eqos_handle_irq(struct tx2_eth_data *dev, int irq);
 
@@ -32,3 +32,14 @@ int eqos_recv(struct tx2_eth_data *dev, uintptr_t packetp);
 void *tx2_initialise(uintptr_t base_addr, ps_io_ops_t *io_ops);
 
 void eqos_set_rx_tail_pointer(struct tx2_eth_data *dev);
+
+/* Start the PTP system time at 0, 'resolution' gets the nanoseconds per tick */
+int eqos_ptp_init(struct tx2_eth_data *dev, uint64_t *resolution);
+
+uint64_t eqos_ptp_get_time(struct tx2_eth_data *dev);
+
+int eqos_ptp_set_time(struct tx2_eth_data *dev, uint64_t ns);
+
+int eqos_ptp_adj_time(struct tx2_eth_data *dev, int64_t delta);
+
+int eqos_ptp_adj_freq(struct tx2_eth_data *dev, int32_t ppb);
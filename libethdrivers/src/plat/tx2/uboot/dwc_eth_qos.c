@@ -94,10 +94,10 @@ void eqos_set_rx_tail_pointer(struct tx2_eth_data *dev)
     struct eqos_priv *eqos = (struct eqos_priv *)dev->eth_dev;
     uint32_t *dma_status = (uint32_t *)(eqos->regs + REG_DWCEQOS_DMA_CH0_STA);
     *dma_status |= DWCEQOS_DMA_CH0_IS_RI;
-    size_t num_buffers_in_ring = dev->rx_size - dev->rx_remain;
+    size_t num_buffers_in_ring = eth_ring_used(&dev->rx);
 
     if (num_buffers_in_ring > 0) {
-        uintptr_t last_rx_desc = (dev->rx_ring_phys + ((dev->rdh + num_buffers_in_ring) * sizeof(struct eqos_desc)));
+        uintptr_t last_rx_desc = (dev->rx_ring_phys + ((dev->rx.head + num_buffers_in_ring) * sizeof(struct eqos_desc)));
         eqos->dma_regs->ch0_rxdesc_tail_pointer = last_rx_desc;
     }
 }
@@ -453,15 +453,18 @@ static int eqos_adjust_link(struct eqos_priv *eqos)
     return 0;
 }
 
-int eqos_send(struct tx2_eth_data *dev, void *packet, int length)
+int eqos_send(struct tx2_eth_data *dev, void *packet, int length, bool timestamp)
 {
     struct eqos_priv *eqos = (struct eqos_priv *)dev->eth_dev;
     volatile struct eqos_desc *tx_desc;
     uint32_t ioc = 0;
-    if (dev->tdt % 32 == 0) {
+    if (dev->tx.tail % 32 == 0) {
         ioc = EQOS_DESC2_IOC;
     }
-    tx_desc = &(dev->tx_ring[dev->tdt]);
+    if (timestamp) {
+        ioc |= EQOS_DESC2_TTSE;
+    }
+    tx_desc = &(dev->tx_ring[dev->tx.tail]);
 
     tx_desc->des0 = (uintptr_t)packet;
     tx_desc->des1 = 0;
@@ -472,12 +475,121 @@ int eqos_send(struct tx2_eth_data *dev, void *packet, int length)
 
     tx_desc->des3 |= EQOS_DESC3_OWN;
 
-    eqos->dma_regs->ch0_txdesc_tail_pointer = (uintptr_t)(&(dev->tx_ring[dev->tdt + 1])) +
+    eqos->dma_regs->ch0_txdesc_tail_pointer = (uintptr_t)(&(dev->tx_ring[dev->tx.tail + 1])) +
                                               sizeof(struct eqos_desc);
 
     return 0;
 }
 
+static int eqos_ptp_write_addend(struct eqos_priv *eqos, uint32_t addend)
+{
+    eqos->ptp_regs->timestamp_addend = addend;
+    eqos->ptp_regs->timestamp_control |= EQOS_PTP_TIMESTAMP_CONTROL_TSADDREG;
+    return wait_for_bit_le32(&eqos->ptp_regs->timestamp_control,
+                             EQOS_PTP_TIMESTAMP_CONTROL_TSADDREG, false, 10, false);
+}
+
+int eqos_ptp_init(struct tx2_eth_data *dev, uint64_t *resolution)
+{
+    struct eqos_priv *eqos = (struct eqos_priv *)dev->eth_dev;
+    int ret;
+
+    freq_t rate = clk_get_freq(eqos->clk_ptp_ref);
+    if (rate == 0) {
+        ZF_LOGE("Unknown PTP reference clock rate");
+        return -EIO;
+    }
+
+    /* Use the fine update method: the addend accumulator overflows at half
+     * the reference clock rate and every overflow adds ssinc nanoseconds,
+     * adjusting the addend then steers the clock rate. */
+    uint32_t ssinc = (2ull * NS_IN_S) / rate;
+    if (ssinc == 0 || ssinc > EQOS_PTP_SUB_SECOND_INCREMENT_SSINC_MASK) {
+        ZF_LOGE("PTP reference clock rate %llu out of range", (unsigned long long)rate);
+        return -EINVAL;
+    }
+    eqos->ptp_addend = ((uint64_t)(NS_IN_S / ssinc) << 32) / rate;
+
+    eqos->ptp_regs->timestamp_control = EQOS_PTP_TIMESTAMP_CONTROL_TSENA |
+                                        EQOS_PTP_TIMESTAMP_CONTROL_TSENALL |
+                                        EQOS_PTP_TIMESTAMP_CONTROL_TSCTRLSSR |
+                                        EQOS_PTP_TIMESTAMP_CONTROL_TSCFUPDT;
+    eqos->ptp_regs->sub_second_increment = ssinc << EQOS_PTP_SUB_SECOND_INCREMENT_SSINC_SHIFT;
+
+    ret = eqos_ptp_write_addend(eqos, eqos->ptp_addend);
+    if (ret) {
+        ZF_LOGE("PTP addend update stuck");
+        return ret;
+    }
+
+    ret = eqos_ptp_set_time(dev, 0);
+    if (ret) {
+        ZF_LOGE("PTP time initialisation stuck");
+        return ret;
+    }
+
+    *resolution = ssinc;
+    return 0;
+}
+
+uint64_t eqos_ptp_get_time(struct tx2_eth_data *dev)
+{
+    struct eqos_priv *eqos = (struct eqos_priv *)dev->eth_dev;
+    uint32_t sec, ns;
+
+    /* re-read if the seconds rolled over while reading the nanoseconds */
+    do {
+        sec = eqos->ptp_regs->system_time_seconds;
+        ns = eqos->ptp_regs->system_time_nanoseconds;
+    } while (sec != eqos->ptp_regs->system_time_seconds);
+
+    return (uint64_t)sec * NS_IN_S + ns;
+}
+
+int eqos_ptp_set_time(struct tx2_eth_data *dev, uint64_t ns)
+{
+    struct eqos_priv *eqos = (struct eqos_priv *)dev->eth_dev;
+
+    eqos->ptp_regs->seconds_update = ns / NS_IN_S;
+    eqos->ptp_regs->nanoseconds_update = ns % NS_IN_S;
+    eqos->ptp_regs->timestamp_control |= EQOS_PTP_TIMESTAMP_CONTROL_TSINIT;
+    return wait_for_bit_le32(&eqos->ptp_regs->timestamp_control,
+                             EQOS_PTP_TIMESTAMP_CONTROL_TSINIT, false, 10, false);
+}
+
+int eqos_ptp_adj_time(struct tx2_eth_data *dev, int64_t delta)
+{
+    struct eqos_priv *eqos = (struct eqos_priv *)dev->eth_dev;
+    bool sub = delta < 0;
+    uint64_t abs_delta = sub ? -(uint64_t)delta : delta;
+    uint32_t sec = abs_delta / NS_IN_S;
+    uint32_t ns = abs_delta % NS_IN_S;
+
+    /* Subtraction is programmed as the complement of the value, seconds
+     * modulo 2^32 and nanoseconds modulo 10^9 in digital rollover mode */
+    if (sub) {
+        sec = -sec;
+        ns = NS_IN_S - ns;
+    }
+    eqos->ptp_regs->seconds_update = sec;
+    eqos->ptp_regs->nanoseconds_update = (sub ? EQOS_PTP_NANOSECONDS_UPDATE_ADDSUB : 0) | ns;
+    eqos->ptp_regs->timestamp_control |= EQOS_PTP_TIMESTAMP_CONTROL_TSUPDT;
+    return wait_for_bit_le32(&eqos->ptp_regs->timestamp_control,
+                             EQOS_PTP_TIMESTAMP_CONTROL_TSUPDT, false, 10, false);
+}
+
+int eqos_ptp_adj_freq(struct tx2_eth_data *dev, int32_t ppb)
+{
+    struct eqos_priv *eqos = (struct eqos_priv *)dev->eth_dev;
+    int64_t addend = eqos->ptp_addend;
+
+    addend += (addend * ppb) / (int64_t)NS_IN_S;
+    if (addend <= 0 || addend > UINT32_MAX) {
+        return -EINVAL;
+    }
+    return eqos_ptp_write_addend(eqos, addend);
+}
+
 static const struct eqos_config eqos_tegra186_config = {
     .reg_access_always_ok = false,
     .mdio_wait = 10,
@@ -941,6 +1053,7 @@ void *tx2_initialise(uintptr_t base_addr, ps_io_ops_t *io_ops)
     eqos->mac_regs = (void *)(eqos->regs + EQOS_MAC_REGS_BASE);
     eqos->mtl_regs = (void *)(eqos->regs + EQOS_MTL_REGS_BASE);
     eqos->dma_regs = (void *)(eqos->regs + EQOS_DMA_REGS_BASE);
+    eqos->ptp_regs = (void *)(eqos->regs + EQOS_PTP_REGS_BASE);
     eqos->tegra186_regs = (void *)(eqos->regs + EQOS_TEGRA186_REGS_BASE);
 
     eqos->mii = mdio_alloc();
@@ -123,6 +123,32 @@ struct eqos_mac_regs {
 
 #define EQOS_MAC_MDIO_DATA_GD_MASK          0xffff
 
+#define EQOS_PTP_REGS_BASE 0xb00
+struct eqos_ptp_regs {
+    uint32_t timestamp_control;         /* 0xb00 */
+    uint32_t sub_second_increment;      /* 0xb04 */
+    uint32_t system_time_seconds;       /* 0xb08 */
+    uint32_t system_time_nanoseconds;   /* 0xb0c */
+    uint32_t seconds_update;            /* 0xb10 */
+    uint32_t nanoseconds_update;        /* 0xb14 */
+    uint32_t timestamp_addend;          /* 0xb18 */
+    uint32_t higher_word_seconds;       /* 0xb1c */
+    uint32_t timestamp_status;          /* 0xb20 */
+};
+
+#define EQOS_PTP_TIMESTAMP_CONTROL_TSCTRLSSR        BIT(9)
+#define EQOS_PTP_TIMESTAMP_CONTROL_TSENALL          BIT(8)
+#define EQOS_PTP_TIMESTAMP_CONTROL_TSADDREG         BIT(5)
+#define EQOS_PTP_TIMESTAMP_CONTROL_TSUPDT           BIT(3)
+#define EQOS_PTP_TIMESTAMP_CONTROL_TSINIT           BIT(2)
+#define EQOS_PTP_TIMESTAMP_CONTROL_TSCFUPDT         BIT(1)
+#define EQOS_PTP_TIMESTAMP_CONTROL_TSENA            BIT(0)
+
+#define EQOS_PTP_SUB_SECOND_INCREMENT_SSINC_SHIFT   16
+#define EQOS_PTP_SUB_SECOND_INCREMENT_SSINC_MASK    0xff
+
+#define EQOS_PTP_NANOSECONDS_UPDATE_ADDSUB          BIT(31)
+
 #define EQOS_MTL_REGS_BASE 0xd00
 struct eqos_mtl_regs {
     uint32_t txq0_operation_mode;           /* 0xd00 */
@@ -242,6 +268,9 @@ struct eqos_priv {
     struct eqos_mac_regs *mac_regs;
     struct eqos_mtl_regs *mtl_regs;
     struct eqos_dma_regs *dma_regs;
+    struct eqos_ptp_regs *ptp_regs;
+    /* timestamp addend for the nominal PTP clock rate */
+    uint32_t ptp_addend;
     struct eqos_tegra186_regs *tegra186_regs;
     struct clock *clk_master_bus;
     struct clock *clk_rx;
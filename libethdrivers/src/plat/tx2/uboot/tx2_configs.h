@@ -6,6 +6,9 @@
 
 #pragma once
 
+#include <ethdrivers/raw.h>
+#include <ethdrivers/ptp.h>
+#include <ethdrivers/ring.h>
 #include "common.h"
 
 #define CONFIG_SYS_CACHELINE_SIZE 64
@@ -45,10 +48,14 @@ struct eqos_desc {
 
 /* descriptor flags */
 #define EQOS_DESC2_IOC      BIT(31)
+#define EQOS_DESC2_TTSE     BIT(30) /* TX: timestamp the frame */
 #define EQOS_DESC3_OWN      BIT(31)
+#define EQOS_DESC3_CTXT     BIT(30) /* RX write-back: context descriptor */
 #define EQOS_DESC3_FD       BIT(29)
 #define EQOS_DESC3_LD       BIT(28)
 #define EQOS_DESC3_BUF1V    BIT(24)
+#define EQOS_DESC3_TTSS     BIT(17) /* TX write-back: des0/des1 hold the timestamp */
+#define EQOS_DESC1_TSA      BIT(14) /* RX write-back: next descriptor holds the timestamp */
 #define DWCEQOS_DMA_RDES3_INTE    BIT(30)
 
 #define EQOS_ALIGN(x,a)      __ALIGN_MASK((x),(typeof(x))(a)-1)
@@ -62,12 +69,11 @@ struct tx2_eth_data {
     volatile struct eqos_desc *rx_ring;
     unsigned int rx_size;
     unsigned int tx_size;
-    void **rx_cookies;
-    unsigned int rx_remain;
-    unsigned int tx_remain;
-    void **tx_cookies;
-    unsigned int *tx_lengths;
-    /* track where the head and tail of the queues are for
-     * enqueueing buffers / checking for completions */
-    unsigned int rdt, rdh, tdt, tdh;
+    eth_ring_t rx;
+    eth_ring_t tx;
+    /* buffer address of each RX slot, the hardware overwrites des0 */
+    uintptr_t *rx_phys;
+    ethif_stats_t stats;
+    /* valid if eqos_ptp_init succeeded */
+    ethif_ptp_clock_t ptp;
 };
@@ -25,6 +25,11 @@
 #define ZYNQ_GEM_RXBUF_EOF_MASK     0x00008000 /* End of frame. */
 #define ZYNQ_GEM_RXBUF_SOF_MASK     0x00004000 /* Start of frame. */
 #define ZYNQ_GEM_RXBUF_LEN_MASK     0x00003FFF /* Mask for length field */
+/* Checksum status, valid with ZYNQ_GEM_NWCFG_RXCHKSUMEN */
+#define ZYNQ_GEM_RXBUF_CSUM_MASK    0x00C00000
+#define ZYNQ_GEM_RXBUF_CSUM_IP      0x00400000 /* IP header checksum OK */
+#define ZYNQ_GEM_RXBUF_CSUM_TCP     0x00800000 /* IP and TCP checksums OK */
+#define ZYNQ_GEM_RXBUF_CSUM_UDP     0x00C00000 /* IP and UDP checksums OK */
 
 #define ZYNQ_GEM_RXBUF_WRAP_MASK    0x00000002 /* Wrap bit, last BD */
 #define ZYNQ_GEM_RXBUF_NEW_MASK     0x00000001 /* Used bit.. */
@@ -46,6 +51,7 @@
 #define ZYNQ_GEM_NWCFG_FSREM        0x000020000 /* FCS removal */
 #define ZYNQ_GEM_NWCFG_MDCCLKDIV    0x0000c0000 /* Div pclk by 48, max 120MHz */
 #define ZYNQ_GEM_NWCFG_COPY_ALL     0x000000010 /* Promiscuous Mode */
+#define ZYNQ_GEM_NWCFG_RXCHKSUMEN   0x001000000 /* RX checksum offload */
 
 #ifdef CONFIG_ARM64
 # define ZYNQ_GEM_DBUS_WIDTH    (1 << 21) /* 64 bit bus */
@@ -56,6 +62,7 @@
 #define ZYNQ_GEM_NWCFG_INIT     (ZYNQ_GEM_DBUS_WIDTH | \
                     ZYNQ_GEM_NWCFG_FDEN | \
                     ZYNQ_GEM_NWCFG_FSREM | \
+                    ZYNQ_GEM_NWCFG_RXCHKSUMEN | \
                     ZYNQ_GEM_NWCFG_MDCCLKDIV)
 
 #define ZYNQ_GEM_NWSR_MDIOIDLE_MASK 0x00000004 /* PHY management idle */
@@ -67,11 +74,14 @@
 #define ZYNQ_GEM_DMACR_TXSIZE       0x00000400
 /* Set with binary 00011000 to use 1536 byte(1*max length frame/buffer) */
 #define ZYNQ_GEM_DMACR_RXBUF        0x00180000
+/* Generate IP/TCP/UDP checksums for all transmitted frames, needs the full TX packet buffer */
+#define ZYNQ_GEM_DMACR_TCPCKSUM     0x00000800
 
 #define ZYNQ_GEM_DMACR_INIT     (ZYNQ_GEM_DMACR_BLENGTH | \
                     ZYNQ_GEM_DMACR_RXSIZE | \
                     ZYNQ_GEM_DMACR_TXSIZE | \
-                    ZYNQ_GEM_DMACR_RXBUF)
+                    ZYNQ_GEM_DMACR_RXBUF | \
+                    ZYNQ_GEM_DMACR_TCPCKSUM)
 
 #define ZYNQ_GEM_TSR_DONE       0x00000020 /* Tx done mask */
 
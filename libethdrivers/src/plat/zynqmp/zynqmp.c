@@ -13,6 +13,7 @@
 #include <ethdrivers/zynqmp.h>
 #include <ethdrivers/raw.h>
 #include <ethdrivers/helpers.h>
+#include <ethdrivers/ring.h>
 #include <ethdrivers/gen_config.h>
 #include <string.h>
 #include <utils/util.h>
@@ -32,48 +33,31 @@ struct zynqmp_eth_data {
     volatile struct emac_bd *rx_ring;
     unsigned int rx_size;
     unsigned int tx_size;
-    void **rx_cookies;
-    unsigned int rx_remain;
-    unsigned int tx_remain;
-    void **tx_cookies;
-    unsigned int *tx_lengths;
-    /* track where the head and tail of the queues are for
-     * enqueueing buffers / checking for completions */
-    unsigned int rdt, rdh, tdt, tdh;
+    eth_ring_t rx;
+    eth_ring_t tx;
+    ethif_stats_t stats;
 };
 
 static void free_desc_ring(struct zynqmp_eth_data *dev, ps_dma_man_t *dma_man)
 {
 
     if (dev->rx_ring != NULL) {
-        dma_unpin_free(dma_man, (void *)dev->rx_ring, sizeof(struct emac_bd) * dev->rx_size);
+        dma_ring_free(dma_man, dev->rx_ring, sizeof(struct emac_bd), dev->rx_size);
         dev->rx_ring = NULL;
     }
 
     if (dev->tx_ring != NULL) {
-        dma_unpin_free(dma_man, (void *)dev->tx_ring, sizeof(struct emac_bd) * dev->tx_size);
+        dma_ring_free(dma_man, dev->tx_ring, sizeof(struct emac_bd), dev->tx_size);
         dev->tx_ring = NULL;
     }
 
-    if (dev->rx_cookies != NULL) {
-        free(dev->rx_cookies);
-        dev->rx_cookies = NULL;
-    }
-
-    if (dev->tx_cookies != NULL) {
-        free(dev->tx_cookies);
-        dev->tx_cookies = NULL;
-    }
-
-    if (dev->tx_lengths != NULL) {
-        free(dev->tx_lengths);
-        dev->tx_lengths = NULL;
-    }
+    eth_ring_destroy(&dev->rx);
+    eth_ring_destroy(&dev->tx);
 }
 
 static int initialize_desc_ring(struct zynqmp_eth_data *dev, ps_dma_man_t *dma_man)
 {
-    dma_addr_t rx_ring = dma_alloc_pin(dma_man, sizeof(struct emac_bd) * dev->rx_size, 0, ARCH_DMA_MINALIGN);
+    dma_addr_t rx_ring = dma_ring_alloc(dma_man, sizeof(struct emac_bd), dev->rx_size, ARCH_DMA_MINALIGN);
     if (!rx_ring.phys) {
         LOG_ERROR("Failed to allocate rx_ring");
         return -1;
@@ -81,7 +65,7 @@ static int initialize_desc_ring(struct zynqmp_eth_data *dev, ps_dma_man_t *dma_m
 
     dev->rx_ring = rx_ring.virt;
     dev->rx_ring_phys = rx_ring.phys;
-    dma_addr_t tx_ring = dma_alloc_pin(dma_man, sizeof(struct emac_bd) * dev->tx_size, 0, ARCH_DMA_MINALIGN);
+    dma_addr_t tx_ring = dma_ring_alloc(dma_man, sizeof(struct emac_bd), dev->tx_size, ARCH_DMA_MINALIGN);
     if (!tx_ring.phys) {
         LOG_ERROR("Failed to allocate tx_ring");
         free_desc_ring(dev, dma_man);
@@ -91,39 +75,17 @@ static int initialize_desc_ring(struct zynqmp_eth_data *dev, ps_dma_man_t *dma_m
     ps_dma_cache_clean_invalidate(dma_man, rx_ring.virt, sizeof(struct emac_bd) * dev->rx_size);
     ps_dma_cache_clean_invalidate(dma_man, tx_ring.virt, sizeof(struct emac_bd) * dev->tx_size);
 
-    dev->rx_cookies = malloc(sizeof(void *) * dev->rx_size);
-    dev->tx_cookies = malloc(sizeof(void *) * dev->tx_size);
-    dev->tx_lengths = malloc(sizeof(unsigned int) * dev->tx_size);
-
-    if (dev->rx_cookies == NULL || dev->tx_cookies == NULL || dev->tx_lengths == NULL) {
-
-        if (dev->rx_cookies != NULL) {
-            free(dev->rx_cookies);
-        }
-
-        if (dev->tx_cookies != NULL) {
-            free(dev->tx_cookies);
-        }
-
-        if (dev->tx_lengths != NULL) {
-            free(dev->tx_lengths);
-        }
+    dev->tx_ring = tx_ring.virt;
+    dev->tx_ring_phys = tx_ring.phys;
 
+    /* Keep 2 descriptors back as we cannot actually enqueue size many descriptors,
+     * since then the head and tail pointers would be equal, indicating empty. */
+    if (eth_ring_init(&dev->rx, dev->rx_size, 2, false) || eth_ring_init(&dev->tx, dev->tx_size, 2, true)) {
         LOG_ERROR("Failed to malloc");
         free_desc_ring(dev, dma_man);
         return -1;
     }
 
-    dev->tx_ring = tx_ring.virt;
-    dev->tx_ring_phys = tx_ring.phys;
-
-    /* Remaining needs to be 2 less than size as we cannot actually enqueue size many descriptors,
-     * since then the head and tail pointers would be equal, indicating empty. */
-    dev->rx_remain = dev->rx_size - 2;
-    dev->tx_remain = dev->tx_size - 2;
-
-    dev->rdt = dev->rdh = dev->tdt = dev->tdh = 0;
-
     /* initialise both rings */
     for (unsigned int i = 0; i < dev->tx_size; i++) {
         dev->tx_ring[i] = (struct emac_bd) {
@@ -148,41 +110,29 @@ static int initialize_desc_ring(struct zynqmp_eth_data *dev, ps_dma_man_t *dma_m
     return 0;
 }
 
-static void fill_rx_bufs(struct eth_driver *driver)
+static void write_rx_desc(struct eth_driver *driver, unsigned int idx, uintptr_t phys)
 {
     struct zynqmp_eth_data *dev = (struct zynqmp_eth_data *)driver->eth_data;
-    __sync_synchronize();
 
-    while (dev->rx_remain > 0) {
+    dev->rx_ring[idx].status = 0;
+    /* Ensure the status is cleared before the descriptor is given back */
+    THREAD_MEMORY_RELEASE();
 
-        /* request a buffer */
-        void *cookie = NULL;
-        int next_rdt = (dev->rdt + 1) % dev->rx_size;
-
-        uintptr_t phys = driver->i_cb.allocate_rx_buf ? driver->i_cb.allocate_rx_buf(driver->cb_cookie, BUF_SIZE, &cookie) : 0;
-        if (!phys) {
-            break;
-        }
-
-        dev->rx_cookies[dev->rdt] = cookie;
-
-        dev->rx_ring[dev->rdt].status = 0;
-
-        /* Remove the used bit so the controller knows this descriptor is
-         * available to be written to */
-        dev->rx_ring[dev->rdt].addr &= ~(ZYNQ_GEM_RXBUF_NEW_MASK | ZYNQ_GEM_RXBUF_ADD_MASK);
-
-        dev->rx_ring[dev->rdt].addr |= (phys & ZYNQ_GEM_RXBUF_ADD_MASK);
-
-        __sync_synchronize();
+    /* Remove the used bit so the controller knows this descriptor is
+     * available to be written to */
+    dev->rx_ring[idx].addr = (dev->rx_ring[idx].addr & ~(ZYNQ_GEM_RXBUF_NEW_MASK | ZYNQ_GEM_RXBUF_ADD_MASK))
+                             | (phys & ZYNQ_GEM_RXBUF_ADD_MASK);
+}
 
-        dev->rdt = next_rdt;
-        dev->rx_remain--;
-    }
+static void fill_rx_bufs(struct eth_driver *driver)
+{
+    struct zynqmp_eth_data *dev = (struct zynqmp_eth_data *)driver->eth_data;
 
+    __sync_synchronize();
+    eth_ring_refill(&dev->rx, driver, BUF_SIZE, &dev->stats, write_rx_desc);
     __sync_synchronize();
 
-    if (dev->rdt != dev->rdh && !zynq_gem_recv_enabled(dev->eth_dev)) {
+    if (eth_ring_used(&dev->rx) && !zynq_gem_recv_enabled(dev->eth_dev)) {
         zynq_gem_recv_enable(dev->eth_dev);
     }
 }
@@ -190,32 +140,28 @@ static void fill_rx_bufs(struct eth_driver *driver)
 static void complete_rx(struct eth_driver *eth_driver)
 {
     struct zynqmp_eth_data *dev = (struct zynqmp_eth_data *)eth_driver->eth_data;
-    unsigned int rdt = dev->rdt;
-
-    while (dev->rdh != rdt) {
-        unsigned int status = dev->rx_ring[dev->rdh].status;
-        unsigned int addr = dev->rx_ring[dev->rdh].addr;
+    eth_ring_t *ring = &dev->rx;
 
+    while (eth_ring_used(ring)) {
         /* Ensure no memory references get ordered before we checked the descriptor was written back */
-        __sync_synchronize();
+        unsigned int addr = dma_ring_load_acquire(&dev->rx_ring[ring->head].addr);
         if (!(addr & ZYNQ_GEM_RXBUF_NEW_MASK)) {
             /* not complete yet */
             break;
         }
+        unsigned int status = dev->rx_ring[ring->head].status;
 
         // TBD: Need to handle multiple buffers for single frame?
-        void *cookie = dev->rx_cookies[dev->rdh];
         unsigned int len = status & ZYNQ_GEM_RXBUF_LEN_MASK;
 
-        /* update rdh */
-        dev->rdh = (dev->rdh + 1) % dev->rx_size;
-        dev->rx_remain++;
+        void *cookie = eth_ring_reap(ring);
 
         /* Give the buffers back */
+        ethif_stats_rx(&dev->stats, 1, &len);
         eth_driver->i_cb.rx_complete(eth_driver->cb_cookie, 1, &cookie, &len);
     }
 
-    if (dev->rdt != dev->rdh && !zynq_gem_recv_enabled(dev->eth_dev)) {
+    if (eth_ring_used(ring) && !zynq_gem_recv_enabled(dev->eth_dev)) {
         zynq_gem_recv_enable(dev->eth_dev);
     }
 }
@@ -224,13 +170,16 @@ static void complete_tx(struct eth_driver *driver)
 {
     struct zynqmp_eth_data *dev = (struct zynqmp_eth_data *)driver->eth_data;
 
-    while (dev->tdh != dev->tdt) {
+    eth_ring_t *ring = &dev->tx;
+
+    while (eth_ring_used(ring)) {
         unsigned int i;
 
-        for (i = 0; i < dev->tx_lengths[dev->tdh]; i++) {
-            int ring_pos = (i + dev->tdh) % dev->tx_size;
+        for (i = 0; i < eth_ring_frame_len(ring, ring->head); i++) {
+            unsigned int ring_pos = eth_ring_wrap(ring, ring->head + i);
 
-            if (i == 0 && !(dev->tx_ring[ring_pos].status & ZYNQ_GEM_TXBUF_USED_MASK)) {
+            /* do not let memory accesses happen before our checking of the descriptor write back */
+            if (i == 0 && !(dma_ring_load_acquire(&dev->tx_ring[ring_pos].status) & ZYNQ_GEM_TXBUF_USED_MASK)) {
                 /* not all parts complete */
                 return;
             }
@@ -239,20 +188,15 @@ static void complete_tx(struct eth_driver *driver)
             dev->tx_ring[ring_pos].status |= ZYNQ_GEM_TXBUF_USED_MASK;
         }
 
-        /* do not let memory loads happen before our checking of the descriptor write back */
-        __sync_synchronize();
-
         /* increase TX Descriptor head */
-        void *cookie = dev->tx_cookies[dev->tdh];
-        dev->tx_remain += dev->tx_lengths[dev->tdh];
-        dev->tdh = (dev->tdh + dev->tx_lengths[dev->tdh]) % dev->tx_size;
+        void *cookie = eth_ring_reap(ring);
 
         /* give the buffer back */
         driver->i_cb.tx_complete(driver->cb_cookie, cookie);
     }
 
-    if (dev->tdh != dev->tdt) {
-        uintptr_t txbase = dev->tx_ring_phys + (uintptr_t)(dev->tdh * sizeof(struct emac_bd));
+    if (eth_ring_used(ring)) {
+        uintptr_t txbase = dev->tx_ring_phys + (uintptr_t)(ring->head * sizeof(struct emac_bd));
         zynq_gem_start_send(dev->eth_dev, txbase);
     }
 }
@@ -262,6 +206,8 @@ static void handle_irq(struct eth_driver *driver, int irq)
     struct zynqmp_eth_data *eth_data = (struct zynqmp_eth_data *)driver->eth_data;
     struct zynq_gem_regs *regs = (struct zynq_gem_regs *)eth_data->eth_dev->iobase;
 
+    ethif_stats_add(&eth_data->stats.irqs, 1);
+
     // Clear Interrupts
     u32 isr = readl(&regs->isr);
     writel(isr, &regs->isr);
@@ -323,11 +269,12 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
     struct zynqmp_eth_data *dev = (struct zynqmp_eth_data *)driver->eth_data;
 
     /* Ensure we have room */
-    if (dev->tx_remain < num) {
+    if (dev->tx.remain < num) {
         /* try and complete some */
         complete_tx(driver);
 
-        if (dev->tx_remain < num) {
+        if (dev->tx.remain < num) {
+            ethif_stats_add(&dev->stats.tx_failed, 1);
             return ETHIF_TX_FAILED;
         }
     }
@@ -335,10 +282,10 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
     unsigned int i;
     __sync_synchronize();
 
-    uintptr_t txbase = dev->tx_ring_phys + (uintptr_t)(dev->tdt * sizeof(struct emac_bd));
+    uintptr_t txbase = dev->tx_ring_phys + (uintptr_t)(dev->tx.tail * sizeof(struct emac_bd));
 
     for (i = 0; i < num; i++) {
-        unsigned int ring = (dev->tdt + i) % dev->tx_size;
+        unsigned int ring = eth_ring_wrap(&dev->tx, dev->tx.tail + i);
         dev->tx_ring[ring].addr = phys[i];
         dev->tx_ring[ring].status &= ~(ZYNQ_GEM_TXBUF_USED_MASK | ZYNQ_GEM_TXBUF_FRMLEN_MASK | ZYNQ_GEM_TXBUF_LAST_MASK);
         dev->tx_ring[ring].status |= (len[i] & ZYNQ_GEM_TXBUF_FRMLEN_MASK);
@@ -347,10 +294,9 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
         }
     }
 
-    dev->tx_cookies[dev->tdt] = cookie;
-    dev->tx_lengths[dev->tdt] = num;
-    dev->tdt = (dev->tdt + num) % dev->tx_size;
-    dev->tx_remain -= num;
+    eth_ring_post(&dev->tx, cookie, num);
+    ethif_stats_tx(&dev->stats, num, len);
+    ethif_stats_hwm(&dev->stats.tx_ring_hwm, eth_ring_used(&dev->tx));
 
     __sync_synchronize();
 
@@ -361,6 +307,9 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
 
 static void raw_poll(struct eth_driver *driver)
 {
+    struct zynqmp_eth_data *dev = (struct zynqmp_eth_data *)driver->eth_data;
+    ethif_stats_add(&dev->stats.polls, 1);
+
     complete_rx(driver);
     complete_tx(driver);
     fill_rx_bufs(driver);
@@ -372,6 +321,11 @@ static void get_mac(struct eth_driver *driver, uint8_t *mac)
     memcpy(mac, eth_dev->enetaddr, 6);
 }
 
+static void get_stats(struct eth_driver *driver, ethif_stats_t *stats)
+{
+    struct zynqmp_eth_data *dev = (struct zynqmp_eth_data *)driver->eth_data;
+    ethif_stats_read(&dev->stats, stats);
+}
 
 static struct raw_iface_funcs iface_fns = {
     .raw_handleIRQ = handle_irq,
@@ -379,7 +333,8 @@ static struct raw_iface_funcs iface_fns = {
     .low_level_init = low_level_init,
     .raw_tx = raw_tx,
     .raw_poll = raw_poll,
-    .get_mac = get_mac
+    .get_mac = get_mac,
+    .get_stats = get_stats
 };
 
 int ethif_zynqmp_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *config)
@@ -391,7 +346,7 @@ int ethif_zynqmp_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *c
 
     printf("ethif_zynqmp_init: Start\n");
 
-    eth_data = (struct zynqmp_eth_data *)malloc(sizeof(struct zynqmp_eth_data));
+    eth_data = (struct zynqmp_eth_data *)calloc(1, sizeof(struct zynqmp_eth_data));
     if (eth_data == NULL) {
         LOG_ERROR("Failed to allocate eth data struct");
         goto error;
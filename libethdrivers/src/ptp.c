@@ -0,0 +1,35 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <string.h>
+#include <utils/util.h>
+#include <ethdrivers/ptp.h>
+
+static int ptp_ltimer_get_time(void *data, uint64_t *time)
+{
+    return ethif_ptp_get_time(data, time);
+}
+
+static int ptp_ltimer_get_resolution(void *data, uint64_t *resolution)
+{
+    ethif_ptp_clock_t *clock = data;
+    *resolution = clock->resolution;
+    return 0;
+}
+
+int ethif_ptp_clock_ltimer(ethif_ptp_clock_t *clock, ltimer_t *ltimer)
+{
+    if (!clock || !clock->get_time || !ltimer) {
+        ZF_LOGE("Need a clock that can tell the time");
+        return EINVAL;
+    }
+
+    memset(ltimer, 0, sizeof(*ltimer));
+    ltimer->get_time = ptp_ltimer_get_time;
+    ltimer->get_resolution = ptp_ltimer_get_resolution;
+    ltimer->data = clock;
+    return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <utils/util.h>
+#include <ethdrivers/ring.h>
+
+#ifdef CONFIG_LIB_ETHDRIVER_POW2_RINGS
+compile_time_assert(rx_desc_count_pow2, IS_POWER_OF_2(CONFIG_LIB_ETHDRIVER_RX_DESC_COUNT));
+compile_time_assert(tx_desc_count_pow2, IS_POWER_OF_2(CONFIG_LIB_ETHDRIVER_TX_DESC_COUNT));
+#endif
+
+int eth_ring_init(eth_ring_t *ring, unsigned int size, unsigned int reserve, bool frames)
+{
+    memset(ring, 0, sizeof(*ring));
+    if (size == 0 || reserve >= size) {
+        ZF_LOGE("Invalid ring of %u descriptors with %u reserved", size, reserve);
+        return -1;
+    }
+#ifdef CONFIG_LIB_ETHDRIVER_POW2_RINGS
+    if (!IS_POWER_OF_2(size)) {
+        ZF_LOGE("Ring of %u descriptors is not a power of two", size);
+        return -1;
+    }
+#endif
+
+    ring->size = size;
+    ring->mask = IS_POWER_OF_2(size) ? size - 1 : 0;
+    ring->reserve = reserve;
+    ring->cookies = calloc(size, sizeof(*ring->cookies));
+    if (frames) {
+        ring->lengths = calloc(size, sizeof(*ring->lengths));
+    }
+    if (!ring->cookies || (frames && !ring->lengths)) {
+        ZF_LOGE("Failed to allocate ring bookkeeping");
+        eth_ring_destroy(ring);
+        return -1;
+    }
+    eth_ring_reset(ring, 0);
+    return 0;
+}
+
+void eth_ring_destroy(eth_ring_t *ring)
+{
+    free(ring->cookies);
+    ring->cookies = NULL;
+    free(ring->lengths);
+    ring->lengths = NULL;
+}
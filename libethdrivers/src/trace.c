@@ -0,0 +1,206 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utils/util.h>
+#include <ethdrivers/trace.h>
+
+#ifdef CONFIG_LIB_ETHDRIVER_LATENCY_TRACE
+
+#if defined(CONFIG_ARCH_X86)
+#include <platsupport/arch/tsc.h>
+
+static uint64_t default_clock(void *data)
+{
+    return rdtsc_pure();
+}
+
+#define DEFAULT_CLOCK default_clock
+#elif defined(CONFIG_ARCH_ARM) && defined(CONFIG_EXPORT_PCNT_USER)
+#include <platsupport/arch/generic_timer.h>
+
+static uint64_t default_clock(void *data)
+{
+    return generic_timer_get_ticks();
+}
+
+#define DEFAULT_CLOCK default_clock
+#else
+#define DEFAULT_CLOCK NULL
+#endif
+
+ethif_trace_clock_fn ethif_trace_clock = DEFAULT_CLOCK;
+void *ethif_trace_clock_data;
+/* 0 means not known yet */
+static uint64_t trace_freq;
+
+static ethif_trace_hist_t trace_hist[ETHIF_TRACE_NUM_POINTS];
+
+static const char *trace_names[ETHIF_TRACE_NUM_POINTS] = {
+    [ETHIF_TRACE_RX_DELIVER] = "rx deliver",
+    [ETHIF_TRACE_RX_CALLBACK] = "rx callback",
+    [ETHIF_TRACE_TX_COMPLETE] = "tx complete",
+};
+
+void ethif_trace_record_ticks(ethif_trace_point_t point, uint64_t ticks)
+{
+    ethif_trace_hist_t *hist = &trace_hist[point];
+    unsigned int bucket = ticks ? 64 - __builtin_clzll(ticks) : 0;
+
+    __atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->total, ticks, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (ticks > max) {
+        if (__atomic_compare_exchange_n(&hist->max, &max, ticks, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+void ethif_trace_set_clock(ethif_trace_clock_fn clock, void *data, uint64_t freq_hz)
+{
+    ethif_trace_clock = NULL;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    ethif_trace_clock_data = data;
+    trace_freq = freq_hz;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    ethif_trace_clock = clock;
+}
+
+uint64_t *ethif_trace_alloc_stamps(size_t size)
+{
+    uint64_t *stamps = calloc(size, sizeof(*stamps));
+    if (!stamps) {
+        ZF_LOGE("Failed to allocate trace timestamps, tracing disabled for this ring");
+    }
+    return stamps;
+}
+
+void ethif_trace_free_stamps(uint64_t *stamps)
+{
+    free(stamps);
+}
+
+void ethif_trace_read(ethif_trace_point_t point, ethif_trace_hist_t *hist)
+{
+    ethif_trace_hist_t *src = &trace_hist[point];
+
+    hist->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    hist->total = __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+    hist->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    for (int i = 0; i < ETHIF_TRACE_BUCKETS; i++) {
+        hist->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+void ethif_trace_reset(void)
+{
+    for (int p = 0; p < ETHIF_TRACE_NUM_POINTS; p++) {
+        ethif_trace_hist_t *hist = &trace_hist[p];
+        __atomic_store_n(&hist->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&hist->total, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&hist->max, 0, __ATOMIC_RELAXED);
+        for (int i = 0; i < ETHIF_TRACE_BUCKETS; i++) {
+            __atomic_store_n(&hist->buckets[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Tick rate of the clock, 0 if not known */
+static uint64_t trace_get_freq(void)
+{
+    uint64_t freq = trace_freq;
+#if defined(CONFIG_ARCH_ARM) && defined(CONFIG_EXPORT_PCNT_USER)
+    if (!freq && ethif_trace_clock == default_clock) {
+        freq = generic_timer_get_freq();
+    }
+#endif
+    return freq;
+}
+
+static uint64_t ticks_to_ns(uint64_t ticks, uint64_t freq)
+{
+    return (ticks / freq) * NS_IN_S + ((ticks % freq) * NS_IN_S) / freq;
+}
+
+bool ethif_trace_ticks_from_ns(uint64_t ns, uint64_t *ticks)
+{
+    uint64_t freq = trace_get_freq();
+    if (!freq) {
+        return false;
+    }
+    *ticks = (ns / NS_IN_S) * freq + ((ns % NS_IN_S) * freq) / NS_IN_S;
+    return true;
+}
+
+void ethif_trace_dump(void)
+{
+    uint64_t freq = trace_get_freq();
+    const char *unit = freq ? "ns" : "ticks";
+
+    for (int p = 0; p < ETHIF_TRACE_NUM_POINTS; p++) {
+        ethif_trace_hist_t hist;
+        ethif_trace_read(p, &hist);
+        if (!hist.count) {
+            continue;
+        }
+        uint64_t mean = hist.total / hist.count;
+        uint64_t max = hist.max;
+        if (freq) {
+            mean = ticks_to_ns(mean, freq);
+            max = ticks_to_ns(max, freq);
+        }
+        printf("%s: %llu samples, mean %llu %s, max %llu %s\n", trace_names[p],
+               (unsigned long long)hist.count, (unsigned long long)mean, unit,
+               (unsigned long long)max, unit);
+        for (int i = 0; i < ETHIF_TRACE_BUCKETS; i++) {
+            if (!hist.buckets[i]) {
+                continue;
+            }
+            uint64_t upper = i == 64 ? UINT64_MAX : (1ull << i) - 1;
+            if (freq) {
+                upper = ticks_to_ns(upper, freq);
+            }
+            printf("  <= %20llu %s: %llu\n", (unsigned long long)upper, unit,
+                   (unsigned long long)hist.buckets[i]);
+        }
+    }
+}
+
+#else
+
+void ethif_trace_set_clock(ethif_trace_clock_fn clock, void *data, uint64_t freq_hz)
+{
+}
+
+uint64_t *ethif_trace_alloc_stamps(size_t size)
+{
+    return NULL;
+}
+
+void ethif_trace_free_stamps(uint64_t *stamps)
+{
+}
+
+void ethif_trace_read(ethif_trace_point_t point, ethif_trace_hist_t *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
+
+void ethif_trace_reset(void)
+{
+}
+
+void ethif_trace_dump(void)
+{
+    printf("ethdrivers: latency tracing not enabled (CONFIG_LIB_ETHDRIVER_LATENCY_TRACE)\n");
+}
+
+#endif /* CONFIG_LIB_ETHDRIVER_LATENCY_TRACE */
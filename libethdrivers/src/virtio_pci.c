@@ -6,6 +6,8 @@
 
 #include <assert.h>
 #include <ethdrivers/helpers.h>
+#include <ethdrivers/ring.h>
+#include <ethdrivers/trace.h>
 #include <ethdrivers/virtio_pci.h>
 #include <virtio/virtio_config.h>
 #include <virtio/virtio_pci.h>
@@ -26,14 +28,11 @@ typedef struct virtio_dev {
     void *mmio_base;
     uint16_t io_base;
     ps_io_port_ops_t ioops;
-    /* R/T Descriptor Head represents the beginning of the block of
-     * descriptors that are currently in use */
-    unsigned int tdh;
-    unsigned int rdh;
-    /* R/T Descriptor Tail represents the next free slot to add
-     * a descriptor */
-    unsigned int tdt;
-    unsigned int rdt;
+    /* head of the rings is the beginning of the block of descriptors that
+     * are currently in use, tail the next free slot to add a descriptor.
+     * Every buffer or frame takes one descriptor more for the virtio header */
+    eth_ring_t rx;
+    eth_ring_t tx;
     /* R/T Used Head represents the index in the used ring that
      * we last observed */
     uint16_t tuh;
@@ -42,17 +41,15 @@ typedef struct virtio_dev {
     uintptr_t rx_ring_phys;
     struct vring rx_ring;
     unsigned int rx_size;
-    unsigned int rx_remain;
-    void **rx_cookies;
     uintptr_t tx_ring_phys;
     struct vring tx_ring;
     unsigned int tx_size;
-    unsigned int tx_remain;
-    void **tx_cookies;
-    unsigned int *tx_lengths;
+    /* time each packet was queued, NULL unless tracing */
+    uint64_t *tx_stamps;
     /* preallocated header. Since we do not actually use any features
      * in the header we put the same one before every send/receive packet */
     uintptr_t virtio_net_hdr_phys;
+    ethif_stats_t stats;
 } virtio_dev_t;
 
 static uint8_t read_reg8(virtio_dev_t *dev, uint16_t port)
@@ -126,18 +123,10 @@ static void free_desc_ring(virtio_dev_t *dev, ps_dma_man_t *dma_man)
         dma_unpin_free(dma_man, (void *)dev->tx_ring.desc, vring_size(dev->tx_size, VIRTIO_PCI_VRING_ALIGN));
         dev->tx_ring.desc = NULL;
     }
-    if (dev->rx_cookies) {
-        free(dev->rx_cookies);
-        dev->rx_cookies = NULL;
-    }
-    if (dev->tx_cookies) {
-        free(dev->tx_cookies);
-        dev->tx_cookies = NULL;
-    }
-    if (dev->tx_lengths) {
-        free(dev->tx_lengths);
-        dev->tx_lengths = NULL;
-    }
+    eth_ring_destroy(&dev->rx);
+    eth_ring_destroy(&dev->tx);
+    ethif_trace_free_stamps(dev->tx_stamps);
+    dev->tx_stamps = NULL;
 }
 
 static int initialize_desc_ring(virtio_dev_t *dev, ps_dma_man_t *dma_man)
@@ -161,21 +150,14 @@ static int initialize_desc_ring(virtio_dev_t *dev, ps_dma_man_t *dma_man)
     memset(tx_ring.virt, 0, vring_size(dev->tx_size, VIRTIO_PCI_VRING_ALIGN));
     vring_init(&dev->tx_ring, dev->tx_size, tx_ring.virt, VIRTIO_PCI_VRING_ALIGN);
     dev->tx_ring_phys = tx_ring.phys;
-    dev->rx_cookies = malloc(sizeof(void *) * dev->rx_size);
-    dev->tx_cookies = malloc(sizeof(void *) * dev->tx_size);
-    dev->tx_lengths = malloc(sizeof(unsigned int) * dev->tx_size);
-    if (!dev->rx_cookies || !dev->tx_cookies || !dev->tx_lengths) {
-        ZF_LOGE("Failed to malloc");
+    /* Keep 2 descriptors back as we cannot actually enqueue size many descriptors,
+     * since then the head and tail pointers would be equal, indicating empty. */
+    if (eth_ring_init(&dev->rx, dev->rx_size, 2, true) || eth_ring_init(&dev->tx, dev->tx_size, 2, true)) {
         free_desc_ring(dev, dma_man);
         return -1;
     }
-    /* Remaining needs to be 2 less than size as we cannot actually enqueue size many descriptors,
-     * since then the head and tail pointers would be equal, indicating empty. */
-    dev->rx_remain = dev->rx_size - 2;
-    dev->tx_remain = dev->tx_size - 2;
+    dev->tx_stamps = ethif_trace_alloc_stamps(dev->tx_size);
 
-    dev->tdh = dev->tdt = 0;
-    dev->rdh = dev->rdt = 0;
     dev->tuh = dev->ruh = 0;
 
     return 0;
@@ -241,15 +223,12 @@ static void complete_tx(struct eth_driver *driver)
 {
     virtio_dev_t *dev = (virtio_dev_t *)driver->eth_data;
     while (dev->tuh != dev->tx_ring.used->idx) {
-        uint16_t ring = dev->tuh % dev->tx_size;
+        uint16_t ring = eth_ring_slot(&dev->tx, dev->tuh);
         unsigned int UNUSED desc = dev->tx_ring.used->ring[ring].id;
-        assert(desc == dev->tdh);
-        void *cookie = dev->tx_cookies[dev->tdh];
-        /* add 1 to the length we stored to account for the extra descriptor
-         * we used for the virtio header */
-        unsigned int used = dev->tx_lengths[dev->tdh] + 1;
-        dev->tx_remain += used;
-        dev->tdh = (dev->tdh + used) % dev->tx_size;
+        assert(desc == dev->tx.head);
+        ethif_trace_complete(dev->tx_stamps, dev->tx.head, ETHIF_TRACE_TX_COMPLETE);
+        /* this releases the extra descriptor we used for the virtio header too */
+        void *cookie = eth_ring_reap(&dev->tx);
         dev->tuh++;
         /* give the buffer back */
         driver->i_cb.tx_complete(driver->cb_cookie, cookie);
@@ -261,54 +240,58 @@ static void fill_rx_bufs(struct eth_driver *driver)
     virtio_dev_t *dev = (virtio_dev_t *)driver->eth_data;
     /* we need 2 free as we enqueue in pairs. One descriptor to hold the
      * virtio header, another one for the actual buffer */
-    while (dev->rx_remain >= 2) {
+    while (dev->rx.remain >= 2) {
         /* request a buffer */
         void *cookie;
         uintptr_t phys = driver->i_cb.allocate_rx_buf(driver->cb_cookie, BUF_SIZE, &cookie);
         if (!phys) {
+            ethif_stats_add(&dev->stats.rx_alloc_failed, 1);
             break;
         }
-        unsigned int next_rdt = (dev->rdt + 1) % dev->rx_size;
-        dev->rx_ring.desc[dev->rdt] = (struct vring_desc) {
+        unsigned int rdt = dev->rx.tail;
+        unsigned int next_rdt = eth_ring_next(&dev->rx, rdt);
+        dev->rx_ring.desc[rdt] = (struct vring_desc) {
             .addr = dev->virtio_net_hdr_phys,
             .len = sizeof(struct virtio_net_hdr),
             .flags = VRING_DESC_F_NEXT | VRING_DESC_F_WRITE,
             .next = next_rdt
         };
-        dev->rx_cookies[dev->rdt] = cookie;
         dev->rx_ring.desc[next_rdt] = (struct vring_desc) {
             .addr = phys,
             .len = BUF_SIZE,
             .flags = VRING_DESC_F_WRITE,
             .next = 0
         };
-        dev->rx_ring.avail->ring[dev->rx_ring.avail->idx % dev->rx_size] = dev->rdt;
+        dev->rx_ring.avail->ring[eth_ring_slot(&dev->rx, dev->rx_ring.avail->idx)] = rdt;
         __atomic_thread_fence(__ATOMIC_RELEASE);
         dev->rx_ring.avail->idx++;
         __atomic_thread_fence(__ATOMIC_RELEASE);
         write_reg16(dev, VIRTIO_PCI_QUEUE_NOTIFY, RX_QUEUE);
-        dev->rdt = (dev->rdt + 2) % dev->rx_size;
-        dev->rx_remain -= 2;
+        eth_ring_post(&dev->rx, cookie, 2);
     }
+    ethif_stats_hwm(&dev->stats.rx_ring_hwm, eth_ring_used(&dev->rx));
 }
 
-static void complete_rx(struct eth_driver *driver)
+/* 'start' is when the interrupt or poll that found the packets began */
+static void complete_rx(struct eth_driver *driver, uint64_t start)
 {
     virtio_dev_t *dev = (virtio_dev_t *)driver->eth_data;
     while (dev->ruh != dev->rx_ring.used->idx) {
-        uint16_t ring = dev->ruh % dev->rx_size;
+        uint16_t ring = eth_ring_slot(&dev->rx, dev->ruh);
         unsigned int UNUSED desc = dev->rx_ring.used->ring[ring].id;
-        assert(desc == dev->rdh);
-        void *cookie = dev->rx_cookies[dev->rdh];
+        assert(desc == dev->rx.head);
         /* subtract off length of the virtio header we received */
         unsigned int len = dev->rx_ring.used->ring[ring].len - sizeof(struct virtio_net_hdr);
-        /* update rdh. remember we actually had two descriptors, one
+        /* update the head. remember we actually had two descriptors, one
          * is the header that we threw away, the other being the actual data */
-        dev->rdh = (dev->rdh + 2) % dev->rx_size;
-        dev->rx_remain += 2;
+        void *cookie = eth_ring_reap(&dev->rx);
         dev->ruh++;
         /* Give the buffers back */
+        ethif_stats_rx(&dev->stats, 1, &len);
+        ethif_trace_record(ETHIF_TRACE_RX_DELIVER, start);
+        uint64_t cb_start = ethif_trace_now();
         driver->i_cb.rx_complete(driver->cb_cookie, 1, &cookie, &len);
+        ethif_trace_record(ETHIF_TRACE_RX_CALLBACK, cb_start);
     }
 }
 
@@ -316,24 +299,26 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
 {
     virtio_dev_t *dev = (virtio_dev_t *)driver->eth_data;
     /* we need to num + 1 free descriptors. The + 1 is for the virtio header */
-    if (dev->tx_remain < num + 1) {
+    if (dev->tx.remain < num + 1) {
         complete_tx(driver);
-        if (dev->tx_remain < num + 1) {
+        if (dev->tx.remain < num + 1) {
+            ethif_stats_add(&dev->stats.tx_failed, 1);
             return ETHIF_TX_FAILED;
         }
     }
     /* install the header */
-    dev->tx_ring.desc[dev->tdt] = (struct vring_desc) {
+    unsigned int tdt = dev->tx.tail;
+    dev->tx_ring.desc[tdt] = (struct vring_desc) {
         .addr = dev->virtio_net_hdr_phys,
         .len = sizeof(struct virtio_net_hdr),
         .flags = VRING_DESC_F_NEXT,
-        .next = (dev->tdt + 1) % dev->tx_size
+        .next = eth_ring_next(&dev->tx, tdt)
     };
     /* now all the buffers */
     unsigned int i;
     for (i = 0; i < num; i++) {
-        unsigned int desc = (dev->tdt + i + 1) % dev->tx_size;
-        unsigned int next_desc = (desc + 1) % dev->tx_size;
+        unsigned int desc = eth_ring_wrap(&dev->tx, tdt + i + 1);
+        unsigned int next_desc = eth_ring_next(&dev->tx, desc);
         dev->tx_ring.desc[desc] = (struct vring_desc) {
             .addr = phys[i],
             .len = len[i],
@@ -341,13 +326,14 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
             .next = next_desc
         };
     }
-    dev->tx_ring.avail->ring[dev->tx_ring.avail->idx % dev->tx_size] = dev->tdt;
-    dev->tx_cookies[dev->tdt] = cookie;
-    dev->tx_lengths[dev->tdt] = num;
+    dev->tx_ring.avail->ring[eth_ring_slot(&dev->tx, dev->tx_ring.avail->idx)] = tdt;
+    ethif_trace_stamp(dev->tx_stamps, tdt);
     /* ensure update to descriptors visible before updating the index */
     __atomic_thread_fence(__ATOMIC_SEQ_CST);
-    dev->tdt = (dev->tdt + num + 1) % dev->tx_size;
-    dev->tx_remain -= (num + 1);
+    /* the frame takes one descriptor more for the virtio header */
+    eth_ring_post(&dev->tx, cookie, num + 1);
+    ethif_stats_tx(&dev->stats, num, len);
+    ethif_stats_hwm(&dev->stats.tx_ring_hwm, eth_ring_used(&dev->tx));
     dev->tx_ring.avail->idx++;
     /* ensure index update visible before notifying */
     __atomic_thread_fence(__ATOMIC_SEQ_CST);
@@ -357,31 +343,45 @@ static int raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys,
 
 static void raw_poll(struct eth_driver *driver)
 {
+    uint64_t start = ethif_trace_now();
+    virtio_dev_t *dev = (virtio_dev_t *)driver->eth_data;
+    ethif_stats_add(&dev->stats.polls, 1);
     complete_tx(driver);
-    complete_rx(driver);
+    complete_rx(driver, start);
     fill_rx_bufs(driver);
 }
 
 static void handle_irq(struct eth_driver *driver, int irq)
 {
+    uint64_t start = ethif_trace_now();
     virtio_dev_t *dev = (virtio_dev_t *)driver->eth_data;
+    ethif_stats_add(&dev->stats.irqs, 1);
     /* read and throw away the ISR state. This will perform the ack */
     read_reg8(dev, VIRTIO_PCI_ISR);
-    raw_poll(driver);
+    complete_tx(driver);
+    complete_rx(driver, start);
+    fill_rx_bufs(driver);
+}
+
+static void get_stats(struct eth_driver *driver, ethif_stats_t *stats)
+{
+    virtio_dev_t *dev = (virtio_dev_t *)driver->eth_data;
+    ethif_stats_read(&dev->stats, stats);
 }
 static struct raw_iface_funcs iface_fns = {
     .raw_handleIRQ = handle_irq,
     .print_state = print_state,
     .low_level_init = low_level_init,
     .raw_tx = raw_tx,
-    .raw_poll = raw_poll
+    .raw_poll = raw_poll,
+    .get_stats = get_stats
 };
 
 int ethif_virtio_pci_init(struct eth_driver *eth_driver, ps_io_ops_t io_ops, void *config)
 {
     int err;
     ethif_virtio_pci_config_t *virtio_config = (ethif_virtio_pci_config_t *)config;
-    virtio_dev_t *dev = (virtio_dev_t *)malloc(sizeof(*dev));
+    virtio_dev_t *dev = (virtio_dev_t *)calloc(1, sizeof(*dev));
     if (!dev) {
         return -1;
     }
@@ -151,6 +151,52 @@ static inline int ps_io_port_out(
     return port_ops->io_port_out_fn(port_ops->cookie, port, io_size, val);
 }
 
+/* Port I/O is little endian, values are stored in buf a byte at a time so it
+ * needs no alignment */
+static inline int ps_io_port_in_rep(
+    const ps_io_port_ops_t *port_ops,
+    uint32_t port,
+    int io_size,
+    void *buf,
+    size_t count)
+{
+    uint8_t *p = buf;
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t val;
+        int error = ps_io_port_in(port_ops, port, io_size, &val);
+        if (error) {
+            return error;
+        }
+        for (int b = 0; b < io_size; b++) {
+            *p++ = val >> (8 * b);
+        }
+    }
+    return 0;
+}
+
+static inline int ps_io_port_out_rep(
+    const ps_io_port_ops_t *port_ops,
+    uint32_t port,
+    int io_size,
+    const void *buf,
+    size_t count)
+{
+    const uint8_t *p = buf;
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t val = 0;
+        for (int b = 0; b < io_size; b++) {
+            val |= (uint32_t) *p++ << (8 * b);
+        }
+        int error = ps_io_port_out(port_ops, port, io_size, val);
+        if (error) {
+            return error;
+        }
+    }
+    return 0;
+}
+
 typedef enum dma_cache_op {
     DMA_CACHE_OP_CLEAN,
     DMA_CACHE_OP_INVALIDATE,
@@ -557,3 +603,11 @@ static inline void write_bits(
  */
 int ps_new_stdlib_malloc_ops(
     ps_malloc_ops_t *ops);
+
+/*
+ * Populate a DMA manager with stdlib malloc wrappers. Physical addresses are
+ * the virtual addresses and cache operations do nothing, so it only suits
+ * software devices that the CPU accesses, not real DMA.
+ */
+int ps_new_stdlib_dma_man(
+    ps_dma_man_t *dma_man);
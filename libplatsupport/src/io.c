@@ -41,3 +41,43 @@ int ps_new_stdlib_malloc_ops(ps_malloc_ops_t *ops)
     ops->cookie = NULL;
     return 0;
 }
+
+static void *ps_stdlib_dma_alloc(UNUSED void *cookie, size_t size, int align, UNUSED int cached,
+                                 UNUSED ps_mem_flags_t flags)
+{
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, MAX(align, sizeof(void *)), size)) {
+        return NULL;
+    }
+    return ptr;
+}
+
+static void ps_stdlib_dma_free(UNUSED void *cookie, void *addr, UNUSED size_t size)
+{
+    free(addr);
+}
+
+static uintptr_t ps_stdlib_dma_pin(UNUSED void *cookie, void *addr, UNUSED size_t size)
+{
+    return (uintptr_t)addr;
+}
+
+static void ps_stdlib_dma_unpin(UNUSED void *cookie, UNUSED void *addr, UNUSED size_t size)
+{
+}
+
+static void ps_stdlib_dma_cache_op(UNUSED void *cookie, UNUSED void *addr, UNUSED size_t size,
+                                   UNUSED dma_cache_op_t op)
+{
+}
+
+int ps_new_stdlib_dma_man(ps_dma_man_t *dma_man)
+{
+    dma_man->dma_alloc_fn = ps_stdlib_dma_alloc;
+    dma_man->dma_free_fn = ps_stdlib_dma_free;
+    dma_man->dma_pin_fn = ps_stdlib_dma_pin;
+    dma_man->dma_unpin_fn = ps_stdlib_dma_unpin;
+    dma_man->dma_cache_op_fn = ps_stdlib_dma_cache_op;
+    dma_man->cookie = NULL;
+    return 0;
+}
@@ -0,0 +1,828 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <satadrivers/ide.h>
+#include <satadrivers/ahci.h>
+#include <satadrivers/ahci_types.h>
+#include <satadrivers/common.h>
+#include <utils/zf_log.h>
+
+#include "ahci_emu.h"
+
+#if !defined(__x86_64__)
+#error "The AHCI emulator single-steps register writes, which needs an x86-64 host"
+#endif
+
+#define EFLAGS_TF   0x100
+
+#define NUM_REGS    (AHCI_EMU_ABAR_SIZE / sizeof(uint32_t))
+#define REG(field)  (offsetof(hba_mem_t, field) / sizeof(uint32_t))
+#define PORT_BASE   (offsetof(hba_mem_t, ports) / sizeof(uint32_t))
+#define PORT_REGS   (sizeof(hba_port_t) / sizeof(uint32_t))
+#define PREG(field) (offsetof(hba_port_t, field) / sizeof(uint32_t))
+
+#define HBA_CAP_S64A        (1u << 31)
+#define HBA_CAP_SAM         (1u << 18)
+#define HBA_CAP_ISS_GEN3    (3u << 20)
+#define HBA_CAP_NCS_32      (31u << 8)
+
+#define EMU_SSTS_ACTIVE     0x113       // IPM active, Gen1 speed, device present
+#define EMU_TFD_READY       0x50        // DRDY | DSC
+#define EMU_TFD_ABORTED     0x451       // ABRT error, DRDY | DSC | ERR
+
+#define EMU_MAX_CHANNELS    32
+
+/* A drive and the port it is on, serviced by a thread of its own */
+typedef struct emu_port {
+    ahci_emu_t *emu;
+    int num;
+    uint32_t *hw;               // Registers of the port as the HBA sees them
+    pthread_t thread;
+
+    // Slots fetched from the command list and not completed yet
+    uint32_t fetched;
+    uint32_t queued;
+    uint32_t failed;
+    uint32_t gen;
+    uint64_t done_at[ENTRIES_PER_CMDLST];
+    uint64_t chan_free[EMU_MAX_CHANNELS];
+} emu_port_t;
+
+struct ahci_emu {
+    ahci_emu_config_t config;
+    int fd;
+    int regs_fd;
+    uint32_t *hw;               // Registers as the HBA sees them
+    uint8_t *drv;               // Read-only view handed to the driver
+    uint32_t snap[NUM_REGS];    // Registers before a trapped write
+    int stepping;
+
+    emu_port_t ports[NUM_MAX_PORTS];
+    int num_threads;
+    int stop;
+
+    uint16_t identify[SATA_BLK_SIZE / sizeof(uint16_t)];
+    ahci_emu_stats_t stats;
+
+    struct sigaction old_segv;
+    struct sigaction old_trap;
+};
+
+static ahci_emu_t *the_emu;
+static int emu_lock_word;
+
+static void emu_lock(void)
+{
+    int expected = 0;
+    while (!__atomic_compare_exchange_n(&emu_lock_word, &expected, 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        expected = 0;
+    }
+}
+
+static void emu_unlock(void)
+{
+    __atomic_store_n(&emu_lock_word, 0, __ATOMIC_RELEASE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Registers where a write sets or clears the bits written rather than storing them */
+static int reg_write_one(uint32_t reg)
+{
+    if (reg < PORT_BASE) {
+        return reg == REG(is);
+    }
+    reg = (reg - PORT_BASE) % PORT_REGS;
+    return (reg == PREG(is)) || (reg == PREG(serr)) || (reg == PREG(sact)) || (reg == PREG(ci));
+}
+
+/* Drop every command of the port, as clearing PxCMD.ST or a reset does */
+static void emu_abort_cmds(emu_port_t *port)
+{
+    port->hw[PREG(ci)] = 0;
+    port->hw[PREG(sact)] = 0;
+    port->hw[PREG(tfd)] = EMU_TFD_READY;
+    port->fetched = 0;
+    port->queued = 0;
+    port->failed = 0;
+    port->gen++;
+}
+
+/* Apply a write of the driver to a register of a port with a drive */
+static void emu_port_write(emu_port_t *port, uint32_t reg, uint32_t old, uint32_t val)
+{
+    uint32_t *hw = port->hw;
+
+    if ((reg == PREG(is)) || (reg == PREG(serr))) {
+        hw[reg] = old & ~val;
+    } else if (reg == PREG(sact)) {
+        hw[reg] = old | val;
+    } else if (reg == PREG(ci)) {
+        if (hw[PREG(cmd)] & HBA_PxCMD_ST) {
+            hw[reg] = old | val;
+        }
+    } else if (reg == PREG(cmd)) {
+        uint32_t cmd = val & ~(HBA_PxCMD_CR | HBA_PxCMD_FR);
+        if (cmd & HBA_PxCMD_ST) {
+            cmd |= HBA_PxCMD_CR;
+        } else if (old & HBA_PxCMD_ST) {
+            emu_abort_cmds(port);
+        }
+        if (cmd & HBA_PxCMD_FRE) {
+            cmd |= HBA_PxCMD_FR;
+        }
+        hw[reg] = cmd;
+    } else if (reg == PREG(sctl)) {
+        // COMRESET takes the link down until DET is cleared again
+        if ((val & PxSCTL_DET_MASK) == PxSCTL_DET_COMRESET) {
+            emu_abort_cmds(port);
+            hw[PREG(ssts)] = HBA_PORT_DET_PRESENT_NO_COM;
+        } else {
+            hw[PREG(ssts)] = EMU_SSTS_ACTIVE;
+        }
+        hw[reg] = val;
+    } else if ((reg == PREG(tfd)) || (reg == PREG(sig)) || (reg == PREG(ssts))) {
+        // Read only
+    } else {
+        hw[reg] = val;
+    }
+}
+
+/* Apply a write of the driver to a register, with the lock held */
+static void emu_reg_write(ahci_emu_t *emu, uint32_t reg, uint32_t old, uint32_t val)
+{
+    uint32_t *hw = emu->hw;
+
+    if (reg >= PORT_BASE) {
+        uint32_t num = (reg - PORT_BASE) / PORT_REGS;
+        if (num < emu->config.ports) {
+            emu_port_write(&emu->ports[num], (reg - PORT_BASE) % PORT_REGS, old, val);
+        } else {
+            // No drive, the registers just hold what is written
+            hw[reg] = val;
+        }
+    } else if (reg == REG(ghc)) {
+        if (val & GHC_HR_BIT) {
+            for (int i = 0; i < emu->config.ports; i++) {
+                emu_port_t *port = &emu->ports[i];
+                emu_abort_cmds(port);
+                port->hw[PREG(cmd)] = 0;
+                port->hw[PREG(is)] = 0;
+                port->hw[PREG(ie)] = 0;
+                port->hw[PREG(serr)] = 0;
+            }
+            hw[REG(is)] = 0;
+            val = 0;
+        }
+        // The HBA only speaks AHCI, so AE stays set
+        hw[reg] = val | GHC_AHCI_EN_BIT;
+    } else if (reg == REG(is)) {
+        hw[reg] = old & ~val;
+    } else if ((reg == REG(cap)) || (reg == REG(pi)) || (reg == REG(vs)) || (reg == REG(cap2))) {
+        // Read only
+    } else {
+        hw[reg] = val;
+    }
+}
+
+/* Registers of the x86-64 ModRM encoding, in the order of ucontext_t */
+static const int gregs_of_modrm[16] = {
+    REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+    REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15
+};
+
+/*
+ * Decode a 32-bit `mov` to memory, the way the driver stores to a register.
+ * Returns the length of the instruction and sets the value stored, or -1
+ * for anything else.
+ */
+static int decode_store(ucontext_t *uc, uint32_t *val)
+{
+    const uint8_t *ip = (const uint8_t *) uc->uc_mcontext.gregs[REG_RIP];
+    uint8_t rex = 0;
+    int len = 0;
+
+    if ((ip[0] & 0xF0) == 0x40) {
+        rex = ip[len++];
+    }
+    uint8_t op = ip[len++];
+    if ((rex & 0x08) || ((0x89 != op) && (0xC7 != op))) {
+        return -1;
+    }
+
+    uint8_t modrm = ip[len++];
+    int mod = modrm >> 6;
+    int reg = (modrm >> 3) & 7;
+    int rm = modrm & 7;
+    if (3 == mod) {
+        return -1;
+    }
+    if (4 == rm) {
+        uint8_t sib = ip[len++];
+        if ((0 == mod) && (5 == (sib & 7))) {
+            len += 4;
+        }
+    } else if ((0 == mod) && (5 == rm)) {
+        len += 4;
+    }
+    if (1 == mod) {
+        len += 1;
+    } else if (2 == mod) {
+        len += 4;
+    }
+
+    if (0xC7 == op) {
+        if (0 != reg) {
+            return -1;
+        }
+        memcpy(val, ip + len, sizeof(*val));
+        len += 4;
+    } else {
+        *val = (uint32_t) uc->uc_mcontext.gregs[gregs_of_modrm[reg | ((rex & 0x04) ? 8 : 0)]];
+    }
+    return len;
+}
+
+/*
+ * A store to the read-only register view. Plain stores are decoded and
+ * applied. Anything else, such as a read-modify-write, is let through for
+ * one instruction: the registers are saved first and those written one to
+ * set or clear are zeroed, so the value written shows even if it is what
+ * they held.
+ */
+static void emu_segv(int sig, siginfo_t *info, void *context)
+{
+    ahci_emu_t *emu = the_emu;
+    ucontext_t *uc = context;
+    uint8_t *addr = info->si_addr;
+    uint32_t val = 0;
+
+    if ((NULL == emu) || (addr < emu->drv) || (addr >= emu->drv + AHCI_EMU_ABAR_SIZE)) {
+        // Not ours, fault again without the handler
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+
+    uint32_t off = addr - emu->drv;
+    int len = (off % sizeof(uint32_t)) ? -1 : decode_store(uc, &val);
+
+    emu_lock();
+    if (len > 0) {
+        uint32_t reg = off / sizeof(uint32_t);
+        emu_reg_write(emu, reg, emu->hw[reg], val);
+        emu->stats.reg_writes++;
+        emu_unlock();
+        uc->uc_mcontext.gregs[REG_RIP] += len;
+        return;
+    }
+
+    memcpy(emu->snap, emu->hw, sizeof(emu->snap));
+    for (uint32_t reg = 0; reg < NUM_REGS; reg++) {
+        if (reg_write_one(reg)) {
+            emu->hw[reg] = 0;
+        }
+    }
+    emu->stepping = 1;
+    mprotect(emu->drv, AHCI_EMU_ABAR_SIZE, PROT_READ | PROT_WRITE);
+    uc->uc_mcontext.gregs[REG_EFL] |= EFLAGS_TF;
+}
+
+/* The store went through, apply it and protect the view again */
+static void emu_trap(int sig, siginfo_t *info, void *context)
+{
+    ahci_emu_t *emu = the_emu;
+    ucontext_t *uc = context;
+
+    if ((NULL == emu) || !emu->stepping) {
+        signal(SIGTRAP, SIG_DFL);
+        raise(SIGTRAP);
+        return;
+    }
+
+    uc->uc_mcontext.gregs[REG_EFL] &= ~EFLAGS_TF;
+    mprotect(emu->drv, AHCI_EMU_ABAR_SIZE, PROT_READ);
+
+    // Restore everything before applying the stores, which may change
+    // other registers
+    uint32_t written[NUM_REGS];
+    memcpy(written, emu->hw, sizeof(written));
+    memcpy(emu->hw, emu->snap, sizeof(emu->snap));
+    for (uint32_t reg = 0; reg < NUM_REGS; reg++) {
+        if (reg_write_one(reg) ? (0 != written[reg]) : (written[reg] != emu->snap[reg])) {
+            emu_reg_write(emu, reg, emu->snap[reg], written[reg]);
+        }
+    }
+    emu->stats.reg_writes++;
+    emu->stats.steps++;
+    emu->stepping = 0;
+    emu_unlock();
+}
+
+static void ident_string(uint16_t *words, const char *str, int len)
+{
+    char buf[len];
+
+    memset(buf, ' ', len);
+    memcpy(buf, str, strnlen(str, len));
+    // ATA strings hold the first character of a pair in the high byte
+    for (int i = 0; i < len; i += 2) {
+        words[i / 2] = (uint16_t)((uint8_t) buf[i] << 8) | (uint8_t) buf[i + 1];
+    }
+}
+
+static void build_identify(ahci_emu_t *emu)
+{
+    uint16_t *id = emu->identify;
+    uint64_t sectors = emu->config.sectors;
+    uint32_t sectors28 = (sectors > 0x0FFFFFFF) ? 0x0FFFFFFF : sectors;
+
+    id[0] = 0x0040;                         // Fixed, non-removable
+    ident_string(&id[10], "EMU00000001", 20);
+    ident_string(&id[23], "1.0", 8);
+    ident_string(&id[27], "libsatadrivers AHCI emulator", 40);
+    id[47] = 0x8010;
+    id[49] = 0x0300;                        // LBA and DMA
+    id[53] = 0x0006;
+    id[60] = sectors28 & 0xFFFF;
+    id[61] = sectors28 >> 16;
+    if (emu->config.ncq_depth) {
+        id[75] = emu->config.ncq_depth - 1;
+        id[76] = IDENT_NCQ_SUPPORT_BIT;
+    }
+    id[76] |= 0x0006;                       // Gen1 and Gen2 speeds
+    id[80] = 0x01F0;                        // ATA8-ACS
+    id[83] = 0x4000 | (1 << 10) | (1 << 13) | (1 << 12); // LBA48, FLUSH CACHE (EXT)
+    id[86] = (1 << 10) | (1 << 13) | (1 << 12);
+    for (int i = 0; i < 4; i++) {
+        id[100 + i] = (sectors >> (16 * i)) & 0xFFFF;
+    }
+}
+
+/*
+ * Move bytes between the image, or the IDENTIFY data, and the memory the
+ * PRDT of a command points to. Returns the bytes transferred.
+ */
+static uint32_t emu_transfer(emu_port_t *port, hba_cmd_hdr_t *hdr, hba_cmd_tbl_t *tbl, int write, uint64_t lba,
+                             uint32_t bytes, const uint8_t *src)
+{
+    ahci_emu_t *emu = port->emu;
+    // Every drive has its own part of the image
+    off_t off = (port->num * emu->config.sectors + lba) * SATA_BLK_SIZE;
+    uint32_t left = bytes;
+
+    for (int i = 0; (i < hdr->prdtl) && left; i++) {
+        hba_prdt_entry_t *prd = &tbl->prdt_entry[i];
+        uint8_t *ptr = (uint8_t *)(uintptr_t)(((uint64_t) prd->dbau << 32) | prd->dba);
+        uint32_t len = prd->dbc + 1;
+        ssize_t ret;
+
+        if (len > left) {
+            len = left;
+        }
+        if (src) {
+            memcpy(ptr, src, len);
+            src += len;
+            ret = len;
+        } else if (write) {
+            ret = pwrite(emu->fd, ptr, len, off);
+        } else {
+            ret = pread(emu->fd, ptr, len, off);
+        }
+        if (ret != len) {
+            break;
+        }
+        off += len;
+        left -= len;
+    }
+
+    hdr->prdbc = bytes - left;
+    return bytes - left;
+}
+
+/*
+ * Run the command in a slot against the image. Returns the time it takes,
+ * or -1 if the drive aborts it.
+ */
+static int64_t emu_run_cmd(emu_port_t *port, hba_cmd_hdr_t *clb, int slot, int *queued)
+{
+    ahci_emu_t *emu = port->emu;
+    hba_cmd_hdr_t *hdr = &clb[slot];
+    hba_cmd_tbl_t *tbl = (hba_cmd_tbl_t *)(uintptr_t)(((uint64_t) hdr->ctbau << 32) | hdr->ctba);
+    fis_reg_h2d_t *fis = (fis_reg_h2d_t *) tbl->cfis;
+    uint64_t lba48 = (uint64_t) fis->lba0 | ((uint64_t) fis->lba1 << 8) | ((uint64_t) fis->lba2 << 16)
+                     | ((uint64_t) fis->lba3 << 24) | ((uint64_t) fis->lba4 << 32) | ((uint64_t) fis->lba5 << 40);
+    uint32_t count;
+    int write = 0;
+
+    *queued = 0;
+    if ((FIS_TYPE_REG_H2D != fis->fis_type) || !fis->c) {
+        return -1;
+    }
+
+    switch (fis->command) {
+    case ATA_CMD_IDENTIFY:
+        if (emu_transfer(port, hdr, tbl, 0, 0, SATA_BLK_SIZE, (uint8_t *) emu->identify) != SATA_BLK_SIZE) {
+            return -1;
+        }
+        return emu->config.read_us * 1000ll;
+    case ATA_CMD_CACHE_FLUSH:
+    case ATA_CMD_CACHE_FLUSH_EXT:
+        fdatasync(emu->fd);
+        return emu->config.write_us * 1000ll;
+    case ATA_CMD_READ_DMA:
+    case ATA_CMD_WRITE_DMA:
+        write = (ATA_CMD_WRITE_DMA == fis->command);
+        lba48 = (lba48 & 0xFFFFFF) | ((uint64_t)(fis->device & 0x0F) << 24);
+        count = fis->countl ? fis->countl : 256;
+        break;
+    case ATA_CMD_READ_DMA_EXT:
+    case ATA_CMD_WRITE_DMA_EXT:
+        write = (ATA_CMD_WRITE_DMA_EXT == fis->command);
+        count = fis->countl | (fis->counth << 8);
+        count = count ? count : 65536;
+        break;
+    case ATA_CMD_READ_FPDMA_QUEUED:
+    case ATA_CMD_WRITE_FPDMA_QUEUED:
+        // The tag must be the slot and active in PxSACT
+        if (!emu->config.ncq_depth || ((fis->countl >> 3) != slot)) {
+            return -1;
+        }
+        write = (ATA_CMD_WRITE_FPDMA_QUEUED == fis->command);
+        count = fis->featurel | (fis->featureh << 8);
+        count = count ? count : 65536;
+        *queued = 1;
+        break;
+    default:
+        ZF_LOGE("AHCI EMU: command 0x%x not supported", fis->command);
+        return -1;
+    }
+
+    if ((lba48 + count > emu->config.sectors) || (write != hdr->w)) {
+        return -1;
+    }
+    if (emu_transfer(port, hdr, tbl, write, lba48, count * SATA_BLK_SIZE, NULL) != count * SATA_BLK_SIZE) {
+        return -1;
+    }
+
+    return (write ? emu->config.write_us : emu->config.read_us) * 1000ll + (int64_t) count * emu->config.sect_ns;
+}
+
+/* When a command finishes, on the channel that frees up first */
+static uint64_t emu_schedule(emu_port_t *port, uint64_t now, int64_t service, int queued)
+{
+    int channels = queued ? port->emu->config.channels : 1;
+    int chan = 0;
+
+    for (int i = 1; i < channels; i++) {
+        if (port->chan_free[i] < port->chan_free[chan]) {
+            chan = i;
+        }
+    }
+    uint64_t start = (port->chan_free[chan] > now) ? port->chan_free[chan] : now;
+    port->chan_free[chan] = start + service;
+    return port->chan_free[chan];
+}
+
+/* Post the completion of a slot, with the lock held */
+static void emu_complete(emu_port_t *port, int slot)
+{
+    ahci_emu_t *emu = port->emu;
+    uint32_t *hw = port->hw;
+    uint32_t bit = 1u << slot;
+
+    if (port->failed & bit) {
+        // The HBA stops on a task file error until the port is restarted
+        hw[PREG(tfd)] = EMU_TFD_ABORTED;
+        hw[PREG(is)] |= HBA_PxIS_TFES;
+    } else {
+        hba_rx_fis_t *rx = (hba_rx_fis_t *)(uintptr_t)(((uint64_t) hw[PREG(fbu)] << 32) | hw[PREG(fb)]);
+        if (port->queued & bit) {
+            hw[PREG(sact)] &= ~bit;
+            hw[PREG(is)] |= HBA_PxIS_SDBS;
+        } else {
+            hw[PREG(ci)] &= ~bit;
+            hw[PREG(is)] |= HBA_PxIS_DHRS;
+        }
+        if (rx && (hw[PREG(cmd)] & HBA_PxCMD_FRE)) {
+            rx->rfis.fis_type = FIS_TYPE_REG_D2H;
+            rx->rfis.i = 1;
+            rx->rfis.status = EMU_TFD_READY;
+            rx->rfis.error = 0;
+        }
+        hw[PREG(tfd)] = EMU_TFD_READY;
+        port->fetched &= ~bit;
+        port->queued &= ~bit;
+        emu->stats.cmds++;
+    }
+    if (hw[PREG(is)] & hw[PREG(ie)]) {
+        emu->hw[REG(is)] |= 1u << port->num;
+    }
+}
+
+static void *emu_thread(void *arg)
+{
+    emu_port_t *port = arg;
+    ahci_emu_t *emu = port->emu;
+    uint32_t *hw = port->hw;
+
+    while (!__atomic_load_n(&emu->stop, __ATOMIC_RELAXED)) {
+        uint64_t now = now_ns();
+
+        // Look for work without the lock, which the driver takes on every
+        // register write, and check again with it
+        uint32_t fetched = __atomic_load_n(&port->fetched, __ATOMIC_RELAXED);
+        int due = 0;
+        for (int slot = 0; slot < ENTRIES_PER_CMDLST; slot++) {
+            if ((fetched & (1u << slot)) && (port->done_at[slot] <= now)) {
+                due = 1;
+                break;
+            }
+        }
+        if (!due && !(__atomic_load_n(&hw[PREG(ci)], __ATOMIC_RELAXED) & ~fetched)) {
+            // Let the driver run if it shares the CPU
+            sched_yield();
+            continue;
+        }
+
+        // Fetch newly issued slots. Queued ones leave PxCI once the drive
+        // took the command, the others when they complete.
+        emu_lock();
+        uint32_t gen = port->gen;
+        uint32_t issued = 0;
+        hba_cmd_hdr_t *clb = NULL;
+        if ((hw[PREG(cmd)] & HBA_PxCMD_ST) && !(hw[PREG(is)] & HBA_PxIS_TFES)) {
+            issued = hw[PREG(ci)] & ~port->fetched;
+            clb = (hba_cmd_hdr_t *)(uintptr_t)(((uint64_t) hw[PREG(clbu)] << 32) | hw[PREG(clb)]);
+            port->fetched |= issued;
+        }
+        emu_unlock();
+
+        for (int slot = 0; issued; slot++) {
+            uint32_t bit = 1u << slot;
+            int queued;
+            if (!(issued & bit)) {
+                continue;
+            }
+            issued &= ~bit;
+
+            int64_t service = emu_run_cmd(port, clb, slot, &queued);
+
+            emu_lock();
+            if (gen == port->gen) {
+                if (service < 0) {
+                    port->failed |= bit;
+                    port->done_at[slot] = now;
+                } else {
+                    port->done_at[slot] = emu_schedule(port, now, service, queued);
+                }
+                if (queued) {
+                    port->queued |= bit;
+                    hw[PREG(ci)] &= ~bit;
+                }
+                uint32_t inflight = __builtin_popcount(port->fetched);
+                if (inflight > emu->stats.max_inflight) {
+                    emu->stats.max_inflight = inflight;
+                }
+                if (queued) {
+                    emu->stats.queued++;
+                }
+            }
+            emu_unlock();
+        }
+
+        now = now_ns();
+        emu_lock();
+        if (!(hw[PREG(is)] & HBA_PxIS_TFES)) {
+            for (int slot = 0; slot < ENTRIES_PER_CMDLST; slot++) {
+                if ((port->fetched & (1u << slot)) && (port->done_at[slot] <= now)) {
+                    emu_complete(port, slot);
+                    if (hw[PREG(is)] & HBA_PxIS_TFES) {
+                        break;
+                    }
+                }
+            }
+        }
+        emu_unlock();
+    }
+
+    return NULL;
+}
+
+static void *emu_io_map(void *cookie, uintptr_t paddr, size_t size, int cached, ps_mem_flags_t flags)
+{
+    ahci_emu_t *emu = cookie;
+
+    if ((paddr < AHCI_EMU_ABAR_PADDR) || (paddr + size > AHCI_EMU_ABAR_PADDR + AHCI_EMU_ABAR_SIZE)) {
+        ZF_LOGE("AHCI EMU: no device at 0x%lx", (unsigned long) paddr);
+        return NULL;
+    }
+    return emu->drv + (paddr - AHCI_EMU_ABAR_PADDR);
+}
+
+static void emu_io_unmap(void *cookie, void *vaddr, size_t size)
+{
+}
+
+int ahci_emu_io_ops(ahci_emu_t *emu, ps_io_ops_t *io_ops)
+{
+    if ((NULL == emu) || (NULL == io_ops)) {
+        return -1;
+    }
+
+    memset(io_ops, 0, sizeof(*io_ops));
+    ps_new_stdlib_malloc_ops(&io_ops->malloc_ops);
+    ps_new_stdlib_dma_man(&io_ops->dma_manager);
+    io_ops->io_mapper.cookie = emu;
+    io_ops->io_mapper.io_map_fn = emu_io_map;
+    io_ops->io_mapper.io_unmap_fn = emu_io_unmap;
+
+    return 0;
+}
+
+int ahci_emu_sata_init(ahci_emu_t *emu, ps_io_ops_t *io_ops, sata_driver_t *driver)
+{
+    int ports = emu->config.ports;
+    ahci_intel_config_t config = {
+        .clb_size = ports * CMD_LIST_SIZE,
+        .ctba_size = ports * ENTRIES_PER_CMDLST * CMD_TBL_SIZE,
+        .fb_size = ports * RCV_FIS_SIZE,
+        .data_size = ports * AHCI_EMU_DATA_SIZE,
+    };
+
+    if (ahci_emu_io_ops(emu, io_ops)) {
+        return -1;
+    }
+    config.bar0 = ps_io_map(&io_ops->io_mapper, AHCI_EMU_ABAR_PADDR, AHCI_EMU_ABAR_SIZE, 0, PS_MEM_NORMAL);
+    config.clb = ps_dma_alloc(&io_ops->dma_manager, config.clb_size, CMD_LIST_SIZE, 0, PS_MEM_NORMAL);
+    config.ctba = ps_dma_alloc(&io_ops->dma_manager, config.ctba_size, 128, 0, PS_MEM_NORMAL);
+    config.fb = ps_dma_alloc(&io_ops->dma_manager, config.fb_size, RCV_FIS_SIZE, 0, PS_MEM_NORMAL);
+    config.data = ps_dma_alloc(&io_ops->dma_manager, config.data_size, 4096, 0, PS_MEM_NORMAL);
+    if (!config.bar0 || !config.clb || !config.ctba || !config.fb || !config.data) {
+        ZF_LOGE("AHCI EMU: cannot map the HBA or allocate its memory");
+        return -1;
+    }
+
+    int err = sata_init(io_ops, driver, AHCI, &config);
+    if (SATA_NO_ERR != err) {
+        ZF_LOGE("AHCI EMU: sata_init failed: %d", err);
+        return -1;
+    }
+    return 0;
+}
+
+void ahci_emu_get_stats(ahci_emu_t *emu, ahci_emu_stats_t *stats)
+{
+    emu_lock();
+    *stats = emu->stats;
+    emu_unlock();
+}
+
+static void emu_free(ahci_emu_t *emu)
+{
+    if (emu->drv && (MAP_FAILED != emu->drv)) {
+        munmap(emu->drv, AHCI_EMU_ABAR_SIZE);
+    }
+    if (emu->hw && (MAP_FAILED != (void *) emu->hw)) {
+        munmap(emu->hw, AHCI_EMU_ABAR_SIZE);
+    }
+    if (emu->regs_fd >= 0) {
+        close(emu->regs_fd);
+    }
+    if (emu->fd >= 0) {
+        close(emu->fd);
+    }
+    free(emu);
+}
+
+int ahci_emu_create(const ahci_emu_config_t *config, ahci_emu_t **emu_out)
+{
+    struct sigaction sa;
+    struct stat st;
+
+    if ((NULL == config) || (NULL == emu_out) || (NULL == config->image) || (0 == config->sectors)) {
+        ZF_LOGE("AHCI EMU: invalid configuration");
+        return -1;
+    }
+    if ((config->ncq_depth < 0) || (config->ncq_depth > ENTRIES_PER_CMDLST)
+        || (config->channels < 1) || (config->channels > EMU_MAX_CHANNELS)
+        || (config->ports < 1) || (config->ports > NUM_MAX_PORTS)) {
+        ZF_LOGE("AHCI EMU: queue depth, channels or ports out of range");
+        return -1;
+    }
+    if (the_emu) {
+        ZF_LOGE("AHCI EMU: only one emulator can run at a time");
+        return -1;
+    }
+
+    ahci_emu_t *emu = calloc(1, sizeof(*emu));
+    if (NULL == emu) {
+        return -1;
+    }
+    emu->config = *config;
+    emu->regs_fd = -1;
+
+    emu->fd = open(config->image, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if ((emu->fd < 0) || fstat(emu->fd, &st)) {
+        ZF_LOGE("AHCI EMU: cannot open %s: %s", config->image, strerror(errno));
+        emu_free(emu);
+        return -1;
+    }
+    uint64_t image_size = config->ports * config->sectors * SATA_BLK_SIZE;
+    if (((uint64_t) st.st_size < image_size) && ftruncate(emu->fd, image_size)) {
+        ZF_LOGE("AHCI EMU: cannot grow %s: %s", config->image, strerror(errno));
+        emu_free(emu);
+        return -1;
+    }
+
+    // Both views share the pages, so the HBA side sees stores of the driver
+    emu->regs_fd = memfd_create("ahci-abar", MFD_CLOEXEC);
+    if ((emu->regs_fd < 0) || ftruncate(emu->regs_fd, AHCI_EMU_ABAR_SIZE)) {
+        ZF_LOGE("AHCI EMU: cannot create the register file: %s", strerror(errno));
+        emu_free(emu);
+        return -1;
+    }
+    emu->hw = mmap(NULL, AHCI_EMU_ABAR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, emu->regs_fd, 0);
+    emu->drv = mmap(NULL, AHCI_EMU_ABAR_SIZE, PROT_READ, MAP_SHARED, emu->regs_fd, 0);
+    if ((MAP_FAILED == (void *) emu->hw) || (MAP_FAILED == emu->drv)) {
+        ZF_LOGE("AHCI EMU: cannot map the registers: %s", strerror(errno));
+        emu_free(emu);
+        return -1;
+    }
+
+    emu->hw[REG(cap)] = HBA_CAP_S64A | HBA_CAP_SAM | HBA_CAP_ISS_GEN3 | HBA_CAP_NCS_32
+                        | (config->ncq_depth ? HBA_CAP_SNCQ : 0);
+    emu->hw[REG(ghc)] = GHC_AHCI_EN_BIT;
+    emu->hw[REG(pi)] = (config->ports < 32) ? ((1u << config->ports) - 1) : ~0u;
+    emu->hw[REG(vs)] = 0x00010301;
+    for (int i = 0; i < config->ports; i++) {
+        emu_port_t *port = &emu->ports[i];
+        port->emu = emu;
+        port->num = i;
+        port->hw = emu->hw + PORT_BASE + i * PORT_REGS;
+        port->hw[PREG(ssts)] = EMU_SSTS_ACTIVE;
+        port->hw[PREG(sig)] = SATA_SIG_ATA;
+        port->hw[PREG(tfd)] = EMU_TFD_READY;
+    }
+    build_identify(emu);
+
+    the_emu = emu;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_sigaction = emu_segv;
+    sigaction(SIGSEGV, &sa, &emu->old_segv);
+    sa.sa_sigaction = emu_trap;
+    sigaction(SIGTRAP, &sa, &emu->old_trap);
+
+    for (; emu->num_threads < config->ports; emu->num_threads++) {
+        emu_port_t *port = &emu->ports[emu->num_threads];
+        if (pthread_create(&port->thread, NULL, emu_thread, port)) {
+            ZF_LOGE("AHCI EMU: cannot start the thread of port %d", port->num);
+            ahci_emu_destroy(emu);
+            return -1;
+        }
+    }
+
+    *emu_out = emu;
+    return 0;
+}
+
+void ahci_emu_destroy(ahci_emu_t *emu)
+{
+    if (NULL == emu) {
+        return;
+    }
+
+    __atomic_store_n(&emu->stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < emu->num_threads; i++) {
+        pthread_join(emu->ports[i].thread, NULL);
+    }
+
+    sigaction(SIGSEGV, &emu->old_segv, NULL);
+    sigaction(SIGTRAP, &emu->old_trap, NULL);
+    the_emu = NULL;
+    emu_free(emu);
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+#include <stdint.h>
+#include <platsupport/io.h>
+#include <satadrivers/common.h>
+
+/*
+ * A software AHCI HBA with a SATA drive on each of ports 0 to ports - 1,
+ * backed by a disk image file that holds the drives one after the other. It
+ * runs the unmodified driver on a Linux host, so its command path can be
+ * profiled without hardware.
+ *
+ * The driver sees the HBA registers through ps_io_map at AHCI_EMU_ABAR_PADDR.
+ * The page is mapped read-only. A write faults, is single-stepped and then
+ * applied with the semantics of the register, so PxIS and PxSERR are write
+ * one to clear and PxCI and PxSACT are write one to set like on hardware.
+ * This needs an x86-64 host. Stores that are not a plain mov are let through
+ * the page for one instruction, which is only safe while one thread uses the
+ * driver: stats.steps counts them.
+ *
+ * Every port has a thread of the emulator. It fetches the command headers,
+ * FISes and PRDTs of issued slots from memory of the DMA manager, which maps
+ * 1:1. It runs
+ * IDENTIFY DEVICE, READ/WRITE DMA (EXT), READ/WRITE FPDMA QUEUED and FLUSH
+ * CACHE (EXT) against the image. A command takes its read_us or write_us
+ * plus sect_ns for every sector. Queued commands run on up to `channels` at
+ * once, commands that are not queued run one after the other.
+ */
+
+#define AHCI_EMU_ABAR_PADDR 0xfebf0000
+#define AHCI_EMU_ABAR_SIZE  0x2000
+#define AHCI_EMU_DATA_SIZE  (1024 * 1024)   // Bounce buffer of each port
+
+typedef struct ahci_emu_config {
+    const char *image;      // Disk image, created or grown to sectors
+    uint64_t sectors;       // Size of each drive
+    int ports;              // Drives, on ports 0 to ports - 1
+    uint32_t read_us;       // Time of a read command
+    uint32_t write_us;      // Time of a write command
+    uint32_t sect_ns;       // Transfer time of a sector
+    int channels;           // Queued commands serviced at once
+    int ncq_depth;          // Queue depth in IDENTIFY data, 0 for no NCQ
+} ahci_emu_config_t;
+
+typedef struct ahci_emu_stats {
+    uint64_t cmds;          // Commands completed
+    uint64_t queued;        // Of which were READ/WRITE FPDMA QUEUED
+    uint64_t reg_writes;    // Register writes trapped
+    uint64_t steps;         // Of which were single-stepped
+    uint32_t max_inflight;  // Most commands a drive held at once
+} ahci_emu_stats_t;
+
+typedef struct ahci_emu ahci_emu_t;
+
+/* Only one emulator can exist at a time, as it owns the fault handlers */
+int ahci_emu_create(const ahci_emu_config_t *config, ahci_emu_t **emu);
+void ahci_emu_destroy(ahci_emu_t *emu);
+
+/* Fills in stdlib memory and DMA managers and an io_mapper for the ABAR */
+int ahci_emu_io_ops(ahci_emu_t *emu, ps_io_ops_t *io_ops);
+
+/* Fills in io_ops as above and runs sata_init in AHCI mode on every port */
+int ahci_emu_sata_init(ahci_emu_t *emu, ps_io_ops_t *io_ops, sata_driver_t *driver);
+
+void ahci_emu_get_stats(ahci_emu_t *emu, ahci_emu_stats_t *stats);
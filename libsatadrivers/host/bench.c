@@ -0,0 +1,462 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * IOPS and latency of the AHCI driver against the host emulator. Every
+ * workload keeps a fixed number of requests in flight through sata_submit
+ * and completes them with sata_poll, for sequential and random reads and
+ * writes at each queue depth. The emulator models the drive, so the results
+ * compare driver configurations rather than disks.
+ *
+ * With --ports N the emulator has a drive on each of N ports and every
+ * workload runs on all of them at once, from a thread per port. The threads
+ * use ahci_submit and ahci_ncq_poll on their own drive, as the sata_* layer
+ * around the cache is single threaded, so they only meet at the port locks
+ * of the driver. The results add up the ports.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <satadrivers/ide.h>
+#include <satadrivers/ahci.h>
+#include <satadrivers/common.h>
+
+#include "ahci_emu.h"
+
+#define BENCH_MAX_QD    32
+
+typedef struct bench_worker bench_worker_t;
+
+typedef struct bench_req {
+    sata_request_t req;
+    bench_worker_t *worker;
+    uint64_t start;
+    int busy;
+    int status;
+    uint8_t buf[AHCI_MAX_CMD_SECTS * SATA_BLK_SIZE];
+} bench_req_t;
+
+typedef struct bench_opts {
+    ahci_emu_config_t emu;
+    uint32_t ops;
+    uint32_t sects;
+    int quick;
+} bench_opts_t;
+
+/* A workload on one drive, run by a thread of its own with several ports */
+struct bench_worker {
+    sata_driver_t *driver;
+    const bench_opts_t *opts;
+    pthread_barrier_t *start;
+    uint8_t drive;
+    int random;
+    int write;
+    int qd;
+    bench_req_t *reqs;
+    uint64_t *latencies;    // opts->ops of them
+    uint32_t completed;
+    int err;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void bench_complete(void *token, int status)
+{
+    bench_req_t *r = token;
+    bench_worker_t *w = r->worker;
+
+    w->latencies[w->completed++] = now_ns() - r->start;
+    r->status = status;
+    r->busy = 0;
+}
+
+static uint8_t pattern(uint8_t drive, uint32_t i)
+{
+    return (uint8_t)(i * 7 + (i >> 9) + drive * 13);
+}
+
+/*
+ * Write a pattern to every drive with the synchronous calls, then read it
+ * back with the synchronous and the asynchronous ones. The patterns differ
+ * between drives, so drives that share sectors of the image show.
+ */
+static int check_data(sata_driver_t *driver, const bench_opts_t *opts)
+{
+    uint32_t sects = 3 * AHCI_MAX_CMD_SECTS + 5;
+    uint8_t *out = malloc(sects * SATA_BLK_SIZE);
+    uint8_t *in = malloc(sects * SATA_BLK_SIZE);
+    bench_req_t *r = calloc(1, sizeof(*r));
+    uint64_t *latency = calloc(1, sizeof(*latency));
+    bench_worker_t w = { .latencies = latency };
+    uint64_t lba = opts->emu.sectors / 2 + 3;
+    int err = -1;
+
+    if (!out || !in || !r || !latency) {
+        goto out;
+    }
+    for (int drive = 0; drive < opts->emu.ports; drive++) {
+        for (uint32_t i = 0; i < sects * SATA_BLK_SIZE; i++) {
+            out[i] = pattern(drive, i);
+        }
+        if (SATA_NO_ERR != sata_write_sectors_ext(driver, drive, sects, lba, out)) {
+            fprintf(stderr, "bench: write to drive %d failed\n", drive);
+            goto out;
+        }
+    }
+
+    for (int drive = 0; drive < opts->emu.ports; drive++) {
+        for (uint32_t i = 0; i < sects * SATA_BLK_SIZE; i++) {
+            out[i] = pattern(drive, i);
+        }
+        if (SATA_NO_ERR != sata_read_sectors_ext(driver, drive, sects, lba, in)
+            || memcmp(in, out, sects * SATA_BLK_SIZE)) {
+            fprintf(stderr, "bench: synchronous read back of drive %d does not match\n", drive);
+            goto out;
+        }
+
+        r->req = (sata_request_t) {
+            .direction = ATA_READ, .drive = drive, .numsects = AHCI_MAX_CMD_SECTS, .lba = lba + 1, .buf = r->buf
+        };
+        r->worker = &w;
+        r->busy = 1;
+        r->start = now_ns();
+        w.completed = 0;
+        if (SATA_NO_ERR != sata_submit(driver, &r->req, bench_complete, r)) {
+            fprintf(stderr, "bench: submit failed\n");
+            goto out;
+        }
+        while (r->busy) {
+            sata_poll(driver);
+            sched_yield();
+        }
+        if ((SATA_NO_ERR != r->status)
+            || memcmp(r->buf, out + SATA_BLK_SIZE, AHCI_MAX_CMD_SECTS * SATA_BLK_SIZE)) {
+            fprintf(stderr, "bench: asynchronous read back of drive %d does not match\n", drive);
+            goto out;
+        }
+    }
+    err = 0;
+
+out:
+    free(out);
+    free(in);
+    free(r);
+    free(latency);
+    return err;
+}
+
+/* Keep w->qd requests in flight on the drive of the worker until opts->ops completed */
+static void *run_worker(void *arg)
+{
+    bench_worker_t *w = arg;
+    const bench_opts_t *opts = w->opts;
+    int threaded = opts->emu.ports > 1;
+    uint64_t span = opts->emu.sectors / opts->sects;
+    uint64_t seed = 0x9E3779B97F4A7C15ull ^ (w->qd * 2 + w->write) ^ ((uint64_t) w->drive << 32);
+    uint64_t next = 0;
+    uint32_t issued = 0;
+    uint32_t done;
+    uint32_t failed;
+
+    w->completed = 0;
+    w->err = 0;
+    if (w->start) {
+        pthread_barrier_wait(w->start);
+    }
+
+    while (w->completed < opts->ops) {
+        for (int i = 0; (i < w->qd) && (issued < opts->ops); i++) {
+            bench_req_t *r = &w->reqs[i];
+            if (r->busy) {
+                continue;
+            }
+            if (SATA_NO_ERR != r->status) {
+                fprintf(stderr, "bench: request on drive %d failed: %d\n", w->drive, r->status);
+                w->err = -1;
+                return NULL;
+            }
+            uint64_t blk = w->random ? (xorshift(&seed) % span) : (next++ % span);
+            r->req = (sata_request_t) {
+                .direction = w->write ? ATA_WRITE : ATA_READ,
+                .drive = w->drive,
+                .numsects = opts->sects,
+                .lba = blk * opts->sects,
+                .buf = r->buf,
+            };
+            r->worker = w;
+            r->busy = 1;
+            r->start = now_ns();
+            int err = threaded ? ahci_submit(w->driver, r->req.direction, w->drive, r->req.lba, r->req.numsects,
+                                             r->buf, bench_complete, r)
+                      : sata_submit(w->driver, &r->req, bench_complete, r);
+            if (SATA_NO_ERR != err) {
+                fprintf(stderr, "bench: submit on drive %d failed: %d\n", w->drive, err);
+                w->err = -1;
+                return NULL;
+            }
+            issued++;
+        }
+        uint32_t before = w->completed;
+        if (threaded) {
+            ahci_ncq_poll(w->driver, w->drive, &done, &failed);
+        } else {
+            sata_poll(w->driver);
+        }
+        if (before == w->completed) {
+            // The emulated HBA may need the CPU
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static int run_workload(sata_driver_t *driver, const bench_opts_t *opts, bench_worker_t *workers,
+                        uint64_t *latencies, int random, int write, int qd)
+{
+    int ports = opts->emu.ports;
+    pthread_barrier_t start_barrier;
+    ahci_port_stats_t stats;
+    uint32_t max_active = 0;
+    int err = 0;
+
+    for (int p = 0; p < ports; p++) {
+        bench_worker_t *w = &workers[p];
+        w->random = random;
+        w->write = write;
+        w->qd = qd;
+        w->start = (ports > 1) ? &start_barrier : NULL;
+        ahci_reset_port_stats(driver, p);
+    }
+
+    uint64_t start = now_ns();
+    if (ports > 1) {
+        pthread_t threads[ports];
+        int started = 0;
+
+        // The main thread is the last to reach the barrier, so every
+        // worker starts at once
+        pthread_barrier_init(&start_barrier, NULL, ports + 1);
+        for (; started < ports; started++) {
+            if (pthread_create(&threads[started], NULL, run_worker, &workers[started])) {
+                fprintf(stderr, "bench: cannot start the thread of drive %d\n", started);
+                exit(1);
+            }
+        }
+        start = now_ns();
+        pthread_barrier_wait(&start_barrier);
+        for (int p = 0; p < ports; p++) {
+            pthread_join(threads[p], NULL);
+        }
+        pthread_barrier_destroy(&start_barrier);
+    } else {
+        run_worker(&workers[0]);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    uint32_t completed = 0;
+    for (int p = 0; p < ports; p++) {
+        bench_worker_t *w = &workers[p];
+        ahci_get_port_stats(driver, p, &stats);
+        if (w->err || (w->completed != opts->ops) || (stats.reads + stats.writes != opts->ops)) {
+            fprintf(stderr, "bench: drive %d completed %u of %u requests, the driver counted %lu\n",
+                    p, w->completed, opts->ops, (unsigned long)(stats.reads + stats.writes));
+            err = -1;
+        }
+        if (stats.max_active > max_active) {
+            max_active = stats.max_active;
+        }
+        completed += w->completed;
+    }
+    if (err) {
+        return err;
+    }
+
+    // The workers filled in consecutive parts of latencies
+    qsort(latencies, completed, sizeof(uint64_t), cmp_u64);
+
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < completed; i++) {
+        sum += latencies[i];
+    }
+    double secs = elapsed / 1e9;
+    printf("%-4s %-5s %3d %10.0f %9.1f %9.1f %9.1f %9.1f %6u\n",
+           random ? "rand" : "seq", write ? "write" : "read", qd,
+           completed / secs,
+           (double) completed * opts->sects * SATA_BLK_SIZE / secs / (1024 * 1024),
+           sum / (double) completed / 1000,
+           latencies[completed / 2] / 1000.0,
+           latencies[(completed * 99) / 100] / 1000.0,
+           max_active);
+
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --image PATH     disk image (default ahci_bench.img)\n"
+            "  --sectors N      drive size in sectors (default 524288)\n"
+            "  --ops N          requests per workload (default 20000)\n"
+            "  --sects N        sectors per request (default 8)\n"
+            "  --read-us N      read command time (default 80)\n"
+            "  --write-us N     write command time (default 30)\n"
+            "  --sect-ns N      transfer time per sector (default 1000)\n"
+            "  --channels N     queued commands the drive services at once (default 8)\n"
+            "  --ncq N          NCQ depth, 0 to disable (default 32)\n"
+            "  --ports N        drives, each driven by its own thread (default 1)\n"
+            "  --quick          fewer requests and queue depths, for CI\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    bench_opts_t opts = {
+        .emu = {
+            .image = "ahci_bench.img",
+            .sectors = 512 * 1024,
+            .ports = 1,
+            .read_us = 80,
+            .write_us = 30,
+            .sect_ns = 1000,
+            .channels = 8,
+            .ncq_depth = 32,
+        },
+        .ops = 20000,
+        .sects = 8,
+    };
+    static const int depths[] = { 1, 2, 4, 8, 16, 32 };
+    ps_io_ops_t io_ops;
+    sata_driver_t driver;
+    ahci_emu_t *emu;
+    ahci_emu_stats_t emu_stats;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!strcmp(arg, "--quick")) {
+            opts.quick = 1;
+            opts.ops = 2000;
+            continue;
+        }
+        if (NULL == val) {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+        if (!strcmp(arg, "--image")) {
+            opts.emu.image = val;
+        } else if (!strcmp(arg, "--sectors")) {
+            opts.emu.sectors = strtoull(val, NULL, 0);
+        } else if (!strcmp(arg, "--ops")) {
+            opts.ops = strtoul(val, NULL, 0);
+        } else if (!strcmp(arg, "--sects")) {
+            opts.sects = strtoul(val, NULL, 0);
+        } else if (!strcmp(arg, "--read-us")) {
+            opts.emu.read_us = strtoul(val, NULL, 0);
+        } else if (!strcmp(arg, "--write-us")) {
+            opts.emu.write_us = strtoul(val, NULL, 0);
+        } else if (!strcmp(arg, "--sect-ns")) {
+            opts.emu.sect_ns = strtoul(val, NULL, 0);
+        } else if (!strcmp(arg, "--channels")) {
+            opts.emu.channels = strtol(val, NULL, 0);
+        } else if (!strcmp(arg, "--ncq")) {
+            opts.emu.ncq_depth = strtol(val, NULL, 0);
+        } else if (!strcmp(arg, "--ports")) {
+            opts.emu.ports = strtol(val, NULL, 0);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((0 == opts.ops) || (0 == opts.sects) || (opts.sects > AHCI_MAX_CMD_SECTS)
+        || (opts.emu.sectors < 4 * AHCI_MAX_CMD_SECTS) || (opts.emu.ports < 1) || (opts.emu.ports > MAX_DRIVES)) {
+        fprintf(stderr, "bench: --ops, --sects, --sectors or --ports out of range\n");
+        return 1;
+    }
+
+    int ports = opts.emu.ports;
+    uint64_t *latencies = calloc((size_t) ports * opts.ops, sizeof(uint64_t));
+    bench_req_t *reqs = calloc((size_t) ports * BENCH_MAX_QD, sizeof(bench_req_t));
+    bench_worker_t *workers = calloc(ports, sizeof(bench_worker_t));
+    if (!latencies || !reqs || !workers || ahci_emu_create(&opts.emu, &emu)) {
+        return 1;
+    }
+    if (ahci_emu_sata_init(emu, &io_ops, &driver) || check_data(&driver, &opts)) {
+        ahci_emu_destroy(emu);
+        return 1;
+    }
+    for (int p = 0; p < ports; p++) {
+        workers[p] = (bench_worker_t) {
+            .driver = &driver,
+            .opts = &opts,
+            .drive = p,
+            .reqs = reqs + p * BENCH_MAX_QD,
+            .latencies = latencies + (size_t) p * opts.ops,
+        };
+    }
+
+    printf("%d port%s, ncq depth %d, %u requests of %u sectors per port, read %uus, write %uus, "
+           "%uns/sector, %d channels\n",
+           ports, (ports > 1) ? "s" : "", ahci_ncq_depth(&driver, 0), opts.ops, opts.sects, opts.emu.read_us,
+           opts.emu.write_us, opts.emu.sect_ns, opts.emu.channels);
+    printf("%-4s %-5s %3s %10s %9s %9s %9s %9s %6s\n",
+           "", "", "qd", "iops", "MiB/s", "avg_us", "p50_us", "p99_us", "max_qd");
+
+    int err = 0;
+    for (int random = 0; (random < 2) && !err; random++) {
+        for (int write = 0; (write < 2) && !err; write++) {
+            for (int d = 0; (d < ARRAY_SIZE(depths)) && !err; d++) {
+                if (opts.quick && (depths[d] != 1) && (depths[d] != 8) && (depths[d] != 32)) {
+                    continue;
+                }
+                err = run_workload(&driver, &opts, workers, latencies, random, write, depths[d]);
+            }
+        }
+    }
+
+    ahci_emu_get_stats(emu, &emu_stats);
+    printf("emulator: %lu commands, %lu queued, %lu register writes (%lu stepped), %u in flight at most\n",
+           (unsigned long) emu_stats.cmds, (unsigned long) emu_stats.queued,
+           (unsigned long) emu_stats.reg_writes, (unsigned long) emu_stats.steps, emu_stats.max_inflight);
+    if ((ports > 1) && emu_stats.steps) {
+        // Other threads could store to the page while it was writable
+        fprintf(stderr, "bench: register stores were single-stepped with several threads\n");
+        err = -1;
+    }
+
+    ahci_emu_destroy(emu);
+    free(workers);
+    free(reqs);
+    free(latencies);
+    return err ? 1 : 0;
+}
@@ -0,0 +1,306 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Tests of the block cache against the host emulator, one per run:
+ *
+ *   cache_test <case> <image>
+ *
+ * The emulator counts the commands that reach the drive, which shows what
+ * the cache kept from it, and sata_device_access reads the drive around the
+ * cache to check what it wrote back.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <satadrivers/ide.h>
+#include <satadrivers/ahci.h>
+#include <satadrivers/common.h>
+#include <satadrivers/cache.h>
+
+#include "ahci_emu.h"
+
+#define TEST_SECTORS    8192
+#define TEST_BLOCK      8       // Sectors of a cache block
+
+#define CHECK(cond) do {                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return -1;                                                      \
+        }                                                                   \
+    } while (0)
+
+typedef struct test_env {
+    ahci_emu_t *emu;
+    ps_io_ops_t io_ops;
+    sata_driver_t driver;
+} test_env_t;
+
+static uint8_t buf[256 * SATA_BLK_SIZE];
+static uint8_t expect[256 * SATA_BLK_SIZE];
+
+static void fill(uint8_t *data, uint32_t numsects, uint64_t lba, uint8_t seed)
+{
+    for (uint32_t i = 0; i < numsects * SATA_BLK_SIZE; i++) {
+        data[i] = (uint8_t)((lba + i / SATA_BLK_SIZE) * 7 + (i % SATA_BLK_SIZE) * 31 + seed);
+    }
+}
+
+static uint64_t emu_cmds(test_env_t *env)
+{
+    ahci_emu_stats_t stats;
+    ahci_emu_get_stats(env->emu, &stats);
+    return stats.cmds;
+}
+
+static void test_complete(void *token, int status)
+{
+    int *done = token;
+    *done = status ? -1 : 1;
+}
+
+/* sata_submit a request and poll until it completes */
+static int submit_wait(test_env_t *env, uint8_t direction, uint32_t numsects, uint64_t lba, uint8_t *data)
+{
+    sata_request_t req = {
+        .direction = direction,
+        .drive = 0,
+        .numsects = numsects,
+        .lba = lba,
+        .buf = data
+    };
+    int done = 0;
+
+    if (SATA_NO_ERR != sata_submit(&env->driver, &req, test_complete, &done)) {
+        return -1;
+    }
+    while (0 == done) {
+        sata_poll(&env->driver);
+    }
+    return (1 == done) ? 0 : -1;
+}
+
+static int cache_setup(test_env_t *env, uint32_t num_blocks, uint32_t readahead)
+{
+    sata_cache_config_t config = {
+        .num_blocks = num_blocks,
+        .block_sects = TEST_BLOCK,
+        .readahead = readahead,
+        .coalesce_sects = 128,
+    };
+    return sata_cache_init(&env->io_ops, &env->driver, &config);
+}
+
+/* A read of sectors just written comes from the cache */
+static int test_read_after_write(test_env_t *env)
+{
+    sata_cache_stats_t stats;
+
+    CHECK(SATA_NO_ERR == cache_setup(env, 16, 0));
+    fill(expect, TEST_BLOCK, 64, 1);
+    CHECK(SATA_NO_ERR == sata_write_sectors_ext(&env->driver, 0, TEST_BLOCK, 64, expect));
+
+    uint64_t cmds = emu_cmds(env);
+    CHECK(SATA_NO_ERR == sata_read_sectors_ext(&env->driver, 0, TEST_BLOCK, 64, buf));
+    CHECK(0 == memcmp(buf, expect, TEST_BLOCK * SATA_BLK_SIZE));
+    // Part of the block too
+    CHECK(SATA_NO_ERR == sata_read_sectors_ext(&env->driver, 0, 3, 66, buf));
+    CHECK(0 == memcmp(buf, expect + 2 * SATA_BLK_SIZE, 3 * SATA_BLK_SIZE));
+    CHECK(emu_cmds(env) == cmds);
+
+    sata_cache_get_stats(&env->driver, &stats);
+    CHECK(2 == stats.hits);
+    CHECK(0 == stats.misses);
+    return 0;
+}
+
+/* Dirty blocks pushed out of a full cache are written back first */
+static int test_evict_dirty(test_env_t *env)
+{
+    sata_cache_stats_t stats;
+    const uint32_t num = 4;
+    const uint32_t writes = 6;
+
+    CHECK(SATA_NO_ERR == cache_setup(env, num, 0));
+    uint64_t cmds = emu_cmds(env);
+    // Blocks far apart, so no two of them could be written by one command
+    for (uint32_t i = 0; i < writes; i++) {
+        uint64_t lba = i * 4 * TEST_BLOCK;
+        fill(expect, TEST_BLOCK, lba, 2);
+        CHECK(SATA_NO_ERR == sata_write_sectors_ext(&env->driver, 0, TEST_BLOCK, lba, expect));
+    }
+
+    sata_cache_get_stats(&env->driver, &stats);
+    CHECK(writes - num == stats.evictions);
+    CHECK(writes - num == stats.writebacks);
+    CHECK(cmds + writes - num == emu_cmds(env));
+
+    for (uint32_t i = 0; i < writes - num; i++) {
+        uint64_t lba = i * 4 * TEST_BLOCK;
+        fill(expect, TEST_BLOCK, lba, 2);
+        CHECK(SATA_NO_ERR == sata_device_access(&env->driver, ATA_READ, 0, TEST_BLOCK, lba, buf));
+        CHECK(0 == memcmp(buf, expect, TEST_BLOCK * SATA_BLK_SIZE));
+    }
+    // All of them read back, whether cached or not
+    for (uint32_t i = 0; i < writes; i++) {
+        uint64_t lba = i * 4 * TEST_BLOCK;
+        fill(expect, TEST_BLOCK, lba, 2);
+        CHECK(SATA_NO_ERR == sata_read_sectors_ext(&env->driver, 0, TEST_BLOCK, lba, buf));
+        CHECK(0 == memcmp(buf, expect, TEST_BLOCK * SATA_BLK_SIZE));
+    }
+    return 0;
+}
+
+/* A flush writes dirty sectors that follow on from each other in one command */
+static int test_flush_merge(test_env_t *env)
+{
+    sata_cache_stats_t stats;
+    const uint64_t run = 10 * TEST_BLOCK;
+
+    CHECK(SATA_NO_ERR == cache_setup(env, 16, 0));
+    uint64_t cmds = emu_cmds(env);
+    // Four blocks written last to first, then one apart from them
+    for (int i = 3; i >= 0; i--) {
+        uint64_t lba = run + i * TEST_BLOCK;
+        fill(expect, TEST_BLOCK, lba, 3);
+        CHECK(SATA_NO_ERR == sata_write_sectors_ext(&env->driver, 0, TEST_BLOCK, lba, expect));
+    }
+    fill(expect, 2, 20 * TEST_BLOCK + 5, 3);
+    CHECK(SATA_NO_ERR == sata_write_sectors_ext(&env->driver, 0, 2, 20 * TEST_BLOCK + 5, expect));
+    CHECK(cmds == emu_cmds(env));
+
+    CHECK(SATA_NO_ERR == sata_cache_flush(&env->driver));
+    CHECK(cmds + 2 == emu_cmds(env));
+    sata_cache_get_stats(&env->driver, &stats);
+    CHECK(2 == stats.writebacks);
+
+    fill(expect, 4 * TEST_BLOCK, run, 3);
+    CHECK(SATA_NO_ERR == sata_device_access(&env->driver, ATA_READ, 0, 4 * TEST_BLOCK, run, buf));
+    CHECK(0 == memcmp(buf, expect, 4 * TEST_BLOCK * SATA_BLK_SIZE));
+    fill(expect, 2, 20 * TEST_BLOCK + 5, 3);
+    CHECK(SATA_NO_ERR == sata_device_access(&env->driver, ATA_READ, 0, 2, 20 * TEST_BLOCK + 5, buf));
+    CHECK(0 == memcmp(buf, expect, 2 * SATA_BLK_SIZE));
+
+    // Nothing is left dirty
+    cmds = emu_cmds(env);
+    CHECK(SATA_NO_ERR == sata_cache_flush(&env->driver));
+    CHECK(cmds == emu_cmds(env));
+    return 0;
+}
+
+/* Requests around the cache see what it holds and it does not go stale */
+static int test_bypass(test_env_t *env)
+{
+    const uint64_t lba = 100;
+
+    CHECK(SATA_NO_ERR == cache_setup(env, 16, 0));
+
+    // A dirty block is written back before a read of it goes to the drive
+    fill(expect, 4, lba, 4);
+    CHECK(SATA_NO_ERR == sata_write_sectors_ext(&env->driver, 0, 4, lba, expect));
+    memset(buf, 0, sizeof(buf));
+    CHECK(0 == submit_wait(env, ATA_READ, 4, lba, buf));
+    CHECK(0 == memcmp(buf, expect, 4 * SATA_BLK_SIZE));
+
+    // A write around the cache replaces what it held
+    CHECK(SATA_NO_ERR == sata_read_sectors_ext(&env->driver, 0, 4, lba, buf));
+    fill(expect, 4, lba, 5);
+    CHECK(0 == submit_wait(env, ATA_WRITE, 4, lba, expect));
+    CHECK(SATA_NO_ERR == sata_read_sectors_ext(&env->driver, 0, 4, lba, buf));
+    CHECK(0 == memcmp(buf, expect, 4 * SATA_BLK_SIZE));
+
+    // And a flush does not write back the old data over it
+    CHECK(SATA_NO_ERR == sata_cache_flush(&env->driver));
+    CHECK(SATA_NO_ERR == sata_device_access(&env->driver, ATA_READ, 0, 4, lba, buf));
+    CHECK(0 == memcmp(buf, expect, 4 * SATA_BLK_SIZE));
+    return 0;
+}
+
+/* Sequential reads are served from blocks read ahead of them */
+static int test_readahead(test_env_t *env)
+{
+    sata_cache_stats_t stats;
+    const uint32_t reads = 8;
+    // Not at sector 0, where a drive not read yet is taken to be read up to
+    const uint64_t start = 64;
+
+    fill(expect, reads * TEST_BLOCK, start, 6);
+    CHECK(SATA_NO_ERR == sata_device_access(&env->driver, ATA_WRITE, 0, reads * TEST_BLOCK, start, expect));
+    CHECK(SATA_NO_ERR == cache_setup(env, 64, 4));
+
+    for (uint32_t i = 0; i < reads; i++) {
+        CHECK(SATA_NO_ERR == sata_read_sectors_ext(&env->driver, 0, TEST_BLOCK, start + i * TEST_BLOCK, buf));
+        CHECK(0 == memcmp(buf, expect + i * TEST_BLOCK * SATA_BLK_SIZE, TEST_BLOCK * SATA_BLK_SIZE));
+    }
+
+    // The first two reads miss, the second starts reading ahead
+    sata_cache_get_stats(&env->driver, &stats);
+    CHECK(2 == stats.misses);
+    CHECK(reads - 2 == stats.hits);
+    CHECK(reads - 2 == stats.readahead_hits);
+    CHECK(stats.readahead >= stats.readahead_hits);
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*fn)(test_env_t *env);
+} tests[] = {
+    { "read_after_write", test_read_after_write },
+    { "evict_dirty", test_evict_dirty },
+    { "flush_merge", test_flush_merge },
+    { "bypass", test_bypass },
+    { "readahead", test_readahead },
+};
+
+int main(int argc, char **argv)
+{
+    ahci_emu_config_t config = {
+        .sectors = TEST_SECTORS,
+        .ports = 1,
+        .read_us = 20,
+        .write_us = 10,
+        .sect_ns = 100,
+        .channels = 8,
+        .ncq_depth = 32,
+    };
+    test_env_t env;
+    int (*fn)(test_env_t *env) = NULL;
+
+    if (3 == argc) {
+        for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+            if (!strcmp(argv[1], tests[i].name)) {
+                fn = tests[i].fn;
+            }
+        }
+    }
+    if (NULL == fn) {
+        fprintf(stderr, "usage: %s <case> <image>, cases:", argv[0]);
+        for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+            fprintf(stderr, " %s", tests[i].name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+
+    config.image = argv[2];
+    memset(&env, 0, sizeof(env));
+    if (ahci_emu_create(&config, &env.emu)) {
+        return 1;
+    }
+    int err = ahci_emu_sata_init(env.emu, &env.io_ops, &env.driver);
+    if (0 == err) {
+        err = fn(&env);
+    }
+    if (env.driver.cache && (SATA_NO_ERR != sata_cache_destroy(&env.driver))) {
+        err = -1;
+    }
+    ahci_emu_destroy(env.emu);
+
+    printf("%s: %s\n", argv[1], err ? "FAILED" : "passed");
+    return err ? 1 : 0;
+}
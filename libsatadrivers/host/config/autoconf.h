@@ -0,0 +1,8 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+/* Stands in for the kernel configuration of a seL4 build, the host build has none */
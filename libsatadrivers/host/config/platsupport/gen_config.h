@@ -0,0 +1,8 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+/* Stands in for the generated libplatsupport configuration, the host build sets none of it */
@@ -0,0 +1,9 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+/* Stands in for the generated libutils configuration, at its default */
+#define CONFIG_LIB_UTILS_DEFAULT_ZF_LOG_LEVEL 5
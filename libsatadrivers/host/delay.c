@@ -0,0 +1,38 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <platsupport/delay.h>
+
+/*
+ * The driver counts its timeouts in calls to ps_udelay, so short delays spin
+ * on the clock like on hardware. They yield while spinning, as the emulated
+ * HBA may need the CPU to finish what the driver waits for. Long ones, such
+ * as the wait after starting a port, sleep instead.
+ */
+void ps_udelay(unsigned long us)
+{
+    struct timespec ts;
+
+    if (us >= 1000) {
+        ts.tv_sec = us / 1000000;
+        ts.tv_nsec = (us % 1000000) * 1000;
+        while (nanosleep(&ts, &ts));
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t end = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec + us * 1000ull;
+    do {
+        sched_yield();
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+    } while ((uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec < end);
+}
+
+void ps_cpufreq_hint(unsigned long hz)
+{
+}
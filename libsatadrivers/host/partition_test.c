@@ -0,0 +1,286 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Tests of the GPT reader against the host emulator, one per run:
+ *
+ *   partition_test <case> <image>
+ *
+ * Every case writes a protective MBR and a GPT, with its backup at the end of
+ * the drive, through the driver before reading the partition map.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <satadrivers/ide.h>
+#include <satadrivers/ahci.h>
+#include <satadrivers/common.h>
+
+#include "ahci_emu.h"
+
+#define TEST_SECTORS    8192
+
+#define GPT_ENTRIES     128
+#define GPT_ENTRY_SIZE  128
+#define GPT_TABLE_SECTS (GPT_ENTRIES * GPT_ENTRY_SIZE / SATA_BLK_SIZE)
+#define GPT_FIRST       (2 + GPT_TABLE_SECTS)
+#define GPT_LAST        (TEST_SECTORS - 2 - GPT_TABLE_SECTS)
+
+#define CHECK(cond) do {                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return -1;                                                      \
+        }                                                                   \
+    } while (0)
+
+typedef struct test_env {
+    ahci_emu_t *emu;
+    ps_io_ops_t io_ops;
+    sata_driver_t driver;
+} test_env_t;
+
+/* Entries of the table, the one out of bounds is not in the map */
+static const struct {
+    uint32_t index;
+    uint64_t first;
+    uint64_t last;
+    uint64_t attributes;
+} entries[] = {
+    { 0, 2048, 4095, 0 },
+    { 2, 4096, 6143, 1ull << 63 },
+    { 5, GPT_FIRST, 2047, 1 },
+    { 7, 8000, TEST_SECTORS - 1, 0 },
+};
+#define MAP_COUNT 3
+
+static uint8_t table[GPT_TABLE_SECTS * SATA_BLK_SIZE];
+static uint8_t sector[SATA_BLK_SIZE];
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t crc32(const uint8_t *data, size_t len)
+{
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static void gpt_header(uint8_t *hdr, uint64_t my_lba, uint64_t alt_lba, uint64_t entries_lba, uint32_t entries_crc)
+{
+    memset(hdr, 0, SATA_BLK_SIZE);
+    memcpy(hdr, "EFI PART", 8);
+    put_le32(hdr + 8, 0x00010000);
+    put_le32(hdr + 12, 92);
+    put_le64(hdr + 24, my_lba);
+    put_le64(hdr + 32, alt_lba);
+    put_le64(hdr + 40, GPT_FIRST);
+    put_le64(hdr + 48, GPT_LAST);
+    memset(hdr + 56, 0xd5, SATA_GUID_SIZE);
+    put_le64(hdr + 72, entries_lba);
+    put_le32(hdr + 80, GPT_ENTRIES);
+    put_le32(hdr + 84, GPT_ENTRY_SIZE);
+    put_le32(hdr + 88, entries_crc);
+    put_le32(hdr + 16, crc32(hdr, 92));
+}
+
+/* Writes the protective MBR, the primary GPT and its backup */
+static int write_gpt(test_env_t *env)
+{
+    sata_driver_t *driver = &env->driver;
+
+    memset(sector, 0, sizeof(sector));
+    sector[PART_OFFSET + 4] = 0xee;
+    put_le32(sector + PART_OFFSET + 8, 1);
+    put_le32(sector + PART_OFFSET + 12, TEST_SECTORS - 1);
+    sector[510] = 0x55;
+    sector[511] = 0xaa;
+    CHECK(SATA_NO_ERR == sata_write_sectors_ext(driver, 0, 1, 0, sector));
+
+    memset(table, 0, sizeof(table));
+    for (int i = 0; i < ARRAY_SIZE(entries); i++) {
+        uint8_t *ent = table + entries[i].index * GPT_ENTRY_SIZE;
+        memset(ent, entries[i].index + 1, SATA_GUID_SIZE);
+        memset(ent + 16, entries[i].index + 0x40, SATA_GUID_SIZE);
+        put_le64(ent + 32, entries[i].first);
+        put_le64(ent + 40, entries[i].last);
+        put_le64(ent + 48, entries[i].attributes);
+    }
+    uint32_t entries_crc = crc32(table, sizeof(table));
+
+    gpt_header(sector, 1, TEST_SECTORS - 1, 2, entries_crc);
+    CHECK(SATA_NO_ERR == sata_write_sectors_ext(driver, 0, 1, 1, sector));
+    CHECK(SATA_NO_ERR == sata_write_sectors_ext(driver, 0, GPT_TABLE_SECTS, 2, table));
+    gpt_header(sector, TEST_SECTORS - 1, 1, GPT_LAST + 1, entries_crc);
+    CHECK(SATA_NO_ERR == sata_write_sectors_ext(driver, 0, GPT_TABLE_SECTS, GPT_LAST + 1, table));
+    CHECK(SATA_NO_ERR == sata_write_sectors_ext(driver, 0, 1, TEST_SECTORS - 1, sector));
+    return 0;
+}
+
+static int check_map(test_env_t *env)
+{
+    const sata_part_map_t *map;
+
+    CHECK(SATA_NO_ERR == sata_get_partition_map(&env->driver, 0, &map));
+    CHECK(SATA_PART_GPT == map->scheme);
+    CHECK(GPT_FIRST == map->first_usable);
+    CHECK(GPT_LAST == map->last_usable);
+    CHECK(0xd5 == map->disk_guid[0] && 0xd5 == map->disk_guid[SATA_GUID_SIZE - 1]);
+    CHECK(MAP_COUNT == map->count);
+
+    // In the order of the table
+    for (int i = 0; i < MAP_COUNT; i++) {
+        const sata_partition_t *part = &map->parts[i];
+        CHECK(entries[i].index == part->index);
+        CHECK(entries[i].first == part->start_lba);
+        CHECK(entries[i].last - entries[i].first + 1 == part->num_sectors);
+        CHECK(entries[i].attributes == part->attributes);
+        CHECK(entries[i].index + 1 == part->type_guid[SATA_GUID_SIZE - 1]);
+        CHECK(entries[i].index + 0x40 == part->unique_guid[0]);
+    }
+    return 0;
+}
+
+/* The partitions of a GPT are read into the map */
+static int test_gpt(test_env_t *env)
+{
+    CHECK(0 == write_gpt(env));
+    return check_map(env);
+}
+
+/* A damaged primary table falls back to the backup */
+static int test_gpt_backup(test_env_t *env)
+{
+    CHECK(0 == write_gpt(env));
+    CHECK(0 == check_map(env));
+
+    // Writing the tables has the map read again
+    CHECK(SATA_NO_ERR == sata_read_sectors_ext(&env->driver, 0, 1, 1, sector));
+    sector[GPT_ENTRY_SIZE / 2] ^= 0xff;
+    CHECK(SATA_NO_ERR == sata_write_sectors_ext(&env->driver, 0, 1, 1, sector));
+    CHECK(0 == check_map(env));
+
+    // So do entries that fail their CRC under a good header
+    CHECK(0 == write_gpt(env));
+    CHECK(SATA_NO_ERR == sata_read_sectors_ext(&env->driver, 0, 1, 2, sector));
+    sector[32] ^= 0x01;
+    CHECK(SATA_NO_ERR == sata_write_sectors_ext(&env->driver, 0, 1, 2, sector));
+    CHECK(0 == check_map(env));
+
+    // Without either the MBR is used, which only has the protective entry
+    CHECK(SATA_NO_ERR == sata_read_sectors_ext(&env->driver, 0, 1, TEST_SECTORS - 1, sector));
+    sector[0] = 0;
+    CHECK(SATA_NO_ERR == sata_write_sectors_ext(&env->driver, 0, 1, TEST_SECTORS - 1, sector));
+
+    const sata_part_map_t *map;
+    CHECK(SATA_NO_ERR == sata_get_partition_map(&env->driver, 0, &map));
+    CHECK(SATA_PART_MBR == map->scheme);
+    CHECK(0 == map->count);
+    return 0;
+}
+
+/* Accesses of a partition stay inside of it */
+static int test_partition_bounds(test_env_t *env)
+{
+    static uint8_t buf[4 * SATA_BLK_SIZE];
+    static uint8_t check[4 * SATA_BLK_SIZE];
+    const uint64_t size = entries[0].last - entries[0].first + 1;
+
+    CHECK(0 == write_gpt(env));
+    CHECK(0 == check_map(env));
+
+    memset(buf, 0x5a, sizeof(buf));
+    CHECK(SATA_NO_ERR == sata_write_partition(&env->driver, 0, 0, 4, size - 4, buf));
+    CHECK(SATA_NO_ERR == sata_read_sectors_ext(&env->driver, 0, 4, entries[0].last - 3, check));
+    CHECK(0 == memcmp(buf, check, sizeof(buf)));
+    CHECK(SATA_NO_ERR == sata_read_partition(&env->driver, 0, 0, 4, size - 4, check));
+    CHECK(0 == memcmp(buf, check, sizeof(buf)));
+
+    // The first sector of the next partition is left alone
+    CHECK(SATA_NO_ERR == sata_read_sectors_ext(&env->driver, 0, 1, entries[1].first, check));
+    memset(buf, 0xa5, sizeof(buf));
+    CHECK(INVALID_POSITION == sata_write_partition(&env->driver, 0, 0, 4, size - 3, buf));
+    CHECK(INVALID_POSITION == sata_write_partition(&env->driver, 0, 0, 1, size, buf));
+    CHECK(INVALID_POSITION == sata_write_partition(&env->driver, 0, 0, 1, UINT64_MAX, buf));
+    CHECK(INVALID_POSITION == sata_read_partition(&env->driver, 0, 0, 2, size - 1, buf));
+    CHECK(INVALID_PARTITION == sata_write_partition(&env->driver, 0, MAP_COUNT, 1, 0, buf));
+    CHECK(SATA_NO_ERR == sata_read_sectors_ext(&env->driver, 0, 1, entries[1].first, buf));
+    CHECK(0 == memcmp(buf, check, SATA_BLK_SIZE));
+
+    // Writes inside of partitions leave the map as it is
+    CHECK(SATA_NO_ERR == sata_write_partition(&env->driver, 0, 1, 1, 0, buf));
+    const sata_part_map_t *map;
+    CHECK(SATA_NO_ERR == sata_get_partition_map(&env->driver, 0, &map));
+    CHECK(SATA_PART_GPT == map->scheme);
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*fn)(test_env_t *env);
+} tests[] = {
+    { "gpt", test_gpt },
+    { "gpt_backup", test_gpt_backup },
+    { "bounds", test_partition_bounds },
+};
+
+int main(int argc, char **argv)
+{
+    ahci_emu_config_t config = {
+        .sectors = TEST_SECTORS,
+        .ports = 1,
+        .read_us = 20,
+        .write_us = 10,
+        .sect_ns = 100,
+        .channels = 8,
+        .ncq_depth = 32,
+    };
+    test_env_t env;
+    int (*fn)(test_env_t *env) = NULL;
+
+    if (3 == argc) {
+        for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+            if (!strcmp(argv[1], tests[i].name)) {
+                fn = tests[i].fn;
+            }
+        }
+    }
+    if (NULL == fn) {
+        fprintf(stderr, "usage: %s <case> <image>, cases:", argv[0]);
+        for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+            fprintf(stderr, " %s", tests[i].name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+
+    config.image = argv[2];
+    memset(&env, 0, sizeof(env));
+    if (ahci_emu_create(&config, &env.emu)) {
+        return 1;
+    }
+    int err = ahci_emu_sata_init(env.emu, &env.io_ops, &env.driver);
+    if (0 == err) {
+        err = fn(&env);
+    }
+    ahci_emu_destroy(env.emu);
+
+    printf("%s: %s\n", argv[1], err ? "FAILED" : "passed");
+    return err ? 1 : 0;
+}
@@ -31,6 +31,15 @@
 
 #define HBA_PxIS_TFES   (1 << 30)
 #define HBA_PxIS_IFS    (1 << 27)
+#define HBA_PxIS_SDBS   (1 << 3)   /* Set Device Bits FIS received */
+#define HBA_PxIS_DSS    (1 << 2)   /* DMA Setup FIS received */
+#define HBA_PxIS_PSS    (1 << 1)   /* PIO Setup FIS received */
+#define HBA_PxIS_DHRS   (1 << 0)   /* Device to Host Register FIS received */
+
+/* PxIE has the bits of PxIS, these raise the interrupt when a command completes */
+#define HBA_PxIE_COMPLETION (HBA_PxIS_DHRS | HBA_PxIS_PSS | HBA_PxIS_DSS | HBA_PxIS_SDBS)
+
+#define HBA_CAP_SNCQ    (1 << 30)  /* HBA supports native command queuing */
 
 #define PxSCTL_DET_MASK     0x0000000F
 #define PxSCTL_DET_COMRESET 0x00000001
@@ -61,12 +70,14 @@
 
 #define GET_IPM_BITS(val)  ((val >> 8) & 0x0F)
 #define GET_DET_BITS(val)  (val & 0x0F)
-#define GET_NUM_SLOTS(val) ((val & 0x0f00) >> 8)
+#define GET_NUM_SLOTS(val) ((((val) >> 8) & 0x1F) + 1)
 
 #define GET_BYTE0(val) ((val & 0x000000FF) >> 0)
 #define GET_BYTE1(val) ((val & 0x0000FF00) >> 8)
 #define GET_BYTE2(val) ((val & 0x00FF0000) >> 16)
 #define GET_BYTE3(val) ((val & 0xFF000000) >> 24)
+#define GET_BYTE4(val) (((uint64_t)(val) >> 32) & 0xFF)
+#define GET_BYTE5(val) (((uint64_t)(val) >> 40) & 0xFF)
 
 #define SECTORS_TO_BYTES(num) ((num<<9)-1) // 512 bytes per sector
 
@@ -76,6 +87,7 @@
 
 #define TIMEOUT_10S 10000
 #define TIMEOUT_1S  1000
+#define TIMEOUT_10S_US (TIMEOUT_10S * 1000)
 
 #define PxSERR_RESERVED_BITS(x) ({ typeof(x) __x = (x); \
             (((__x) >= 2 && (__x) <= 7) || ((__x) >= 12 && (__x) <= 15)); })
@@ -108,5 +120,88 @@ typedef struct ahci_intel_config {
     uint32_t data_size;
 } ahci_intel_config_t;
 
+/*
+ * Every port has its own lock and its own part of the data buffer, so
+ * threads using drives on different ports run in parallel. Threads sharing a
+ * port take turns at its registers and slots. ahci_exec_cmd keeps the port
+ * to itself until its command completed. host/bench.c --ports runs a thread
+ * per port against the host emulator.
+ */
 int ahci_init(ps_io_ops_t *io_ops, sata_driver_t *driver, void *config);
-int ahci_exec_cmd(sata_driver_t *driver, uint8_t command, uint8_t drive, uint32_t lba, uint16_t count, uint8_t *buf);
+
+/*
+ * Counters of a port. Dividing them by the time a workload ran gives its
+ * IOPS and throughput, and max_active shows the queue depth it reached.
+ * host/bench.c measures them against a software HBA on a Linux host.
+ */
+typedef struct ahci_port_stats {
+    uint64_t reads;         // Read commands issued
+    uint64_t writes;        // Write commands issued
+    uint64_t read_sects;
+    uint64_t write_sects;
+    uint64_t other;         // Other commands, such as IDENTIFY
+    uint64_t errors;        // Commands issued without waiting that an error aborted
+    uint64_t cmdlst_full;   // Commands that found no free slot
+    uint32_t max_active;    // Most commands in flight at once
+} ahci_port_stats_t;
+
+int ahci_get_port_stats(sata_driver_t *driver, uint8_t drive, ahci_port_stats_t *stats);
+int ahci_reset_port_stats(sata_driver_t *driver, uint8_t drive);
+int ahci_exec_cmd(sata_driver_t *driver, uint8_t command, uint8_t drive, uint64_t lba, uint16_t count, uint8_t *buf);
+
+/* Sectors a command through the data buffer can move, limited by its PRDT */
+#define AHCI_MAX_CMD_SECTS  (NUM_PRDT_ENTRIES * SECTORS_PER_PRDT)
+
+/* Splits the transfer into as many commands as it takes and keeps them all in flight */
+int ahci_exec_cmd_ext(sata_driver_t *driver, uint8_t command, uint8_t drive, uint64_t lba, uint32_t count,
+                      uint8_t *buf);
+
+/*
+ * Native command queuing. A drive with NCQ support takes up to
+ * ahci_ncq_depth() READ/WRITE FPDMA QUEUED commands at once, each with its
+ * own tag. Every tag has its own part of the data buffer, so the largest
+ * queued transfer is the data buffer divided by 32 tags per active port.
+ * ahci_exec_cmd waits for queued commands of its drive to finish before it
+ * issues its own. ahci_ncq_drain also waits for commands from ahci_submit.
+ */
+int ahci_ncq_depth(sata_driver_t *driver, uint8_t drive);
+int ahci_ncq_submit(sata_driver_t *driver, uint8_t command, uint8_t drive, uint64_t lba, uint16_t count,
+                    uint8_t *buf, int *tag);
+int ahci_ncq_poll(sata_driver_t *driver, uint8_t drive, uint32_t *done, uint32_t *failed);
+int ahci_ncq_drain(sata_driver_t *driver, uint8_t drive);
+
+/*
+ * Asynchronous commands. ahci_submit issues a command without waiting and
+ * calls cb once it completed, from ahci_handle_irq or ahci_poll. Commands are
+ * queued on drives with NCQ support, otherwise the HBA runs them one after
+ * the other. They take parts of the data buffer like queued commands.
+ * The HBA interrupt is masked after ahci_init. Callers that register a
+ * handler calling ahci_handle_irq unmask it with ahci_enable_irq.
+ */
+int ahci_submit(sata_driver_t *driver, uint8_t command, uint8_t drive, uint64_t lba, uint16_t count,
+                uint8_t *buf, sata_complete_fn cb, void *token);
+int ahci_submit_max_sects(sata_driver_t *driver);
+int ahci_enable_irq(sata_driver_t *driver);
+int ahci_handle_irq(sata_driver_t *driver);
+int ahci_poll(sata_driver_t *driver);
+
+/*
+ * Zero-copy commands. The HBA transfers straight to or from the physical
+ * memory in a scatter-gather list, such as memory pinned with ps_dma_man_t,
+ * instead of through the data buffer. Every element takes a PRDT entry, so a
+ * command has at most AHCI_SG_MAX_ENTRIES of them, each an even number of
+ * bytes at an even address, at most AHCI_SG_MAX_LEN long. The lengths must
+ * add up to the sectors transferred. The caller does the cache maintenance.
+ */
+#define AHCI_SG_MAX_ENTRIES NUM_PRDT_ENTRIES
+#define AHCI_SG_MAX_LEN     (1 << 22)
+
+typedef struct ahci_sg {
+    uintptr_t phys;
+    uint32_t len;
+} ahci_sg_t;
+
+int ahci_exec_cmd_sg(sata_driver_t *driver, uint8_t command, uint8_t drive, uint64_t lba, uint16_t count,
+                     const ahci_sg_t *sg, int num_sg);
+int ahci_submit_sg(sata_driver_t *driver, uint8_t command, uint8_t drive, uint64_t lba, uint16_t count,
+                   const ahci_sg_t *sg, int num_sg, sata_complete_fn cb, void *token);
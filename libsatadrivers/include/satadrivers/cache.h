@@ -0,0 +1,77 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+#include <stdint.h>
+#include <platsupport/io.h>
+#include <satadrivers/common.h>
+
+/*
+ * Block cache between the sata_read/write calls and the drives. Blocks of
+ * block_sects sectors are replaced with the CLOCK algorithm. Writes stay in
+ * the cache until their block is evicted or sata_cache_flush is called, and
+ * dirty sectors next to each other go out in one command. A drive read
+ * sequentially gets the following blocks read ahead without waiting, which
+ * complete from sata_handle_irq or sata_poll like other requests.
+ *
+ * The cache has no lock. The driver must be used from one thread at a time
+ * once it has a cache, including sata_submit, sata_handle_irq and sata_poll,
+ * which complete read aheads. Two threads in the cache at once abort. The
+ * callbacks of requests may run from inside a cache call, where calling back
+ * into the driver aborts too.
+ */
+
+#define SATA_CACHE_MAX_BLOCK_SECTS 64
+
+#define SATA_CACHE_DEFAULT_BLOCKS       256
+#define SATA_CACHE_DEFAULT_BLOCK_SECTS  8
+#define SATA_CACHE_DEFAULT_READAHEAD    4
+#define SATA_CACHE_DEFAULT_COALESCE     128
+
+typedef struct sata_cache_config {
+    uint32_t num_blocks;        // Blocks held by the cache
+    uint32_t block_sects;       // Sectors per block, at most SATA_CACHE_MAX_BLOCK_SECTS
+    uint32_t readahead;         // Blocks read ahead of a sequential reader, 0 disables it
+    uint32_t coalesce_sects;    // Largest command that reads or writes several blocks
+} sata_cache_config_t;
+
+typedef struct sata_cache_stats {
+    uint64_t hits;              // Blocks read from the cache
+    uint64_t misses;            // Blocks read from the drive
+    uint64_t readahead;         // Blocks read ahead
+    uint64_t readahead_hits;    // Blocks read ahead that were then read
+    uint64_t writebacks;        // Write commands for dirty sectors
+    uint64_t evictions;         // Blocks replaced
+} sata_cache_stats_t;
+
+/*
+ * Put a cache in front of the drives of an initialised driver. A NULL config
+ * takes the SATA_CACHE_DEFAULT_* values, and so do zero fields of a config
+ * except readahead, where 0 disables reading ahead. With read ahead, a block
+ * must fit in a command issued without waiting, see ahci_submit_max_sects.
+ */
+int sata_cache_init(ps_io_ops_t *io_ops, sata_driver_t *driver, const sata_cache_config_t *config);
+
+/* Write every dirty sector to the drives */
+int sata_cache_flush(sata_driver_t *driver);
+
+/* Flush and remove the cache */
+int sata_cache_destroy(sata_driver_t *driver);
+
+void sata_cache_get_stats(sata_driver_t *driver, sata_cache_stats_t *stats);
+
+/* Used by common.c to read and write through the cache */
+int sata_cache_access(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t numsects,
+                      uint64_t lba, uint8_t *buf);
+
+/* Used by common.c before a request that bypasses the cache. Dirty sectors
+ * are written before a read, cached sectors are dropped before a write. */
+int sata_cache_bypass(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t numsects, uint64_t lba);
+
+/* Read or write the drives directly, implemented by common.c */
+int sata_device_access(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t numsects,
+                       uint64_t lba, uint8_t *buf);
+int sata_device_submit(sata_driver_t *driver, sata_request_t *req, sata_complete_fn cb, void *token);
@@ -17,7 +17,10 @@ enum sata_errors {
     INVALID_POSITION,
     INVALID_TYPE,
     INVALID_DIRECTION,
-    INVALID_PTR
+    INVALID_PTR,
+    NO_MEMORY,
+    CACHE_TIMEOUT,
+    INVALID_PARTITION
 };
 
 enum drive_types {
@@ -45,6 +48,41 @@ typedef struct partition_table {
     uint32_t num_sectors;
 } partition_table_t;
 
+#define SATA_MAX_PARTITIONS 128
+#define SATA_GUID_SIZE      16
+
+enum sata_part_scheme {
+    SATA_PART_UNREAD,   // Not read since sata_init or the last invalidation
+    SATA_PART_NONE,     // No partition table
+    SATA_PART_MBR,
+    SATA_PART_GPT
+};
+
+typedef struct sata_partition {
+    uint64_t start_lba;
+    uint64_t num_sectors;
+    uint64_t attributes;                    // GPT only
+    uint32_t index;                         // Slot in the partition table
+    uint8_t sys_id;                         // MBR only
+    uint8_t type_guid[SATA_GUID_SIZE];      // GPT only
+    uint8_t unique_guid[SATA_GUID_SIZE];    // GPT only
+} sata_partition_t;
+
+/*
+ * Partitions of a drive that are in use, read once by sata_get_partition_map.
+ * The map is allocated on first use with room for the entries of the table,
+ * at most SATA_MAX_PARTITIONS.
+ */
+typedef struct sata_part_map {
+    enum sata_part_scheme scheme;
+    uint32_t count;
+    uint32_t max_count;         // Entries parts has room for
+    uint64_t first_usable;      // Sectors outside of these hold the partition tables
+    uint64_t last_usable;
+    uint8_t disk_guid[SATA_GUID_SIZE];
+    sata_partition_t parts[];
+} sata_part_map_t;
+
 typedef struct sata_device {
     uint8_t      Reserved;    // 0 (Empty) or 1 (This Drive really exists).
     uint8_t      Channel;     // 0 (Primary Channel) or 1 (Secondary Channel).
@@ -53,18 +91,64 @@ typedef struct sata_device {
     uint16_t     Signature;   // Drive Signature
     uint16_t     Capabilities;// Features.
     uint32_t     CommandSets; // Command Sets Supported.
-    uint32_t     Size;        // Size in Sectors.
+    uint64_t     Size;        // Size in Sectors.
     uint8_t      Model[MODEL_STRING_SIZE];   // Model in string.
 } sata_dev_t;
 
+struct sata_cache;
+
 typedef struct sata_driver {
     sata_dev_t sata_devices[MAX_DRIVES];
     enum driver_mode mode;
     void *driver;
+    struct sata_cache *cache;   // Set up by sata_cache_init, NULL without a cache
+    ps_io_ops_t *io_ops;
+    sata_part_map_t *part_maps[MAX_DRIVES];    // NULL until first read
 } sata_driver_t;
 
+typedef struct sata_request {
+    uint8_t direction;   // ATA_READ or ATA_WRITE
+    uint8_t drive;
+    uint16_t numsects;
+    uint64_t lba;
+    uint8_t *buf;        // For reads it is filled in before the callback
+} sata_request_t;
+
+/* Called with the token of a request and its status (0 on success) */
+typedef void (*sata_complete_fn)(void *token, int status);
+
 int sata_get_partition_tables(sata_driver_t *driver, uint8_t drive, partition_table_t *partition_tables,
                               uint8_t *part_data);
 int sata_read_sectors(sata_driver_t *driver, uint8_t drive, uint16_t numsects, uint32_t lba, uint8_t *buf);
 int sata_write_sectors(sata_driver_t *driver, uint8_t drive, uint16_t numsects, uint32_t lba, uint8_t *buf);
+int sata_read_sectors_ext(sata_driver_t *driver, uint8_t drive, uint32_t numsects, uint64_t lba, uint8_t *buf);
+int sata_write_sectors_ext(sata_driver_t *driver, uint8_t drive, uint32_t numsects, uint64_t lba, uint8_t *buf);
 int sata_init(ps_io_ops_t *io_ops, sata_driver_t *driver, enum driver_mode mode, void *config);
+
+/*
+ * Partition map of a drive, MBR or GPT. The tables are read on first use and
+ * kept until sata_invalidate_partitions, or until a write touches them.
+ * Partitions are numbered from 0 in the order of the map.
+ */
+int sata_get_partition_map(sata_driver_t *driver, uint8_t drive, const sata_part_map_t **map);
+void sata_invalidate_partitions(sata_driver_t *driver, uint8_t drive);
+int sata_read_partition(sata_driver_t *driver, uint8_t drive, uint32_t part, uint32_t numsects, uint64_t lba,
+                        uint8_t *buf);
+int sata_write_partition(sata_driver_t *driver, uint8_t drive, uint32_t part, uint32_t numsects, uint64_t lba,
+                         uint8_t *buf);
+
+/* Used by common.c to drop the map of a drive when its tables are written */
+void sata_partitions_written(sata_driver_t *driver, uint8_t drive, uint32_t numsects, uint64_t lba);
+
+/*
+ * Asynchronous requests. sata_submit returns without waiting for the drive
+ * and cb is called when the request completed, from sata_handle_irq or
+ * sata_poll. In IDE mode requests complete before sata_submit returns.
+ * The drives only raise interrupts after sata_enable_irq, which is called
+ * once a handler calling sata_handle_irq is registered. Until then
+ * sata_poll completes the requests.
+ */
+int sata_submit(sata_driver_t *driver, sata_request_t *req, sata_complete_fn cb, void *token);
+int sata_enable_irq(sata_driver_t *driver);
+int sata_handle_irq(sata_driver_t *driver);
+int sata_poll(sata_driver_t *driver);
@@ -55,6 +55,8 @@
 #define ATA_IDENT_MAX_LBA      120
 #define ATA_IDENT_COMMANDSETS  164
 #define ATA_IDENT_MAX_LBA_EXT  200
+#define ATA_IDENT_QUEUE_DEPTH  150
+#define ATA_IDENT_SATA_CAPS    152
 
 // IDE Commands
 #define ATA_CMD_READ_PIO          0x20
@@ -65,6 +67,8 @@
 #define ATA_CMD_WRITE_PIO_EXT     0x34
 #define ATA_CMD_WRITE_DMA         0xCA
 #define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_READ_FPDMA_QUEUED  0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
 #define ATA_CMD_CACHE_FLUSH       0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT   0xEA
 #define ATA_CMD_PACKET            0xA0
@@ -103,6 +107,7 @@
 #define ATA_ERR            2
 #define ATA_DRIVE_FAULT    1
 #define ATA_DRQ_UNSET      3
+#define ATA_DMA_TIMEOUT    5
 
 #define ATA_WORDS          256 /* Almost every ATA drive has a sector-size of 512-byte. */
 
@@ -123,8 +128,10 @@
 #define ID_NOT_FOUND_ERR    21
 #define UNCORRECT_DATA_ERR  22
 #define READ_NOTHING_ERR    23
+#define DMA_TIMEOUT_ERR     24
 
 #define LBA28_MAX_SIZE 0x10000000
+#define IDE_MAX_SECTS  256  // Sector count of an LBA28 command, written as 0
 #define LBA_48_MODE 2
 #define LBA_28_MODE 1
 #define LBA_CHS_MODE 0
@@ -132,9 +139,44 @@
 #define NUM_IDE_CHANNELS  2
 
 #define NUM_SECT_PER_TRACK 63
+
+// Bus Master IDE registers, offsets from the channel's part of PCI BAR4
+#define BM_REG_COMMAND     0x00
+#define BM_REG_STATUS      0x02
+#define BM_REG_PRDT        0x04
+#define BM_CHANNEL_SIZE    0x08
+
+#define BM_CMD_START       0x01
+#define BM_CMD_READ        0x08    // Device to memory
+
+#define BM_STATUS_ACTIVE   0x01
+#define BM_STATUS_ERR      0x02    // Write 1 to clear
+#define BM_STATUS_IRQ      0x04    // Write 1 to clear
+#define BM_STATUS_DMA_CAP  0x60    // Drive 0 and 1 DMA capable, kept as set up by firmware
+
+#define IDE_DMA_TIMEOUT_US 10000000
+
+#define IDE_PRD_EOT        0x8000
+#define IDE_PRD_MAX_BYTES  0x10000 // A region may not cross 64K, written as 0
+#define IDE_DMA_BUF_SIZE   (IDE_MAX_SECTS * 512)
+#define IDE_DMA_NUM_PRDS   (IDE_DMA_BUF_SIZE / IDE_PRD_MAX_BYTES)
+
+/* Physical region descriptor of the bus master */
+typedef struct ide_prd {
+    uint32_t phys;
+    uint16_t len;
+    uint16_t flags;
+} ide_prd_t;
+
+typedef struct ide_config {
+    /* I/O port base of the bus master registers from PCI BAR4, 0 for PIO only */
+    uint16_t bm_base;
+} ide_config_t;
 #define NUM_LBA_BYTES 6
 
 #define IDENT_LBA48_SUPPORT_BIT (1u << 26)
+#define IDENT_NCQ_SUPPORT_BIT   (1u << 8)
+#define IDENT_QUEUE_DEPTH(val)  (((val) & 0x1F) + 1)
 
 static inline void sata_delay(unsigned int delay)
 {
@@ -143,7 +185,7 @@ static inline void sata_delay(unsigned int delay)
     }
 }
 
-int ide_init(ps_io_ops_t *io_ops, sata_driver_t *driver);
-uint8_t ide_ata_access(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t lba, uint16_t numsects,
+int ide_init(ps_io_ops_t *io_ops, sata_driver_t *driver, ide_config_t *config);
+uint8_t ide_ata_access(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint64_t lba, uint16_t numsects,
                        uint8_t *buf);
 uint8_t ide_print_error(sata_driver_t *driver, uint32_t drive, uint8_t err);
@@ -13,26 +13,37 @@
 struct disk_driver;
 
 #define VIRTIO_BLK_XFER_FAILED   (-1)
+#define VIRTIO_BLK_XFER_ENQUEUED 0
 #define VIRTIO_BLK_XFER_COMPLETE 1
 
 /**
- * Transmit a packet.
+ * Start a transfer between the disk and memory.
  *
  * @param driver    Pointer to disk driver
- * @param num       Number of memory regions making up the packet
- * @param phys      Array of length 'num' detailing physical addresses
- *                  of each memory region
- * @param len       Array of length 'num' detailing the length of each
- *                  memory region
- * @param cookie    Cookie to be passed to receive complete function
+ * @param direction VIRTIO_BLK_T_IN to read, VIRTIO_BLK_T_OUT to write or
+ *                  VIRTIO_BLK_T_FLUSH to write back the cache of the disk
+ * @param sector    First sector, of 512 bytes, of the transfer
+ * @param len       Length of the transfer in bytes, a multiple of 512.
+ *                  0 for a flush
+ * @param guest_buf_phys Physical address of the buffer, unused for a flush
+ * @param cookie    Cookie to be passed to the xfer_complete function
  *
- * @return          DISKIF_TX_ENQUEUED if buffer request is enqueued, diskif_raw_tx_complete
- *                  will be called when completed. DISKIF_TX_COMPLETE if transmit completed
- *                  inline and buffer can be freed. DISKIF_TX_FAILED if transmit could not
- *                  be done
+ * @return          VIRTIO_BLK_XFER_ENQUEUED if the transfer is enqueued, xfer_complete
+ *                  will be called when completed. VIRTIO_BLK_XFER_COMPLETE if it completed
+ *                  inline. VIRTIO_BLK_XFER_FAILED if it could not be done, such as when
+ *                  the queue is full
  */
 typedef int (*diskif_raw_xfer)(struct disk_driver *driver, uint8_t direction, uint64_t sector, uint32_t len,
-                               uintptr_t guest_buf_phys);
+                               uintptr_t guest_buf_phys, void *cookie);
+
+/**
+ * Called when an enqueued transfer completed
+ *
+ * @param cb_cookie Cookie of the driver
+ * @param cookie    Cookie given to raw_xfer
+ * @param status    VIRTIO_BLK_S_OK or the error of the device
+ */
+typedef void (*diskif_raw_xfer_complete)(void *cb_cookie, void *cookie, int status);
 
 /**
  * Handle an IRQ event
@@ -44,9 +55,10 @@ typedef int (*diskif_raw_xfer)(struct disk_driver *driver, uint8_t direction, ui
 typedef void (*diskif_raw_handleIRQ_t)(struct disk_driver *driver, int irq);
 
 /**
- * Get low level device from the driver
+ * Get the configuration of the device from the driver
  *
- * @param driver    Pointer to disk drivers
+ * @param driver    Pointer to disk driver
+ * @param cfg       Filled in with the configuration of the device
  */
 typedef void (*diskif_low_level_init_t)(struct disk_driver *driver, struct virtio_blk_config *cfg);
 
@@ -64,10 +76,10 @@ typedef void (*diskif_raw_poll)(struct disk_driver *driver);
 /**
  * Defining of generic function for initializing a disk
  * driver. Takes an allocated and partially filled out
- * eth_driver struct that it will finish filling out.
+ * disk_driver struct that it will finish filling out.
  *
- * @param driver        Partially filled out eth_driver struct. Expects
-                        i_cb and cb_cookie to already be filled out
+ * @param driver        Partially filled out disk_driver struct. Expects
+ *                      i_cb and cb_cookie to already be filled out
  * @param io_ops        Interface containing OS specific functions
  * @param config        Pointer to driver specific config struct. The
  *                      caller is responsible for freeing this
@@ -86,10 +98,17 @@ typedef struct raw_diskiface_funcs {
     diskif_low_level_init_t low_level_init;
 } raw_diskiface_funcs_t;
 
+/* Structure defining the set of callback functions a disk driver
+ * can call */
+typedef struct raw_diskiface_callbacks {
+    diskif_raw_xfer_complete xfer_complete;
+} raw_diskiface_callbacks_t;
+
 /* Structure to hold the interface for a disk driver */
 struct disk_driver {
     void *disk_data;
     raw_diskiface_funcs_t i_fn;
+    raw_diskiface_callbacks_t i_cb;
     void *cb_cookie;
     ps_io_ops_t io_ops;
     int dma_alignment;
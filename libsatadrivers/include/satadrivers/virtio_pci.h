@@ -0,0 +1,28 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#pragma once
+
+#include <platsupport/io.h>
+#include <satadrivers/raw.h>
+
+typedef struct diskif_virtio_pci_config {
+    uint16_t io_base;   // BAR0 of the device, legacy devices only have port I/O
+} diskif_virtio_pci_config_t;
+
+/**
+ * This function initialises a legacy virtio-blk PCI device and conforms to
+ * the diskif_driver_init type in raw.h. Transfers complete out of order, as
+ * the device finishes them, and every completed one is reported from a
+ * single raw_poll or raw_handleIRQ. As many transfers can be in flight as
+ * the queue of the device has room for, three descriptors each. See
+ * README.md for a check of it under QEMU.
+ *
+ * @param[out] disk_driver  Disk driver structure to fill out
+ * @param[in] io_ops        A structure containing os specific data and
+ *                          functions.
+ * @param[in] config        Pointer to a diskif_virtio_pci_config struct
+ */
+int diskif_virtio_pci_init(struct disk_driver *disk_driver, ps_io_ops_t io_ops, void *config);
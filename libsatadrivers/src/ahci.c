@@ -12,8 +12,8 @@
 #include <satadrivers/ahci.h>
 #include <unistd.h>
 #include <string.h>
-#include <sel4/sel4.h>
 #include <platsupport/delay.h>
+#include <platsupport/sync/spinlock.h>
 
 #include <satadrivers/ahci_types.h>
 #include <utils/zf_log.h>
@@ -21,12 +21,43 @@
 #define GET_LOWER_32BITS(val) ((uint32_t)(val))
 #define GET_UPPER_32BITS(val) ((uint32_t)((val) >> 32))
 
+/* A command issued without waiting, kept until its slot is harvested */
+typedef struct ahci_async_cmd {
+    uint8_t command;
+    uint16_t count;
+    uint8_t *buf;
+    sata_complete_fn cb;
+    void *token;
+} ahci_async_cmd_t;
+
+/*
+ * Commands a caller waits for. Whoever harvests them, be it the caller,
+ * ahci_poll or ahci_handle_irq, completes them through this.
+ */
+typedef struct ahci_wait {
+    uint32_t pending;       // Commands issued and not yet completed
+    int status;             // First error of the commands
+} ahci_wait_t;
+
+/*
+ * The state of a port is only touched with its lock held, so threads using
+ * different ports do not wait for each other. The lock is not held while
+ * waiting for the drive or calling callbacks, except by ahci_exec_cmd, which
+ * uses the whole data buffer of the port.
+ */
 typedef struct ahci_port {
     uint8_t in_use: 1;
     uint8_t port_num: 7;
     uint32_t clb;
     uint32_t ctba;
     uint32_t fb;
+    uint8_t ncq_depth;      // Tags the drive accepts, 0 without NCQ
+    uint32_t active;        // Slots issued without waiting and not yet harvested
+    ahci_async_cmd_t cmds[ENTRIES_PER_CMDLST];
+    sync_spinlock_t lock;
+    uint8_t *buf;           // Part of the data buffer for this port, split between its slots
+    uint32_t buf_size;
+    ahci_port_stats_t stats;
 } ahci_port_t;
 
 typedef struct ahci_dev {
@@ -39,6 +70,8 @@ typedef struct ahci_dev {
     uint32_t fb_size;
     uint8_t *buf;
     uint32_t buf_size;
+    uint32_t slot_buf_size; // Part of the buffer of a port for each slot
+    int num_ports;
     ahci_port_t device_list[NUM_MAX_PORTS];
 } ahci_dev_t;
 
@@ -79,9 +112,26 @@ static int reset_ahci_controller(ahci_dev_t *ahci, hba_port_t *port);
 static int soft_reset_port(hba_port_t *port);
 static int hard_reset_controller(ahci_dev_t *ahci);
 
-static int construct_cmd_header(hba_cmd_hdr_t *cmdheader, uint8_t command, uint16_t num_sects);
+static int construct_cmd_header(hba_cmd_hdr_t *cmdheader, uint8_t command, uint16_t prdt_len);
 static int construct_cmd_tbl(hba_cmd_tbl_t *cmdtbl, uint16_t num_sects, uint16_t prdt_len, uint8_t *data_buf);
-static int construct_cmd_fis(fis_reg_h2d_t *cmdfis, uint8_t command, uint16_t num_sects, uint32_t lba);
+static int construct_cmd_tbl_sg(hba_cmd_tbl_t *cmdtbl, uint16_t num_sects, const ahci_sg_t *sg, int num_sg);
+static int construct_cmd_fis(fis_reg_h2d_t *cmdfis, uint8_t command, uint16_t num_sects, uint64_t lba);
+static int construct_ncq_fis(fis_reg_h2d_t *cmdfis, uint8_t command, uint16_t num_sects, uint64_t lba,
+                             int tag);
+static int get_drive(sata_driver_t *driver, uint8_t drive, ahci_dev_t **ahci, ahci_port_t **dev);
+static int exec_cmd_locked(ahci_dev_t *ahci, ahci_port_t *dev, uint8_t command, uint64_t lba, uint16_t count,
+                           uint8_t *buf);
+static uint32_t port_active(ahci_port_t *dev);
+static void wait_complete(void *token, int status);
+static int wait_cmds(ahci_dev_t *ahci, uint8_t drive, ahci_wait_t *wait);
+static void count_cmd(ahci_port_t *dev, uint8_t command, uint16_t count);
+static int issue_slot(ahci_dev_t *ahci, ahci_port_t *dev, uint8_t command, uint64_t lba, uint16_t count,
+                      uint8_t *buf, const ahci_sg_t *sg, int num_sg, sata_complete_fn cb, void *token, int *tag);
+static int issue_async_cmd(ahci_dev_t *ahci, uint8_t drive, uint8_t command, uint64_t lba, uint16_t count,
+                           uint8_t *buf, const ahci_sg_t *sg, int num_sg, sata_complete_fn cb, void *token,
+                           int *tag);
+static int harvest_port(ahci_dev_t *ahci, uint8_t drive, uint32_t *done, uint32_t *failed);
+static void recover_port(ahci_dev_t *ahci, hba_port_t *port);
 
 static int validate_config(ahci_intel_config_t *config);
 static int validate_memory_space(ahci_dev_t *ahci, int active_ports);
@@ -335,7 +385,7 @@ static void stop_cmd(hba_port_t *port)
  * Returns: success (0) or failure (error code)
  *
  */
-int ahci_exec_cmd(sata_driver_t *driver, uint8_t command, uint8_t drive, uint32_t lba, uint16_t count, uint8_t *buf)
+int ahci_exec_cmd(sata_driver_t *driver, uint8_t command, uint8_t drive, uint64_t lba, uint16_t count, uint8_t *buf)
 {
     if (NULL == driver) {
         ZF_LOGE("AHCI: exec: driver can't be NULL");
@@ -348,20 +398,60 @@ int ahci_exec_cmd(sata_driver_t *driver, uint8_t command, uint8_t drive, uint32_
     }
 
     ahci_dev_t *ahci = driver->driver;
+    ahci_port_t *dev = &ahci->device_list[drive];
+    int error;
+
+    // Asynchronous commands use parts of the data buffer of the port and a
+    // drive cannot take a non-queued command while it has queued ones. The
+    // lock is kept from when the port is idle until the command completed.
+    while (1) {
+        sync_spinlock_lock(&dev->lock);
+        if (!dev->active) {
+            break;
+        }
+        sync_spinlock_unlock(&dev->lock);
+
+        error = ahci_ncq_drain(driver, drive);
+        if (AHCI_NO_ERR != error) {
+            return error;
+        }
+    }
+
+    error = exec_cmd_locked(ahci, dev, command, lba, count, buf);
+    sync_spinlock_unlock(&dev->lock);
+    return error;
+}
 
+/*
+ * Purpose: Used to execute a command through the data buffer of an idle
+ *          port, with its lock held
+ *
+ * Inputs:
+ *   - *dev: the port of the drive
+ *   - command: the command to be executed
+ *   - lba: the address at which to start reading or writing
+ *   - count: the length of the data to be read or written
+ *   - *buf: the buffer used to transfer or receive data from the device
+ *
+ * Returns: success (0) or failure (error code)
+ *
+ */
+static int exec_cmd_locked(ahci_dev_t *ahci, ahci_port_t *dev, uint8_t command, uint64_t lba, uint16_t count,
+                           uint8_t *buf)
+{
     int spin = 0; // Spin lock timeout counter
     int slot = 0;
-    uint8_t *bufptr = ahci->buf;
-    int i;
+    uint8_t *bufptr = dev->buf;
     int error = AHCI_NO_ERR;
 
-    hba_port_t *port = &ahci->abar->ports[ahci->device_list[drive].port_num];
+    hba_port_t *port = &ahci->abar->ports[dev->port_num];
     port->is = (uint32_t) -1;       // Clear pending interrupt bits
 
     check_for_errors(port);
     // Find free slot in port's command list
     slot = find_cmdslot(ahci, port);
     if (-1 == slot) {
+        dev->stats.cmdlst_full++;
         ZF_LOGE("AHCI: Command List is full");
         ZF_LOGE("PxSACT: 0x%x", port->sact);
         ZF_LOGE("PxCI: 0x%x", port->ci);
@@ -372,8 +462,8 @@ int ahci_exec_cmd(sata_driver_t *driver, uint8_t command, uint8_t drive, uint32_
         return AHCI_CMDLST_FULL_ERR;
     }
 
-    // Verify ahci->buf can handle transfer size requested
-    if ((count * SATA_BLK_SIZE) > ahci->buf_size) {
+    // Verify the buffer of the port can handle transfer size requested
+    if ((count * SATA_BLK_SIZE) > dev->buf_size) {
         ZF_LOGE("AHCI: Requested transfer exceeds the data buffer size");
         return AHCI_CMD_FAILED_ERR;
     }
@@ -382,7 +472,7 @@ int ahci_exec_cmd(sata_driver_t *driver, uint8_t command, uint8_t drive, uint32_
     hba_cmd_hdr_t *cmdheader = (hba_cmd_hdr_t *)port_clb;
     cmdheader += slot;
 
-    error = construct_cmd_header(cmdheader, command, count);
+    error = construct_cmd_header(cmdheader, command, PRDT_ENTRIES_NEEDED(count));
     if (AHCI_NO_ERR != error) {
         return error;
     }
@@ -404,7 +494,7 @@ int ahci_exec_cmd(sata_driver_t *driver, uint8_t command, uint8_t drive, uint32_
     }
 
     if (ATA_WRITE == command) {
-        memcpy(ahci->buf, buf, cmdheader->prdtl * BYTES_PER_PRDT);
+        memcpy(dev->buf, buf, count * SATA_BLK_SIZE);
     }
 
     // The below loop waits until the port is no longer busy before issuing a new command
@@ -418,6 +508,7 @@ int ahci_exec_cmd(sata_driver_t *driver, uint8_t command, uint8_t drive, uint32_
     }
 
     port->ci = 1 << slot; // Issue command
+    count_cmd(dev, command, count);
 
     // Reset timeout counter
     spin = 0;
@@ -441,11 +532,11 @@ int ahci_exec_cmd(sata_driver_t *driver, uint8_t command, uint8_t drive, uint32_
             }
             return AHCI_READ_DISK_ERR;
         }
-        if (TIMEOUT_10S < spin) {
+        if (TIMEOUT_10S_US < spin) {
             ZF_LOGE("AHCI: Timed out waiting for completion!");
             return AHCI_TIMEOUT_ERR;
         }
-        ps_mdelay(1);
+        ps_udelay(1);
         spin++;
     }
 
@@ -456,287 +547,1245 @@ int ahci_exec_cmd(sata_driver_t *driver, uint8_t command, uint8_t drive, uint32_
     }
 
     if ((ATA_READ == command) || (ATA_IDENTIFY == command)) {
-        memcpy(buf, ahci->buf, cmdheader->prdtl * BYTES_PER_PRDT);
+        memcpy(buf, dev->buf, count * SATA_BLK_SIZE);
     }
     return AHCI_NO_ERR;
 }
 
 /*
- * Purpose: Used to fill data into the a command header structure
+ * Purpose: Used to read or write any number of sectors. The transfer is split
+ *          into commands that fit the data buffer of a slot and the PRDT of a
+ *          command, which are all issued before waiting for the first, so
+ *          the drive always has the next one.
  *
  * Inputs:
- *   - *cmdheader: a pointer to the command header structure
- *   - command: the command request to be sent (read or write)
- *   - num_sects: the length of the data to be read or written
+ *   - command: the command to be executed (read or write)
+ *   - drive: the drive to execute the command on
+ *   - lba: the address at which to start reading or writing
+ *   - count: the number of sectors to be read or written
+ *   - *buf: the buffer used to transfer or receive data from the device
  *
  * Returns: success (0) or failure (error code)
  *
  */
-static int construct_cmd_header(hba_cmd_hdr_t *cmdheader, uint8_t command, uint16_t num_sects)
+int ahci_exec_cmd_ext(sata_driver_t *driver, uint8_t command, uint8_t drive, uint64_t lba, uint32_t count,
+                      uint8_t *buf)
 {
-    if (NULL == cmdheader) {
-        ZF_LOGE("AHCI: command header is NULL");
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
+    uint32_t done;
+    uint32_t failed;
+    ahci_wait_t wait = { .pending = 0, .status = AHCI_NO_ERR };
+    uint32_t chunk;
+    int spin = 0;
+    int tag;
+    int error = get_drive(driver, drive, &ahci, &dev);
+
+    if (AHCI_NO_ERR != error) {
+        return error;
+    }
+    if (NULL == buf) {
+        ZF_LOGE("AHCI: buffer can't be NULL");
         return AHCI_NULL_PTR_ERR;
     }
 
-    if (ATA_READ == command) {
-        cmdheader->w = 0;       // Read from device
-    } else if (ATA_WRITE == command) {
-        cmdheader->w = 1;       // Write to device
-    } else if (ATA_IDENTIFY == command) {
-        cmdheader->w = 0;       // Read from device
-    } else {
-        ZF_LOGE("AHCI: Command not found");
-        return AHCI_CMD_NOT_FOUND_ERR;
+    uint32_t max_sects = ahci->slot_buf_size / SATA_BLK_SIZE;
+    if (max_sects > AHCI_MAX_CMD_SECTS) {
+        max_sects = AHCI_MAX_CMD_SECTS;
     }
 
-    cmdheader->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t); // Command FIS size
-    cmdheader->prdtl = PRDT_ENTRIES_NEEDED(num_sects);    // PRDT entries count
+    if (0 == max_sects) {
+        // The data buffer is too small to split between slots, so one
+        // command at a time goes through the whole of the port's part
+        max_sects = dev->buf_size / SATA_BLK_SIZE;
+        if (max_sects > AHCI_MAX_CMD_SECTS) {
+            max_sects = AHCI_MAX_CMD_SECTS;
+        }
+        if (0 == max_sects) {
+            ZF_LOGE("AHCI: Data buffer cannot hold a sector");
+            return AHCI_MEM_SIZE_ERR;
+        }
+        while (count && (AHCI_NO_ERR == error)) {
+            chunk = (count > max_sects) ? max_sects : count;
+            error = ahci_exec_cmd(driver, command, drive, lba, chunk, buf);
+            count -= chunk;
+            lba += chunk;
+            buf += chunk * SATA_BLK_SIZE;
+        }
+        return error;
+    }
 
-    if (NUM_PRDT_ENTRIES < cmdheader->prdtl) {
-        ZF_LOGE("AHCI: Command table cannot handle transfer size requested");
-        return AHCI_CMD_FAILED_ERR;
+    // Once a command failed nothing more is issued, the commands in flight
+    // are waited for
+    while (count && (AHCI_NO_ERR == __atomic_load_n(&wait.status, __ATOMIC_RELAXED))) {
+        chunk = (count > max_sects) ? max_sects : count;
+        __atomic_fetch_add(&wait.pending, 1, __ATOMIC_RELAXED);
+        error = issue_async_cmd(ahci, drive, command, lba, chunk, buf, NULL, 0, wait_complete, &wait, &tag);
+        if (AHCI_NO_ERR == error) {
+            count -= chunk;
+            lba += chunk;
+            buf += chunk * SATA_BLK_SIZE;
+            spin = 0;
+            continue;
+        }
+        __atomic_fetch_sub(&wait.pending, 1, __ATOMIC_RELAXED);
+        if (AHCI_CMDLST_FULL_ERR != error) {
+            break;
+        }
+        error = AHCI_NO_ERR;
+
+        // Every slot is taken, harvesting frees those that completed
+        if (TIMEOUT_10S_US < spin) {
+            ZF_LOGE("AHCI: Timed out waiting for a free slot");
+            error = AHCI_TIMEOUT_ERR;
+            break;
+        }
+        harvest_port(ahci, drive, &done, &failed);
+        ps_udelay(1);
+        spin++;
     }
 
-    return AHCI_NO_ERR;
+    int wait_error = wait_cmds(ahci, drive, &wait);
+
+    return (AHCI_NO_ERR != error) ? error : wait_error;
 }
 
 /*
- * Purpose: Used to fill data into the command table structure
+ * Purpose: Used to get the NCQ queue depth of a drive
  *
  * Inputs:
- *   - *cmdtbl: a pointer to the command table structure
- *   - num_sects: the length of the data to be read or written
- *   - prdt_len: physical region descriptor table length
- *   - *data_buf: the buffer used to transfer or receive data from the device
+ *   - drive: the drive to check
  *
- * Returns: success (0) or failure (error code)
+ * Returns: number of tags the drive accepts, 0 if it cannot queue commands
  *
  */
-static int construct_cmd_tbl(hba_cmd_tbl_t *cmdtbl, uint16_t num_sects, uint16_t prdt_len,
-                             uint8_t *data_buf)
+int ahci_ncq_depth(sata_driver_t *driver, uint8_t drive)
 {
-    int i;
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
 
-    if (NULL == cmdtbl) {
-        ZF_LOGE("AHCI: command table is NULL");
-        return AHCI_NULL_PTR_ERR;
+    if (AHCI_NO_ERR != get_drive(driver, drive, &ahci, &dev)) {
+        return 0;
     }
+    return dev->ncq_depth;
+}
 
-    memset(cmdtbl, 0, CMD_TBL_SIZE);
+/*
+ * Purpose: Used to get the most sectors a command issued without waiting
+ *          moves through the data buffer, which is the part of a slot
+ *
+ * Returns: number of sectors, 0 if the driver is not set up
+ *
+ */
+int ahci_submit_max_sects(sata_driver_t *driver)
+{
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
 
-    // 4K bytes (8 sectors) per PRDT
-    for (i = 0; i < (prdt_len - 1); i++) {
-        cmdtbl->prdt_entry[i].dba = GET_LOWER_32BITS((uint64_t)((uintptr_t) data_buf));
-        cmdtbl->prdt_entry[i].dbau = GET_UPPER_32BITS((uint64_t)((uintptr_t) data_buf));
-        cmdtbl->prdt_entry[i].dbc = DATA_BLK_SIZE;
-        cmdtbl->prdt_entry[i].i = 0;
-        data_buf += BYTES_PER_PRDT;
-        num_sects -= SECTORS_PER_PRDT;    // 8 sectors
+    if (AHCI_NO_ERR != get_drive(driver, 0, &ahci, &dev)) {
+        return 0;
     }
-    // Last entry
-    cmdtbl->prdt_entry[i].dba = GET_LOWER_32BITS((uint64_t)((uintptr_t) data_buf));
-    cmdtbl->prdt_entry[i].dbau = GET_UPPER_32BITS((uint64_t)((uintptr_t) data_buf));
-    cmdtbl->prdt_entry[i].dbc = SECTORS_TO_BYTES(num_sects);
-    cmdtbl->prdt_entry[i].i = 1;
-
-    return AHCI_NO_ERR;
+    uint32_t max_sects = ahci->slot_buf_size / SATA_BLK_SIZE;
+    return (max_sects > AHCI_MAX_CMD_SECTS) ? AHCI_MAX_CMD_SECTS : max_sects;
 }
 
 /*
- * Purpose: Used to fill data into a command frame information structure
+ * Purpose: Used to queue a READ/WRITE FPDMA QUEUED command without waiting for it
  *
  * Inputs:
- *   - *cmdfis: a pointer to the command frame information structure
- *   - command: the command request to be sent (read or write)
- *   - num_sects: the length of the data to be read or written
+ *   - command: the command to be queued (read or write)
+ *   - drive: the drive to queue the command on
  *   - lba: the address at which to start reading or writing
+ *   - count: the number of sectors to be read or written
+ *   - *buf: the buffer used to transfer or receive data from the device. For
+ *           reads it is filled in when ahci_ncq_poll reports the tag done
+ *   - *tag: set to the tag of the command
  *
  * Returns: success (0) or failure (error code)
  *
  */
-static int construct_cmd_fis(fis_reg_h2d_t *cmdfis, uint8_t command, uint16_t num_sects, uint32_t lba)
+int ahci_ncq_submit(sata_driver_t *driver, uint8_t command, uint8_t drive, uint64_t lba, uint16_t count,
+                    uint8_t *buf, int *tag)
 {
-    if (NULL == cmdfis) {
-        ZF_LOGE("AHCI: command frame information structure is NULL");
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
+    int error = get_drive(driver, drive, &ahci, &dev);
+
+    if (AHCI_NO_ERR != error) {
+        return error;
+    }
+    if (NULL == tag) {
+        ZF_LOGE("AHCI: ncq: tag can't be NULL");
         return AHCI_NULL_PTR_ERR;
     }
-
-    cmdfis->fis_type = FIS_TYPE_REG_H2D;
-    cmdfis->c = 1;  // signifies structure is a command
-
-    if (ATA_READ == command) {
-        cmdfis->command = ATA_CMD_READ_DMA_EXT;
-    } else if (ATA_WRITE == command) {
-        cmdfis->command = ATA_CMD_WRITE_DMA_EXT;
-    } else if (ATA_IDENTIFY == command) {
-        cmdfis->command = ATA_CMD_IDENTIFY;
-    } else {
-        ZF_LOGE("AHCI: Command not found");
-        return AHCI_CMD_NOT_FOUND_ERR;
+    if (0 == dev->ncq_depth) {
+        ZF_LOGE("AHCI: ncq: drive %u does not support NCQ", drive);
+        return AHCI_CONFIG_ERR;
     }
 
-    // Using LBA 48 mode
-    cmdfis->lba0 = GET_BYTE0(lba);
-    cmdfis->lba1 = GET_BYTE1(lba);
-    cmdfis->lba2 = GET_BYTE2(lba);
-    cmdfis->device = 1 << 6; // LBA mode
-
-    cmdfis->lba3 = GET_BYTE3(lba);
-    cmdfis->lba4 = 0; // LBA28 is integer, so 32-bits are enough to access 2TB.
-    cmdfis->lba5 = 0; // LBA28 is integer, so 32-bits are enough to access 2TB.
-
-    cmdfis->countl = GET_BYTE0(num_sects);
-    cmdfis->counth = GET_BYTE1(num_sects);
-
-    return AHCI_NO_ERR;
+    return issue_async_cmd(ahci, drive, command, lba, count, buf, NULL, 0, NULL, NULL, tag);
 }
 
 /*
- * Purpose: Used to find an empty slot in the command list
+ * Purpose: Used to harvest queued commands the drive completed
  *
  * Inputs:
- *   - *port: a pointer to the memory space that contains the port specific registers
+ *   - drive: the drive to check
+ *   - *done: set to the tags that completed since the last call
+ *   - *failed: set to the tags that were aborted by an error
  *
- * Returns: the free slot or failure
+ * Returns: success (0) or failure (error code) if commands failed
  *
  */
-static int find_cmdslot(ahci_dev_t *ahci, hba_port_t *port)
+int ahci_ncq_poll(sata_driver_t *driver, uint8_t drive, uint32_t *done, uint32_t *failed)
 {
-    // If not set in SACT and CI, the slot is free
-    uint32_t slots = (port->sact | port->ci);
-    int num_slots = GET_NUM_SLOTS(ahci->abar->cap);
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
+    int error = get_drive(driver, drive, &ahci, &dev);
 
-    for (int i = 0; i < num_slots; i++) {
-        if ((slots & 1) == 0) {
-            return i;
-        }
-        slots >>= 1;
+    if (AHCI_NO_ERR != error) {
+        return error;
     }
-    ZF_LOGE("Cannot find free command list entry");
-    return -1;
+    if ((NULL == done) || (NULL == failed)) {
+        ZF_LOGE("AHCI: ncq: done and failed can't be NULL");
+        return AHCI_NULL_PTR_ERR;
+    }
+
+    return harvest_port(ahci, drive, done, failed);
 }
 
 /*
- * Purpose: Used to reset the port or the entire controller on a fatal error
+ * Purpose: Used to wait for all commands issued without waiting on a drive
+ *          to complete
  *
  * Inputs:
- *   - *port: a pointer to the memory space that contains the port specific registers
+ *   - drive: the drive to wait for
  *
- * Returns: success or failure (error code)
+ * Returns: success (0) or failure (error code) if any of them failed
  *
  */
-static int reset_ahci_controller(ahci_dev_t *ahci, hba_port_t *port)
+int ahci_ncq_drain(sata_driver_t *driver, uint8_t drive)
 {
-    ZF_LOGV("AHCI: reset controller");
-    int status = 0;
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
+    uint32_t done;
+    uint32_t failed;
+    int spin = 0;
+    int error = get_drive(driver, drive, &ahci, &dev);
 
-    status = soft_reset_port(port);
-    if (AHCI_TIMEOUT_ERR == status) {
-        status = hard_reset_controller(ahci);
+    if (AHCI_NO_ERR != error) {
+        return error;
     }
 
-    return status;
+    while (port_active(dev)) {
+        error = harvest_port(ahci, drive, &done, &failed);
+        if (AHCI_NO_ERR != error) {
+            return error;
+        }
+        if (!port_active(dev)) {
+            break;
+        }
+        if (TIMEOUT_10S_US < spin) {
+            ZF_LOGE("AHCI: Timed out waiting for slots 0x%x", port_active(dev));
+            return AHCI_TIMEOUT_ERR;
+        }
+        ps_udelay(1);
+        spin++;
+    }
+
+    return AHCI_NO_ERR;
 }
 
 /*
- * Purpose: Used to soft reset the port on which there is a fatal error
+ * Purpose: Used to issue a read or write command without waiting for it. It
+ *          is queued on drives that support NCQ.
  *
  * Inputs:
- *   - *port: a pointer to the memory space that contains the port specific registers
+ *   - command: the command to be issued (read or write)
+ *   - drive: the drive to issue the command on
+ *   - lba: the address at which to start reading or writing
+ *   - count: the number of sectors to be read or written
+ *   - *buf: the buffer used to transfer or receive data from the device. For
+ *           reads it is filled in before cb is called
+ *   - cb: called with token and the status once the command completed
+ *   - *token: passed to cb
  *
- * Returns: success or failure (error code)
+ * Returns: success (0) or failure (error code), cb is only called on success
  *
  */
-static int soft_reset_port(hba_port_t *port)
+int ahci_submit(sata_driver_t *driver, uint8_t command, uint8_t drive, uint64_t lba, uint16_t count,
+                uint8_t *buf, sata_complete_fn cb, void *token)
 {
-    uint32_t tmp;
-    int spin = 0;
-    int err = AHCI_NO_ERR;
-
-    stop_cmd(port);
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
+    int tag;
+    int error = get_drive(driver, drive, &ahci, &dev);
 
-    // set PxSCTL.DET to 1
-    tmp = ~PxSCTL_DET_MASK & port->sctl;
-    port->sctl = tmp | PxSCTL_DET_COMRESET;
-
-    ps_mdelay(1);
-
-    // set PxSCTL.DET to 0
-    tmp = ~PxSCTL_DET_MASK & port->sctl;
-    port->sctl = tmp;
-
-    // wait for communication to re-establish
-    while ((GET_DET_BITS(port->ssts) != HBA_PORT_DET_PRESENT_AND_COM) && (TIMEOUT_10S > spin)) {
-        ps_mdelay(1);
-        spin++;
+    if (AHCI_NO_ERR != error) {
+        return error;
     }
-    if (TIMEOUT_10S <= spin) {
-        ZF_LOGE("AHCI: Timed out on reset");
-        err = AHCI_TIMEOUT_ERR;
+    if (NULL == cb) {
+        ZF_LOGE("AHCI: submit: callback can't be NULL");
+        return AHCI_NULL_PTR_ERR;
     }
 
-    // clear errors that were set due to reset
-    port->serr |= 0xFFFFFFFF;
-
-    start_cmd(port);
-
-    return err;
+    return issue_async_cmd(ahci, drive, command, lba, count, buf, NULL, 0, cb, token, &tag);
 }
 
 /*
- * Purpose: Used to hard reset the whole controller on a fatal error
+ * Purpose: Used to issue a read or write command that transfers directly
+ *          to or from the caller's DMA memory, without waiting for it
  *
  * Inputs:
- *   - *port: a pointer to the memory space that contains the port specific registers
+ *   - command: the command to be issued (read or write)
+ *   - drive: the drive to issue the command on
+ *   - lba: the address at which to start reading or writing
+ *   - count: the number of sectors to be read or written
+ *   - *sg: the physical memory to transfer, only read until ahci_submit_sg returns
+ *   - num_sg: the number of entries in sg
+ *   - cb: called with token and the status once the command completed
+ *   - *token: passed to cb
  *
- * Returns: success or failure (error code)
+ * Returns: success (0) or failure (error code), cb is only called on success
  *
  */
-static int hard_reset_controller(ahci_dev_t *ahci)
+int ahci_submit_sg(sata_driver_t *driver, uint8_t command, uint8_t drive, uint64_t lba, uint16_t count,
+                   const ahci_sg_t *sg, int num_sg, sata_complete_fn cb, void *token)
 {
-    int spin = 0;
-    int err = AHCI_NO_ERR;
-
-    ahci->abar->ghc |= GHC_HR_BIT;
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
+    int tag;
+    int error = get_drive(driver, drive, &ahci, &dev);
 
-    // wait HBA reset to complete
-    while (((ahci->abar->ghc & GHC_HR_BIT) != HBA_RESET_DONE) && (TIMEOUT_1S > spin)) {
-        ps_mdelay(1);
-        spin++;
+    if (AHCI_NO_ERR != error) {
+        return error;
     }
-    if (TIMEOUT_1S <= spin) {
-        ZF_LOGE("AHCI: Hardware is hung or locked");
-        err = AHCI_TIMEOUT_ERR;
-    } else {
-        int active_ports = 0;
-        ahci->abar->ghc |= GHC_AHCI_EN_BIT;
-        active_ports = probe_ports(ahci);
-        for (int i = 0; i < active_ports; i++) {
-            ahci->abar->ports[ahci->device_list[i].port_num].serr |= 0xFFFFFFFF;
-            port_rebase(ahci, &ahci->abar->ports[ahci->device_list[i].port_num], i);
-        }
+    if (NULL == cb) {
+        ZF_LOGE("AHCI: submit: callback can't be NULL");
+        return AHCI_NULL_PTR_ERR;
     }
 
-    return err;
+    return issue_async_cmd(ahci, drive, command, lba, count, NULL, sg, num_sg, cb, token, &tag);
 }
 
 /*
- * Purpose: Used to initialize the AHCI driver
+ * Purpose: Used to execute a read or write command that transfers directly
+ *          to or from the caller's DMA memory. Unlike ahci_exec_cmd it does
+ *          not use the data buffer, so other commands of the drive carry on.
  *
  * Inputs:
- *   - *io_ops: the io functions
- *   - *config: the driver configuration data
+ *   - command: the command to be executed (read or write)
+ *   - drive: the drive to execute the command on
+ *   - lba: the address at which to start reading or writing
+ *   - count: the number of sectors to be read or written
+ *   - *sg: the physical memory to transfer
+ *   - num_sg: the number of entries in sg
  *
  * Returns: success (0) or failure (error code)
  *
  */
-int ahci_init(ps_io_ops_t *io_ops, sata_driver_t *driver, void *config)
+int ahci_exec_cmd_sg(sata_driver_t *driver, uint8_t command, uint8_t drive, uint64_t lba, uint16_t count,
+                     const ahci_sg_t *sg, int num_sg)
 {
-    if (NULL == driver) {
-        ZF_LOGE("AHCI: init: driver can't be NULL");
-        return AHCI_NULL_PTR_ERR;
-    }
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
+    ahci_wait_t wait = { .pending = 1, .status = AHCI_NO_ERR };
+    int tag;
+    int error = get_drive(driver, drive, &ahci, &dev);
+
+    if (AHCI_NO_ERR != error) {
+        return error;
+    }
+
+    error = issue_async_cmd(ahci, drive, command, lba, count, NULL, sg, num_sg, wait_complete, &wait, &tag);
+    if (AHCI_NO_ERR != error) {
+        return error;
+    }
+
+    return wait_cmds(ahci, drive, &wait);
+}
+
+/*
+ * Purpose: Used to harvest completed commands of all drives without waiting
+ *          for them. This is the polled mode for callers that spin rather
+ *          than wait for the interrupt.
+ *
+ * Returns: success (0) or failure (error code) if commands failed
+ *
+ */
+int ahci_poll(sata_driver_t *driver)
+{
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
+    uint32_t done;
+    uint32_t failed;
+    int error = get_drive(driver, 0, &ahci, &dev);
+
+    if (AHCI_NO_ERR != error) {
+        return error;
+    }
+
+    for (int i = 0; i < ahci->num_ports; i++) {
+        if (port_active(&ahci->device_list[i])) {
+            int port_error = harvest_port(ahci, i, &done, &failed);
+            if (AHCI_NO_ERR != port_error) {
+                error = port_error;
+            }
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Purpose: Used to handle the interrupt of the HBA. Every command completed
+ *          on the ports that raised it is harvested in one go.
+ *
+ * Returns: success (0) or failure (error code) if commands failed
+ *
+ */
+int ahci_handle_irq(sata_driver_t *driver)
+{
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
+    uint32_t done;
+    uint32_t failed;
+    int error = get_drive(driver, 0, &ahci, &dev);
+
+    if (AHCI_NO_ERR != error) {
+        return error;
+    }
+
+    uint32_t is = ahci->abar->is;
+
+    for (int i = 0; i < ahci->num_ports; i++) {
+        if (is & (1u << ahci->device_list[i].port_num)) {
+            int port_error = harvest_port(ahci, i, &done, &failed);
+            if (AHCI_NO_ERR != port_error) {
+                error = port_error;
+            }
+        }
+    }
+
+    // PxIS is acknowledged first, or the port raises IS again
+    ahci->abar->is = is;
+
+    return error;
+}
+
+/*
+ * Purpose: Used to enable the completion and error interrupts of every port,
+ *          once the caller registered a handler that calls ahci_handle_irq.
+ *          Without it the HBA never raises its interrupt and completed
+ *          commands are harvested by ahci_poll.
+ *
+ * Returns: success (0) or failure (error code)
+ *
+ */
+int ahci_enable_irq(sata_driver_t *driver)
+{
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
+    int error = get_drive(driver, 0, &ahci, &dev);
+
+    if (AHCI_NO_ERR != error) {
+        return error;
+    }
+
+    for (int i = 0; i < ahci->num_ports; i++) {
+        hba_port_t *port = &ahci->abar->ports[ahci->device_list[i].port_num];
+        port->ie = HBA_PxIE_COMPLETION | HBA_PxIS_TFES | HBA_PxIS_IFS;
+    }
+    ahci->abar->ghc |= GHC_IRQ_EN_BIT;
+
+    return AHCI_NO_ERR;
+}
+
+/*
+ * Purpose: Used to read the counters of a port
+ *
+ * Inputs:
+ *   - drive: the drive of the port
+ *   - *stats: filled in with the counters
+ *
+ * Returns: success (0) or failure (error code)
+ *
+ */
+int ahci_get_port_stats(sata_driver_t *driver, uint8_t drive, ahci_port_stats_t *stats)
+{
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
+    int error = get_drive(driver, drive, &ahci, &dev);
+
+    if (AHCI_NO_ERR != error) {
+        return error;
+    }
+    if (NULL == stats) {
+        ZF_LOGE("AHCI: stats can't be NULL");
+        return AHCI_NULL_PTR_ERR;
+    }
+
+    sync_spinlock_lock(&dev->lock);
+    *stats = dev->stats;
+    sync_spinlock_unlock(&dev->lock);
+
+    return AHCI_NO_ERR;
+}
+
+/*
+ * Purpose: Used to zero the counters of a port, such as before a workload
+ *
+ * Inputs:
+ *   - drive: the drive of the port
+ *
+ * Returns: success (0) or failure (error code)
+ *
+ */
+int ahci_reset_port_stats(sata_driver_t *driver, uint8_t drive)
+{
+    ahci_dev_t *ahci;
+    ahci_port_t *dev;
+    int error = get_drive(driver, drive, &ahci, &dev);
+
+    if (AHCI_NO_ERR != error) {
+        return error;
+    }
+
+    sync_spinlock_lock(&dev->lock);
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    sync_spinlock_unlock(&dev->lock);
+
+    return AHCI_NO_ERR;
+}
+
+/*
+ * Purpose: Used to look up an initialised drive
+ *
+ * Inputs:
+ *   - drive: the drive to look up
+ *   - **ahci: set to the AHCI driver
+ *   - **dev: set to the port of the drive
+ *
+ * Returns: success (0) or failure (error code)
+ *
+ */
+static int get_drive(sata_driver_t *driver, uint8_t drive, ahci_dev_t **ahci, ahci_port_t **dev)
+{
+    if (NULL == driver) {
+        ZF_LOGE("AHCI: driver can't be NULL");
+        return AHCI_NULL_PTR_ERR;
+    }
+    if (driver->mode != AHCI) {
+        ZF_LOGE("AHCI: SATA driver not designated as AHCI");
+        return AHCI_CONFIG_ERR;
+    }
+
+    *ahci = driver->driver;
+    if ((drive >= NUM_MAX_PORTS) || (drive >= MAX_DRIVES)) {
+        ZF_LOGE("AHCI: drive %u not found", drive);
+        return AHCI_INVALID_NUM_ERR;
+    }
+    *dev = &(*ahci)->device_list[drive];
+
+    return AHCI_NO_ERR;
+}
+
+/*
+ * Purpose: Used to build and issue a command in a free slot without waiting
+ *          for it. Drives that support NCQ get READ/WRITE FPDMA QUEUED with
+ *          the slot as tag, others get non-queued commands, which the HBA
+ *          sends one after the other.
+ *
+ * Inputs:
+ *   - command: the command to be issued (read or write)
+ *   - drive: the drive to issue the command on
+ *   - lba: the address at which to start reading or writing
+ *   - count: the number of sectors to be read or written
+ *   - *buf: the buffer used to transfer or receive data from the device,
+ *           copied through the data buffer of the slot. NULL if sg is used.
+ *   - *sg: the physical memory to transfer directly, NULL if buf is used
+ *   - num_sg: the number of entries in sg
+ *   - cb: called when the command is harvested, may be NULL
+ *   - *token: passed to cb
+ *   - *tag: set to the slot of the command
+ *
+ * Returns: success (0) or failure (error code)
+ *
+ */
+static int issue_async_cmd(ahci_dev_t *ahci, uint8_t drive, uint8_t command, uint64_t lba, uint16_t count,
+                           uint8_t *buf, const ahci_sg_t *sg, int num_sg, sata_complete_fn cb, void *token,
+                           int *tag)
+{
+    ahci_port_t *dev = &ahci->device_list[drive];
+    int error;
+
+    if (drive >= ahci->num_ports) {
+        ZF_LOGE("AHCI: drive %u not found", drive);
+        return AHCI_INVALID_NUM_ERR;
+    }
+    if ((NULL == buf) && (NULL == sg)) {
+        ZF_LOGE("AHCI: buffer can't be NULL");
+        return AHCI_NULL_PTR_ERR;
+    }
+    if ((NULL == sg) && ((0 == count) || ((count * SATA_BLK_SIZE) > ahci->slot_buf_size))) {
+        ZF_LOGE("AHCI: Requested transfer exceeds the data buffer of a slot");
+        return AHCI_CMD_FAILED_ERR;
+    }
+
+    sync_spinlock_lock(&dev->lock);
+    error = issue_slot(ahci, dev, command, lba, count, buf, sg, num_sg, cb, token, tag);
+    sync_spinlock_unlock(&dev->lock);
+
+    return error;
+}
+
+/*
+ * Purpose: Used to build and issue a command in a free slot of a port, with
+ *          its lock held. The inputs are those of issue_async_cmd.
+ *
+ * Returns: success (0) or failure (error code)
+ *
+ */
+static int issue_slot(ahci_dev_t *ahci, ahci_port_t *dev, uint8_t command, uint64_t lba, uint16_t count,
+                      uint8_t *buf, const ahci_sg_t *sg, int num_sg, sata_complete_fn cb, void *token, int *tag)
+{
+    int depth = dev->ncq_depth ? dev->ncq_depth : GET_NUM_SLOTS(ahci->abar->cap);
+    int slot = -1;
+    int error;
+
+    hba_port_t *port = &ahci->abar->ports[dev->port_num];
+
+    // A slot is free once it was harvested and the HBA let go of it
+    uint32_t busy = dev->active | port->sact | port->ci;
+    for (int i = 0; i < depth; i++) {
+        if (!(busy & (1u << i))) {
+            slot = i;
+            break;
+        }
+    }
+    if (-1 == slot) {
+        dev->stats.cmdlst_full++;
+        return AHCI_CMDLST_FULL_ERR;
+    }
+
+    uint64_t port_clb = ((uint64_t)port->clbu << 32) + (uint64_t)port->clb;
+    hba_cmd_hdr_t *cmdheader = (hba_cmd_hdr_t *)port_clb;
+    cmdheader += slot;
+
+    error = construct_cmd_header(cmdheader, command, sg ? num_sg : PRDT_ENTRIES_NEEDED(count));
+    if (AHCI_NO_ERR != error) {
+        return error;
+    }
+
+    hba_cmd_tbl_t *cmdtbl = (hba_cmd_tbl_t *)(((uint64_t)cmdheader->ctbau << 32) + (uint64_t)cmdheader->ctba);
+    uint8_t *bufptr = dev->buf + slot * ahci->slot_buf_size;
+
+    if (sg) {
+        error = construct_cmd_tbl_sg(cmdtbl, count, sg, num_sg);
+    } else {
+        error = construct_cmd_tbl(cmdtbl, count, cmdheader->prdtl, bufptr);
+    }
+    if (AHCI_NO_ERR != error) {
+        return error;
+    }
+
+    if (dev->ncq_depth) {
+        error = construct_ncq_fis((fis_reg_h2d_t *) &cmdtbl->cfis, command, count, lba, slot);
+    } else {
+        error = construct_cmd_fis((fis_reg_h2d_t *) &cmdtbl->cfis, command, count, lba);
+    }
+    if (AHCI_NO_ERR != error) {
+        return error;
+    }
+
+    if (buf && (ATA_WRITE == command)) {
+        memcpy(bufptr, buf, count * SATA_BLK_SIZE);
+    }
+
+    dev->cmds[slot] = (ahci_async_cmd_t) {
+        .command = command,
+        .count = count,
+        .buf = buf,
+        .cb = cb,
+        .token = token
+    };
+    dev->active |= 1u << slot;
+    count_cmd(dev, command, count);
+
+    if (dev->ncq_depth) {
+        // The tag has to be active before the command is issued
+        port->sact = 1u << slot;
+    }
+    port->ci = 1u << slot;
+
+    *tag = slot;
+    return AHCI_NO_ERR;
+}
+
+/*
+ * Purpose: Used to harvest the commands a drive completed and call their
+ *          callbacks. A command is complete once the HBA cleared its slot in
+ *          PxCI and, for queued commands, the Set Device Bits FIS of the
+ *          drive cleared its tag in PxSACT.
+ *
+ * Inputs:
+ *   - drive: the drive to check
+ *   - *done: set to the slots that completed since the last call
+ *   - *failed: set to the slots that were aborted by an error
+ *
+ * Returns: success (0) or failure (error code) if commands failed
+ *
+ */
+static int harvest_port(ahci_dev_t *ahci, uint8_t drive, uint32_t *done, uint32_t *failed)
+{
+    ahci_port_t *dev = &ahci->device_list[drive];
+    hba_port_t *port = &ahci->abar->ports[dev->port_num];
+    ahci_async_cmd_t cmds[ENTRIES_PER_CMDLST];
+    int status = AHCI_NO_ERR;
+    uint32_t completed;
+    uint32_t aborted = 0;
+
+    sync_spinlock_lock(&dev->lock);
+
+    uint32_t is = port->is;
+    if (is & (HBA_PxIS_TFES | HBA_PxIS_IFS)) {
+        // Slots the drive finished before the error completed normally, the
+        // error aborts the rest. Recovery clears PxSACT and PxCI, so they
+        // are read first.
+        completed = dev->active & ~(port->sact | port->ci);
+        aborted = dev->active & ~completed;
+        ZF_LOGE("AHCI: error with slots 0x%x outstanding", aborted);
+        check_for_errors(port);
+        recover_port(ahci, port);
+        status = AHCI_READ_DISK_ERR;
+        dev->stats.errors += __builtin_popcount(aborted);
+    } else {
+        // Acknowledge before reading PxCI and PxSACT, so a later completion
+        // raises the interrupt again. Polls that find nothing skip the write.
+        if (is) {
+            port->is = is;
+        }
+        completed = dev->active & ~(port->sact | port->ci);
+    }
+    *done = completed;
+    *failed = aborted;
+
+    for (int i = 0; i < ENTRIES_PER_CMDLST; i++) {
+        if ((completed | aborted) & (1u << i)) {
+            ahci_async_cmd_t *cmd = &dev->cmds[i];
+            if ((completed & (1u << i)) && cmd->buf && (ATA_READ == cmd->command)) {
+                uint8_t *bufptr = dev->buf + i * ahci->slot_buf_size;
+                memcpy(cmd->buf, bufptr, cmd->count * SATA_BLK_SIZE);
+            }
+            cmds[i] = *cmd;
+        }
+    }
+    dev->active &= ~(completed | aborted);
+
+    sync_spinlock_unlock(&dev->lock);
+
+    // The slots are free and the lock released, so callbacks may issue new commands
+    for (int i = 0; i < ENTRIES_PER_CMDLST; i++) {
+        if (((completed | aborted) & (1u << i)) && cmds[i].cb) {
+            cmds[i].cb(cmds[i].token, (aborted & (1u << i)) ? status : AHCI_NO_ERR);
+        }
+    }
+
+    return status;
+}
+
+/* Count a command issued on a port, with its lock held */
+static void count_cmd(ahci_port_t *dev, uint8_t command, uint16_t count)
+{
+    uint32_t active = __builtin_popcount(dev->active);
+
+    if (ATA_READ == command) {
+        dev->stats.reads++;
+        dev->stats.read_sects += count;
+    } else if (ATA_WRITE == command) {
+        dev->stats.writes++;
+        dev->stats.write_sects += count;
+    } else {
+        dev->stats.other++;
+    }
+    // Commands from ahci_exec_cmd are not in active
+    if (0 == active) {
+        active = 1;
+    }
+    if (active > dev->stats.max_active) {
+        dev->stats.max_active = active;
+    }
+}
+
+/* Slots of a port issued without waiting and not yet harvested */
+static uint32_t port_active(ahci_port_t *dev)
+{
+    sync_spinlock_lock(&dev->lock);
+    uint32_t active = dev->active;
+    sync_spinlock_unlock(&dev->lock);
+
+    return active;
+}
+
+/* Callback of the commands a caller waits for, token is their ahci_wait_t */
+static void wait_complete(void *token, int status)
+{
+    ahci_wait_t *wait = token;
+
+    if (AHCI_NO_ERR != status) {
+        int no_err = AHCI_NO_ERR;
+        __atomic_compare_exchange_n(&wait->status, &no_err, status, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_sub(&wait->pending, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Purpose: Used to wait for the commands of a caller to complete. Commands
+ *          of other callers on the drive complete on the way.
+ *
+ * Inputs:
+ *   - drive: the drive the commands were issued on
+ *   - *wait: the token the commands were issued with
+ *
+ * Returns: success (0) or failure (error code) of the commands
+ *
+ */
+static int wait_cmds(ahci_dev_t *ahci, uint8_t drive, ahci_wait_t *wait)
+{
+    ahci_port_t *dev = &ahci->device_list[drive];
+    uint32_t done;
+    uint32_t failed;
+    int spin = 0;
+
+    while (__atomic_load_n(&wait->pending, __ATOMIC_ACQUIRE)) {
+        harvest_port(ahci, drive, &done, &failed);
+        if (!__atomic_load_n(&wait->pending, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (TIMEOUT_10S_US < spin) {
+            ZF_LOGE("AHCI: Timed out waiting for completion!");
+            // The slots stay issued, so they must not call back into the
+            // stack frame of the caller or copy into its buffer later
+            sync_spinlock_lock(&dev->lock);
+            for (int i = 0; i < ENTRIES_PER_CMDLST; i++) {
+                if ((dev->active & (1u << i)) && (dev->cmds[i].token == wait)) {
+                    dev->cmds[i].cb = NULL;
+                    dev->cmds[i].buf = NULL;
+                }
+            }
+            sync_spinlock_unlock(&dev->lock);
+            return AHCI_TIMEOUT_ERR;
+        }
+        ps_udelay(1);
+        spin++;
+    }
+
+    return __atomic_load_n(&wait->status, __ATOMIC_RELAXED);
+}
+
+/*
+ * Purpose: Used to bring a port back after a task file error aborted its
+ *          queued commands
+ *
+ * Inputs:
+ *   - *port: a pointer to the memory space that contains the port specific registers
+ *
+ * Returns: nothing
+ *
+ */
+static void recover_port(ahci_dev_t *ahci, hba_port_t *port)
+{
+    // Clearing PxCMD.ST clears PxSACT and PxCI
+    stop_cmd(port);
+    port->serr |= 0xFFFFFFFF;
+    port->is = (uint32_t) -1;
+
+    if (port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) {
+        if (AHCI_NO_ERR != reset_ahci_controller(ahci, port)) {
+            ZF_LOGE("AHCI: Controller did not reset!");
+        }
+    } else {
+        start_cmd(port);
+    }
+}
+
+/*
+ * Purpose: Used to fill data into the a command header structure
+ *
+ * Inputs:
+ *   - *cmdheader: a pointer to the command header structure
+ *   - command: the command request to be sent (read or write)
+ *   - prdt_len: the number of PRDT entries the command uses
+ *
+ * Returns: success (0) or failure (error code)
+ *
+ */
+static int construct_cmd_header(hba_cmd_hdr_t *cmdheader, uint8_t command, uint16_t prdt_len)
+{
+    if (NULL == cmdheader) {
+        ZF_LOGE("AHCI: command header is NULL");
+        return AHCI_NULL_PTR_ERR;
+    }
+
+    if (ATA_READ == command) {
+        cmdheader->w = 0;       // Read from device
+    } else if (ATA_WRITE == command) {
+        cmdheader->w = 1;       // Write to device
+    } else if (ATA_IDENTIFY == command) {
+        cmdheader->w = 0;       // Read from device
+    } else {
+        ZF_LOGE("AHCI: Command not found");
+        return AHCI_CMD_NOT_FOUND_ERR;
+    }
+
+    cmdheader->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t); // Command FIS size
+    cmdheader->prdtl = prdt_len;    // PRDT entries count
+
+    if ((0 == prdt_len) || (NUM_PRDT_ENTRIES < prdt_len)) {
+        ZF_LOGE("AHCI: Command table cannot handle transfer size requested");
+        return AHCI_CMD_FAILED_ERR;
+    }
+
+    return AHCI_NO_ERR;
+}
+
+/*
+ * Purpose: Used to fill data into the command table structure
+ *
+ * Inputs:
+ *   - *cmdtbl: a pointer to the command table structure
+ *   - num_sects: the length of the data to be read or written
+ *   - prdt_len: physical region descriptor table length
+ *   - *data_buf: the buffer used to transfer or receive data from the device
+ *
+ * Returns: success (0) or failure (error code)
+ *
+ */
+static int construct_cmd_tbl(hba_cmd_tbl_t *cmdtbl, uint16_t num_sects, uint16_t prdt_len,
+                             uint8_t *data_buf)
+{
+    int i;
+
+    if (NULL == cmdtbl) {
+        ZF_LOGE("AHCI: command table is NULL");
+        return AHCI_NULL_PTR_ERR;
+    }
+
+    memset(cmdtbl, 0, CMD_TBL_SIZE);
+
+    // 4K bytes (8 sectors) per PRDT
+    for (i = 0; i < (prdt_len - 1); i++) {
+        cmdtbl->prdt_entry[i].dba = GET_LOWER_32BITS((uint64_t)((uintptr_t) data_buf));
+        cmdtbl->prdt_entry[i].dbau = GET_UPPER_32BITS((uint64_t)((uintptr_t) data_buf));
+        cmdtbl->prdt_entry[i].dbc = DATA_BLK_SIZE;
+        cmdtbl->prdt_entry[i].i = 0;
+        data_buf += BYTES_PER_PRDT;
+        num_sects -= SECTORS_PER_PRDT;    // 8 sectors
+    }
+    // Last entry
+    cmdtbl->prdt_entry[i].dba = GET_LOWER_32BITS((uint64_t)((uintptr_t) data_buf));
+    cmdtbl->prdt_entry[i].dbau = GET_UPPER_32BITS((uint64_t)((uintptr_t) data_buf));
+    cmdtbl->prdt_entry[i].dbc = SECTORS_TO_BYTES(num_sects);
+    cmdtbl->prdt_entry[i].i = 1;
+
+    return AHCI_NO_ERR;
+}
+
+/*
+ * Purpose: Used to fill data into the command table structure from a
+ *          scatter-gather list, one PRDT entry per element
+ *
+ * Inputs:
+ *   - *cmdtbl: a pointer to the command table structure
+ *   - num_sects: the length of the data to be read or written
+ *   - *sg: the physical memory to transfer
+ *   - num_sg: the number of entries in sg
+ *
+ * Returns: success (0) or failure (error code)
+ *
+ */
+static int construct_cmd_tbl_sg(hba_cmd_tbl_t *cmdtbl, uint16_t num_sects, const ahci_sg_t *sg, int num_sg)
+{
+    uint64_t total = 0;
+    int i;
+
+    if ((NULL == cmdtbl) || (NULL == sg)) {
+        ZF_LOGE("AHCI: command table or scatter-gather list is NULL");
+        return AHCI_NULL_PTR_ERR;
+    }
+
+    memset(cmdtbl, 0, CMD_TBL_SIZE);
+
+    for (i = 0; i < num_sg; i++) {
+        // The HBA transfers words, and dbc holds the byte count minus one
+        if ((0 == sg[i].len) || (sg[i].len & 1) || (sg[i].phys & 1) || (AHCI_SG_MAX_LEN < sg[i].len)) {
+            ZF_LOGE("AHCI: Invalid scatter-gather element %d", i);
+            return AHCI_CMD_FAILED_ERR;
+        }
+        cmdtbl->prdt_entry[i].dba = GET_LOWER_32BITS((uint64_t) sg[i].phys);
+        cmdtbl->prdt_entry[i].dbau = GET_UPPER_32BITS((uint64_t) sg[i].phys);
+        cmdtbl->prdt_entry[i].dbc = sg[i].len - 1;
+        cmdtbl->prdt_entry[i].i = 0;
+        total += sg[i].len;
+    }
+    cmdtbl->prdt_entry[num_sg - 1].i = 1;
+
+    if ((0 == num_sects) || (total != (uint64_t) num_sects * SATA_BLK_SIZE)) {
+        ZF_LOGE("AHCI: Scatter-gather list does not match the transfer size");
+        return AHCI_CMD_FAILED_ERR;
+    }
+
+    return AHCI_NO_ERR;
+}
+
+/*
+ * Purpose: Used to fill data into a command frame information structure
+ *
+ * Inputs:
+ *   - *cmdfis: a pointer to the command frame information structure
+ *   - command: the command request to be sent (read or write)
+ *   - num_sects: the length of the data to be read or written
+ *   - lba: the address at which to start reading or writing
+ *
+ * Returns: success (0) or failure (error code)
+ *
+ */
+static int construct_cmd_fis(fis_reg_h2d_t *cmdfis, uint8_t command, uint16_t num_sects, uint64_t lba)
+{
+    if (NULL == cmdfis) {
+        ZF_LOGE("AHCI: command frame information structure is NULL");
+        return AHCI_NULL_PTR_ERR;
+    }
+
+    cmdfis->fis_type = FIS_TYPE_REG_H2D;
+    cmdfis->c = 1;  // signifies structure is a command
+
+    if (ATA_READ == command) {
+        cmdfis->command = ATA_CMD_READ_DMA_EXT;
+    } else if (ATA_WRITE == command) {
+        cmdfis->command = ATA_CMD_WRITE_DMA_EXT;
+    } else if (ATA_IDENTIFY == command) {
+        cmdfis->command = ATA_CMD_IDENTIFY;
+    } else {
+        ZF_LOGE("AHCI: Command not found");
+        return AHCI_CMD_NOT_FOUND_ERR;
+    }
+
+    // Using LBA 48 mode
+    cmdfis->lba0 = GET_BYTE0(lba);
+    cmdfis->lba1 = GET_BYTE1(lba);
+    cmdfis->lba2 = GET_BYTE2(lba);
+    cmdfis->device = 1 << 6; // LBA mode
+
+    cmdfis->lba3 = GET_BYTE3(lba);
+    cmdfis->lba4 = GET_BYTE4(lba);
+    cmdfis->lba5 = GET_BYTE5(lba);
+
+    cmdfis->countl = GET_BYTE0(num_sects);
+    cmdfis->counth = GET_BYTE1(num_sects);
+
+    return AHCI_NO_ERR;
+}
+
+/*
+ * Purpose: Used to fill data into a command frame information structure for a
+ *          queued command
+ *
+ * Inputs:
+ *   - *cmdfis: a pointer to the command frame information structure
+ *   - command: the command request to be sent (read or write)
+ *   - num_sects: the length of the data to be read or written
+ *   - lba: the address at which to start reading or writing
+ *   - tag: the tag of the command
+ *
+ * Returns: success (0) or failure (error code)
+ *
+ */
+static int construct_ncq_fis(fis_reg_h2d_t *cmdfis, uint8_t command, uint16_t num_sects, uint64_t lba,
+                             int tag)
+{
+    if (NULL == cmdfis) {
+        ZF_LOGE("AHCI: command frame information structure is NULL");
+        return AHCI_NULL_PTR_ERR;
+    }
+
+    memset(cmdfis, 0, sizeof(fis_reg_h2d_t));
+    cmdfis->fis_type = FIS_TYPE_REG_H2D;
+    cmdfis->c = 1;  // signifies structure is a command
+
+    if (ATA_READ == command) {
+        cmdfis->command = ATA_CMD_READ_FPDMA_QUEUED;
+    } else if (ATA_WRITE == command) {
+        cmdfis->command = ATA_CMD_WRITE_FPDMA_QUEUED;
+    } else {
+        ZF_LOGE("AHCI: Command not found");
+        return AHCI_CMD_NOT_FOUND_ERR;
+    }
+
+    cmdfis->lba0 = GET_BYTE0(lba);
+    cmdfis->lba1 = GET_BYTE1(lba);
+    cmdfis->lba2 = GET_BYTE2(lba);
+    cmdfis->device = 1 << 6; // LBA mode
+
+    cmdfis->lba3 = GET_BYTE3(lba);
+    cmdfis->lba4 = GET_BYTE4(lba);
+    cmdfis->lba5 = GET_BYTE5(lba);
+
+    // Queued commands take the sector count in the features register and
+    // the tag in bits 7:3 of the count register
+    cmdfis->featurel = GET_BYTE0(num_sects);
+    cmdfis->featureh = GET_BYTE1(num_sects);
+    cmdfis->countl = tag << 3;
+    cmdfis->counth = 0;
+
+    return AHCI_NO_ERR;
+}
+
+/*
+ * Purpose: Used to find an empty slot in the command list
+ *
+ * Inputs:
+ *   - *port: a pointer to the memory space that contains the port specific registers
+ *
+ * Returns: the free slot or failure
+ *
+ */
+static int find_cmdslot(ahci_dev_t *ahci, hba_port_t *port)
+{
+    // If not set in SACT and CI, the slot is free
+    uint32_t slots = (port->sact | port->ci);
+    int num_slots = GET_NUM_SLOTS(ahci->abar->cap);
+
+    for (int i = 0; i < num_slots; i++) {
+        if ((slots & 1) == 0) {
+            return i;
+        }
+        slots >>= 1;
+    }
+    ZF_LOGE("Cannot find free command list entry");
+    return -1;
+}
+
+/*
+ * Purpose: Used to reset the port or the entire controller on a fatal error
+ *
+ * Inputs:
+ *   - *port: a pointer to the memory space that contains the port specific registers
+ *
+ * Returns: success or failure (error code)
+ *
+ */
+static int reset_ahci_controller(ahci_dev_t *ahci, hba_port_t *port)
+{
+    ZF_LOGV("AHCI: reset controller");
+    int status = 0;
+
+    status = soft_reset_port(port);
+    if (AHCI_TIMEOUT_ERR == status) {
+        status = hard_reset_controller(ahci);
+    }
+
+    return status;
+}
+
+/*
+ * Purpose: Used to soft reset the port on which there is a fatal error
+ *
+ * Inputs:
+ *   - *port: a pointer to the memory space that contains the port specific registers
+ *
+ * Returns: success or failure (error code)
+ *
+ */
+static int soft_reset_port(hba_port_t *port)
+{
+    uint32_t tmp;
+    int spin = 0;
+    int err = AHCI_NO_ERR;
+
+    stop_cmd(port);
+
+    // set PxSCTL.DET to 1
+    tmp = ~PxSCTL_DET_MASK & port->sctl;
+    port->sctl = tmp | PxSCTL_DET_COMRESET;
+
+    ps_mdelay(1);
+
+    // set PxSCTL.DET to 0
+    tmp = ~PxSCTL_DET_MASK & port->sctl;
+    port->sctl = tmp;
+
+    // wait for communication to re-establish
+    while ((GET_DET_BITS(port->ssts) != HBA_PORT_DET_PRESENT_AND_COM) && (TIMEOUT_10S > spin)) {
+        ps_mdelay(1);
+        spin++;
+    }
+    if (TIMEOUT_10S <= spin) {
+        ZF_LOGE("AHCI: Timed out on reset");
+        err = AHCI_TIMEOUT_ERR;
+    }
+
+    // clear errors that were set due to reset
+    port->serr |= 0xFFFFFFFF;
+
+    start_cmd(port);
+
+    return err;
+}
+
+/*
+ * Purpose: Used to hard reset the whole controller on a fatal error
+ *
+ * Inputs:
+ *   - *port: a pointer to the memory space that contains the port specific registers
+ *
+ * Returns: success or failure (error code)
+ *
+ */
+static int hard_reset_controller(ahci_dev_t *ahci)
+{
+    int spin = 0;
+    int err = AHCI_NO_ERR;
+
+    ahci->abar->ghc |= GHC_HR_BIT;
+
+    // wait HBA reset to complete
+    while (((ahci->abar->ghc & GHC_HR_BIT) != HBA_RESET_DONE) && (TIMEOUT_1S > spin)) {
+        ps_mdelay(1);
+        spin++;
+    }
+    if (TIMEOUT_1S <= spin) {
+        ZF_LOGE("AHCI: Hardware is hung or locked");
+        err = AHCI_TIMEOUT_ERR;
+    } else {
+        int active_ports = 0;
+        ahci->abar->ghc |= GHC_AHCI_EN_BIT;
+        active_ports = probe_ports(ahci);
+        for (int i = 0; i < active_ports; i++) {
+            ahci->abar->ports[ahci->device_list[i].port_num].serr |= 0xFFFFFFFF;
+            port_rebase(ahci, &ahci->abar->ports[ahci->device_list[i].port_num], i);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * Purpose: Used to initialize the AHCI driver
+ *
+ * Inputs:
+ *   - *io_ops: the io functions
+ *   - *config: the driver configuration data
+ *
+ * Returns: success (0) or failure (error code)
+ *
+ */
+int ahci_init(ps_io_ops_t *io_ops, sata_driver_t *driver, void *config)
+{
+    if (NULL == driver) {
+        ZF_LOGE("AHCI: init: driver can't be NULL");
+        return AHCI_NULL_PTR_ERR;
+    }
 
     if (driver->mode != AHCI) {
         ZF_LOGE("AHCI: init: calling init on a SATA driver not designated as AHCI");
@@ -790,15 +1839,43 @@ int ahci_init(ps_io_ops_t *io_ops, sata_driver_t *driver, void *config)
     if (NUM_MAX_PORTS < active_ports) {
         return AHCI_INVALID_NUM_ERR;
     }
+    // The driver describes at most MAX_DRIVES drives
+    if (MAX_DRIVES < active_ports) {
+        ZF_LOGW("AHCI: using the first %d of %d drives", MAX_DRIVES, active_ports);
+        active_ports = MAX_DRIVES;
+    }
 
     error = validate_memory_space(ahci, active_ports);
     if (AHCI_NO_ERR != error) {
         return error;
     }
 
+    // Each port gets a part of the data buffer, so transfers on different
+    // ports do not share it, and commands issued without waiting each get a
+    // part of that of their port
+    ahci->num_ports = active_ports;
+    if (active_ports) {
+        uint32_t port_buf_size = ahci->buf_size / active_ports;
+        port_buf_size -= port_buf_size % SATA_BLK_SIZE;
+        ahci->slot_buf_size = port_buf_size / ENTRIES_PER_CMDLST;
+        ahci->slot_buf_size -= ahci->slot_buf_size % SATA_BLK_SIZE;
+
+        for (int i = 0; i < active_ports; i++) {
+            sync_spinlock_init(&ahci->device_list[i].lock);
+            ahci->device_list[i].buf = ahci->buf + i * port_buf_size;
+            ahci->device_list[i].buf_size = port_buf_size;
+        }
+    }
+
     for (int i = 0; i < active_ports; i++) {
-        port_rebase(ahci, &ahci->abar->ports[ahci->device_list[i].port_num], i);
+        hba_port_t *port = &ahci->abar->ports[ahci->device_list[i].port_num];
+        port_rebase(ahci, port, i);
+        port->is = (uint32_t) -1;
+        port->ie = 0;
     }
+    // Interrupts stay masked until a handler is registered with ahci_enable_irq
+    ahci->abar->is = (uint32_t) -1;
+    ahci->abar->ghc &= ~GHC_IRQ_EN_BIT;
 
     for (int count = 0; count < active_ports; count++) {
         ZF_LOGV("AHCI IDENTIFY PORT %d", count);
@@ -825,10 +1902,26 @@ int ahci_init(ps_io_ops_t *io_ops, sata_driver_t *driver, void *config)
         /* Get Size */
         if (driver->sata_devices[count].CommandSets & IDENT_LBA48_SUPPORT_BIT) {
             /* Device uses 48-Bit Addressing */
-            memcpy(&driver->sata_devices[count].Size, mbuf + ATA_IDENT_MAX_LBA_EXT, sizeof(uint32_t));
+            memcpy(&driver->sata_devices[count].Size, mbuf + ATA_IDENT_MAX_LBA_EXT, sizeof(uint64_t));
         } else {
             /* Device uses CHS or 28-bit Addressing */
-            memcpy(&driver->sata_devices[count].Size, mbuf + ATA_IDENT_MAX_LBA, sizeof(uint32_t));
+            uint32_t size;
+            memcpy(&size, mbuf + ATA_IDENT_MAX_LBA, sizeof(uint32_t));
+            driver->sata_devices[count].Size = size;
+        }
+
+        /* NCQ needs support from both the HBA and the drive */
+        uint16_t sata_caps;
+        uint16_t queue_depth;
+        memcpy(&sata_caps, mbuf + ATA_IDENT_SATA_CAPS, sizeof(uint16_t));
+        memcpy(&queue_depth, mbuf + ATA_IDENT_QUEUE_DEPTH, sizeof(uint16_t));
+        if ((ahci->abar->cap & HBA_CAP_SNCQ) && (sata_caps & IDENT_NCQ_SUPPORT_BIT)
+            && (ahci->slot_buf_size >= SATA_BLK_SIZE)) {
+            ahci->device_list[count].ncq_depth = IDENT_QUEUE_DEPTH(queue_depth);
+            if (ahci->device_list[count].ncq_depth > GET_NUM_SLOTS(ahci->abar->cap)) {
+                ahci->device_list[count].ncq_depth = GET_NUM_SLOTS(ahci->abar->cap);
+            }
+            ZF_LOGV("DRIVE %d NCQ DEPTH: %d", count, ahci->device_list[count].ncq_depth);
         }
     }
     ZF_LOGV("INIT COMPLETE");
@@ -0,0 +1,937 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <platsupport/delay.h>
+
+#include <satadrivers/ide.h>
+#include <satadrivers/ahci.h>
+#include <satadrivers/common.h>
+#include <satadrivers/cache.h>
+#include <utils/zf_log.h>
+#include <utils/zf_log_if.h>
+
+#define CACHE_WAIT_TIMEOUT_US 10000000
+
+enum cache_entry_state {
+    CACHE_FREE,
+    CACHE_VALID,
+    CACHE_PENDING   // Read ahead in flight
+};
+
+struct sata_cache;
+
+typedef struct cache_entry {
+    struct sata_cache *cache;
+    enum cache_entry_state state;
+    uint8_t drive;
+    uint8_t referenced;     // CLOCK bit, set on every use
+    uint8_t prefetched;     // Read ahead and not used yet
+    uint64_t block;
+    uint64_t valid;         // Sectors that hold data
+    uint64_t dirty;         // Sectors newer than on the drive
+    int next;               // Hash chain, -1 terminated
+    uint8_t *data;
+} cache_entry_t;
+
+typedef struct sata_cache {
+    ps_io_ops_t *io_ops;
+    sata_driver_t *driver;
+    sata_cache_config_t config;
+    cache_entry_t *entries;
+    cache_entry_t **sorted;     // Scratch space for sata_cache_flush
+    int *buckets;
+    uint32_t hand;              // CLOCK hand
+    uint32_t pending;           // Read aheads in flight
+    uint8_t *data;
+    uint8_t *staging;           // coalesce_sects sectors
+    uint64_t seq_next[MAX_DRIVES];  // Sector after the last read of each drive
+    uint32_t seq_count[MAX_DRIVES]; // Reads in a row that followed the last one
+    uint64_t ra_next[MAX_DRIVES];   // First block not read ahead yet
+    sata_cache_stats_t stats;
+    int busy;                   // Set while a thread is in the cache
+} sata_cache_t;
+
+static void cache_free(sata_cache_t *cache);
+static int cache_read(sata_cache_t *cache, uint8_t drive, uint32_t numsects, uint64_t lba, uint8_t *buf);
+static int cache_write(sata_cache_t *cache, uint8_t drive, uint32_t numsects, uint64_t lba, uint8_t *buf);
+static void cache_readahead(sata_cache_t *cache, uint8_t drive, uint64_t lba, uint32_t numsects);
+static void cache_readahead_done(void *token, int status);
+static int cache_bypass(sata_cache_t *cache, uint8_t direction, uint8_t drive, uint32_t numsects, uint64_t lba);
+static int cache_flush(sata_cache_t *cache);
+
+/* The cache is not locked, these catch two threads using it at once */
+static inline void cache_enter(sata_cache_t *cache)
+{
+    int busy = __atomic_exchange_n(&cache->busy, 1, __ATOMIC_ACQUIRE);
+    ZF_LOGF_IF(busy, "SATA: cache: used by two threads at once");
+}
+
+static inline void cache_leave(sata_cache_t *cache)
+{
+    __atomic_store_n(&cache->busy, 0, __ATOMIC_RELEASE);
+}
+
+/* Mask of count sectors of a block, starting at sector first */
+static inline uint64_t sects_mask(uint32_t first, uint32_t count)
+{
+    return ((count >= 64) ? ~0ull : ((1ull << count) - 1)) << first;
+}
+
+/* Number of sectors of a block that are on the drive */
+static uint32_t block_len(sata_cache_t *cache, uint8_t drive, uint64_t block)
+{
+    uint64_t first = block * cache->config.block_sects;
+    uint64_t size = cache->driver->sata_devices[drive].Size;
+
+    if (first >= size) {
+        return 0;
+    }
+    return (size - first < cache->config.block_sects) ? size - first : cache->config.block_sects;
+}
+
+static inline uint32_t cache_bucket(sata_cache_t *cache, uint8_t drive, uint64_t block)
+{
+    return (block * 31 + drive) % cache->config.num_blocks;
+}
+
+static int cache_lookup(sata_cache_t *cache, uint8_t drive, uint64_t block)
+{
+    for (int i = cache->buckets[cache_bucket(cache, drive, block)]; -1 != i; i = cache->entries[i].next) {
+        if ((cache->entries[i].drive == drive) && (cache->entries[i].block == block)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void cache_insert(sata_cache_t *cache, int idx)
+{
+    cache_entry_t *e = &cache->entries[idx];
+    uint32_t bucket = cache_bucket(cache, e->drive, e->block);
+
+    e->next = cache->buckets[bucket];
+    cache->buckets[bucket] = idx;
+}
+
+/* Take an entry out of the hash table and mark it free */
+static void cache_remove(sata_cache_t *cache, int idx)
+{
+    cache_entry_t *e = &cache->entries[idx];
+    int *link = &cache->buckets[cache_bucket(cache, e->drive, e->block)];
+
+    while (-1 != *link) {
+        if (*link == idx) {
+            *link = e->next;
+            break;
+        }
+        link = &cache->entries[*link].next;
+    }
+    e->state = CACHE_FREE;
+    e->next = -1;
+}
+
+/*
+ * Purpose: Wait for a read ahead to complete, or for all of them if e is NULL
+ *
+ * Returns: success or failure code
+ *
+ */
+static int cache_wait(sata_cache_t *cache, cache_entry_t *e)
+{
+    int spin = 0;
+
+    while (e ? (CACHE_PENDING == e->state) : (0 != cache->pending)) {
+        sata_poll(cache->driver);
+        if (CACHE_WAIT_TIMEOUT_US < spin) {
+            ZF_LOGE("SATA: cache: timed out waiting for read ahead");
+            return CACHE_TIMEOUT;
+        }
+        ps_udelay(1);
+        spin++;
+    }
+    return SATA_NO_ERR;
+}
+
+/*
+ * Purpose: Write the dirty sectors of a block, a command per run of them
+ *
+ * Returns: success or failure code
+ *
+ */
+static int cache_write_entry(sata_cache_t *cache, cache_entry_t *e)
+{
+    uint32_t bs = cache->config.block_sects;
+    uint32_t i = 0;
+
+    while (i < bs) {
+        if (!(e->dirty & (1ull << i))) {
+            i++;
+            continue;
+        }
+        uint32_t start = i;
+        while ((i < bs) && (e->dirty & (1ull << i))) {
+            i++;
+        }
+        int err = sata_device_access(cache->driver, ATA_WRITE, e->drive, i - start, e->block * bs + start,
+                                     e->data + start * SATA_BLK_SIZE);
+        if (SATA_NO_ERR != err) {
+            return err;
+        }
+        e->dirty &= ~sects_mask(start, i - start);
+        cache->stats.writebacks++;
+    }
+    return SATA_NO_ERR;
+}
+
+/*
+ * Purpose: Find an entry to replace with the CLOCK algorithm. Used blocks get
+ *          a second chance, dirty ones are written back first and blocks with
+ *          a read ahead in flight are skipped.
+ *
+ * Returns: index of a free entry, or -1 if none could be freed
+ *
+ */
+static int cache_evict(sata_cache_t *cache)
+{
+    uint32_t num = cache->config.num_blocks;
+
+    // The first sweep may only clear referenced bits
+    for (uint32_t tries = 0; tries < 2 * num; tries++) {
+        int idx = cache->hand;
+        cache_entry_t *e = &cache->entries[idx];
+        cache->hand = (cache->hand + 1) % num;
+
+        if (CACHE_FREE == e->state) {
+            return idx;
+        }
+        if (CACHE_PENDING == e->state) {
+            continue;
+        }
+        if (e->referenced) {
+            e->referenced = 0;
+            continue;
+        }
+        if (e->dirty && (SATA_NO_ERR != cache_write_entry(cache, e))) {
+            return -1;
+        }
+        cache_remove(cache, idx);
+        cache->stats.evictions++;
+        return idx;
+    }
+    return -1;
+}
+
+/*
+ * Purpose: Get the entry of a block, adding an empty one if it is not cached
+ *
+ * Inputs:
+ *   - drive: drive of the block
+ *   - block: block number
+ *   - **entry: set to the entry
+ *
+ * Returns: success or failure code
+ *
+ */
+static int cache_get(sata_cache_t *cache, uint8_t drive, uint64_t block, cache_entry_t **entry)
+{
+    int err;
+    int idx = cache_lookup(cache, drive, block);
+
+    if (-1 != idx) {
+        cache_entry_t *e = &cache->entries[idx];
+        err = cache_wait(cache, e);
+        if (SATA_NO_ERR != err) {
+            return err;
+        }
+        // A read ahead that failed frees its entry
+        if (CACHE_VALID == e->state) {
+            e->referenced = 1;
+            *entry = e;
+            return SATA_NO_ERR;
+        }
+    }
+
+    idx = cache_evict(cache);
+    if ((-1 == idx) && cache->pending) {
+        err = cache_wait(cache, NULL);
+        if (SATA_NO_ERR != err) {
+            return err;
+        }
+        idx = cache_evict(cache);
+    }
+    if (-1 == idx) {
+        ZF_LOGE("SATA: cache: no block could be replaced");
+        return CACHE_TIMEOUT;
+    }
+
+    cache_entry_t *e = &cache->entries[idx];
+    e->state = CACHE_VALID;
+    e->drive = drive;
+    e->block = block;
+    e->valid = 0;
+    e->dirty = 0;
+    e->referenced = 1;
+    e->prefetched = 0;
+    cache_insert(cache, idx);
+
+    *entry = e;
+    return SATA_NO_ERR;
+}
+
+/*
+ * Purpose: Read the sectors of a block that are not cached, keeping those
+ *          that are dirty
+ *
+ * Returns: success or failure code
+ *
+ */
+static int cache_fill(sata_cache_t *cache, cache_entry_t *e)
+{
+    uint32_t len = block_len(cache, e->drive, e->block);
+    uint64_t want = sects_mask(0, len);
+    int err;
+
+    if ((e->valid & want) == want) {
+        return SATA_NO_ERR;
+    }
+
+    if (!e->dirty) {
+        err = sata_device_access(cache->driver, ATA_READ, e->drive, len, e->block * cache->config.block_sects,
+                                 e->data);
+    } else {
+        err = sata_device_access(cache->driver, ATA_READ, e->drive, len, e->block * cache->config.block_sects,
+                                 cache->staging);
+        for (uint32_t i = 0; (SATA_NO_ERR == err) && (i < len); i++) {
+            if (!(e->dirty & (1ull << i))) {
+                memcpy(e->data + i * SATA_BLK_SIZE, cache->staging + i * SATA_BLK_SIZE, SATA_BLK_SIZE);
+            }
+        }
+    }
+    if (SATA_NO_ERR != err) {
+        return err;
+    }
+
+    e->valid |= want;
+    return SATA_NO_ERR;
+}
+
+/*
+ * Purpose: Read a run of blocks that are not cached in one command and add
+ *          them to the cache
+ *
+ * Inputs:
+ *   - drive: drive to read from
+ *   - block: first block, not cached
+ *   - off: sector of the first block the request starts at
+ *   - numsects: sectors left in the request
+ *   - *buf: where the request continues
+ *
+ * Returns: number of sectors of the request done, negative on failure
+ *
+ */
+static int cache_read_run(sata_cache_t *cache, uint8_t drive, uint64_t block, uint32_t off, uint32_t numsects,
+                          uint8_t *buf)
+{
+    uint32_t bs = cache->config.block_sects;
+    uint32_t max_blocks = cache->config.coalesce_sects / bs;
+    uint32_t req_blocks = (off + numsects + bs - 1) / bs;
+    uint32_t nblocks = 1;
+    uint32_t len = block_len(cache, drive, block);
+
+    while ((nblocks < max_blocks) && (nblocks < req_blocks)
+           && (-1 == cache_lookup(cache, drive, block + nblocks))) {
+        len += block_len(cache, drive, block + nblocks);
+        nblocks++;
+    }
+
+    int err = sata_device_access(cache->driver, ATA_READ, drive, len, block * bs, cache->staging);
+    if (SATA_NO_ERR != err) {
+        return -err;
+    }
+    cache->stats.misses += nblocks;
+
+    uint32_t done = 0;
+    for (uint32_t i = 0; i < nblocks; i++) {
+        cache_entry_t *e;
+        uint8_t *src = cache->staging + i * bs * SATA_BLK_SIZE;
+        uint32_t n = ((bs - off) < (numsects - done)) ? (bs - off) : (numsects - done);
+
+        memcpy(buf + done * SATA_BLK_SIZE, src + off * SATA_BLK_SIZE, n * SATA_BLK_SIZE);
+        done += n;
+        off = 0;
+
+        // The data reached the caller, a block that cannot be cached is not an error
+        if (SATA_NO_ERR == cache_get(cache, drive, block + i, &e)) {
+            uint32_t blen = block_len(cache, drive, block + i);
+            memcpy(e->data, src, blen * SATA_BLK_SIZE);
+            e->valid = sects_mask(0, blen);
+        }
+    }
+    return done;
+}
+
+/*
+ * Purpose: Read sectors through the cache
+ *
+ * Returns: success or failure code
+ *
+ */
+static int cache_read(sata_cache_t *cache, uint8_t drive, uint32_t numsects, uint64_t lba, uint8_t *buf)
+{
+    uint32_t bs = cache->config.block_sects;
+    uint64_t block = lba / bs;
+    uint32_t off = lba % bs;
+    uint32_t total = numsects;
+    uint64_t start = lba;
+    int err;
+
+    while (numsects) {
+        int idx = cache_lookup(cache, drive, block);
+
+        if (-1 == idx) {
+            int done = cache_read_run(cache, drive, block, off, numsects, buf);
+            if (0 > done) {
+                return -done;
+            }
+            numsects -= done;
+            buf += done * SATA_BLK_SIZE;
+            block += (off + done) / bs;
+            off = (off + done) % bs;
+            continue;
+        }
+
+        cache_entry_t *e;
+        uint32_t n = ((bs - off) < numsects) ? (bs - off) : numsects;
+        uint64_t need = sects_mask(off, n);
+
+        err = cache_get(cache, drive, block, &e);
+        if (SATA_NO_ERR != err) {
+            return err;
+        }
+        if ((e->valid & need) == need) {
+            cache->stats.hits++;
+            if (e->prefetched) {
+                cache->stats.readahead_hits++;
+                e->prefetched = 0;
+            }
+        } else {
+            cache->stats.misses++;
+            err = cache_fill(cache, e);
+            if (SATA_NO_ERR != err) {
+                return err;
+            }
+        }
+        memcpy(buf, e->data + off * SATA_BLK_SIZE, n * SATA_BLK_SIZE);
+
+        numsects -= n;
+        buf += n * SATA_BLK_SIZE;
+        block++;
+        off = 0;
+    }
+
+    cache_readahead(cache, drive, start, total);
+    return SATA_NO_ERR;
+}
+
+/*
+ * Purpose: Write sectors into the cache. Writes of coalesce_sects or more
+ *          go to the drive, as caching them would only push out other blocks.
+ *
+ * Returns: success or failure code
+ *
+ */
+static int cache_write(sata_cache_t *cache, uint8_t drive, uint32_t numsects, uint64_t lba, uint8_t *buf)
+{
+    uint32_t bs = cache->config.block_sects;
+    uint64_t block = lba / bs;
+    uint32_t off = lba % bs;
+    int err;
+
+    if (numsects >= cache->config.coalesce_sects) {
+        err = cache_bypass(cache, ATA_WRITE, drive, numsects, lba);
+        if (SATA_NO_ERR != err) {
+            return err;
+        }
+        return sata_device_access(cache->driver, ATA_WRITE, drive, numsects, lba, buf);
+    }
+
+    while (numsects) {
+        cache_entry_t *e;
+        uint32_t n = ((bs - off) < numsects) ? (bs - off) : numsects;
+        uint64_t mask = sects_mask(off, n);
+
+        err = cache_get(cache, drive, block, &e);
+        if (SATA_NO_ERR != err) {
+            return err;
+        }
+        memcpy(e->data + off * SATA_BLK_SIZE, buf, n * SATA_BLK_SIZE);
+        e->valid |= mask;
+        e->dirty |= mask;
+        e->prefetched = 0;
+
+        numsects -= n;
+        buf += n * SATA_BLK_SIZE;
+        block++;
+        off = 0;
+    }
+    return SATA_NO_ERR;
+}
+
+/*
+ * Purpose: Read the blocks after a sequential reader ahead of it, without
+ *          waiting for them
+ *
+ * Inputs:
+ *   - drive: drive that was read
+ *   - lba: first sector of the read
+ *   - numsects: sectors read
+ *
+ * Returns: nothing
+ *
+ */
+static void cache_readahead(sata_cache_t *cache, uint8_t drive, uint64_t lba, uint32_t numsects)
+{
+    uint32_t bs = cache->config.block_sects;
+    uint64_t end = lba + numsects;
+
+    if (0 == cache->config.readahead) {
+        return;
+    }
+
+    if (lba == cache->seq_next[drive]) {
+        cache->seq_count[drive]++;
+    } else {
+        cache->seq_count[drive] = 0;
+        cache->ra_next[drive] = 0;
+    }
+    cache->seq_next[drive] = end;
+
+    // Only read ahead once a read followed the previous one
+    if (0 == cache->seq_count[drive]) {
+        return;
+    }
+
+    uint64_t first = (end + bs - 1) / bs;
+    uint64_t last = (end - 1) / bs + cache->config.readahead;
+    uint64_t block = (cache->ra_next[drive] > first) ? cache->ra_next[drive] : first;
+
+    for (; block <= last; block++) {
+        uint32_t len = block_len(cache, drive, block);
+        if (0 == len) {
+            break;
+        }
+        if (-1 != cache_lookup(cache, drive, block)) {
+            continue;
+        }
+
+        int idx = cache_evict(cache);
+        if (-1 == idx) {
+            break;
+        }
+
+        cache_entry_t *e = &cache->entries[idx];
+        e->state = CACHE_PENDING;
+        e->drive = drive;
+        e->block = block;
+        e->valid = 0;
+        e->dirty = 0;
+        e->referenced = 0;
+        e->prefetched = 0;
+        cache_insert(cache, idx);
+        cache->pending++;
+
+        sata_request_t req = {
+            .direction = ATA_READ,
+            .drive = drive,
+            .numsects = len,
+            .lba = block * bs,
+            .buf = e->data
+        };
+        if (SATA_NO_ERR != sata_device_submit(cache->driver, &req, cache_readahead_done, e)) {
+            cache->pending--;
+            cache_remove(cache, idx);
+            break;
+        }
+        cache->stats.readahead++;
+    }
+    cache->ra_next[drive] = block;
+}
+
+/* Completion of a read ahead, from sata_handle_irq or sata_poll */
+static void cache_readahead_done(void *token, int status)
+{
+    cache_entry_t *e = token;
+    sata_cache_t *cache = e->cache;
+
+    cache->pending--;
+    if (SATA_NO_ERR != status) {
+        cache_remove(cache, e - cache->entries);
+        return;
+    }
+
+    e->state = CACHE_VALID;
+    e->valid = sects_mask(0, block_len(cache, e->drive, e->block));
+    e->prefetched = 1;
+}
+
+/*
+ * Purpose: Read or write through the cache
+ *
+ * Inputs:
+ *   - direction: used to specify a read or a write
+ *   - drive: drive to read from or write to
+ *   - numsects: number of sectors to be read or written
+ *   - lba: address of the first sector
+ *   - *buf: Buffer to write or read data from
+ *
+ * Returns: success or failure code
+ *
+ */
+int sata_cache_access(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t numsects,
+                      uint64_t lba, uint8_t *buf)
+{
+    sata_cache_t *cache = driver->cache;
+    int err;
+
+    cache_enter(cache);
+    if (cache->pending) {
+        // Pick up read aheads that completed without an interrupt
+        sata_poll(driver);
+    }
+
+    if (ATA_READ == direction) {
+        err = cache_read(cache, drive, numsects, lba, buf);
+    } else {
+        err = cache_write(cache, drive, numsects, lba, buf);
+    }
+    cache_leave(cache);
+    return err;
+}
+
+/*
+ * Purpose: Make the cache consistent with a request that bypasses it
+ *
+ * Inputs:
+ *   - direction: direction of the request
+ *   - drive: drive of the request
+ *   - numsects: number of sectors of the request
+ *   - lba: address of the first sector
+ *
+ * Returns: success or failure code
+ *
+ */
+int sata_cache_bypass(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t numsects, uint64_t lba)
+{
+    sata_cache_t *cache = driver->cache;
+
+    if ((NULL == cache) || (0 == numsects)) {
+        return SATA_NO_ERR;
+    }
+
+    cache_enter(cache);
+    int err = cache_bypass(cache, direction, drive, numsects, lba);
+    cache_leave(cache);
+    return err;
+}
+
+static int cache_bypass(sata_cache_t *cache, uint8_t direction, uint8_t drive, uint32_t numsects, uint64_t lba)
+{
+    int err;
+    uint32_t bs = cache->config.block_sects;
+    uint64_t block = lba / bs;
+    uint64_t last = (lba + numsects - 1) / bs;
+
+    for (; block <= last; block++) {
+        int idx = cache_lookup(cache, drive, block);
+        if (-1 == idx) {
+            continue;
+        }
+
+        cache_entry_t *e = &cache->entries[idx];
+        uint64_t first = block * bs;
+        uint32_t off = (lba > first) ? lba - first : 0;
+        uint64_t end = ((lba + numsects) < (first + bs)) ? (lba + numsects) : (first + bs);
+        uint64_t mask = sects_mask(off, end - first - off);
+
+        if (ATA_READ == direction) {
+            // A read ahead in flight is clean
+            if ((CACHE_VALID == e->state) && (e->dirty & mask)) {
+                err = cache_write_entry(cache, e);
+                if (SATA_NO_ERR != err) {
+                    return err;
+                }
+            }
+        } else {
+            err = cache_wait(cache, e);
+            if (SATA_NO_ERR != err) {
+                return err;
+            }
+            if (CACHE_FREE == e->state) {
+                continue;
+            }
+            e->valid &= ~mask;
+            e->dirty &= ~mask;
+            if (!e->valid) {
+                cache_remove(cache, idx);
+            }
+        }
+    }
+    return SATA_NO_ERR;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const cache_entry_t *ea = *(cache_entry_t *const *) a;
+    const cache_entry_t *eb = *(cache_entry_t *const *) b;
+
+    if (ea->drive != eb->drive) {
+        return ea->drive - eb->drive;
+    }
+    return (ea->block > eb->block) - (ea->block < eb->block);
+}
+
+/*
+ * Purpose: Write every dirty sector to the drives. Dirty sectors are sorted
+ *          by address, runs of them that continue across blocks are merged
+ *          into commands of up to coalesce_sects sectors.
+ *
+ * Returns: success or failure code
+ *
+ */
+int sata_cache_flush(sata_driver_t *driver)
+{
+    if ((NULL == driver) || (NULL == driver->cache)) {
+        ZF_LOGE("SATA: cache: no cache to flush");
+        return INVALID_PTR;
+    }
+
+    sata_cache_t *cache = driver->cache;
+    cache_enter(cache);
+    int err = cache_flush(cache);
+    cache_leave(cache);
+    return err;
+}
+
+static int cache_flush(sata_cache_t *cache)
+{
+    sata_driver_t *driver = cache->driver;
+    uint32_t bs = cache->config.block_sects;
+    uint32_t count = 0;
+    uint8_t run_drive = 0;
+    uint64_t run_lba = 0;
+    uint32_t run_len = 0;
+    int err;
+
+    for (uint32_t i = 0; i < cache->config.num_blocks; i++) {
+        if ((CACHE_VALID == cache->entries[i].state) && cache->entries[i].dirty) {
+            cache->sorted[count++] = &cache->entries[i];
+        }
+    }
+    qsort(cache->sorted, count, sizeof(cache_entry_t *), compare_entries);
+
+    for (uint32_t k = 0; k < count; k++) {
+        cache_entry_t *e = cache->sorted[k];
+        uint32_t i = 0;
+
+        while (i < bs) {
+            if (!(e->dirty & (1ull << i))) {
+                i++;
+                continue;
+            }
+            uint32_t start = i;
+            while ((i < bs) && (e->dirty & (1ull << i))) {
+                i++;
+            }
+            uint64_t lba = e->block * bs + start;
+            uint32_t len = i - start;
+
+            if (run_len && ((run_drive != e->drive) || (run_lba + run_len != lba)
+                            || (run_len + len > cache->config.coalesce_sects))) {
+                err = sata_device_access(driver, ATA_WRITE, run_drive, run_len, run_lba, cache->staging);
+                if (SATA_NO_ERR != err) {
+                    return err;
+                }
+                cache->stats.writebacks++;
+                run_len = 0;
+            }
+            if (0 == run_len) {
+                run_drive = e->drive;
+                run_lba = lba;
+            }
+            memcpy(cache->staging + run_len * SATA_BLK_SIZE, e->data + start * SATA_BLK_SIZE,
+                   len * SATA_BLK_SIZE);
+            run_len += len;
+        }
+    }
+    if (run_len) {
+        err = sata_device_access(driver, ATA_WRITE, run_drive, run_len, run_lba, cache->staging);
+        if (SATA_NO_ERR != err) {
+            return err;
+        }
+        cache->stats.writebacks++;
+    }
+
+    // Only clean once everything is on the drives, a failed flush can be retried
+    for (uint32_t k = 0; k < count; k++) {
+        cache->sorted[k]->dirty = 0;
+    }
+    return SATA_NO_ERR;
+}
+
+void sata_cache_get_stats(sata_driver_t *driver, sata_cache_stats_t *stats)
+{
+    if ((NULL == driver) || (NULL == driver->cache) || (NULL == stats)) {
+        return;
+    }
+    cache_enter(driver->cache);
+    *stats = driver->cache->stats;
+    cache_leave(driver->cache);
+}
+
+/*
+ * Purpose: Put a cache in front of the drives
+ *
+ * Inputs:
+ *   - io_ops: IO Operation Functions
+ *   - *config: cache configuration, NULL for the defaults
+ *
+ * Returns: success or failure code
+ *
+ */
+int sata_cache_init(ps_io_ops_t *io_ops, sata_driver_t *driver, const sata_cache_config_t *config)
+{
+    sata_cache_t *cache = NULL;
+    int error;
+
+    if ((NULL == io_ops) || (NULL == driver)) {
+        ZF_LOGE("SATA: cache: parameters are null");
+        return INVALID_PTR;
+    }
+    if (driver->cache) {
+        ZF_LOGE("SATA: cache: driver already has a cache");
+        return INVALID_PTR;
+    }
+
+    error = ps_calloc(&io_ops->malloc_ops, 1, sizeof(sata_cache_t), (void **) &cache);
+    if (error) {
+        ZF_LOGE("SATA: cache: failed to allocate memory for the cache");
+        return NO_MEMORY;
+    }
+
+    cache->io_ops = io_ops;
+    cache->driver = driver;
+    if (config) {
+        cache->config = *config;
+    }
+    if (0 == cache->config.num_blocks) {
+        cache->config.num_blocks = SATA_CACHE_DEFAULT_BLOCKS;
+    }
+    if (0 == cache->config.block_sects) {
+        cache->config.block_sects = SATA_CACHE_DEFAULT_BLOCK_SECTS;
+    }
+    // A config with readahead 0 turns it off
+    if (config == NULL) {
+        cache->config.readahead = SATA_CACHE_DEFAULT_READAHEAD;
+    }
+    if (0 == cache->config.coalesce_sects) {
+        cache->config.coalesce_sects = SATA_CACHE_DEFAULT_COALESCE;
+    }
+    if (SATA_CACHE_MAX_BLOCK_SECTS < cache->config.block_sects) {
+        ZF_LOGE("SATA: cache: blocks can have at most %d sectors", SATA_CACHE_MAX_BLOCK_SECTS);
+        cache_free(cache);
+        return INVALID_POSITION;
+    }
+    // A block read ahead is a single command issued without waiting
+    if (cache->config.readahead && (AHCI == driver->mode)
+        && (cache->config.block_sects > ahci_submit_max_sects(driver))) {
+        ZF_LOGE("SATA: cache: blocks of %u sectors are larger than the %d an AHCI slot can read ahead",
+                cache->config.block_sects, ahci_submit_max_sects(driver));
+        cache_free(cache);
+        return INVALID_POSITION;
+    }
+    if (cache->config.coalesce_sects < cache->config.block_sects) {
+        cache->config.coalesce_sects = cache->config.block_sects;
+    }
+
+    size_t block_size = cache->config.block_sects * SATA_BLK_SIZE;
+    uint32_t num = cache->config.num_blocks;
+
+    error = ps_calloc(&io_ops->malloc_ops, num, sizeof(cache_entry_t), (void **) &cache->entries);
+    error |= ps_calloc(&io_ops->malloc_ops, num, sizeof(cache_entry_t *), (void **) &cache->sorted);
+    error |= ps_calloc(&io_ops->malloc_ops, num, sizeof(int), (void **) &cache->buckets);
+    error |= ps_calloc(&io_ops->malloc_ops, num, block_size, (void **) &cache->data);
+    error |= ps_calloc(&io_ops->malloc_ops, cache->config.coalesce_sects, SATA_BLK_SIZE,
+                       (void **) &cache->staging);
+    if (error) {
+        ZF_LOGE("SATA: cache: failed to allocate memory for the cache");
+        cache_free(cache);
+        return NO_MEMORY;
+    }
+
+    for (uint32_t i = 0; i < num; i++) {
+        cache->buckets[i] = -1;
+        cache->entries[i].cache = cache;
+        cache->entries[i].next = -1;
+        cache->entries[i].data = cache->data + i * block_size;
+    }
+
+    driver->cache = cache;
+    return SATA_NO_ERR;
+}
+
+/*
+ * Purpose: Flush and remove the cache
+ *
+ * Returns: success or failure code, the cache stays on failure
+ *
+ */
+int sata_cache_destroy(sata_driver_t *driver)
+{
+    if ((NULL == driver) || (NULL == driver->cache)) {
+        ZF_LOGE("SATA: cache: no cache to destroy");
+        return INVALID_PTR;
+    }
+
+    sata_cache_t *cache = driver->cache;
+    cache_enter(cache);
+    int err = cache_flush(cache);
+    if (SATA_NO_ERR == err) {
+        err = cache_wait(cache, NULL);
+    }
+    cache_leave(cache);
+    if (SATA_NO_ERR != err) {
+        return err;
+    }
+
+    cache_free(driver->cache);
+    driver->cache = NULL;
+    return SATA_NO_ERR;
+}
+
+static void cache_free(sata_cache_t *cache)
+{
+    ps_malloc_ops_t *ops = &cache->io_ops->malloc_ops;
+    uint32_t num = cache->config.num_blocks;
+
+    if (cache->entries) {
+        ps_free(ops, num * sizeof(cache_entry_t), cache->entries);
+    }
+    if (cache->sorted) {
+        ps_free(ops, num * sizeof(cache_entry_t *), cache->sorted);
+    }
+    if (cache->buckets) {
+        ps_free(ops, num * sizeof(int), cache->buckets);
+    }
+    if (cache->data) {
+        ps_free(ops, num * cache->config.block_sects * SATA_BLK_SIZE, cache->data);
+    }
+    if (cache->staging) {
+        ps_free(ops, cache->config.coalesce_sects * SATA_BLK_SIZE, cache->staging);
+    }
+    ps_free(ops, sizeof(sata_cache_t), cache);
+}
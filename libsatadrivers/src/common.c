@@ -10,9 +10,14 @@
 #include <satadrivers/ide.h>
 #include <satadrivers/common.h>
 #include <satadrivers/ahci.h>
+#include <satadrivers/cache.h>
 
-static int sata_access_sectors(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint16_t numsects,
-                               uint32_t lba, uint8_t *buf);
+static int sata_access_sectors(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t numsects,
+                               uint64_t lba, uint8_t *buf);
+static int sata_check_access(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t numsects,
+                             uint64_t lba, uint8_t *buf);
+static int ide_access_split(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t numsects,
+                            uint64_t lba, uint8_t *buf);
 
 /*
  * Purpose: get the partition tables for the inputted drive
@@ -46,7 +51,7 @@ int sata_get_partition_tables(sata_driver_t *driver, uint8_t drive, partition_ta
     }
 
     /* Get & print partition information
-     * NOTE: This assumes MBR */
+     * NOTE: This assumes MBR, sata_get_partition_map also reads GPT */
     for (int i = 0; i < PART_ENTRIES; i++) {
         memcpy(&partition_tables[i], &part_data[PART_OFFSET + (PART_SIZE * i)], sizeof(partition_table_t));
 
@@ -96,6 +101,40 @@ int sata_write_sectors(sata_driver_t *driver, uint8_t drive, uint16_t numsects,
 {
     return sata_access_sectors(driver, ATA_WRITE, drive, numsects, lba, buf);
 }
+
+/*
+ * Purpose: Read the sector of the drives, in as many commands as it takes
+ *
+ * Inputs:
+ *   - drive: drive to read information from
+ *   - numsects: number of sectors to be read
+ *   - lba: 48 bit address, for disks past 2TB.
+ *   - *buf: Buffer to write or read data from
+ *
+ * Returns: success or failure code
+ *
+ */
+int sata_read_sectors_ext(sata_driver_t *driver, uint8_t drive, uint32_t numsects, uint64_t lba, uint8_t *buf)
+{
+    return sata_access_sectors(driver, ATA_READ, drive, numsects, lba, buf);
+}
+
+/*
+ * Purpose: Write the sector of the drives, in as many commands as it takes
+ *
+ * Inputs:
+ *   - drive: drive to write information to
+ *   - numsects: number of sectors to write
+ *   - lba: 48 bit address, for disks past 2TB.
+ *   - *buf: Buffer to write or read data from
+ *
+ * Returns: success or failure code
+ *
+ */
+int sata_write_sectors_ext(sata_driver_t *driver, uint8_t drive, uint32_t numsects, uint64_t lba, uint8_t *buf)
+{
+    return sata_access_sectors(driver, ATA_WRITE, drive, numsects, lba, buf);
+}
 /*
  * Purpose: Read/Write the sector of the drives
  *
@@ -109,8 +148,98 @@ int sata_write_sectors(sata_driver_t *driver, uint8_t drive, uint16_t numsects,
  * Returns: success or failure code
  *
  */
-static int sata_access_sectors(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint16_t numsects, uint32_t lba,
+static int sata_access_sectors(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t numsects, uint64_t lba,
                                uint8_t *buf)
+{
+    int err = sata_check_access(driver, direction, drive, numsects, lba, buf);
+
+    if (SATA_NO_ERR == err) {
+        if (ATA_WRITE == direction) {
+            sata_partitions_written(driver, drive, numsects, lba);
+        }
+        if (driver->cache) {
+            err = sata_cache_access(driver, direction, drive, numsects, lba, buf);
+        } else {
+            err = sata_device_access(driver, direction, drive, numsects, lba, buf);
+        }
+    }
+    return err;
+}
+
+/*
+ * Purpose: Read/Write the sectors of a drive without going through the cache,
+ *          the access must have been checked
+ *
+ * Inputs:
+ *   - direction: used to specify a read or a write
+ *   - drive: drive to read from or write to
+ *   - numsects: number of sectors to be read or write
+ *   - lba: address of the first sector
+ *   - *buf: Buffer to write or read data from
+ *
+ * Returns: success or failure code
+ *
+ */
+int sata_device_access(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t numsects, uint64_t lba,
+                       uint8_t *buf)
+{
+    if (driver->mode == AHCI) {
+        return ahci_exec_cmd_ext(driver, direction, drive, lba, numsects, buf);
+    }
+    return ide_access_split(driver, direction, drive, numsects, lba, buf);
+}
+
+/*
+ * Purpose: Read/Write the sector of an IDE drive in commands of at most
+ *          IDE_MAX_SECTS sectors. A command does not cross LBA28_MAX_SIZE,
+ *          as the addressing mode is chosen from its first sector.
+ *
+ * Inputs:
+ *   - direction: used to specify a read or a write
+ *   - drive: drive to read from or write to
+ *   - numsects: number of sectors to be read or write
+ *   - lba: address of the first sector
+ *   - *buf: Buffer to write or read data from
+ *
+ * Returns: success or failure code
+ *
+ */
+static int ide_access_split(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t numsects,
+                            uint64_t lba, uint8_t *buf)
+{
+    int err = SATA_NO_ERR;
+
+    while (numsects && (SATA_NO_ERR == err)) {
+        uint32_t chunk = (numsects > IDE_MAX_SECTS) ? IDE_MAX_SECTS : numsects;
+        if ((lba < LBA28_MAX_SIZE) && (lba + chunk > LBA28_MAX_SIZE)) {
+            chunk = LBA28_MAX_SIZE - lba;
+        }
+
+        err = ide_ata_access(driver, direction, drive, lba, chunk, buf);
+        err = ide_print_error(driver, drive, err);
+
+        numsects -= chunk;
+        lba += chunk;
+        buf += chunk * SATA_BLK_SIZE;
+    }
+    return err;
+}
+
+/*
+ * Purpose: Check that a read or write of the drives is valid
+ *
+ * Inputs:
+ *   - direction: used to specify a read or a write
+ *   - drive: drive to read from or write to
+ *   - numsects: number of sectors to be read or write
+ *   - lba: address which allows us to access disks up to 2TB.
+ *   - *buf: Buffer to write or read data from
+ *
+ * Returns: success or failure code
+ *
+ */
+static int sata_check_access(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t numsects,
+                             uint64_t lba, uint8_t *buf)
 {
     int err = SATA_NO_ERR;
 
@@ -139,27 +268,141 @@ static int sata_access_sectors(sata_driver_t *driver, uint8_t direction, uint8_t
     /*Check if device type is valid */
     else if (DEV_SATA != driver->sata_devices[drive].Type) {
         err = INVALID_TYPE;
-    } else {
-        if ((direction == ATA_READ) || (direction == ATA_WRITE)) {
-            if (driver->mode == AHCI) {
-                err = ahci_exec_cmd(driver, direction, drive, lba, numsects, buf);
-            } else {
-                err = ide_ata_access(driver, direction, drive, lba, numsects, buf);
-                err = ide_print_error(driver, drive, err);
-            }
-        } else {
-            err = INVALID_DIRECTION;
-        }
+    } else if ((direction != ATA_READ) && (direction != ATA_WRITE)) {
+        err = INVALID_DIRECTION;
     }
     return err;
 }
 
+/*
+ * Purpose: Start a read or write of the drives without waiting for it
+ *
+ * Inputs:
+ *   - *req: the request, only read until sata_submit returns
+ *   - cb: called with token and the status once the request completed
+ *   - *token: passed to cb
+ *
+ * Returns: success or failure code, cb is only called on success
+ *
+ */
+int sata_submit(sata_driver_t *driver, sata_request_t *req, sata_complete_fn cb, void *token)
+{
+    int err;
+
+    if ((NULL == req) || (NULL == cb)) {
+        ZF_LOGE("SATA: ERROR: request or callback is null");
+        return INVALID_PTR;
+    }
+
+    err = sata_check_access(driver, req->direction, req->drive, req->numsects, req->lba, req->buf);
+    if (SATA_NO_ERR != err) {
+        return err;
+    }
+
+    if (ATA_WRITE == req->direction) {
+        sata_partitions_written(driver, req->drive, req->numsects, req->lba);
+    }
+
+    /* Requests go around the cache, which must not hold stale or newer data */
+    err = sata_cache_bypass(driver, req->direction, req->drive, req->numsects, req->lba);
+    if (SATA_NO_ERR != err) {
+        return err;
+    }
+
+    return sata_device_submit(driver, req, cb, token);
+}
+
+/*
+ * Purpose: Start a read or write without going through the cache, the
+ *          access must have been checked
+ *
+ * Inputs:
+ *   - *req: the request, only read until sata_device_submit returns
+ *   - cb: called with token and the status once the request completed
+ *   - *token: passed to cb
+ *
+ * Returns: success or failure code, cb is only called on success
+ *
+ */
+int sata_device_submit(sata_driver_t *driver, sata_request_t *req, sata_complete_fn cb, void *token)
+{
+    if (driver->mode == AHCI) {
+        return ahci_submit(driver, req->direction, req->drive, req->lba, req->numsects, req->buf, cb, token);
+    }
+
+    /* The IDE driver polls for its PIO and bus master transfers alike, so
+     * the request is done here */
+    int err = ide_access_split(driver, req->direction, req->drive, req->numsects, req->lba, req->buf);
+    cb(token, err);
+    return SATA_NO_ERR;
+}
+
+/*
+ * Purpose: Let the drives raise an interrupt when requests complete, once
+ *          the caller registered a handler that calls sata_handle_irq
+ *
+ * Returns: success or failure code
+ *
+ */
+int sata_enable_irq(sata_driver_t *driver)
+{
+    if (NULL == driver) {
+        ZF_LOGE("SATA: ERROR: sata_driver is null");
+        return INVALID_PTR;
+    }
+
+    if (driver->mode == AHCI) {
+        return ahci_enable_irq(driver);
+    }
+    return SATA_NO_ERR;
+}
+
+/*
+ * Purpose: Complete the requests of the drives that raised an interrupt
+ *
+ * Returns: success or failure code
+ *
+ */
+int sata_handle_irq(sata_driver_t *driver)
+{
+    if (NULL == driver) {
+        ZF_LOGE("SATA: ERROR: sata_driver is null");
+        return INVALID_PTR;
+    }
+
+    if (driver->mode == AHCI) {
+        return ahci_handle_irq(driver);
+    }
+    return SATA_NO_ERR;
+}
+
+/*
+ * Purpose: Complete the requests that are done without waiting for an
+ *          interrupt
+ *
+ * Returns: success or failure code
+ *
+ */
+int sata_poll(sata_driver_t *driver)
+{
+    if (NULL == driver) {
+        ZF_LOGE("SATA: ERROR: sata_driver is null");
+        return INVALID_PTR;
+    }
+
+    if (driver->mode == AHCI) {
+        return ahci_poll(driver);
+    }
+    return SATA_NO_ERR;
+}
+
 /*
  * Purpose: Initialize the SATA Device
  *
  * Inputs:
  *   - io_ops: IO Operation Functions
- *   - *config: pointer to the driver config structure
+ *   - *config: pointer to the driver config structure, ahci_intel_config_t
+ *              or ide_config_t, which may be NULL for PIO only
  *
  * Returns: success or failure code
  *
@@ -178,10 +421,15 @@ int sata_init(ps_io_ops_t *io_ops, sata_driver_t *driver, enum driver_mode mode,
     }
 
     driver->mode = mode;
+    driver->cache = NULL;
+    driver->io_ops = io_ops;
+    for (int i = 0; i < MAX_DRIVES; i++) {
+        driver->part_maps[i] = NULL;
+    }
     if (mode == AHCI) {
         err = ahci_init(io_ops, driver, config);
     } else {
-        err = ide_init(io_ops, driver);
+        err = ide_init(io_ops, driver, config);
     }
 
     return err;
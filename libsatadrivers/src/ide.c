@@ -6,20 +6,35 @@
 #include <assert.h>
 #include <satadrivers/ide.h>
 #include <satadrivers/common.h>
+#include <platsupport/delay.h>
 #include <utils/zf_log.h>
+#include <utils/zf_log_if.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdbool.h>
 
 struct IDEChannelRegisters {
     uint16_t base;  // I/O Base.
     uint16_t ctrl;  // Control Base
+    uint16_t bmide; // Bus Master IDE, 0 without DMA
 };
 
 typedef struct ide_dev {
     struct IDEChannelRegisters channels[NUM_IDE_CHANNELS];
     ps_io_ops_t *io_ops;
+    /* Bounce buffer and PRD table for bus master DMA, NULL for PIO only */
+    uint8_t *dma_buf;
+    uintptr_t dma_buf_phys;
+    ide_prd_t *prdt;
+    uintptr_t prdt_phys;
 } ide_dev_t;
 
+static void ide_dma_init(ide_dev_t *ide, ide_config_t *config);
+static uint8_t ide_dma_prepare(ide_dev_t *ide, uint8_t channel, uint8_t direction, uint16_t numsects, uint8_t *buf);
+static uint8_t ide_dma_clear_status(ide_dev_t *ide, uint8_t channel);
+static uint8_t ide_dma_transfer(ide_dev_t *ide, uint8_t channel, uint8_t direction, uint16_t numsects,
+                                uint8_t *buf);
+
 /*
  * Purpose: Poll the device through the IDE Controller to see if Data Transfer is ready
  *
@@ -156,6 +171,9 @@ uint8_t ide_print_error(sata_driver_t *driver, uint32_t drive, uint8_t err)
     } else if (ATA_DRQ_UNSET == err) {
         ZF_LOGE("- Reads Nothing\n     ");
         err = READ_NOTHING_ERR;
+    } else if (ATA_DMA_TIMEOUT == err) {
+        ZF_LOGE("- DMA Timed Out\n     ");
+        err = DMA_TIMEOUT_ERR;
     } else if (4 == err) {
         ZF_LOGE("- Write Protected\n     ");
         err = WRITE_PROTECT_ERR;
@@ -177,7 +195,7 @@ uint8_t ide_print_error(sata_driver_t *driver, uint32_t drive, uint8_t err)
  *
  * Inputs:
  *   - drive: The drive number which can be from 0 to 3.
- *   - lba: The LBA address which allows us to access disks up to 2TB.
+ *   - lba: The LBA address, 48 bits are used past the first 128GB.
  *   - numsects:  The number of sectors to be read, it is a char, as reading more than
  *                256 sector immediately may performance issues. If numsects is 0, the
  *                ATA controller will know that we want 256 sectors.
@@ -185,7 +203,7 @@ uint8_t ide_print_error(sata_driver_t *driver, uint32_t drive, uint8_t err)
  *
  * Returns: success (0) failure (code)
  */
-uint8_t ide_ata_access(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t lba,
+uint8_t ide_ata_access(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint64_t lba,
                        uint16_t numsects, uint8_t *buf)
 {
     if (NULL == driver) {
@@ -218,10 +236,10 @@ uint8_t ide_ata_access(sata_driver_t *driver, uint8_t direction, uint8_t drive,
     uint32_t  ctrl = ide->channels[channel].ctrl;
     uint16_t  cyl, i;
     uint8_t   head, sect;
-    uint32_t  bufp_val = 0;
 
     uint32_t res = 0;
     int error = 0;
+    bool use_dma;
 
     if (NULL == buf) {
         ZF_LOGE("IDE: Invalid buffer for ATA access.\n");
@@ -243,8 +261,8 @@ uint8_t ide_ata_access(sata_driver_t *driver, uint8_t direction, uint8_t drive,
         lba_io[1] = (lba & 0x0000FF00) >> 8;
         lba_io[2] = (lba & 0x00FF0000) >> 16;
         lba_io[3] = (lba & 0xFF000000) >> 24;
-        lba_io[4] = 0; // LBA28 is integer, so 32-bits are enough to access 2TB.
-        lba_io[5] = 0; // LBA28 is integer, so 32-bits are enough to access 2TB.
+        lba_io[4] = (lba >> 32) & 0xFF;
+        lba_io[5] = (lba >> 40) & 0xFF;
         head      = 0; // Lower 4-bits of HDDEVSEL are not used here.
     } else if (driver->sata_devices[drive].Capabilities & 0x200) {
         // LBA28:
@@ -273,6 +291,10 @@ uint8_t ide_ata_access(sata_driver_t *driver, uint8_t direction, uint8_t drive,
         head      = (lba + 1  - sect) % (16 * NUM_SECT_PER_TRACK) / (NUM_SECT_PER_TRACK);
     }
 
+    /* The bus master needs LBA addressing and a transfer that fits its buffer */
+    use_dma = ide->dma_buf && ide->channels[channel].bmide && (LBA_CHS_MODE != lba_mode)
+              && (0 < numsects) && (IDE_MAX_SECTS >= numsects);
+
     /* Wait if the drive is busy */
     error = ps_io_port_in(&io_ops->io_port_ops, (uint32_t)(bus + ATA_REG_STATUS), 1, &res);
     assert(!error);
@@ -330,10 +352,10 @@ uint8_t ide_ata_access(sata_driver_t *driver, uint8_t direction, uint8_t drive,
             cmd = ATA_CMD_READ_PIO;
             break;
         case LBA_28_MODE:
-            cmd = ATA_CMD_READ_PIO;
+            cmd = use_dma ? ATA_CMD_READ_DMA : ATA_CMD_READ_PIO;
             break;
         case LBA_48_MODE:
-            cmd = ATA_CMD_READ_PIO_EXT;
+            cmd = use_dma ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_PIO_EXT;
             break;
         default:
             return ATA_DRIVE_FAULT;
@@ -345,10 +367,10 @@ uint8_t ide_ata_access(sata_driver_t *driver, uint8_t direction, uint8_t drive,
             cmd = ATA_CMD_WRITE_PIO;
             break;
         case LBA_28_MODE:
-            cmd = ATA_CMD_WRITE_PIO;
+            cmd = use_dma ? ATA_CMD_WRITE_DMA : ATA_CMD_WRITE_PIO;
             break;
         case LBA_48_MODE:
-            cmd = ATA_CMD_WRITE_DMA_EXT;
+            cmd = use_dma ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_PIO_EXT;
             break;
         default:
             return ATA_DRIVE_FAULT;
@@ -358,11 +380,24 @@ uint8_t ide_ata_access(sata_driver_t *driver, uint8_t direction, uint8_t drive,
         return ATA_DRIVE_FAULT;
     }
 
+    if (use_dma) {
+        /* The bus master is set up before the command and started after it */
+        error = ide_dma_prepare(ide, channel, direction, numsects, buf);
+        if (error) {
+            return error;
+        }
+    }
+
     /* Send the Command */
     error = ps_io_port_out(&io_ops->io_port_ops, (uint32_t)(bus + ATA_REG_COMMAND), 1, (cmd));
     assert(!error);
 
-    if (ATA_READ == direction) {
+    if (use_dma) {
+        error = ide_dma_transfer(ide, channel, direction, numsects, buf);
+        if (error) {
+            return error;
+        }
+    } else if (ATA_READ == direction) {
         /* PIO Read. */
         for (i = 0; i < numsects; i++) {
             /* Polling, set error and exit if there is */
@@ -370,34 +405,22 @@ uint8_t ide_ata_access(sata_driver_t *driver, uint8_t direction, uint8_t drive,
             if (error) {
                 return error;
             }
-            for (int j = 0; j < ATA_WORDS; j++) {
-                /* Do 16 bit reads in ATA_WORDS
-                 * Get the pointer to copy data into
-                 *   i * ATA_WORDS * 2 is the start of the current sector in bytes
-                 *   j * 2 is the offset in bytes in the current sector
-                 */
-                error = ps_io_port_in(&io_ops->io_port_ops, (uint32_t)(bus + ATA_REG_DATA), 2,
-                                      &bufp_val);
-                memcpy(&buf[i * ATA_WORDS * 2 + j * 2], &bufp_val, 2);
-                assert(!error);
-            }
+            /* A sector of 16 bit reads */
+            error = ps_io_port_in_rep(&io_ops->io_port_ops, (uint32_t)(bus + ATA_REG_DATA), 2,
+                                      &buf[i * ATA_WORDS * 2], ATA_WORDS);
+            assert(!error);
         }
     } else {
         /* PIO Write */
         for (i = 0; i < numsects; i++) {
             ide_polling(ide, channel, 0);
-            for (int j = 0; j < ATA_WORDS; j++) {
-                /* Do 16 bit writes in ATA_WORDS
-                 * Get the pointer to copy data from
-                 *   i * ATA_WORDS * 2 is the start of the current sector in bytes
-                 *   j * 2 is the offset in bytes in the current sector
-                 */
-                memcpy(&bufp_val, &buf[i * ATA_WORDS * 2 + j * 2], 2);
-                error = ps_io_port_out(&io_ops->io_port_ops, (uint32_t)(bus + ATA_REG_DATA), 2,
-                                       bufp_val);
-                assert(!error);
-            }
+            error = ps_io_port_out_rep(&io_ops->io_port_ops, (uint32_t)(bus + ATA_REG_DATA), 2,
+                                       &buf[i * ATA_WORDS * 2], ATA_WORDS);
+            assert(!error);
         }
+    }
+
+    if (ATA_WRITE == direction) {
         error = ps_io_port_out(&io_ops->io_port_ops, (uint32_t)(bus + ATA_REG_COMMAND), 1,
                                (flush_cmd));
         assert(!error);
@@ -407,16 +430,236 @@ uint8_t ide_ata_access(sata_driver_t *driver, uint8_t direction, uint8_t drive,
     return 0;
 }
 
+/*
+ * Purpose: Allocate the bounce buffer and PRD table for bus master DMA. The
+ *          driver keeps to PIO if anything is missing.
+ *
+ * Inputs:
+ *   - *config: the bus master base, may be NULL
+ *
+ * Returns: nothing
+ *
+ */
+static void ide_dma_init(ide_dev_t *ide, ide_config_t *config)
+{
+    ps_dma_man_t *dma_man = &ide->io_ops->dma_manager;
+
+    if ((NULL == config) || (0 == config->bm_base) || (NULL == dma_man->dma_alloc_fn)) {
+        ZF_LOGV("IDE: no bus master, using PIO\n");
+        return;
+    }
+
+    /* Aligned so that no PRD region crosses a 64K boundary */
+    uint8_t *dma_buf = ps_dma_alloc(dma_man, IDE_DMA_BUF_SIZE, IDE_PRD_MAX_BYTES, 1, PS_MEM_NORMAL);
+    ide_prd_t *prdt = ps_dma_alloc(dma_man, IDE_DMA_NUM_PRDS * sizeof(ide_prd_t), sizeof(ide_prd_t), 1,
+                                   PS_MEM_NORMAL);
+    if ((NULL == dma_buf) || (NULL == prdt)) {
+        ZF_LOGE("IDE: failed to allocate DMA memory, using PIO\n");
+        goto error;
+    }
+
+    uintptr_t dma_buf_phys = ps_dma_pin(dma_man, dma_buf, IDE_DMA_BUF_SIZE);
+    uintptr_t prdt_phys = ps_dma_pin(dma_man, prdt, IDE_DMA_NUM_PRDS * sizeof(ide_prd_t));
+    /* The bus master only takes 32 bit addresses */
+    if ((0 == dma_buf_phys) || (0 == prdt_phys) || (UINT32_MAX < (uint64_t) dma_buf_phys + IDE_DMA_BUF_SIZE)
+        || (UINT32_MAX < (uint64_t) prdt_phys + IDE_DMA_NUM_PRDS * sizeof(ide_prd_t))) {
+        ZF_LOGE("IDE: DMA memory is not addressable by the bus master, using PIO\n");
+        goto error;
+    }
+
+    for (int i = 0; i < IDE_DMA_NUM_PRDS; i++) {
+        prdt[i].phys = dma_buf_phys + i * IDE_PRD_MAX_BYTES;
+    }
+
+    ide->dma_buf = dma_buf;
+    ide->dma_buf_phys = dma_buf_phys;
+    ide->prdt = prdt;
+    ide->prdt_phys = prdt_phys;
+    for (int i = 0; i < NUM_IDE_CHANNELS; i++) {
+        ide->channels[i].bmide = config->bm_base + i * BM_CHANNEL_SIZE;
+    }
+    return;
+
+error:
+    if (dma_buf) {
+        ps_dma_free(dma_man, dma_buf, IDE_DMA_BUF_SIZE);
+    }
+    if (prdt) {
+        ps_dma_free(dma_man, prdt, IDE_DMA_NUM_PRDS * sizeof(ide_prd_t));
+    }
+}
+
+/*
+ * Purpose: Set up the bus master of a channel for a transfer, without
+ *          starting it
+ *
+ * Inputs:
+ *   - channel: channel of the drive
+ *   - direction: ATA_READ or ATA_WRITE
+ *   - numsects: number of sectors, at most IDE_MAX_SECTS
+ *   - buf: data to write, not used for reads
+ *
+ * Returns: success (0) failure (code)
+ *
+ */
+static uint8_t ide_dma_prepare(ide_dev_t *ide, uint8_t channel, uint8_t direction, uint16_t numsects, uint8_t *buf)
+{
+    ps_io_ops_t *io_ops = ide->io_ops;
+    uint32_t bm = ide->channels[channel].bmide;
+    uint32_t len = numsects * ATA_WORDS * 2;
+    int error;
+    int i;
+
+    if (ATA_WRITE == direction) {
+        memcpy(ide->dma_buf, buf, len);
+        ps_dma_cache_clean(&io_ops->dma_manager, ide->dma_buf, len);
+    }
+
+    for (i = 0; len > IDE_PRD_MAX_BYTES; i++) {
+        ide->prdt[i].len = 0;   // 64K
+        ide->prdt[i].flags = 0;
+        len -= IDE_PRD_MAX_BYTES;
+    }
+    ide->prdt[i].len = (len == IDE_PRD_MAX_BYTES) ? 0 : len;
+    ide->prdt[i].flags = IDE_PRD_EOT;
+    ps_dma_cache_clean(&io_ops->dma_manager, ide->prdt, IDE_DMA_NUM_PRDS * sizeof(ide_prd_t));
+
+    error = ps_io_port_out(&io_ops->io_port_ops, bm + BM_REG_COMMAND, 1, 0);
+    error |= ide_dma_clear_status(ide, channel);
+    error |= ps_io_port_out(&io_ops->io_port_ops, bm + BM_REG_PRDT, 4, ide->prdt_phys);
+    error |= ps_io_port_out(&io_ops->io_port_ops, bm + BM_REG_COMMAND, 1,
+                            (ATA_READ == direction) ? BM_CMD_READ : 0);
+    if (error) {
+        ZF_LOGE("IDE: cannot set up the bus master of channel %u", channel);
+        return ATA_ERR;
+    }
+    return ATA_NO_ERR;
+}
+
+/*
+ * Purpose: Clear the error and interrupt bits of the bus master status of a
+ *          channel. The DMA capable bits are written back as they were.
+ *
+ * Inputs:
+ *   - channel: channel of the bus master
+ *
+ * Returns: success (0) failure (code)
+ *
+ */
+static uint8_t ide_dma_clear_status(ide_dev_t *ide, uint8_t channel)
+{
+    ps_io_ops_t *io_ops = ide->io_ops;
+    uint32_t bm = ide->channels[channel].bmide;
+    uint32_t bm_status = 0;
+    int error;
+
+    error = ps_io_port_in(&io_ops->io_port_ops, bm + BM_REG_STATUS, 1, &bm_status);
+    if (error) {
+        return ATA_ERR;
+    }
+    error = ps_io_port_out(&io_ops->io_port_ops, bm + BM_REG_STATUS, 1,
+                           (bm_status & BM_STATUS_DMA_CAP) | BM_STATUS_ERR | BM_STATUS_IRQ);
+    return error ? ATA_ERR : ATA_NO_ERR;
+}
+
+/*
+ * Purpose: Start the bus master of a channel after the command was sent and
+ *          wait for the transfer. It takes a couple of port reads to poll,
+ *          rather than one per word with PIO. A transfer that does not finish
+ *          within IDE_DMA_TIMEOUT_US is stopped and the channel reset.
+ *
+ * Inputs:
+ *   - channel: channel of the drive
+ *   - direction: ATA_READ or ATA_WRITE
+ *   - numsects: number of sectors
+ *   - buf: buffer to read into, not used for writes
+ *
+ * Returns: success (0) failure (code)
+ *
+ */
+static uint8_t ide_dma_transfer(ide_dev_t *ide, uint8_t channel, uint8_t direction, uint16_t numsects,
+                                uint8_t *buf)
+{
+    ps_io_ops_t *io_ops = ide->io_ops;
+    uint32_t bm = ide->channels[channel].bmide;
+    uint32_t cmd = (ATA_READ == direction) ? BM_CMD_READ : 0;
+    uint32_t ctrl = ide->channels[channel].ctrl;
+    uint32_t bm_status = 0;
+    uint32_t res = 0;
+    uint8_t err = ATA_NO_ERR;
+    int spin = 0;
+    int error;
+
+    error = ps_io_port_out(&io_ops->io_port_ops, bm + BM_REG_COMMAND, 1, cmd | BM_CMD_START);
+    if (error) {
+        ZF_LOGE("IDE: cannot start the bus master of channel %u", channel);
+        return ATA_ERR;
+    }
+
+    /* Done once the bus master ran out of PRDs, or the drive stopped early */
+    while (1) {
+        ps_io_port_in(&io_ops->io_port_ops, bm + BM_REG_STATUS, 1, &bm_status);
+        if (!(bm_status & BM_STATUS_ACTIVE) || (bm_status & BM_STATUS_ERR)) {
+            break;
+        }
+        ps_io_port_in(&io_ops->io_port_ops, ctrl + ATA_REG_ALTSTATUS, 1, &res);
+        if (!(res & (ATA_SR_BSY | ATA_SR_DRQ))) {
+            break;
+        }
+        if (IDE_DMA_TIMEOUT_US < spin) {
+            err = ATA_DMA_TIMEOUT;
+            break;
+        }
+        ps_udelay(1);
+        spin++;
+    }
+
+    error = ps_io_port_out(&io_ops->io_port_ops, bm + BM_REG_COMMAND, 1, cmd);
+    error |= ide_dma_clear_status(ide, channel);
+    if (error && (ATA_NO_ERR == err)) {
+        ZF_LOGE("IDE: cannot stop the bus master of channel %u", channel);
+        err = ATA_ERR;
+    }
+
+    if (ATA_DMA_TIMEOUT == err) {
+        /* The drive is still busy, a software reset of the channel frees it
+         * for the next command */
+        ZF_LOGE("IDE: DMA transfer timed out, resetting channel %u", channel);
+        error = ps_io_port_out(&io_ops->io_port_ops, ctrl + ATA_REG_CONTROL, 1, ATA_CTRL_NIEN | ATA_CTRL_SRST);
+        ps_udelay(5);
+        error |= ps_io_port_out(&io_ops->io_port_ops, ctrl + ATA_REG_CONTROL, 1, ATA_CTRL_NIEN);
+        ZF_LOGE_IF(error, "IDE: cannot reset channel %u", channel);
+        ps_mdelay(2);
+        return err;
+    }
+
+    ide_polling(ide, channel, 0);
+    ps_io_port_in(&io_ops->io_port_ops, ide->channels[channel].base + ATA_REG_STATUS, 1, &res);
+    if (res & ATA_SR_ERR) {
+        err = ATA_ERR;
+    } else if ((res & ATA_SR_DF) || (bm_status & BM_STATUS_ERR)) {
+        err = ATA_DRIVE_FAULT;
+    }
+
+    if ((ATA_NO_ERR == err) && (ATA_READ == direction)) {
+        uint32_t len = numsects * ATA_WORDS * 2;
+        ps_dma_cache_invalidate(&io_ops->dma_manager, ide->dma_buf, len);
+        memcpy(buf, ide->dma_buf, len);
+    }
+    return err;
+}
+
 /*
  * Purpose: Initialize the IDE Device
  *
  * Inputs:
  *   - io_ops: IO Operation Functions
+ *   - *config: bus master configuration, NULL for PIO only
  *
  * Returns: 0
  *
  */
-int ide_init(ps_io_ops_t *io_ops, sata_driver_t *driver)
+int ide_init(ps_io_ops_t *io_ops, sata_driver_t *driver, ide_config_t *config)
 {
     if (NULL == driver) {
         ZF_LOGE("IDE: init: driver can't be NULL!");
@@ -432,7 +675,6 @@ int ide_init(ps_io_ops_t *io_ops, sata_driver_t *driver)
     uint32_t res = 0;
     int error = 0;
     int i = 0;
-    int j = 0;
     int k = 0;
     int count = 0;
 
@@ -451,6 +693,8 @@ int ide_init(ps_io_ops_t *io_ops, sata_driver_t *driver)
     ide->channels[ATA_PRIMARY].base = (PRIMARY_CMD_BASE);
     ide->channels[ATA_PRIMARY].ctrl = (PRIMARY_CTRL_BASE);
 
+    ide_dma_init(ide, config);
+
     /* Disable IRQs */
     error = ps_io_port_out(&io_ops->io_port_ops, (uint32_t)(ide->channels[ATA_PRIMARY].ctrl
                                                             + ATA_REG_CONTROL), 1, ATA_CTRL_NIEN);
@@ -540,11 +784,9 @@ int ide_init(ps_io_ops_t *io_ops, sata_driver_t *driver)
         ZF_LOGV("IDE: Sent ATA_CMD_IDENTIFY_PACKET\n");
 
         /* Read Identification Space of the Device */
-        for (j = 0; j < ATA_WORDS; j++) {
-            error = ps_io_port_in(&io_ops->io_port_ops, (uint32_t)(ide->channels[ATA_PRIMARY].base
-                                                                   + ATA_REG_DATA), 2, (uint32_t *)&ide_buf[j * 2]);
-            assert(!error);
-        }
+        error = ps_io_port_in_rep(&io_ops->io_port_ops, (uint32_t)(ide->channels[ATA_PRIMARY].base
+                                                                   + ATA_REG_DATA), 2, ide_buf, ATA_WORDS);
+        assert(!error);
         ZF_LOGV("IDE: Read DATA\n");
 
         /* Read Device Parameters */
@@ -559,10 +801,12 @@ int ide_init(ps_io_ops_t *io_ops, sata_driver_t *driver)
         /* Get Size */
         if (driver->sata_devices[count].CommandSets & (1 << 26)) {
             /* Device uses 48-Bit Addressing */
-            memcpy(&driver->sata_devices[count].Size, ide_buf + ATA_IDENT_MAX_LBA_EXT, sizeof(uint32_t));
+            memcpy(&driver->sata_devices[count].Size, ide_buf + ATA_IDENT_MAX_LBA_EXT, sizeof(uint64_t));
         } else {
             /* Device uses CHS or 28-bit Addressing */
-            memcpy(&driver->sata_devices[count].Size, ide_buf + ATA_IDENT_MAX_LBA, sizeof(uint32_t));
+            uint32_t size;
+            memcpy(&size, ide_buf + ATA_IDENT_MAX_LBA, sizeof(uint32_t));
+            driver->sata_devices[count].Size = size;
         }
 
         /* String indicates model of device (like Western Digital HDD and SONY DVD-RW...) */
@@ -582,7 +826,7 @@ int ide_init(ps_io_ops_t *io_ops, sata_driver_t *driver)
             (const char *[]) {
                 "ATA", "ATAPI"
             }[driver->sata_devices[i].Type],  /* Type */
-            driver->sata_devices[i].Size / 1024 / 1024 / 2,                  /* Size */
+            (int)(driver->sata_devices[i].Size / 1024 / 1024 / 2),           /* Size */
             driver->sata_devices[i].Model);
         }
     }
@@ -0,0 +1,464 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <string.h>
+#include <stdbool.h>
+
+#include <satadrivers/ide.h>
+#include <satadrivers/common.h>
+#include <utils/zf_log.h>
+
+#define MBR_SIGNATURE_OFFSET    0x01FE
+#define MBR_SYS_ID_GPT          0xEE
+
+#define GPT_SIGNATURE           "EFI PART"
+#define GPT_HEADER_MIN_SIZE     92
+#define GPT_ENTRY_MIN_SIZE      128
+#define GPT_MAX_TABLE_SIZE      (1024 * 1024)
+
+/* Offsets into the GPT header */
+#define GPT_HDR_SIZE            12
+#define GPT_HDR_CRC             16
+#define GPT_HDR_MY_LBA          24
+#define GPT_HDR_ALT_LBA         32
+#define GPT_HDR_FIRST_USABLE    40
+#define GPT_HDR_LAST_USABLE     48
+#define GPT_HDR_DISK_GUID       56
+#define GPT_HDR_ENTRIES_LBA     72
+#define GPT_HDR_NUM_ENTRIES     80
+#define GPT_HDR_ENTRY_SIZE      84
+#define GPT_HDR_ENTRIES_CRC     88
+
+/* Offsets into a GPT entry */
+#define GPT_ENT_TYPE_GUID       0
+#define GPT_ENT_UNIQUE_GUID     16
+#define GPT_ENT_FIRST_LBA       32
+#define GPT_ENT_LAST_LBA        40
+#define GPT_ENT_ATTRIBUTES      48
+
+typedef struct gpt_header {
+    uint64_t alt_lba;
+    uint64_t first_usable;
+    uint64_t last_usable;
+    uint64_t entries_lba;
+    uint32_t num_entries;
+    uint32_t entry_size;
+    uint32_t entries_crc;
+    uint8_t disk_guid[SATA_GUID_SIZE];
+} gpt_header_t;
+
+/*
+ * Purpose: Get an empty map for a drive with room for max_count partitions.
+ *          The map of the drive is reused if it is large enough.
+ *
+ * Returns: the map, NULL if it could not be allocated
+ *
+ */
+static sata_part_map_t *part_map_alloc(sata_driver_t *driver, uint8_t drive, uint32_t max_count)
+{
+    ps_malloc_ops_t *ops = &driver->io_ops->malloc_ops;
+    sata_part_map_t *map = driver->part_maps[drive];
+
+    if (map && (map->max_count < max_count)) {
+        ps_free(ops, sizeof(sata_part_map_t) + map->max_count * sizeof(sata_partition_t), map);
+        driver->part_maps[drive] = NULL;
+        map = NULL;
+    }
+    if (NULL == map) {
+        if (ps_calloc(ops, 1, sizeof(sata_part_map_t) + max_count * sizeof(sata_partition_t), (void **) &map)) {
+            ZF_LOGE("SATA: drive %u: failed to allocate a map of %u partitions", drive, max_count);
+            return NULL;
+        }
+        map->max_count = max_count;
+        driver->part_maps[drive] = map;
+    }
+
+    max_count = map->max_count;
+    memset(map, 0, sizeof(sata_part_map_t) + max_count * sizeof(sata_partition_t));
+    map->max_count = max_count;
+    map->scheme = SATA_PART_NONE;
+    map->first_usable = 1;
+    map->last_usable = driver->sata_devices[drive].Size - 1;
+    return map;
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t get_le64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* CRC32 as used by GPT, continued from crc. Only run when the tables are read. */
+static uint32_t gpt_crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+/*
+ * Purpose: Read and check a GPT header
+ *
+ * Inputs:
+ *   - drive: drive to read from
+ *   - lba: where the header is
+ *   - *sector: a sector sized buffer
+ *   - *hdr: filled in with the header
+ *
+ * Returns: success or failure code
+ *
+ */
+static int gpt_read_header(sata_driver_t *driver, uint8_t drive, uint64_t lba, uint8_t *sector, gpt_header_t *hdr)
+{
+    uint64_t size = driver->sata_devices[drive].Size;
+    int err = sata_read_sectors_ext(driver, drive, 1, lba, sector);
+
+    if (SATA_NO_ERR != err) {
+        return err;
+    }
+    if (memcmp(sector, GPT_SIGNATURE, strlen(GPT_SIGNATURE))) {
+        ZF_LOGV("SATA: drive %u: no GPT header at %llu", drive, (unsigned long long) lba);
+        return INVALID_PARTITION;
+    }
+
+    uint32_t hdr_size = get_le32(sector + GPT_HDR_SIZE);
+    if ((hdr_size < GPT_HEADER_MIN_SIZE) || (hdr_size > SATA_BLK_SIZE)) {
+        ZF_LOGE("SATA: drive %u: GPT header at %llu has bad size %u", drive, (unsigned long long) lba, hdr_size);
+        return INVALID_PARTITION;
+    }
+
+    uint32_t crc = get_le32(sector + GPT_HDR_CRC);
+    memset(sector + GPT_HDR_CRC, 0, sizeof(uint32_t));
+    if (gpt_crc32(0, sector, hdr_size) != crc) {
+        ZF_LOGE("SATA: drive %u: GPT header at %llu fails its CRC", drive, (unsigned long long) lba);
+        return INVALID_PARTITION;
+    }
+    if (get_le64(sector + GPT_HDR_MY_LBA) != lba) {
+        ZF_LOGE("SATA: drive %u: GPT header at %llu is for another sector", drive, (unsigned long long) lba);
+        return INVALID_PARTITION;
+    }
+
+    hdr->alt_lba = get_le64(sector + GPT_HDR_ALT_LBA);
+    hdr->first_usable = get_le64(sector + GPT_HDR_FIRST_USABLE);
+    hdr->last_usable = get_le64(sector + GPT_HDR_LAST_USABLE);
+    hdr->entries_lba = get_le64(sector + GPT_HDR_ENTRIES_LBA);
+    hdr->num_entries = get_le32(sector + GPT_HDR_NUM_ENTRIES);
+    hdr->entry_size = get_le32(sector + GPT_HDR_ENTRY_SIZE);
+    hdr->entries_crc = get_le32(sector + GPT_HDR_ENTRIES_CRC);
+    memcpy(hdr->disk_guid, sector + GPT_HDR_DISK_GUID, SATA_GUID_SIZE);
+
+    /* Entries are 128 << n bytes, only those that pack into sectors are supported */
+    if ((hdr->entry_size < GPT_ENTRY_MIN_SIZE) || (hdr->entry_size > SATA_BLK_SIZE)
+        || (hdr->entry_size & (hdr->entry_size - 1))) {
+        ZF_LOGE("SATA: drive %u: GPT entry size %u not supported", drive, hdr->entry_size);
+        return INVALID_PARTITION;
+    }
+    uint64_t table_size = (uint64_t) hdr->num_entries * hdr->entry_size;
+    uint64_t table_sects = (table_size + SATA_BLK_SIZE - 1) / SATA_BLK_SIZE;
+    if ((table_size > GPT_MAX_TABLE_SIZE) || (hdr->entries_lba >= size) || (table_sects > size - hdr->entries_lba)
+        || (hdr->first_usable > hdr->last_usable) || (hdr->last_usable >= size)) {
+        ZF_LOGE("SATA: drive %u: GPT header at %llu is out of bounds", drive, (unsigned long long) lba);
+        return INVALID_PARTITION;
+    }
+    return SATA_NO_ERR;
+}
+
+/*
+ * Purpose: Read the entries of a GPT into the map of the drive, a sector at
+ *          a time
+ *
+ * Inputs:
+ *   - drive: drive to read from
+ *   - *hdr: checked header of the table
+ *   - *sector: a sector sized buffer
+ *
+ * Returns: success or failure code
+ *
+ */
+static int gpt_read_entries(sata_driver_t *driver, uint8_t drive, const gpt_header_t *hdr, uint8_t *sector)
+{
+    uint32_t per_sector = SATA_BLK_SIZE / hdr->entry_size;
+    uint32_t crc = 0;
+    uint32_t idx = 0;
+    int err;
+
+    sata_part_map_t *map = part_map_alloc(driver, drive, (hdr->num_entries < SATA_MAX_PARTITIONS)
+                                          ? hdr->num_entries : SATA_MAX_PARTITIONS);
+    if (NULL == map) {
+        return NO_MEMORY;
+    }
+
+    for (uint64_t lba = hdr->entries_lba; idx < hdr->num_entries; lba++) {
+        err = sata_read_sectors_ext(driver, drive, 1, lba, sector);
+        if (SATA_NO_ERR != err) {
+            return err;
+        }
+
+        uint32_t n = hdr->num_entries - idx;
+        n = (n < per_sector) ? n : per_sector;
+        crc = gpt_crc32(crc, sector, n * hdr->entry_size);
+
+        for (uint32_t i = 0; i < n; i++, idx++) {
+            const uint8_t *ent = sector + i * hdr->entry_size;
+            static const uint8_t unused[SATA_GUID_SIZE];
+            uint64_t first = get_le64(ent + GPT_ENT_FIRST_LBA);
+            uint64_t last = get_le64(ent + GPT_ENT_LAST_LBA);
+
+            if (!memcmp(ent + GPT_ENT_TYPE_GUID, unused, SATA_GUID_SIZE)) {
+                continue;
+            }
+            if ((first > last) || (first < hdr->first_usable) || (last > hdr->last_usable)) {
+                ZF_LOGE("SATA: drive %u: GPT entry %u is out of bounds, skipped", drive, idx);
+                continue;
+            }
+            if (map->count == map->max_count) {
+                ZF_LOGE("SATA: drive %u: more than %d partitions, entry %u skipped", drive, SATA_MAX_PARTITIONS, idx);
+                continue;
+            }
+
+            sata_partition_t *part = &map->parts[map->count++];
+            memset(part, 0, sizeof(*part));
+            part->start_lba = first;
+            part->num_sectors = last - first + 1;
+            part->attributes = get_le64(ent + GPT_ENT_ATTRIBUTES);
+            part->index = idx;
+            memcpy(part->type_guid, ent + GPT_ENT_TYPE_GUID, SATA_GUID_SIZE);
+            memcpy(part->unique_guid, ent + GPT_ENT_UNIQUE_GUID, SATA_GUID_SIZE);
+        }
+    }
+
+    if (crc != hdr->entries_crc) {
+        ZF_LOGE("SATA: drive %u: GPT entries at %llu fail their CRC", drive,
+                (unsigned long long) hdr->entries_lba);
+        return INVALID_PARTITION;
+    }
+
+    map->scheme = SATA_PART_GPT;
+    map->first_usable = hdr->first_usable;
+    map->last_usable = hdr->last_usable;
+    memcpy(map->disk_guid, hdr->disk_guid, SATA_GUID_SIZE);
+    return SATA_NO_ERR;
+}
+
+/*
+ * Purpose: Read a GPT, from the backup if the primary one is damaged
+ *
+ * Returns: success or failure code
+ *
+ */
+static int gpt_read(sata_driver_t *driver, uint8_t drive, uint8_t *sector)
+{
+    gpt_header_t hdr;
+    uint64_t backup = driver->sata_devices[drive].Size - 1;
+    int err = gpt_read_header(driver, drive, 1, sector, &hdr);
+
+    if (SATA_NO_ERR == err) {
+        err = gpt_read_entries(driver, drive, &hdr, sector);
+        if ((SATA_NO_ERR == err) || (NO_MEMORY == err)) {
+            return err;
+        }
+        if ((hdr.alt_lba > 1) && (hdr.alt_lba < driver->sata_devices[drive].Size)) {
+            backup = hdr.alt_lba;
+        }
+    }
+
+    ZF_LOGE("SATA: drive %u: primary GPT unusable, trying the backup at %llu", drive,
+            (unsigned long long) backup);
+    err = gpt_read_header(driver, drive, backup, sector, &hdr);
+    if (SATA_NO_ERR == err) {
+        err = gpt_read_entries(driver, drive, &hdr, sector);
+    }
+    return err;
+}
+
+/*
+ * Purpose: Read the partition tables of a drive into its map
+ *
+ * Inputs:
+ *   - drive: drive to read from
+ *
+ * Returns: success or failure code
+ *
+ */
+static int sata_load_partitions(sata_driver_t *driver, uint8_t drive)
+{
+    sata_part_map_t *map;
+    partition_table_t mbr[PART_ENTRIES];
+    uint8_t sector[SATA_BLK_SIZE];
+    bool protective = false;
+    int err;
+
+    ZF_LOGV("SATA: Reading partition map for Drive: %u", drive);
+
+    err = sata_read_sectors_ext(driver, drive, 1, 0, sector);
+    if (SATA_NO_ERR != err) {
+        return err;
+    }
+
+    if ((0x55 != sector[MBR_SIGNATURE_OFFSET]) || (0xAA != sector[MBR_SIGNATURE_OFFSET + 1])) {
+        ZF_LOGV("SATA: drive %u has no partition table", drive);
+        return part_map_alloc(driver, drive, 0) ? SATA_NO_ERR : NO_MEMORY;
+    }
+
+    for (int i = 0; i < PART_ENTRIES; i++) {
+        memcpy(&mbr[i], &sector[PART_OFFSET + (PART_SIZE * i)], sizeof(partition_table_t));
+        if (MBR_SYS_ID_GPT == mbr[i].sys_id) {
+            protective = true;
+        }
+    }
+
+    if (protective) {
+        err = gpt_read(driver, drive, sector);
+        if (SATA_NO_ERR == err) {
+            ZF_LOGV("SATA: drive %u: GPT with %u partitions", drive, driver->part_maps[drive]->count);
+            return err;
+        }
+        if (NO_MEMORY == err) {
+            return err;
+        }
+        ZF_LOGE("SATA: drive %u: no usable GPT, using the MBR", drive);
+    }
+
+    map = part_map_alloc(driver, drive, PART_ENTRIES);
+    if (NULL == map) {
+        return NO_MEMORY;
+    }
+
+    for (int i = 0; i < PART_ENTRIES; i++) {
+        if ((0 == mbr[i].num_sectors) || (MBR_SYS_ID_GPT == mbr[i].sys_id)) {
+            continue;
+        }
+        if ((mbr[i].start_lba == 0) || ((uint64_t) mbr[i].start_lba + mbr[i].num_sectors > map->last_usable + 1)) {
+            ZF_LOGE("SATA: drive %u: MBR partition %d is out of bounds, skipped", drive, i);
+            continue;
+        }
+
+        sata_partition_t *part = &map->parts[map->count++];
+        part->start_lba = mbr[i].start_lba;
+        part->num_sectors = mbr[i].num_sectors;
+        part->sys_id = mbr[i].sys_id;
+        part->index = i;
+    }
+    map->scheme = SATA_PART_MBR;
+    ZF_LOGV("SATA: drive %u: MBR with %u partitions", drive, map->count);
+    return SATA_NO_ERR;
+}
+
+/*
+ * Purpose: Get the partition map of a drive, reading it on first use
+ *
+ * Inputs:
+ *   - drive: drive to get the map of
+ *   - **map: set to the map, valid until the drive's tables are written
+ *
+ * Returns: success or failure code
+ *
+ */
+int sata_get_partition_map(sata_driver_t *driver, uint8_t drive, const sata_part_map_t **map)
+{
+    if ((NULL == driver) || (NULL == map)) {
+        ZF_LOGE("SATA: ERROR: parameters are null");
+        return INVALID_PTR;
+    }
+    if ((drive >= MAX_DRIVES) || (0 == driver->sata_devices[drive].Reserved)) {
+        ZF_LOGE("SATA: ERROR: Drive Not Found");
+        return DRIVE_NOT_FOUND;
+    }
+
+    if ((NULL == driver->part_maps[drive]) || (SATA_PART_UNREAD == driver->part_maps[drive]->scheme)) {
+        int err = sata_load_partitions(driver, drive);
+        if (SATA_NO_ERR != err) {
+            if (driver->part_maps[drive]) {
+                driver->part_maps[drive]->scheme = SATA_PART_UNREAD;
+            }
+            return err;
+        }
+    }
+    *map = driver->part_maps[drive];
+    return SATA_NO_ERR;
+}
+
+/* Have the tables of a drive read again on the next use of its map */
+void sata_invalidate_partitions(sata_driver_t *driver, uint8_t drive)
+{
+    if ((NULL != driver) && (drive < MAX_DRIVES) && driver->part_maps[drive]) {
+        driver->part_maps[drive]->scheme = SATA_PART_UNREAD;
+    }
+}
+
+void sata_partitions_written(sata_driver_t *driver, uint8_t drive, uint32_t numsects, uint64_t lba)
+{
+    sata_part_map_t *map = driver->part_maps[drive];
+
+    if (map && (SATA_PART_UNREAD != map->scheme) && numsects
+        && ((lba < map->first_usable) || (lba + numsects - 1 > map->last_usable))) {
+        map->scheme = SATA_PART_UNREAD;
+    }
+}
+
+/*
+ * Purpose: Read/Write the sectors of a partition
+ *
+ * Inputs:
+ *   - direction: used to specify a read or a write
+ *   - drive: drive of the partition
+ *   - part: partition number in the map of the drive
+ *   - numsects: number of sectors to be read or written
+ *   - lba: address relative to the start of the partition
+ *   - *buf: Buffer to write or read data from
+ *
+ * Returns: success or failure code
+ *
+ */
+static int sata_access_partition(sata_driver_t *driver, uint8_t direction, uint8_t drive, uint32_t part,
+                                 uint32_t numsects, uint64_t lba, uint8_t *buf)
+{
+    const sata_part_map_t *map;
+    int err = sata_get_partition_map(driver, drive, &map);
+
+    if (SATA_NO_ERR != err) {
+        return err;
+    }
+    if (part >= map->count) {
+        ZF_LOGE("SATA: ERROR: drive %u has no partition %u", drive, part);
+        return INVALID_PARTITION;
+    }
+
+    const sata_partition_t *p = &map->parts[part];
+    if ((lba >= p->num_sectors) || (numsects > p->num_sectors - lba)) {
+        ZF_LOGE("SATA: ERROR: access past the end of partition %u", part);
+        return INVALID_POSITION;
+    }
+
+    if (ATA_READ == direction) {
+        return sata_read_sectors_ext(driver, drive, numsects, p->start_lba + lba, buf);
+    }
+    return sata_write_sectors_ext(driver, drive, numsects, p->start_lba + lba, buf);
+}
+
+int sata_read_partition(sata_driver_t *driver, uint8_t drive, uint32_t part, uint32_t numsects, uint64_t lba,
+                        uint8_t *buf)
+{
+    return sata_access_partition(driver, ATA_READ, drive, part, numsects, lba, buf);
+}
+
+int sata_write_partition(sata_driver_t *driver, uint8_t drive, uint32_t part, uint32_t numsects, uint64_t lba,
+                         uint8_t *buf)
+{
+    return sata_access_partition(driver, ATA_WRITE, drive, part, numsects, lba, buf);
+}
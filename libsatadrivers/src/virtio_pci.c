@@ -0,0 +1,387 @@
+/*
+ * Copyright 2019, DornerWorks
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <satadrivers/raw.h>
+#include <satadrivers/virtio_pci.h>
+#include <virtio/virtio_config.h>
+#include <virtio/virtio_pci.h>
+#include <virtio/virtio_ring.h>
+#include <virtio/virtio_blk.h>
+#include <utils/util.h>
+
+/* Mask of features we will use if the device has them */
+#define FEATURES_WANTED (BIT(VIRTIO_BLK_F_RO) | BIT(VIRTIO_BLK_F_FLUSH) | BIT(VIRTIO_BLK_F_BLK_SIZE))
+
+#define DMA_ALIGN 16
+#define SECTOR_SIZE 512
+
+#define REQ_QUEUE 0
+
+/* Header and status of a request. There is one for every descriptor and a
+ * request uses the one of its first descriptor */
+typedef struct virtio_blk_req {
+    struct virtio_blk_outhdr hdr;
+    uint8_t status;
+} virtio_blk_req_t;
+
+typedef struct virtio_blk_dev {
+    uint16_t io_base;
+    ps_io_port_ops_t ioops;
+    uint32_t features;
+    /* The device completes requests in any order, so descriptors not in
+     * use are chained from free_head through their next field */
+    uint16_t free_head;
+    unsigned int num_free;
+    /* index in the used ring that we last observed */
+    uint16_t used_head;
+    /* descriptor ring */
+    uintptr_t ring_phys;
+    struct vring ring;
+    unsigned int size;
+    /* headers and cookies of the requests, by first descriptor */
+    virtio_blk_req_t *reqs;
+    uintptr_t reqs_phys;
+    void **cookies;
+} virtio_blk_dev_t;
+
+static uint8_t read_reg8(virtio_blk_dev_t *dev, uint16_t port)
+{
+    uint32_t val;
+    ps_io_port_in(&dev->ioops, dev->io_base + port, 1, &val);
+    return (uint8_t)val;
+}
+
+static uint16_t read_reg16(virtio_blk_dev_t *dev, uint16_t port)
+{
+    uint32_t val;
+    ps_io_port_in(&dev->ioops, dev->io_base + port, 2, &val);
+    return (uint16_t)val;
+}
+
+static uint32_t read_reg32(virtio_blk_dev_t *dev, uint16_t port)
+{
+    uint32_t val;
+    ps_io_port_in(&dev->ioops, dev->io_base + port, 4, &val);
+    return val;
+}
+
+static void write_reg8(virtio_blk_dev_t *dev, uint16_t port, uint8_t val)
+{
+    ps_io_port_out(&dev->ioops, dev->io_base + port, 1, val);
+}
+
+static void write_reg16(virtio_blk_dev_t *dev, uint16_t port, uint16_t val)
+{
+    ps_io_port_out(&dev->ioops, dev->io_base + port, 2, val);
+}
+
+static void write_reg32(virtio_blk_dev_t *dev, uint16_t port, uint32_t val)
+{
+    ps_io_port_out(&dev->ioops, dev->io_base + port, 4, val);
+}
+
+static void set_status(virtio_blk_dev_t *dev, uint8_t status)
+{
+    write_reg8(dev, VIRTIO_PCI_STATUS, status);
+}
+
+static uint8_t get_status(virtio_blk_dev_t *dev)
+{
+    return read_reg8(dev, VIRTIO_PCI_STATUS);
+}
+
+static void add_status(virtio_blk_dev_t *dev, uint8_t status)
+{
+    write_reg8(dev, VIRTIO_PCI_STATUS, get_status(dev) | status);
+}
+
+static uint32_t get_features(virtio_blk_dev_t *dev)
+{
+    return read_reg32(dev, VIRTIO_PCI_HOST_FEATURES);
+}
+
+static void set_features(virtio_blk_dev_t *dev, uint32_t features)
+{
+    write_reg32(dev, VIRTIO_PCI_GUEST_FEATURES, features);
+}
+
+static void free_queue(virtio_blk_dev_t *dev, ps_dma_man_t *dma_man)
+{
+    if (dev->ring.desc) {
+        size_t size = vring_size(dev->size, VIRTIO_PCI_VRING_ALIGN);
+        ps_dma_unpin(dma_man, dev->ring.desc, size);
+        ps_dma_free(dma_man, dev->ring.desc, size);
+        dev->ring.desc = NULL;
+    }
+    if (dev->reqs) {
+        ps_dma_unpin(dma_man, dev->reqs, dev->size * sizeof(virtio_blk_req_t));
+        ps_dma_free(dma_man, dev->reqs, dev->size * sizeof(virtio_blk_req_t));
+        dev->reqs = NULL;
+    }
+    free(dev->cookies);
+    dev->cookies = NULL;
+}
+
+static int initialize_queue(virtio_blk_dev_t *dev, ps_dma_man_t *dma_man)
+{
+    size_t size = vring_size(dev->size, VIRTIO_PCI_VRING_ALIGN);
+    void *ring = ps_dma_alloc(dma_man, size, VIRTIO_PCI_VRING_ALIGN, 1, PS_MEM_NORMAL);
+    if (!ring) {
+        ZF_LOGE("Failed to allocate the request ring");
+        return -1;
+    }
+    memset(ring, 0, size);
+    vring_init(&dev->ring, dev->size, ring, VIRTIO_PCI_VRING_ALIGN);
+    dev->ring_phys = ps_dma_pin(dma_man, ring, size);
+
+    dev->reqs = ps_dma_alloc(dma_man, dev->size * sizeof(virtio_blk_req_t), DMA_ALIGN, 1, PS_MEM_NORMAL);
+    dev->cookies = calloc(dev->size, sizeof(void *));
+    if (!dev->reqs || !dev->cookies) {
+        ZF_LOGE("Failed to allocate the request headers");
+        free_queue(dev, dma_man);
+        return -1;
+    }
+    memset(dev->reqs, 0, dev->size * sizeof(virtio_blk_req_t));
+    dev->reqs_phys = ps_dma_pin(dma_man, dev->reqs, dev->size * sizeof(virtio_blk_req_t));
+
+    for (unsigned int i = 0; i < dev->size; i++) {
+        dev->ring.desc[i].next = i + 1;
+    }
+    dev->free_head = 0;
+    dev->num_free = dev->size;
+    dev->used_head = 0;
+
+    return 0;
+}
+
+static int initialize(virtio_blk_dev_t *dev, ps_dma_man_t *dma_man)
+{
+    int err;
+    /* perform a reset */
+    set_status(dev, 0);
+    /* acknowledge to the host that we found it and can drive it */
+    add_status(dev, VIRTIO_CONFIG_S_ACKNOWLEDGE);
+    add_status(dev, VIRTIO_CONFIG_S_DRIVER);
+    /* write the features we will use */
+    dev->features = get_features(dev) & FEATURES_WANTED;
+    set_features(dev, dev->features);
+    /* determine the queue size */
+    write_reg16(dev, VIRTIO_PCI_QUEUE_SEL, REQ_QUEUE);
+    dev->size = read_reg16(dev, VIRTIO_PCI_QUEUE_NUM);
+    if (dev->size < 3) {
+        ZF_LOGE("Request queue of %u descriptors is too small", dev->size);
+        return -1;
+    }
+    /* create the ring */
+    err = initialize_queue(dev, dma_man);
+    if (err) {
+        return -1;
+    }
+    /* write the virtqueue location */
+    write_reg32(dev, VIRTIO_PCI_QUEUE_PFN, dev->ring_phys >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+    /* tell the driver everything is okay */
+    add_status(dev, VIRTIO_CONFIG_S_DRIVER_OK);
+    return 0;
+}
+
+static uint16_t alloc_desc(virtio_blk_dev_t *dev)
+{
+    uint16_t desc = dev->free_head;
+    dev->free_head = dev->ring.desc[desc].next;
+    dev->num_free--;
+    return desc;
+}
+
+/* Put the descriptors of a completed request back on the free chain */
+static void free_chain(virtio_blk_dev_t *dev, uint16_t head)
+{
+    uint16_t desc = head;
+    dev->num_free++;
+    while (dev->ring.desc[desc].flags & VRING_DESC_F_NEXT) {
+        desc = dev->ring.desc[desc].next;
+        dev->num_free++;
+    }
+    dev->ring.desc[desc].next = dev->free_head;
+    dev->free_head = head;
+}
+
+static void low_level_init(struct disk_driver *driver, struct virtio_blk_config *cfg)
+{
+    virtio_blk_dev_t *dev = (virtio_blk_dev_t *)driver->disk_data;
+    uint8_t *bytes = (uint8_t *)cfg;
+    for (unsigned int i = 0; i < sizeof(*cfg); i++) {
+        bytes[i] = read_reg8(dev, VIRTIO_PCI_CONFIG_OFF(0) + i);
+    }
+    if (!(dev->features & BIT(VIRTIO_BLK_F_BLK_SIZE))) {
+        cfg->blk_size = SECTOR_SIZE;
+    }
+}
+
+static void print_state(struct disk_driver *driver)
+{
+    virtio_blk_dev_t *dev = (virtio_blk_dev_t *)driver->disk_data;
+    ZF_LOGI("virtio-blk: features 0x%x, %u of %u descriptors free, avail %u, used %u/%u", dev->features,
+            dev->num_free, dev->size, dev->ring.avail->idx, dev->used_head, dev->ring.used->idx);
+}
+
+/* Report every request the device finished since the last call */
+static void complete_xfers(struct disk_driver *driver)
+{
+    virtio_blk_dev_t *dev = (virtio_blk_dev_t *)driver->disk_data;
+    while (dev->used_head != dev->ring.used->idx) {
+        /* read the entry only after seeing the index that covers it */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint16_t head = dev->ring.used->ring[dev->used_head % dev->size].id;
+        int status = dev->reqs[head].status;
+        void *cookie = dev->cookies[head];
+        free_chain(dev, head);
+        dev->used_head++;
+        driver->i_cb.xfer_complete(driver->cb_cookie, cookie, status);
+    }
+}
+
+static int raw_xfer(struct disk_driver *driver, uint8_t direction, uint64_t sector, uint32_t len,
+                    uintptr_t guest_buf_phys, void *cookie)
+{
+    virtio_blk_dev_t *dev = (virtio_blk_dev_t *)driver->disk_data;
+    bool flush = (VIRTIO_BLK_T_FLUSH == direction);
+
+    if (flush) {
+        if (!(dev->features & BIT(VIRTIO_BLK_F_FLUSH))) {
+            /* the device has no write cache to flush */
+            return VIRTIO_BLK_XFER_COMPLETE;
+        }
+    } else if ((VIRTIO_BLK_T_IN != direction) && (VIRTIO_BLK_T_OUT != direction)) {
+        ZF_LOGE("Unknown direction %u", direction);
+        return VIRTIO_BLK_XFER_FAILED;
+    } else if ((0 == len) || (len % SECTOR_SIZE)) {
+        ZF_LOGE("Length %u is not a number of sectors", len);
+        return VIRTIO_BLK_XFER_FAILED;
+    } else if ((VIRTIO_BLK_T_OUT == direction) && (dev->features & BIT(VIRTIO_BLK_F_RO))) {
+        ZF_LOGE("Disk is read only");
+        return VIRTIO_BLK_XFER_FAILED;
+    }
+
+    /* header, data and status, or header and status for a flush */
+    unsigned int needed = flush ? 2 : 3;
+    if (dev->num_free < needed) {
+        complete_xfers(driver);
+        if (dev->num_free < needed) {
+            return VIRTIO_BLK_XFER_FAILED;
+        }
+    }
+
+    uint16_t head = alloc_desc(dev);
+    virtio_blk_req_t *req = &dev->reqs[head];
+    uintptr_t req_phys = dev->reqs_phys + head * sizeof(virtio_blk_req_t);
+    req->hdr = (struct virtio_blk_outhdr) {
+        .type = direction,
+        .ioprio = 0,
+        .sector = flush ? 0 : sector
+    };
+    req->status = VIRTIO_BLK_S_IOERR;
+    dev->cookies[head] = cookie;
+
+    uint16_t desc = head;
+    dev->ring.desc[desc] = (struct vring_desc) {
+        .addr = req_phys,
+        .len = sizeof(struct virtio_blk_outhdr),
+        .flags = VRING_DESC_F_NEXT,
+    };
+    if (!flush) {
+        uint16_t data = alloc_desc(dev);
+        dev->ring.desc[desc].next = data;
+        desc = data;
+        dev->ring.desc[desc] = (struct vring_desc) {
+            .addr = guest_buf_phys,
+            .len = len,
+            /* the device writes to the buffer of a read */
+            .flags = VRING_DESC_F_NEXT | (VIRTIO_BLK_T_IN == direction ? VRING_DESC_F_WRITE : 0),
+        };
+    }
+    uint16_t status = alloc_desc(dev);
+    dev->ring.desc[desc].next = status;
+    dev->ring.desc[status] = (struct vring_desc) {
+        .addr = req_phys + offsetof(virtio_blk_req_t, status),
+        .len = sizeof(uint8_t),
+        .flags = VRING_DESC_F_WRITE,
+        .next = 0
+    };
+
+    dev->ring.avail->ring[dev->ring.avail->idx % dev->size] = head;
+    /* ensure update to descriptors visible before updating the index */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    dev->ring.avail->idx++;
+    /* ensure index update visible before checking whether to notify */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    /* the device asks not to be notified while it is still working through
+     * the ring, so requests made in a burst cost a single exit */
+    if (!(dev->ring.used->flags & VRING_USED_F_NO_NOTIFY)) {
+        write_reg16(dev, VIRTIO_PCI_QUEUE_NOTIFY, REQ_QUEUE);
+    }
+    return VIRTIO_BLK_XFER_ENQUEUED;
+}
+
+static void raw_poll(struct disk_driver *driver)
+{
+    complete_xfers(driver);
+}
+
+static void handle_irq(struct disk_driver *driver, int irq)
+{
+    virtio_blk_dev_t *dev = (virtio_blk_dev_t *)driver->disk_data;
+    /* read and throw away the ISR state. This will perform the ack */
+    read_reg8(dev, VIRTIO_PCI_ISR);
+    complete_xfers(driver);
+}
+
+static raw_diskiface_funcs_t iface_fns = {
+    .raw_xfer = raw_xfer,
+    .raw_handleIRQ = handle_irq,
+    .raw_poll = raw_poll,
+    .print_state = print_state,
+    .low_level_init = low_level_init
+};
+
+int diskif_virtio_pci_init(struct disk_driver *disk_driver, ps_io_ops_t io_ops, void *config)
+{
+    int err;
+    diskif_virtio_pci_config_t *virtio_config = (diskif_virtio_pci_config_t *)config;
+    if (!virtio_config || !disk_driver->i_cb.xfer_complete) {
+        ZF_LOGE("virtio-blk: config and xfer_complete must be set");
+        return -1;
+    }
+
+    virtio_blk_dev_t *dev = (virtio_blk_dev_t *)calloc(1, sizeof(*dev));
+    if (!dev) {
+        return -1;
+    }
+
+    dev->io_base = virtio_config->io_base;
+    dev->ioops = io_ops.io_port_ops;
+
+    disk_driver->disk_data = dev;
+    disk_driver->dma_alignment = DMA_ALIGN;
+    disk_driver->i_fn = iface_fns;
+
+    err = initialize(dev, &io_ops.dma_manager);
+    if (err) {
+        goto error;
+    }
+
+    return 0;
+
+error:
+    set_status(dev, VIRTIO_CONFIG_S_FAILED);
+    free_queue(dev, &io_ops.dma_manager);
+    free(dev);
+    disk_driver->disk_data = NULL;
+    return -1;
+}